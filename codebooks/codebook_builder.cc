@@ -67,47 +67,31 @@ void CodebookBuilder::AddData(const sjm::sift::DescriptorSet& descriptors,
     return;
   }
 
-  if (!data_) {
-    // On the initial AddData, we just allocate enough storage for
-    // 100% of the descriptors.
-    data_ = new flann::Matrix<float>(
-        new float[descriptors.sift_descriptor_size() * data_dimensions_],
-        descriptors.sift_descriptor_size(), data_dimensions_);
-  } else {
-    // On subsequent additions, we double the size of the storage
-    // until there's enough storage for the 100% of the additional
-    // data.
-    size_t required_data_size =
-        matrix_usage_ + descriptors.sift_descriptor_size();
-    // TODO(sanchom): Handle the case where doubling the memory
-    // allocation would fail, and adaptively back-off the requested
-    // amount by calling new(nothrow).
-    while (data_->rows < required_data_size) {
-      int new_size = data_->rows * 2;
-      flann::Matrix<float>* larger_data =
-          new flann::Matrix<float>(new float[new_size * data_dimensions_],
-                                   new_size, data_dimensions_);
-      // Copy old data into larger data space.
-      copy((*data_)[0],
-           (*data_)[data_->rows - 1] + data_->cols,
-           (*larger_data)[0]);
-      // Delete smaller data structure.
-      delete[] data_->ptr();
-      delete data_;
-      // Re-assign pointer to point to new, larger data structure.
-      data_ = larger_data;
-    }
+  if (storage_.data() == NULL) {
+    // This only reserves address space. Memory is used as rows are
+    // added.
+    storage_.Reserve(data_dimensions_,
+                     sjm::util::GrowableMatrix<float>::kDefaultMaxRows);
+  }
+  CHECK_EQ(data_dimensions_, static_cast<int>(storage_.cols())) <<
+      "Adding data with inconsistent dimensions.";
+  // If the descriptors might not fit, the rows are moved to a larger
+  // reservation. Nothing points at them until UpdateDataView().
+  const size_t max_rows =
+      storage_.rows() + descriptors.sift_descriptor_size();
+  if (max_rows > storage_.max_rows()) {
+    storage_.Reserve(data_dimensions_,
+                     std::max(max_rows, 2 * storage_.max_rows()));
   }
 
-  // Putting a percentage of the descriptors into data_.
+  // Putting a percentage of the descriptors into storage_.
   for (int i = 0; i < descriptors.sift_descriptor_size(); ++i) {
     // TODO(sanchom): Replace with new C++11 <random> library usage.
     if (std::rand() / static_cast<float>(RAND_MAX) < percentage) {
-      int next_row = matrix_usage_;  // This is the next row of data_
-                                     // to use.
+      float* row = storage_.AddRows(1);
       // Copying the data from the descriptor into the matrix row.
       for (int d = 0; d < descriptors.sift_descriptor(i).bin_size(); ++d) {
-        (*data_)[next_row][d] = descriptors.sift_descriptor(i).bin(d);
+        row[d] = descriptors.sift_descriptor(i).bin(d);
       }
       // Copying the location.
       if (location_weighting > 0) {
@@ -116,9 +100,9 @@ void CodebookBuilder::AddData(const sjm::sift::DescriptorSet& descriptors,
         // can be stored in uint8s in the protocol buffer. We need to
         // multiply the x and y by 127 (they're stored in [0,1]) so
         // that the location weighting is more interpretable.
-        (*data_)[next_row][data_dimensions_ - 2] =
+        row[data_dimensions_ - 2] =
             (descriptors.sift_descriptor(i).x() * 127 * location_weighting);
-        (*data_)[next_row][data_dimensions_ - 1] =
+        row[data_dimensions_ - 1] =
             (descriptors.sift_descriptor(i).y() * 127 * location_weighting);
       }
       ++matrix_usage_;
@@ -126,26 +110,19 @@ void CodebookBuilder::AddData(const sjm::sift::DescriptorSet& descriptors,
   }
 }
 
+void CodebookBuilder::UpdateDataView() {
+  // The used rows are clustered in place, without a compacting copy.
+  delete data_;
+  data_ = new flann::Matrix<float>(storage_.data(), matrix_usage_,
+                                   data_dimensions_);
+}
+
 // TODO(sanchom): Calling this when no data has been added gives a
 // segmentation fault. Fix this.
 void CodebookBuilder::Cluster(const int num_clusters_requested,
                               const int num_iterations) {
   CHECK_GT(num_clusters_requested, 0) << "Num clusters must be greater than 0";
-  // First, truncate the data_ to the actual usage. This unfortunately
-  // requires allocating additional memory, just to get rid of memory.
-  // TODO(sanchom): Look into using realloc instead.
-  flann::Matrix<float>* truncated_matrix =
-      new flann::Matrix<float>(new float[matrix_usage_ * data_dimensions_],
-                               matrix_usage_, data_dimensions_);
-  // Copy data into smaller data space.
-  copy((*data_)[0],
-       (*data_)[matrix_usage_ - 1] + data_->cols,
-       (*truncated_matrix)[0]);
-  // Delete original, larger data structure.
-  delete[] data_->ptr();
-  delete data_;
-  // Re-assign pointer to new, smaller data structure.
-  data_ = truncated_matrix;
+  UpdateDataView();
 
   // Do the kmeans clustering using flann's kmeans index with
   // num_clusters clusters, num_iterations, kmeans++ initialization.
@@ -179,22 +156,7 @@ void CodebookBuilder::ClusterApproximately(
   } else {
     CHECK_GT(num_clusters_requested, 0) <<
         "Num clusters must be greater than 0";
-    // First, truncate the data to the actual usage. This
-    // unfortunately requires allocating additional memory, just to
-    // get rid of memory.
-    // TODO(sanchom): Look into using realloc instead.
-    flann::Matrix<float>* truncated_matrix =
-        new flann::Matrix<float>(new float[matrix_usage_ * data_dimensions_],
-                                 matrix_usage_, data_dimensions_);
-    // Copy data into smaller data space.
-    copy((*data_)[0],
-         (*data_)[matrix_usage_ - 1] + data_->cols,
-         (*truncated_matrix)[0]);
-    // Delete original, larger data structure.
-    delete[] data_->ptr();
-    delete data_;
-    // Re-assign pointer to new, smaller data structure.
-    data_ = truncated_matrix;
+    UpdateDataView();
 
     // KMeanPP initialization.
     LOG(INFO) << "Doing kmeanspp initialization.";
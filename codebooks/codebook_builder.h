@@ -33,6 +33,8 @@
 
 #include "flann/flann.hpp"
 
+#include "util/growable_matrix.h"
+
 DECLARE_string(initialization_checkpoint_file);
 
 // Forward-declarations.
@@ -62,10 +64,8 @@ class CodebookBuilder {
     centroids_ = NULL;
   }
   ~CodebookBuilder() {
-    if (data_) {
-      delete[] data_->ptr();
-      delete data_;
-    }
+    // data_ is only a view of storage_.
+    delete data_;
     if (centroids_) {
       delete[] centroids_->ptr();
       delete centroids_;
@@ -104,8 +104,14 @@ class CodebookBuilder {
   // Returns the number of data points that have been added.
   int DataSize() const;
  private:
+  // Points data_ at the rows of storage_ that are in use.
+  void UpdateDataView();
+
   int data_dimensions_;
   int matrix_usage_;
+  // The added descriptors, one per row.
+  sjm::util::GrowableMatrix<float> storage_;
+  // A view of the used rows of storage_, for clustering.
   flann::Matrix<float>* data_;
   flann::Matrix<float>* centroids_;
 };
@@ -39,6 +39,7 @@
 
 #include "codebooks/codebook_builder.h"
 #include "codebooks/dictionary.pb.h"
+#include "codebooks/pca.h"
 #include "sift/sift_descriptors.pb.h"
 #include "sift/sift_util.h"
 #include "util/util.h"
@@ -66,6 +67,11 @@ DEFINE_string(
 DEFINE_string(
     stats_file, "",
     "A file to which stats will be written.");
+DEFINE_string(
+    projection_file, "",
+    "A projection learned by pca_cli. If given, the descriptors are "
+    "projected with it before clustering, and it is stored with the "
+    "dictionary so that descriptors are projected before they're coded.");
 
 using std::string;
 using std::vector;
@@ -131,7 +137,8 @@ int main(int argc, char* argv[]) {
 
     for (size_t i = 0; i < file_list.size(); ++i) {
       sjm::sift::DescriptorSet d;
-      sjm::sift::ReadDescriptorSetFromFile(file_list[i], &d);
+      sjm::codebooks::ReadProjectedDescriptorSet(
+          file_list[i], FLAGS_projection_file, &d);
       LOG(INFO) << "Adding data from " << file_list[i] << " (" <<
           d.sift_descriptor_size() << ").";
       // TODO(sanchom): Move location_weighting option to
@@ -143,8 +150,9 @@ int main(int argc, char* argv[]) {
     // We will read input from the single file and add it to the
     // codebook builder.
     sjm::sift::DescriptorSet descriptors;
-    sjm::sift::ReadDescriptorSetFromFile(sjm::util::expand_user(input_parts[1]),
-                                         &descriptors);
+    sjm::codebooks::ReadProjectedDescriptorSet(
+        sjm::util::expand_user(input_parts[1]), FLAGS_projection_file,
+        &descriptors);
     // TODO(sanchom): Implement max_descriptors for single files.
     builder.AddData(descriptors, 1.0, FLAGS_location_weighting);
   }
@@ -186,6 +194,10 @@ int main(int argc, char* argv[]) {
   // TODO(sanchom): Move the responsibility for setting this protobuf
   // field to the dictionary builder.
   dictionary.set_location_weighting(FLAGS_location_weighting);
+  if (!FLAGS_projection_file.empty()) {
+    dictionary.mutable_projection()->CopyFrom(
+        sjm::codebooks::GetProjectionOrDie(FLAGS_projection_file));
+  }
   string serialized_dictionary;
   CHECK(dictionary.SerializeToString(&serialized_dictionary));
   sjm::util::WriteStringToFileOrDie(FLAGS_output, serialized_dictionary);
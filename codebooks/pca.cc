@@ -0,0 +1,260 @@
+// Copyright 2011 Sancho McCann
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+
+// - Redistributions of source code must retain the above copyright
+//   notice, this list of conditions and the following disclaimer.
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "codebooks/pca.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "boost/thread/mutex.hpp"
+#include "glog/logging.h"
+
+#include "codebooks/dictionary.pb.h"
+#include "sift/sift_descriptors.pb.h"
+#include "sift/sift_util.h"
+#include "util/util.h"
+
+using std::vector;
+
+namespace sjm {
+namespace codebooks {
+
+void PcaBuilder::AddData(const sjm::sift::DescriptorSet& descriptors,
+                         const float percentage) {
+  if (descriptors.sift_descriptor_size() == 0) {
+    // There was no data to add.
+    return;
+  }
+  if (data_dimensions_ == 0) {
+    data_dimensions_ = descriptors.sift_descriptor(0).bin_size();
+    sums_.assign(data_dimensions_, 0);
+    products_.assign(data_dimensions_ * data_dimensions_, 0);
+  }
+  vector<double> bins(data_dimensions_);
+  for (int i = 0; i < descriptors.sift_descriptor_size(); ++i) {
+    if (std::rand() / static_cast<float>(RAND_MAX) >= percentage) {
+      continue;
+    }
+    const sjm::sift::SiftDescriptor& descriptor =
+        descriptors.sift_descriptor(i);
+    CHECK_EQ(data_dimensions_, descriptor.bin_size()) <<
+        "Adding data with inconsistent dimensions.";
+    for (int d = 0; d < data_dimensions_; ++d) {
+      bins[d] = descriptor.bin(d);
+      sums_[d] += bins[d];
+    }
+    // Only the upper triangle is accumulated; it's mirrored in
+    // GetProjection().
+    for (int r = 0; r < data_dimensions_; ++r) {
+      double* row = &products_[r * data_dimensions_];
+      for (int c = r; c < data_dimensions_; ++c) {
+        row[c] += bins[r] * bins[c];
+      }
+    }
+    ++data_size_;
+  }
+}
+
+void PcaBuilder::GetProjection(const int num_components,
+                               Projection* projection) const {
+  CHECK_GT(data_size_, 0) << "Can't learn a projection without data.";
+  CHECK_GT(num_components, 0);
+  CHECK_LE(num_components, data_dimensions_);
+  const int n = data_dimensions_;
+  vector<double> mean(n);
+  for (int d = 0; d < n; ++d) {
+    mean[d] = sums_[d] / data_size_;
+  }
+  vector<double> covariance(n * n);
+  for (int r = 0; r < n; ++r) {
+    for (int c = r; c < n; ++c) {
+      covariance[r * n + c] = covariance[c * n + r] =
+          products_[r * n + c] / data_size_ - mean[r] * mean[c];
+    }
+  }
+  vector<double> eigenvalues;
+  vector<double> eigenvectors;
+  internal::SymmetricEigenvectors(n, &covariance, &eigenvalues,
+                                  &eigenvectors);
+
+  projection->Clear();
+  for (int d = 0; d < n; ++d) {
+    projection->add_mean(mean[d]);
+  }
+  for (int i = 0; i < num_components; ++i) {
+    PrincipalComponent* component = projection->add_component();
+    for (int d = 0; d < n; ++d) {
+      component->add_weight(eigenvectors[i * n + d]);
+    }
+  }
+  // The projected bins are centred on 63.5, so three standard
+  // deviations of the first component have to fit in 63.5.
+  const double kDeviations = 3;
+  const double deviation = std::sqrt(std::max(0.0, eigenvalues[0]));
+  projection->set_scale(
+      deviation > 0 ? std::min(1.0, 63.5 / (kDeviations * deviation)) : 1);
+}
+
+int PcaBuilder::DataSize() const {
+  return data_size_;
+}
+
+void ProjectDescriptorSet(const Projection& projection,
+                          sjm::sift::DescriptorSet* descriptors) {
+  const int dimensions = projection.mean_size();
+  vector<float> centred(dimensions);
+  for (int i = 0; i < descriptors->sift_descriptor_size(); ++i) {
+    sjm::sift::SiftDescriptor* descriptor =
+        descriptors->mutable_sift_descriptor(i);
+    CHECK_EQ(dimensions, descriptor->bin_size()) <<
+        "The projection is for descriptors of " << dimensions << " bins.";
+    for (int d = 0; d < dimensions; ++d) {
+      centred[d] = descriptor->bin(d) - projection.mean(d);
+    }
+    descriptor->clear_bin();
+    for (int c = 0; c < projection.component_size(); ++c) {
+      const PrincipalComponent& component = projection.component(c);
+      float projected = 0;
+      for (int d = 0; d < dimensions; ++d) {
+        projected += component.weight(d) * centred[d];
+      }
+      const float quantised =
+          std::floor(63.5 + projection.scale() * projected + 0.5);
+      descriptor->add_bin(std::min(127.0f, std::max(0.0f, quantised)));
+    }
+  }
+}
+
+void ReadProjectionFromFileOrDie(const std::string& filename,
+                                 Projection* projection) {
+  std::string serialized;
+  sjm::util::ReadFileToStringOrDie(filename, &serialized);
+  CHECK(projection->ParseFromString(serialized)) <<
+      filename << " is not a projection.";
+}
+
+const Projection& GetProjectionOrDie(const std::string& filename) {
+  static boost::mutex mutex;
+  // The projections are never freed, so the references stay valid.
+  static std::map<std::string, Projection>* projections =
+      new std::map<std::string, Projection>;
+  boost::mutex::scoped_lock lock(mutex);
+  std::map<std::string, Projection>::iterator it =
+      projections->find(filename);
+  if (it == projections->end()) {
+    it = projections->insert(std::make_pair(filename, Projection())).first;
+    ReadProjectionFromFileOrDie(filename, &it->second);
+  }
+  return it->second;
+}
+
+void ReadProjectedDescriptorSet(const std::string& filename,
+                                const std::string& projection_file,
+                                sjm::sift::DescriptorSet* descriptors) {
+  sjm::sift::ReadDescriptorSetFromFile(filename, descriptors);
+  if (!projection_file.empty()) {
+    ProjectDescriptorSet(GetProjectionOrDie(projection_file), descriptors);
+  }
+}
+
+namespace internal {
+void SymmetricEigenvectors(const int n, vector<double>* matrix,
+                           vector<double>* eigenvalues,
+                           vector<double>* eigenvectors) {
+  CHECK_EQ(static_cast<size_t>(n * n), matrix->size());
+  vector<double>& a = *matrix;
+  // The rotations are accumulated into v, whose columns become the
+  // eigenvectors.
+  vector<double> v(n * n, 0);
+  for (int i = 0; i < n; ++i) {
+    v[i * n + i] = 1;
+  }
+  const int kMaxSweeps = 100;
+  for (int sweep = 0; sweep < kMaxSweeps; ++sweep) {
+    double off_diagonal = 0;
+    double diagonal = 0;
+    for (int p = 0; p < n; ++p) {
+      diagonal += a[p * n + p] * a[p * n + p];
+      for (int q = p + 1; q < n; ++q) {
+        off_diagonal += a[p * n + q] * a[p * n + q];
+      }
+    }
+    if (off_diagonal <= 1e-24 * diagonal) {
+      break;
+    }
+    for (int p = 0; p < n; ++p) {
+      for (int q = p + 1; q < n; ++q) {
+        const double apq = a[p * n + q];
+        if (apq == 0) {
+          continue;
+        }
+        // The rotation that zeroes a[p][q].
+        const double theta = (a[q * n + q] - a[p * n + p]) / (2 * apq);
+        const double t = (theta >= 0 ? 1 : -1) /
+            (std::fabs(theta) + std::sqrt(theta * theta + 1));
+        const double c = 1 / std::sqrt(t * t + 1);
+        const double s = t * c;
+        for (int k = 0; k < n; ++k) {
+          const double akp = a[k * n + p];
+          const double akq = a[k * n + q];
+          a[k * n + p] = c * akp - s * akq;
+          a[k * n + q] = s * akp + c * akq;
+        }
+        for (int k = 0; k < n; ++k) {
+          const double apk = a[p * n + k];
+          const double aqk = a[q * n + k];
+          a[p * n + k] = c * apk - s * aqk;
+          a[q * n + k] = s * apk + c * aqk;
+        }
+        for (int k = 0; k < n; ++k) {
+          const double vkp = v[k * n + p];
+          const double vkq = v[k * n + q];
+          v[k * n + p] = c * vkp - s * vkq;
+          v[k * n + q] = s * vkp + c * vkq;
+        }
+      }
+    }
+  }
+  vector<std::pair<double, int> > order(n);
+  for (int i = 0; i < n; ++i) {
+    order[i] = std::make_pair(-a[i * n + i], i);
+  }
+  std::sort(order.begin(), order.end());
+  eigenvalues->resize(n);
+  eigenvectors->resize(n * n);
+  for (int i = 0; i < n; ++i) {
+    const int column = order[i].second;
+    (*eigenvalues)[i] = -order[i].first;
+    for (int k = 0; k < n; ++k) {
+      (*eigenvectors)[i * n + k] = v[k * n + column];
+    }
+  }
+}
+}  // namespace internal.
+}}  // namespace.
@@ -0,0 +1,108 @@
+// Copyright 2011 Sancho McCann
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+
+// - Redistributions of source code must retain the above copyright
+//   notice, this list of conditions and the following disclaimer.
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// Learns a PCA projection of descriptor bins, and projects descriptors
+// with it. Projected descriptors are ordinary DescriptorSets with fewer
+// bins, re-quantised to [0,127], so they can be given to anything that
+// takes descriptors (e.g. CodebookBuilder, NbnnClassifier or
+// MergedClassifier) in place of the originals. Both the training and
+// the query descriptors must be projected with the same projection.
+
+#ifndef CODEBOOKS_PCA_H_
+#define CODEBOOKS_PCA_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+// Forward-declarations.
+namespace sjm {
+namespace sift {
+class DescriptorSet;
+}}
+
+namespace sjm {
+namespace codebooks {
+class Projection;
+}}
+
+namespace sjm {
+namespace codebooks {
+
+class PcaBuilder {
+ public:
+  PcaBuilder() : data_dimensions_(0), data_size_(0) {}
+  // Adds the bins of a percentage of the descriptors to the sample
+  // that the projection is learned from. The percentage is a hint and
+  // only approximate. The locations aren't projected.
+  void AddData(const sjm::sift::DescriptorSet& descriptors,
+               const float percentage);
+  // Populates the projection onto the num_components principal
+  // components of the sample, which has to be non-empty. The scale is
+  // 1 (so the projection preserves distances within the components'
+  // subspace) unless the projected bins would often fall outside of
+  // [0,127], in which case it's reduced to fit three standard
+  // deviations of the first component.
+  void GetProjection(const int num_components, Projection* projection) const;
+  // Returns the number of descriptors that have been added.
+  int DataSize() const;
+ private:
+  int data_dimensions_;
+  int64_t data_size_;
+  // The sums of the bins, and of the products of each pair of bins.
+  std::vector<double> sums_;
+  std::vector<double> products_;
+};
+
+// Replaces the bins of each descriptor with its projected bins.
+void ProjectDescriptorSet(const Projection& projection,
+                          sjm::sift::DescriptorSet* descriptors);
+
+// Reads a projection that was serialized to the file.
+void ReadProjectionFromFileOrDie(const std::string& filename,
+                                 Projection* projection);
+
+// Returns the projection that was serialized to the file. Each file is
+// only read by the first call for it. It's thread-safe.
+const Projection& GetProjectionOrDie(const std::string& filename);
+
+// Reads the descriptor set, projecting it with the projection in
+// projection_file (see GetProjectionOrDie) unless that's empty.
+void ReadProjectedDescriptorSet(const std::string& filename,
+                                const std::string& projection_file,
+                                sjm::sift::DescriptorSet* descriptors);
+
+namespace internal {
+// Finds the eigenvalues and eigenvectors of the n x n symmetric
+// row-major matrix, with cyclic Jacobi rotations, which destroy the
+// matrix. The eigenvalues are stored in decreasing order, and the
+// eigenvectors in the same order, one per row of the n x n matrix.
+void SymmetricEigenvectors(const int n, std::vector<double>* matrix,
+                           std::vector<double>* eigenvalues,
+                           std::vector<double>* eigenvectors);
+}  // namespace internal.
+}}  // namespace.
+
+#endif  // CODEBOOKS_PCA_H_
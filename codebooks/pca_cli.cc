@@ -0,0 +1,122 @@
+// Copyright 2011 Sancho McCann
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+
+// - Redistributions of source code must retain the above copyright
+//   notice, this list of conditions and the following disclaimer.
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// This is a command line tool that learns a PCA projection (see
+// codebooks/pca.h) from saved .sift files.
+
+// Usage: ./pca_cli --help
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "boost/algorithm/string.hpp"
+
+#include "gflags/gflags.h"
+#include "glog/logging.h"
+
+#include "codebooks/dictionary.pb.h"
+#include "codebooks/pca.h"
+#include "sift/sift_descriptors.pb.h"
+#include "sift/sift_util.h"
+#include "util/util.h"
+
+DEFINE_string(
+    input, "",
+    "One of 'list:<textfile>', or 'file:<siftfile>'.");
+DEFINE_string(
+    output, "",
+    "The name of the output path for the projection.");
+DEFINE_int32(max_descriptors, 0,
+             "The maximum number of descriptors to learn the projection "
+             "from. If 0 or negative, all the descriptors available are "
+             "used. If positive, the data is subsampled so approximately "
+             "that many descriptors are used.");
+DEFINE_int32(dimensions, 0,
+             "The number of principal components to project onto.");
+
+using std::string;
+using std::vector;
+
+int main(int argc, char* argv[]) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  GOOGLE_PROTOBUF_VERIFY_VERSION;
+
+  CHECK(!FLAGS_input.empty()) << "--input is a required argument.";
+  CHECK(!FLAGS_output.empty()) << "--output is a required argument.";
+  CHECK_GE(FLAGS_dimensions, 1) <<
+      "--dimensions must be specified and greater than 0.";
+
+  // Parse the input file structure.
+  vector<string> input_parts;
+  boost::split(input_parts, FLAGS_input, boost::is_any_of(":"));
+  CHECK_EQ(2, input_parts.size()) << "Invalid --input.";
+  vector<string> file_list;
+  if (input_parts[0] == "list") {
+    vector<string> unexpanded_input_files;
+    sjm::util::ReadLinesFromFileIntoVectorOrDie(input_parts[1],
+                                                &unexpanded_input_files);
+    for (size_t i = 0; i < unexpanded_input_files.size(); ++i) {
+      if (!unexpanded_input_files[i].empty()) {
+        file_list.push_back(sjm::util::expand_user(unexpanded_input_files[i]));
+      }
+    }
+  } else if (input_parts[0] == "file") {
+    file_list.push_back(sjm::util::expand_user(input_parts[1]));
+  } else {
+    LOG(FATAL) << "Unhandled input option.";
+  }
+
+  float percentage_to_load = 1.0;
+  if (FLAGS_max_descriptors > 0) {
+    // Count number of descriptors in training set.
+    int total_descriptors = 0;
+    for (size_t i = 0; i < file_list.size(); ++i) {
+      sjm::sift::DescriptorSet d;
+      sjm::sift::ReadDescriptorSetFromFile(file_list[i], &d);
+      total_descriptors += d.sift_descriptor_size();
+    }
+    percentage_to_load = std::min(
+        1.0f, static_cast<float>(FLAGS_max_descriptors) / total_descriptors);
+  }
+
+  sjm::codebooks::PcaBuilder builder;
+  for (size_t i = 0; i < file_list.size(); ++i) {
+    sjm::sift::DescriptorSet d;
+    sjm::sift::ReadDescriptorSetFromFile(file_list[i], &d);
+    LOG(INFO) << "Adding data from " << file_list[i] << " (" <<
+        d.sift_descriptor_size() << ").";
+    builder.AddData(d, percentage_to_load);
+  }
+  LOG(INFO) << "Learning the projection from " << builder.DataSize() <<
+      " descriptors.";
+  sjm::codebooks::Projection projection;
+  builder.GetProjection(FLAGS_dimensions, &projection);
+  LOG(INFO) << "Scale: " << projection.scale();
+  string serialized_projection;
+  CHECK(projection.SerializeToString(&serialized_projection));
+  sjm::util::WriteStringToFileOrDie(FLAGS_output, serialized_projection);
+  return 0;
+}
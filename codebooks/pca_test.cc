@@ -0,0 +1,207 @@
+// Copyright 2011 Sancho McCann
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+
+// - Redistributions of source code must retain the above copyright
+//   notice, this list of conditions and the following disclaimer.
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// This file tests learning PCA projections of descriptors.
+
+// Files under test.
+#include "codebooks/pca.h"
+
+// STL includes.
+#include <cmath>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+// Third party includes.
+#include "glog/logging.h"
+#include "gtest/gtest.h"
+
+#include "codebooks/codebook_builder.h"
+#include "codebooks/dictionary.pb.h"
+#include "sift/sift_descriptors.pb.h"
+#include "sift/sift_util.h"
+#include "util/util.h"
+
+using std::string;
+using std::vector;
+
+TEST(PcaTest, TestSymmetricEigenvectors) {
+  const int n = 6;
+  vector<double> matrix(n * n);
+  for (int r = 0; r < n; ++r) {
+    for (int c = r; c < n; ++c) {
+      matrix[r * n + c] = matrix[c * n + r] =
+          std::rand() / static_cast<double>(RAND_MAX) - 0.5;
+    }
+  }
+  const vector<double> original(matrix);
+  vector<double> eigenvalues;
+  vector<double> eigenvectors;
+  sjm::codebooks::internal::SymmetricEigenvectors(n, &matrix, &eigenvalues,
+                                                  &eigenvectors);
+  ASSERT_EQ(n, eigenvalues.size());
+  for (int i = 0; i < n; ++i) {
+    if (i > 0) {
+      ASSERT_GE(eigenvalues[i - 1], eigenvalues[i]);
+    }
+    const double* v = &eigenvectors[i * n];
+    for (int r = 0; r < n; ++r) {
+      double product = 0;
+      for (int c = 0; c < n; ++c) {
+        product += original[r * n + c] * v[c];
+      }
+      ASSERT_NEAR(eigenvalues[i] * v[r], product, 1e-9);
+    }
+    // The eigenvectors are orthonormal.
+    for (int j = 0; j < n; ++j) {
+      double dot = 0;
+      for (int c = 0; c < n; ++c) {
+        dot += v[c] * eigenvectors[j * n + c];
+      }
+      ASSERT_NEAR(i == j ? 1 : 0, dot, 1e-9);
+    }
+  }
+}
+
+TEST(PcaTest, TestProjectionPreservesDistancesInSubspace) {
+  // Descriptors of 16 bins that vary along only 3 directions.
+  const int kBins = 16;
+  const int kComponents = 3;
+  vector<vector<int> > directions(kComponents, vector<int>(kBins));
+  for (int c = 0; c < kComponents; ++c) {
+    for (int d = 0; d < kBins; ++d) {
+      directions[c][d] = (d % (c + 2) == 0) ? 1 : 0;
+    }
+  }
+  sjm::sift::DescriptorSet descriptors;
+  for (int i = 0; i < 500; ++i) {
+    sjm::sift::SiftDescriptor* descriptor = descriptors.add_sift_descriptor();
+    vector<int> weights(kComponents);
+    for (int c = 0; c < kComponents; ++c) {
+      weights[c] = std::rand() % 21 - 10;
+    }
+    for (int d = 0; d < kBins; ++d) {
+      int bin = 64;
+      for (int c = 0; c < kComponents; ++c) {
+        bin += weights[c] * directions[c][d];
+      }
+      descriptor->add_bin(bin);
+    }
+    descriptor->set_x(i / 500.0);
+    descriptor->set_y(0.25);
+  }
+  sjm::codebooks::PcaBuilder builder;
+  builder.AddData(descriptors, 1.0);
+  ASSERT_EQ(500, builder.DataSize());
+  sjm::codebooks::Projection projection;
+  builder.GetProjection(kComponents, &projection);
+  ASSERT_EQ(kBins, projection.mean_size());
+  ASSERT_EQ(kComponents, projection.component_size());
+  ASSERT_EQ(1, projection.scale());
+
+  sjm::sift::DescriptorSet projected(descriptors);
+  sjm::codebooks::ProjectDescriptorSet(projection, &projected);
+  ASSERT_EQ(descriptors.sift_descriptor_size(),
+            projected.sift_descriptor_size());
+  for (int i = 0; i < projected.sift_descriptor_size(); ++i) {
+    ASSERT_EQ(kComponents, projected.sift_descriptor(i).bin_size());
+    ASSERT_EQ(descriptors.sift_descriptor(i).x(),
+              projected.sift_descriptor(i).x());
+    ASSERT_EQ(descriptors.sift_descriptor(i).y(),
+              projected.sift_descriptor(i).y());
+  }
+  // The distances are preserved, up to the rounding of each bin.
+  for (int i = 0; i + 1 < descriptors.sift_descriptor_size(); ++i) {
+    double distance = 0;
+    for (int d = 0; d < kBins; ++d) {
+      const double difference =
+          static_cast<double>(descriptors.sift_descriptor(i).bin(d)) -
+          descriptors.sift_descriptor(i + 1).bin(d);
+      distance += difference * difference;
+    }
+    double projected_distance = 0;
+    for (int d = 0; d < kComponents; ++d) {
+      const double difference =
+          static_cast<double>(projected.sift_descriptor(i).bin(d)) -
+          projected.sift_descriptor(i + 1).bin(d);
+      projected_distance += difference * difference;
+    }
+    ASSERT_NEAR(std::sqrt(distance), std::sqrt(projected_distance),
+                std::sqrt(static_cast<double>(kComponents)));
+  }
+}
+
+TEST(PcaTest, TestProjectRealData) {
+  sjm::sift::DescriptorSet emu_descriptors;
+  sjm::sift::ReadDescriptorSetFromFile(
+      "../naive_bayes_nearest_neighbor/test_data/caltech_emu_set.sift",
+      &emu_descriptors);
+  sjm::codebooks::PcaBuilder builder;
+  builder.AddData(emu_descriptors, 0.5);
+  ASSERT_GT(builder.DataSize(), 0);
+  ASSERT_LT(builder.DataSize(), emu_descriptors.sift_descriptor_size());
+  sjm::codebooks::Projection projection;
+  builder.GetProjection(32, &projection);
+  ASSERT_GT(projection.scale(), 0);
+  ASSERT_LE(projection.scale(), 1);
+
+  // The projection survives being saved.
+  string serialized;
+  ASSERT_TRUE(projection.SerializeToString(&serialized));
+  sjm::util::WriteStringToFileOrDie("/tmp/pca_test_projection", serialized);
+  sjm::codebooks::Projection loaded;
+  sjm::codebooks::ReadProjectionFromFileOrDie("/tmp/pca_test_projection",
+                                              &loaded);
+  ASSERT_EQ(projection.SerializeAsString(), loaded.SerializeAsString());
+
+  sjm::sift::DescriptorSet read_projected;
+  sjm::codebooks::ReadProjectedDescriptorSet(
+      "../naive_bayes_nearest_neighbor/test_data/caltech_emu_set.sift",
+      "/tmp/pca_test_projection", &read_projected);
+  sjm::codebooks::ProjectDescriptorSet(loaded, &emu_descriptors);
+  ASSERT_EQ(emu_descriptors.SerializeAsString(),
+            read_projected.SerializeAsString());
+  for (int i = 0; i < emu_descriptors.sift_descriptor_size(); ++i) {
+    const sjm::sift::SiftDescriptor& descriptor =
+        emu_descriptors.sift_descriptor(i);
+    ASSERT_EQ(32, descriptor.bin_size());
+    for (int d = 0; d < descriptor.bin_size(); ++d) {
+      ASSERT_LE(descriptor.bin(d), 127);
+    }
+  }
+  // Projected descriptors can be clustered like the originals.
+  sjm::codebooks::CodebookBuilder codebook_builder;
+  codebook_builder.AddData(emu_descriptors, 1.0, 0);
+  codebook_builder.Cluster(10, 2);
+  sjm::codebooks::Dictionary dictionary;
+  codebook_builder.GetDictionary(&dictionary);
+  ASSERT_EQ(10, dictionary.centroid_size());
+  ASSERT_EQ(32, dictionary.centroid(0).bin_size());
+}
+
+int main(int argc, char** argv) {
+  google::InitGoogleLogging(argv[0]);
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,142 @@
+// Copyright (c) 2011, Sancho McCann
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+
+// - Redistributions of source code must retain the above copyright
+//   notice, this list of conditions and the following disclaimer.
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// An exact nearest neighbor index over uint8_t descriptors, which can
+// be used as the IndexType of an NbnnClassifier (see
+// nbnn_classifier.h). It compares each query against every row, so it
+// gives the accuracy that the approximate FLANN indices approach as
+// checks is increased.
+
+#ifndef NAIVE_BAYES_NEAREST_NEIGHBOR_BRUTE_FORCE_INDEX_H_
+#define NAIVE_BAYES_NEAREST_NEIGHBOR_BRUTE_FORCE_INDEX_H_
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "glog/logging.h"
+
+#include "flann/flann.hpp"
+
+#include "naive_bayes_nearest_neighbor/distance.h"
+#include "naive_bayes_nearest_neighbor/index_io.h"
+
+namespace sjm {
+namespace nbnn {
+
+class BruteForceIndex {
+ public:
+  // The params are ignored.
+  explicit BruteForceIndex(
+      const flann::Matrix<uint8_t>& data,
+      const flann::IndexParams& params = flann::IndexParams())
+      : dimensions_(data.cols) {
+    AppendRows(data);
+  }
+
+  // There is nothing to build or save: the index is just its data.
+  void buildIndex() {}
+  void save(const std::string& filename) const {}
+
+  void addPoints(const flann::Matrix<uint8_t>& points,
+                 float rebuild_threshold = 2) {
+    CHECK_EQ(dimensions_, points.cols);
+    AppendRows(points);
+  }
+
+  size_t size() const {
+    return rows_.size();
+  }
+
+  size_t veclen() const {
+    return dimensions_;
+  }
+
+  // Finds the knn nearest rows to each query. Ties go to the lower
+  // row. The search params are ignored, since the search is always
+  // exact.
+  int knnSearch(const flann::Matrix<uint8_t>& queries,
+                flann::Matrix<int>& indices,
+                flann::Matrix<float>& dists,
+                size_t knn,
+                const flann::SearchParams& params) const {
+    CheckKnnSearchOrDie(queries, indices, dists, knn, dimensions_);
+    const int dimensions = dimensions_;
+    // Each query's heap holds its nearest (distance, row) pairs so
+    // far, with the farthest on top.
+    std::vector<std::vector<std::pair<int, int> > > heaps(queries.rows);
+    for (size_t q = 0; q < queries.rows; ++q) {
+      heaps[q].reserve(knn + 1);
+    }
+    // The rows are visited in blocks that stay in cache while every
+    // query is compared against them.
+    for (size_t block = 0; block < rows_.size(); block += kBlockRows) {
+      const size_t block_end = std::min(rows_.size(), block + kBlockRows);
+      for (size_t q = 0; q < queries.rows; ++q) {
+        std::vector<std::pair<int, int> >& heap = heaps[q];
+        for (size_t row = block; row < block_end; ++row) {
+          const std::pair<int, int> candidate(
+              internal::SquaredDistance(queries[q], rows_[row],
+                                        dimensions),
+              static_cast<int>(row));
+          if (heap.size() < knn) {
+            heap.push_back(candidate);
+            std::push_heap(heap.begin(), heap.end());
+          } else if (knn > 0 && candidate < heap.front()) {
+            std::pop_heap(heap.begin(), heap.end());
+            heap.back() = candidate;
+            std::push_heap(heap.begin(), heap.end());
+          }
+        }
+      }
+    }
+    int found = 0;
+    for (size_t q = 0; q < queries.rows; ++q) {
+      std::vector<std::pair<int, int> >& heap = heaps[q];
+      std::sort_heap(heap.begin(), heap.end());
+      found += StoreNeighbors(heap, knn, indices[q], dists[q]);
+    }
+    return found;
+  }
+
+ private:
+  // 128 rows of 130 dimensions take about half of a 32 KiB L1 cache,
+  // leaving room for the queries.
+  static const size_t kBlockRows = 128;
+
+  void AppendRows(const flann::Matrix<uint8_t>& data) {
+    for (size_t i = 0; i < data.rows; ++i) {
+      rows_.push_back(data[i]);
+    }
+  }
+
+  size_t dimensions_;
+  std::vector<const uint8_t*> rows_;
+};
+}}  // Namespace.
+
+#endif  // NAIVE_BAYES_NEAREST_NEIGHBOR_BRUTE_FORCE_INDEX_H_
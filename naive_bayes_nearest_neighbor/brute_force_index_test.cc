@@ -0,0 +1,157 @@
+// Copyright (c) 2011, Sancho McCann
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+
+// - Redistributions of source code must retain the above copyright
+//   notice, this list of conditions and the following disclaimer.
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "naive_bayes_nearest_neighbor/brute_force_index.h"
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <utility>
+#include <vector>
+
+#include "glog/logging.h"
+#include "gtest/gtest.h"
+
+#include "flann/flann.hpp"
+
+#include "naive_bayes_nearest_neighbor/nbnn_classifier.h"
+#include "sift/sift_descriptors.pb.h"
+
+using std::pair;
+using std::vector;
+
+class BruteForceIndexTest : public ::testing::Test {
+ protected:
+  // Fills the matrix with random bytes from the whole uint8_t range.
+  static flann::Matrix<uint8_t> RandomMatrix(const int rows, const int cols) {
+    flann::Matrix<uint8_t> matrix(new uint8_t[rows * cols], rows, cols);
+    for (int i = 0; i < rows; ++i) {
+      for (int j = 0; j < cols; ++j) {
+        matrix[i][j] = std::rand() % 256;
+      }
+    }
+    return matrix;
+  }
+};
+
+TEST_F(BruteForceIndexTest,
+       TestSquaredDistance) {
+  // 130 dimensions exercises both the vectorized and the leftover
+  // parts of the distance computation.
+  flann::Matrix<uint8_t> data = RandomMatrix(2, 130);
+  data[0][0] = 0;
+  data[1][0] = 255;
+  ASSERT_EQ(sjm::nbnn::internal::SquaredDistanceScalar(data[0], data[1], 130),
+            sjm::nbnn::internal::SquaredDistance(data[0], data[1], 130));
+  ASSERT_EQ(0, sjm::nbnn::internal::SquaredDistance(data[0], data[0], 130));
+  delete[] data.ptr();
+}
+
+TEST_F(BruteForceIndexTest,
+       TestKnnSearchIsExact) {
+  const int kRows = 1000;
+  const int kQueries = 20;
+  const int kDimensions = 130;
+  const size_t kNeighbors = 3;
+  flann::Matrix<uint8_t> data = RandomMatrix(kRows, kDimensions);
+  flann::Matrix<uint8_t> queries = RandomMatrix(kQueries, kDimensions);
+  sjm::nbnn::BruteForceIndex index(data);
+  index.buildIndex();
+  ASSERT_EQ(kRows, index.size());
+  ASSERT_EQ(kDimensions, index.veclen());
+  flann::Matrix<int> indices(new int[kQueries * kNeighbors], kQueries,
+                             kNeighbors);
+  flann::Matrix<float> dists(new float[kQueries * kNeighbors], kQueries,
+                             kNeighbors);
+  ASSERT_EQ(kQueries * kNeighbors,
+            index.knnSearch(queries, indices, dists, kNeighbors,
+                            flann::SearchParams(1)));
+  for (int q = 0; q < kQueries; ++q) {
+    vector<pair<int, int> > expected;
+    for (int row = 0; row < kRows; ++row) {
+      expected.push_back(std::make_pair(
+          sjm::nbnn::internal::SquaredDistanceScalar(queries[q], data[row],
+                                                     kDimensions),
+          row));
+    }
+    std::sort(expected.begin(), expected.end());
+    for (size_t k = 0; k < kNeighbors; ++k) {
+      ASSERT_EQ(expected[k].second, indices[q][k]);
+      ASSERT_EQ(expected[k].first, dists[q][k]);
+    }
+  }
+  delete[] indices.ptr();
+  delete[] dists.ptr();
+  delete[] data.ptr();
+  delete[] queries.ptr();
+}
+
+TEST_F(BruteForceIndexTest,
+       TestFewerRowsThanNeighbors) {
+  flann::Matrix<uint8_t> data = RandomMatrix(2, 128);
+  sjm::nbnn::BruteForceIndex index(data);
+  flann::Matrix<uint8_t> query(data[0], 1, 128);
+  flann::Matrix<int> indices(new int[3], 1, 3);
+  flann::Matrix<float> dists(new float[3], 1, 3);
+  ASSERT_EQ(2, index.knnSearch(query, indices, dists, 3,
+                               flann::SearchParams(1)));
+  ASSERT_EQ(0, indices[0][0]);
+  ASSERT_EQ(0, dists[0][0]);
+  ASSERT_EQ(1, indices[0][1]);
+  ASSERT_EQ(-1, indices[0][2]);
+  delete[] indices.ptr();
+  delete[] dists.ptr();
+  delete[] data.ptr();
+}
+
+TEST_F(BruteForceIndexTest,
+       TestClassify) {
+  flann::Matrix<uint8_t> class_1_data(new uint8_t[10 * 128], 10, 128);
+  flann::Matrix<uint8_t> class_2_data(new uint8_t[10 * 128], 10, 128);
+  std::fill(class_1_data.ptr(), class_1_data.ptr() + 10 * 128, 1);
+  std::fill(class_2_data.ptr(), class_2_data.ptr() + 10 * 128, 5);
+  sjm::nbnn::NbnnClassifier<sjm::nbnn::BruteForceIndex> classifier;
+  classifier.SetClassificationParams(1, 0, 1);
+  classifier.AddClass("Class 1",
+                      new sjm::nbnn::BruteForceIndex(class_1_data));
+  classifier.AddClass("Class 2",
+                      new sjm::nbnn::BruteForceIndex(class_2_data));
+  sjm::sift::DescriptorSet descriptor_set;
+  for (int i = 0; i < 10; ++i) {
+    sjm::sift::SiftDescriptor* d = descriptor_set.add_sift_descriptor();
+    for (int j = 0; j < 128; ++j) {
+      d->add_bin(2);
+    }
+  }
+  ASSERT_EQ("Class 1", classifier.Classify(descriptor_set).category);
+  delete[] class_1_data.ptr();
+  delete[] class_2_data.ptr();
+}
+
+int main(int argc, char** argv) {
+  google::InitGoogleLogging(argv[0]);
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,112 @@
+// Copyright (c) 2011, Sancho McCann
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+
+// - Redistributions of source code must retain the above copyright
+//   notice, this list of conditions and the following disclaimer.
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// Squared L2 distances between uint8_t descriptors, and Hamming
+// distances between binary codes. When compiled with AVX2 enabled
+// (e.g. scons native=1), the squared distances are computed 32
+// dimensions at a time. The Hamming distances use the popcnt
+// instruction when it's enabled (also by scons native=1).
+
+#ifndef NAIVE_BAYES_NEAREST_NEIGHBOR_DISTANCE_H_
+#define NAIVE_BAYES_NEAREST_NEIGHBOR_DISTANCE_H_
+
+#include <stdint.h>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+namespace sjm {
+namespace nbnn {
+
+namespace internal {
+
+inline int SquaredDistanceScalar(const uint8_t* a, const uint8_t* b,
+                                 const int dimensions) {
+  int total = 0;
+  for (int i = 0; i < dimensions; ++i) {
+    const int difference = static_cast<int>(a[i]) - b[i];
+    total += difference * difference;
+  }
+  return total;
+}
+
+#ifdef __AVX2__
+// The bytes are widened to 16 bits before subtracting, so the result
+// is exact over the whole uint8_t range.
+inline int SquaredDistanceAvx2(const uint8_t* a, const uint8_t* b,
+                               const int dimensions) {
+  __m256i sums = _mm256_setzero_si256();
+  int i = 0;
+  for (; i + 32 <= dimensions; i += 32) {
+    const __m256i a_bytes =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+    const __m256i b_bytes =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+    const __m256i low_differences = _mm256_sub_epi16(
+        _mm256_cvtepu8_epi16(_mm256_castsi256_si128(a_bytes)),
+        _mm256_cvtepu8_epi16(_mm256_castsi256_si128(b_bytes)));
+    const __m256i high_differences = _mm256_sub_epi16(
+        _mm256_cvtepu8_epi16(_mm256_extracti128_si256(a_bytes, 1)),
+        _mm256_cvtepu8_epi16(_mm256_extracti128_si256(b_bytes, 1)));
+    sums = _mm256_add_epi32(
+        sums, _mm256_madd_epi16(low_differences, low_differences));
+    sums = _mm256_add_epi32(
+        sums, _mm256_madd_epi16(high_differences, high_differences));
+  }
+  __m128i half_sums = _mm_add_epi32(_mm256_castsi256_si128(sums),
+                                    _mm256_extracti128_si256(sums, 1));
+  half_sums = _mm_add_epi32(half_sums,
+                            _mm_shuffle_epi32(half_sums, 0x4e));
+  half_sums = _mm_add_epi32(half_sums,
+                            _mm_shuffle_epi32(half_sums, 0xb1));
+  return _mm_cvtsi128_si32(half_sums) +
+      SquaredDistanceScalar(a + i, b + i, dimensions - i);
+}
+#endif
+
+// Returns the squared L2 distance between a and b.
+inline int SquaredDistance(const uint8_t* a, const uint8_t* b,
+                           const int dimensions) {
+#ifdef __AVX2__
+  return SquaredDistanceAvx2(a, b, dimensions);
+#else
+  return SquaredDistanceScalar(a, b, dimensions);
+#endif
+}
+
+// Returns the number of bits that differ between the codes of
+// 64-bit words.
+inline int HammingDistance(const uint64_t* a, const uint64_t* b,
+                           const int words) {
+  int total = 0;
+  for (int i = 0; i < words; ++i) {
+    total += __builtin_popcountll(a[i] ^ b[i]);
+  }
+  return total;
+}
+}  // namespace internal.
+}}  // Namespace.
+
+#endif  // NAIVE_BAYES_NEAREST_NEIGHBOR_DISTANCE_H_
@@ -36,6 +36,14 @@
 
 #include "flann/flann.hpp"
 
+#include "codebooks/dictionary.pb.h"
+#include "codebooks/pca.h"
+#include "naive_bayes_nearest_neighbor/brute_force_index.h"
+#include "naive_bayes_nearest_neighbor/hnsw_index.h"
+#include "naive_bayes_nearest_neighbor/index_io.h"
+#include "naive_bayes_nearest_neighbor/index_server.h"
+#include "naive_bayes_nearest_neighbor/kd_forest_index.h"
+#include "naive_bayes_nearest_neighbor/location_reranking.h"
 #include "naive_bayes_nearest_neighbor/nbnn_classifier.h"
 #include "sift/sift_descriptors.pb.h"
 #include "sift/sift_util.h"
@@ -60,32 +68,91 @@ DEFINE_string(category_list, "",
               "the features directory.");
 DEFINE_double(subsample, 1.0,
               "A subsample fraction to use for query descriptors.");
+DEFINE_int32(thread_limit, 1,
+             "The number of threads that search the class indices for "
+             "each test image.");
+DEFINE_double(anytime_error_tolerance, 0,
+              "If > 0, classes that fall behind are dropped as the test "
+              "image's descriptors are searched, once the chance that "
+              "they would have won is below this.");
+DEFINE_int32(anytime_batch_size, 50,
+             "The number of descriptors searched between dropping "
+             "classes, with --anytime_error_tolerance.");
+DEFINE_string(index_directory, "",
+              "If set, the built class indices and the training/testing "
+              "split are saved here, and later runs with the same "
+              "directory load them instead of rebuilding. --alpha must "
+              "match the saved indices, unless they were built with "
+              "--location_candidates, and --category_list, --num_train, "
+              "--num_test, --trees, --index_type, --location_candidates "
+              "and the content of --projection_file must match.");
+DEFINE_string(index_type, "kdtree",
+              "How the classes are searched: 'kdtree' for FLANN "
+              "kd-trees, 'kdforest' for the cache-friendly kd-forest "
+              "(with the same --trees and --checks), 'hnsw' for HNSW "
+              "graphs (with --checks as the search's ef), 'exact' for "
+              "brute force, or 'server' to search the indices that "
+              "index_server is serving from --index_directory.");
+DEFINE_int32(hnsw_m, 16,
+             "The number of links per node in the HNSW graphs.");
+DEFINE_int32(hnsw_ef_construction, 200,
+             "The candidate list size used while building the HNSW "
+             "graphs.");
+DEFINE_int32(location_candidates, 0,
+             "If > 0, the class indices are built without the location, "
+             "and this many candidates nearest by appearance are reranked "
+             "with the location weighted by --alpha, so that saved "
+             "indices can be reused for any --alpha.");
+DEFINE_string(projection_file, "",
+              "A projection learned by codebooks/pca_cli. If given, all "
+              "the descriptors are projected with it.");
 
 using std::map;
 using std::string;
 using std::vector;
 
-int main(int argc, char** argv) {
-  google::ParseCommandLineFlags(&argc, &argv, true);
-  google::InitGoogleLogging(argv[0]);
-  GOOGLE_PROTOBUF_VERIFY_VERSION;
-
-  std::srand(std::time(NULL));
-
-  CHECK(!FLAGS_category_list.empty()) << "--category_list is required.";
-  vector<string> categories;
-  sjm::util::ReadLinesFromFileIntoVectorOrDie(FLAGS_category_list,
-                                             & categories);
-
+// Builds (or loads) the classifier and returns its mean per-class
+// accuracy on the testing files.
+template <typename IndexType>
+float RunExperiment(const vector<string>& categories) {
   // Get list of files from each category, by looking in the
   // features_directory, constructing the classifier and testing lists
   // as we go.
-  sjm::nbnn::NbnnClassifier<flann::Index<flann::L2<uint8_t> > > classifier;
+  sjm::nbnn::NbnnClassifier<IndexType> classifier;
   classifier.SetClassificationParams(1, FLAGS_alpha, FLAGS_checks);
+  classifier.SetNumThreads(FLAGS_thread_limit);
+  if (FLAGS_location_candidates > 0) {
+    classifier.SetLocationReranking(FLAGS_location_candidates);
+  }
+  const float indexed_alpha = FLAGS_location_candidates > 0 ? 0 : FLAGS_alpha;
+  if (FLAGS_anytime_error_tolerance > 0) {
+    classifier.SetAnytimeParams(FLAGS_anytime_batch_size,
+                                FLAGS_anytime_error_tolerance);
+  }
   map<string, vector<string> > testing_files;
   vector<flann::Matrix<uint8_t>* > datasets;
   boost::filesystem::path root(FLAGS_features_directory);
-  for (size_t i = 0; i < categories.size(); ++i) {
+  const boost::filesystem::path index_directory(
+      sjm::util::expand_user(FLAGS_index_directory));
+  const string testing_files_name =
+      (index_directory / sjm::nbnn::kTestingFilesName).string();
+  const string index_params_name =
+      (index_directory / sjm::nbnn::kIndexParamsName).string();
+  const map<string, string> experiment_params =
+      sjm::nbnn::ExperimentIndexParams(categories, FLAGS_num_train,
+                                       FLAGS_num_test, FLAGS_trees,
+                                       FLAGS_index_type, FLAGS_alpha,
+                                       FLAGS_location_candidates,
+                                       FLAGS_projection_file);
+  const bool load_index = !FLAGS_index_directory.empty() &&
+      boost::filesystem::exists(testing_files_name);
+  if (load_index) {
+    LOG(INFO) << "Loading the class indices from " << FLAGS_index_directory;
+    sjm::nbnn::CheckIndexParamsOrDie(index_params_name, experiment_params);
+    classifier.Load(index_directory.string());
+    sjm::nbnn::ReadTestingFilesOrDie(testing_files_name, &testing_files);
+  }
+  for (size_t i = 0; !load_index && i < categories.size(); ++i) {
     boost::filesystem::path stem(categories[i]);
     boost::filesystem::path category_directory = root / stem;
 
@@ -109,11 +176,14 @@ int main(int argc, char** argv) {
     int total_descriptors = 0;
     for (size_t j = 0; j < train_list.size(); ++j) {
       sjm::sift::DescriptorSet d;
-      sjm::sift::ReadDescriptorSetFromFile(train_list[j], &d);
+      sjm::codebooks::ReadProjectedDescriptorSet(
+          train_list[j], FLAGS_projection_file, &d);
       total_descriptors += d.sift_descriptor_size();
     }
-    int dimensions = 128;
-    if (FLAGS_alpha > 0) {
+    int dimensions = FLAGS_projection_file.empty() ?
+        128 : sjm::codebooks::GetProjectionOrDie(
+            FLAGS_projection_file).component_size();
+    if (indexed_alpha > 0) {
       dimensions += 2;
     }
     flann::Matrix<uint8_t>* data =
@@ -122,29 +192,40 @@ int main(int argc, char** argv) {
     datasets.push_back(data);
     LOG(INFO) << "Loading data for category " << categories[i] << ".";
     int data_index = 0;
+    vector<float> locations;
     for (size_t j = 0; j < train_list.size(); ++j) {
       sjm::sift::DescriptorSet d;
-      sjm::sift::ReadDescriptorSetFromFile(train_list[j], &d);
+      sjm::codebooks::ReadProjectedDescriptorSet(
+          train_list[j], FLAGS_projection_file, &d);
       for (int k = 0; k < d.sift_descriptor_size(); ++k) {
         for (int col = 0; col < d.sift_descriptor(k).bin_size(); ++col) {
           (*data)[data_index][col] = d.sift_descriptor(k).bin(col);
         }
-        if (FLAGS_alpha > 0) {
+        if (indexed_alpha > 0) {
           (*data)[data_index][dimensions - 2] =
-              static_cast<int>(d.sift_descriptor(k).x() * 127 * FLAGS_alpha +
-                               0.5);
+              sjm::sift::WeightLocation(d.sift_descriptor(k).x(),
+                                        indexed_alpha);
           (*data)[data_index][dimensions - 1] =
-              static_cast<int>(d.sift_descriptor(k).y() * 127 * FLAGS_alpha +
-                               0.5);
+              sjm::sift::WeightLocation(d.sift_descriptor(k).y(),
+                                        indexed_alpha);
+        }
+        if (FLAGS_location_candidates > 0) {
+          sjm::nbnn::AppendLocation(d.sift_descriptor(k), &locations);
         }
         ++data_index;
       }
     }
-    flann::Index<flann::L2<uint8_t> >* index =
-        new flann::Index<flann::L2<uint8_t> >(
-            *data, flann::KDTreeIndexParams(FLAGS_trees));
+    flann::IndexParams index_params = flann::KDTreeIndexParams(FLAGS_trees);
+    const sjm::nbnn::HnswIndexParams hnsw_params(FLAGS_hnsw_m,
+                                                 FLAGS_hnsw_ef_construction);
+    index_params.insert(hnsw_params.begin(), hnsw_params.end());
+    IndexType* index = new IndexType(*data, index_params);
     index->buildIndex();
-    classifier.AddClass(categories[i], index);
+    if (FLAGS_location_candidates > 0) {
+      classifier.AddClass(categories[i], index, *data, locations);
+    } else {
+      classifier.AddClass(categories[i], index, *data);
+    }
 
     vector<string> test_list;
     for (int j = FLAGS_num_train; j < FLAGS_num_train + num_test; ++j) {
@@ -152,6 +233,12 @@ int main(int argc, char** argv) {
     }
     testing_files[categories[i]] = test_list;
   }
+  if (!load_index && !FLAGS_index_directory.empty()) {
+    classifier.Save(index_directory.string());
+    sjm::nbnn::AddIndexParamsOrDie(index_params_name, experiment_params);
+    // Written last, so it marks a complete save.
+    sjm::nbnn::WriteTestingFilesOrDie(testing_files_name, testing_files);
+  }
 
   float mean_accuracy = 0;
   float num_classes = 0;
@@ -161,12 +248,18 @@ int main(int argc, char** argv) {
     vector<string> test_list = it->second;
     float correct = 0;
     float total = 0;
-    BOOST_FOREACH(string test_file, test_list) {
-      LOG(INFO) << "Testing " << test_file << ".";
-      sjm::sift::DescriptorSet descriptors;
-      sjm::sift::ReadDescriptorSetFromFile(test_file, &descriptors);
-      sjm::nbnn::Result result = classifier.Classify(descriptors,
-                                                     FLAGS_subsample);
+    // The category's test images are classified as one batch.
+    vector<sjm::sift::DescriptorSet> descriptors(test_list.size());
+    vector<const sjm::sift::DescriptorSet*> batch;
+    for (size_t i = 0; i < test_list.size(); ++i) {
+      LOG(INFO) << "Testing " << test_list[i] << ".";
+      sjm::codebooks::ReadProjectedDescriptorSet(
+          test_list[i], FLAGS_projection_file, &descriptors[i]);
+      batch.push_back(&descriptors[i]);
+    }
+    const vector<sjm::nbnn::Result> results =
+        classifier.ClassifyBatch(batch, FLAGS_subsample);
+    BOOST_FOREACH(const sjm::nbnn::Result& result, results) {
       if (result.category == true_category) {
         correct += 1;
       }
@@ -180,6 +273,38 @@ int main(int argc, char** argv) {
     num_classes += 1;
   }
   mean_accuracy /= testing_files.size();
+  return mean_accuracy;
+}
+
+int main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  GOOGLE_PROTOBUF_VERIFY_VERSION;
+
+  std::srand(std::time(NULL));
+
+  CHECK(!FLAGS_category_list.empty()) << "--category_list is required.";
+  vector<string> categories;
+  sjm::util::ReadLinesFromFileIntoVectorOrDie(FLAGS_category_list,
+                                             & categories);
+
+  float mean_accuracy = 0;
+  if (FLAGS_index_type == "kdtree") {
+    mean_accuracy =
+        RunExperiment<flann::Index<flann::L2<uint8_t> > >(categories);
+  } else if (FLAGS_index_type == "kdforest") {
+    mean_accuracy = RunExperiment<sjm::nbnn::KdForestIndex>(categories);
+  } else if (FLAGS_index_type == "hnsw") {
+    mean_accuracy = RunExperiment<sjm::nbnn::HnswIndex>(categories);
+  } else if (FLAGS_index_type == "exact") {
+    mean_accuracy = RunExperiment<sjm::nbnn::BruteForceIndex>(categories);
+  } else if (FLAGS_index_type == "server") {
+    CHECK(!FLAGS_index_directory.empty()) <<
+        "--index_type server needs the --index_directory being served.";
+    mean_accuracy = RunExperiment<sjm::nbnn::IndexClient>(categories);
+  } else {
+    LOG(FATAL) << "Unknown --index_type " << FLAGS_index_type;
+  }
   // Write the mean accuracy safely to the output file.
   FILE* f = fopen(sjm::util::expand_user(FLAGS_results_file).c_str(), "a");
   CHECK(f != NULL) << "Error opening " << FLAGS_results_file << ".";
@@ -22,23 +22,36 @@
 // (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
 // OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
+#include <algorithm>
 #include <cstdlib>
 #include <ctime>
 #include <map>
+#include <sstream>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "boost/filesystem.hpp"
-#include "boost/foreach.hpp"
+#include "boost/lexical_cast.hpp"
 
 #include "gflags/gflags.h"
 #include "glog/logging.h"
 
 #include "flann/flann.hpp"
 
+#include "codebooks/dictionary.pb.h"
+#include "codebooks/pca.h"
+#include "naive_bayes_nearest_neighbor/hamming_index.h"
+#include "naive_bayes_nearest_neighbor/hnsw_index.h"
+#include "naive_bayes_nearest_neighbor/index_io.h"
+#include "naive_bayes_nearest_neighbor/index_server.h"
+#include "naive_bayes_nearest_neighbor/ivf_pq_index.h"
+#include "naive_bayes_nearest_neighbor/kd_forest_index.h"
 #include "naive_bayes_nearest_neighbor/merged_classifier.h"
+#include "naive_bayes_nearest_neighbor/neighbor_list.h"
 #include "sift/sift_descriptors.pb.h"
 #include "sift/sift_util.h"
+#include "util/growable_matrix.h"
 #include "util/util.h"
 
 DEFINE_double(alpha, 0,
@@ -66,33 +79,190 @@ DEFINE_double(subsample, 1.0,
               "A subsample fraction to use for query descriptors.");
 DEFINE_bool(full_results, false,
             "Output results from every class, not just the total average.");
+DEFINE_string(index_directory, "",
+              "If set, the built index and the training/testing split "
+              "are saved here, and later runs with the same directory "
+              "load them instead of rebuilding. --alpha must match the "
+              "saved index, unless it was built with "
+              "--location_candidates, and --category_list, --num_train, "
+              "--num_test, --trees, --index_type, --location_candidates "
+              "and the content of --projection_file must match.");
+DEFINE_string(index_type, "kdtree",
+              "How the merged descriptors are searched: 'kdtree' for a "
+              "FLANN kd-forest, 'kdforest' for the cache-friendly "
+              "kd-forest (with the same --trees and --checks), 'hnsw' "
+              "for an HNSW graph (with --checks as the search's ef), or "
+              "'ivfpq' for compressed codes in an "
+              "inverted file (with --checks as the number of codes "
+              "scanned), 'hamming' for binary codes compared by Hamming "
+              "distance, or 'server' to search the index that "
+              "index_server is serving from --index_directory.");
+DEFINE_int32(hnsw_m, 16,
+             "The number of links per node in the HNSW graph.");
+DEFINE_int32(hnsw_ef_construction, 200,
+             "The candidate list size used while building the HNSW graph.");
+DEFINE_int32(ivf_lists, 1024,
+             "The number of coarse centroids in the IVF-PQ index.");
+DEFINE_int32(pq_code_size, 16,
+             "The number of bytes each descriptor is compressed to in the "
+             "IVF-PQ index.");
+DEFINE_int32(pq_rerank, 0,
+             "If > 0, this many IVF-PQ candidates are re-ranked by their "
+             "exact distances.");
+DEFINE_int32(hamming_bits, 256,
+             "The number of bits in each descriptor's Hamming index code.");
+DEFINE_int32(hamming_rerank, 0,
+             "The number of candidates by Hamming distance that are "
+             "re-ranked by their exact distances (at least --k + --b).");
+DEFINE_int64(max_descriptors,
+             sjm::util::GrowableMatrix<uint8_t>::kDefaultMaxRows,
+             "The most training descriptors the index can hold. This only "
+             "reserves address space, so it can be generous.");
+DEFINE_int32(location_candidates, 0,
+             "If > 0, the index is built without the location, and this "
+             "many candidates nearest by appearance are reranked with the "
+             "location weighted by --alpha, so that a saved index can be "
+             "reused for any --alpha.");
+
+DEFINE_string(sweep_k, "",
+              "A comma-separated list of k values. If this or --sweep_b "
+              "is set, every combination of k and b is scored from one "
+              "search of each test image, and the results file lines "
+              "start with '<k> <b>'.");
+DEFINE_string(sweep_b, "",
+              "A comma-separated list of b values, as for --sweep_k.");
+DEFINE_string(neighbor_cache_directory, "",
+              "If set, each test image's neighbors are cached here, keyed "
+              "by the test file, the index, --checks, --alpha and "
+              "--subsample, so that later runs (e.g. with other --k and "
+              "--b, or --sweep_k and --sweep_b) don't search again.");
+DEFINE_string(projection_file, "",
+              "A projection learned by codebooks/pca_cli. If given, all "
+              "the descriptors are projected with it.");
 
 using std::map;
+using std::pair;
 using std::string;
 using std::vector;
 
-int main(int argc, char** argv) {
-  google::ParseCommandLineFlags(&argc, &argv, true);
-  google::InitGoogleLogging(argv[0]);
-  GOOGLE_PROTOBUF_VERIFY_VERSION;
-
-  std::srand(std::time(NULL));
+// Parses a comma-separated list of values, or returns the default
+// value if the list is empty.
+vector<int> ParseValuesOrDie(const string& list, const int default_value) {
+  vector<int> values;
+  if (list.empty()) {
+    values.push_back(default_value);
+    return values;
+  }
+  vector<string> parts;
+  sjm::util::SplitStringUsing(list, ",", &parts);
+  for (size_t i = 0; i < parts.size(); ++i) {
+    values.push_back(boost::lexical_cast<int>(parts[i]));
+  }
+  return values;
+}
 
-  CHECK(!FLAGS_category_list.empty()) << "--category_list is required.";
-  CHECK_GE(FLAGS_k, 2) << "--k needs to be at least 2.";
-  vector<string> categories;
-  sjm::util::ReadLinesFromFileIntoVectorOrDie(FLAGS_category_list,
-                                              &categories);
+// Finds the neighbors of each test file's descriptors, reading them
+// from the neighbor cache if it has enough of them. The rest are
+// searched for as one batch, and cached.
+template <typename IndexType>
+void FindNeighbors(
+    const sjm::nbnn::BasicMergedClassifier<IndexType>& classifier,
+    const vector<string>& test_files,
+    const int num_neighbors,
+    const string& cache_key_suffix,
+    vector<sjm::nbnn::NeighborList>* neighbors) {
+  neighbors->resize(test_files.size());
+  vector<int> uncached;
+  for (size_t i = 0; i < test_files.size(); ++i) {
+    if (!FLAGS_neighbor_cache_directory.empty()) {
+      const string cache_key = test_files[i] + cache_key_suffix;
+      sjm::nbnn::NeighborList& cached = (*neighbors)[i];
+      if (sjm::nbnn::ReadNeighborList(
+              sjm::nbnn::NeighborCacheFilename(
+                  FLAGS_neighbor_cache_directory, cache_key),
+              cache_key, &cached) &&
+          (static_cast<int>(cached.neighbors) >= num_neighbors ||
+           static_cast<int>(cached.neighbors) == classifier.DataSize())) {
+        continue;
+      }
+    }
+    uncached.push_back(i);
+  }
+  if (uncached.empty()) {
+    return;
+  }
+  vector<sjm::sift::DescriptorSet> descriptors(uncached.size());
+  vector<const sjm::sift::DescriptorSet*> batch;
+  for (size_t i = 0; i < uncached.size(); ++i) {
+    sjm::codebooks::ReadProjectedDescriptorSet(
+        test_files[uncached[i]], FLAGS_projection_file, &descriptors[i]);
+    batch.push_back(&descriptors[i]);
+  }
+  vector<sjm::nbnn::NeighborList> found;
+  classifier.FindNeighbors(batch, FLAGS_subsample, num_neighbors, &found);
+  for (size_t i = 0; i < uncached.size(); ++i) {
+    if (!FLAGS_neighbor_cache_directory.empty()) {
+      const string cache_key = test_files[uncached[i]] + cache_key_suffix;
+      sjm::nbnn::WriteNeighborListOrDie(
+          sjm::nbnn::NeighborCacheFilename(FLAGS_neighbor_cache_directory,
+                                           cache_key),
+          cache_key, found[i]);
+    }
+    std::swap((*neighbors)[uncached[i]], found[i]);
+  }
+}
 
+// Builds (or loads) the classifier, writes its accuracy on each
+// category to the results file for each (k, b) setting, and returns
+// its mean per-category accuracy for each setting.
+template <typename IndexType>
+vector<float> RunExperiment(const vector<string>& categories,
+                            const vector<pair<int, int> >& settings) {
   // Get list of files from each category, by looking in the
   // features_directory, constructing the classifier and testing lists
   // as we go.
-  sjm::nbnn::MergedClassifier classifier;
+  sjm::nbnn::BasicMergedClassifier<IndexType> classifier;
   classifier.SetClassifierParams(
       FLAGS_k, FLAGS_k + FLAGS_b, FLAGS_alpha, FLAGS_checks, FLAGS_trees);
+  flann::IndexParams index_params =
+      sjm::nbnn::HnswIndexParams(FLAGS_hnsw_m, FLAGS_hnsw_ef_construction);
+  if (FLAGS_index_type == "hamming") {
+    // These go first, since they share the "rerank" param with IVF-PQ.
+    const sjm::nbnn::HammingIndexParams hamming_params(FLAGS_hamming_bits,
+                                                       FLAGS_hamming_rerank);
+    index_params.insert(hamming_params.begin(), hamming_params.end());
+  }
+  const sjm::nbnn::IvfPqIndexParams ivf_pq_params(
+      FLAGS_ivf_lists, FLAGS_pq_code_size, FLAGS_pq_rerank);
+  index_params.insert(ivf_pq_params.begin(), ivf_pq_params.end());
+  classifier.SetIndexParams(index_params);
+  classifier.SetCapacity(FLAGS_max_descriptors);
+  if (FLAGS_location_candidates > 0) {
+    classifier.SetLocationReranking(FLAGS_location_candidates);
+  }
   map<string, vector<string> > testing_files;
   boost::filesystem::path root(FLAGS_features_directory);
-  for (size_t i = 0; i < categories.size(); ++i) {
+  const boost::filesystem::path index_directory(
+      sjm::util::expand_user(FLAGS_index_directory));
+  const string testing_files_name =
+      (index_directory / sjm::nbnn::kTestingFilesName).string();
+  const string index_params_name =
+      (index_directory / sjm::nbnn::kIndexParamsName).string();
+  const map<string, string> experiment_params =
+      sjm::nbnn::ExperimentIndexParams(categories, FLAGS_num_train,
+                                       FLAGS_num_test, FLAGS_trees,
+                                       FLAGS_index_type, FLAGS_alpha,
+                                       FLAGS_location_candidates,
+                                       FLAGS_projection_file);
+  const bool load_index = !FLAGS_index_directory.empty() &&
+      boost::filesystem::exists(testing_files_name);
+  if (load_index) {
+    LOG(INFO) << "Loading the index from " << FLAGS_index_directory;
+    sjm::nbnn::CheckIndexParamsOrDie(index_params_name, experiment_params);
+    classifier.Load(index_directory.string());
+    sjm::nbnn::ReadTestingFilesOrDie(testing_files_name, &testing_files);
+  }
+  for (size_t i = 0; !load_index && i < categories.size(); ++i) {
     LOG(INFO) << "Loading data for category " << categories[i] << ".";
     boost::filesystem::path stem(categories[i]);
     boost::filesystem::path category_directory = root / stem;
@@ -111,7 +281,8 @@ int main(int argc, char** argv) {
     // Images 0 to FLAGS_num_train-1 go into the training set.
     for (int j = 0; j < FLAGS_num_train; ++j) {
       sjm::sift::DescriptorSet d;
-      sjm::sift::ReadDescriptorSetFromFile(file_list[j], &d);
+      sjm::codebooks::ReadProjectedDescriptorSet(
+          file_list[j], FLAGS_projection_file, &d);
       classifier.AddData(categories[i], d);
     }
 
@@ -123,49 +294,147 @@ int main(int argc, char** argv) {
     }
     testing_files[categories[i]] = test_list;
   }
-  classifier.BuildIndex();
+  if (!load_index) {
+    classifier.BuildIndex();
+    if (!FLAGS_index_directory.empty()) {
+      classifier.Save(index_directory.string());
+      sjm::nbnn::AddIndexParamsOrDie(index_params_name, experiment_params);
+      // Written last, so it marks a complete save.
+      sjm::nbnn::WriteTestingFilesOrDie(testing_files_name, testing_files);
+    }
+  }
+
+  // Every setting is scored from the same neighbors, enough for the
+  // largest k + b.
+  int num_neighbors = 0;
+  for (size_t i = 0; i < settings.size(); ++i) {
+    num_neighbors =
+        std::max(num_neighbors, settings[i].first + settings[i].second);
+  }
+  string cache_key_suffix;
+  if (!FLAGS_neighbor_cache_directory.empty()) {
+    boost::filesystem::create_directories(
+        sjm::util::expand_user(FLAGS_neighbor_cache_directory));
+    std::ostringstream key;
+    key << "\t" << std::hex << classifier.Fingerprint() << std::dec <<
+        "\t" << FLAGS_checks << "\t" << FLAGS_alpha << "\t" <<
+        FLAGS_subsample;
+    cache_key_suffix = key.str();
+  }
+  const bool sweeping = !FLAGS_sweep_k.empty() || !FLAGS_sweep_b.empty();
 
-  float mean_accuracy = 0;
+  vector<float> mean_accuracy(settings.size(), 0);
   float classes_processed = 0;
   for (map<string, vector<string> >::const_iterator it = testing_files.begin();
        it != testing_files.end(); ++it) {
     string true_category = it->first;
     vector<string> test_list = it->second;
-    float correct_this_category = 0;
+    vector<float> correct_this_category(settings.size(), 0);
     float total_this_category = 0;
-    BOOST_FOREACH(string test_file, test_list) {
-      LOG(INFO) << "Testing " << test_file << ".";
-      sjm::sift::DescriptorSet descriptors;
-      sjm::sift::ReadDescriptorSetFromFile(test_file, &descriptors);
-      sjm::nbnn::Result result = classifier.Classify(descriptors,
-                                                     FLAGS_subsample);
-      if (result.category == true_category) {
-        correct_this_category += 1;
+    // The category's test images are searched as one batch.
+    vector<sjm::nbnn::NeighborList> test_neighbors;
+    FindNeighbors(classifier, test_list, num_neighbors, cache_key_suffix,
+                  &test_neighbors);
+    for (size_t i = 0; i < test_list.size(); ++i) {
+      LOG(INFO) << "Testing " << test_list[i] << ".";
+      const sjm::nbnn::NeighborList& neighbors = test_neighbors[i];
+      string predicted;
+      for (size_t s = 0; s < settings.size(); ++s) {
+        sjm::nbnn::Result result = classifier.ClassifyNeighbors(
+            neighbors, settings[s].first,
+            settings[s].first + settings[s].second);
+        if (result.category == true_category) {
+          correct_this_category[s] += 1;
+        }
+        if (s == 0) {
+          predicted = result.category;
+        }
       }
       total_this_category += 1;
       // This logs a running update of the mean accuracy across all
       // classes seen so far, including the current estimated accuracy
-      // for the current class.
-      LOG(INFO) << "Predicted " << result.category <<
+      // for the current class, with the first setting.
+      LOG(INFO) << "Predicted " << predicted <<
           ". Cumulative mean accuracy = " <<
-          ((correct_this_category / total_this_category) + mean_accuracy) /
-          (classes_processed + 1) << ".";
+          ((correct_this_category[0] / total_this_category) +
+           mean_accuracy[0]) / (classes_processed + 1) << ".";
+    }
+    for (size_t s = 0; s < settings.size(); ++s) {
+      float class_accuracy = correct_this_category[s] / total_this_category;
+      // Write this class's accuracy safely to the output file.
+      const int kBufferSize = 256;
+      char buffer[kBufferSize];
+      if (sweeping) {
+        std::snprintf(buffer, kBufferSize, "%d %d %s %f\n",
+                      settings[s].first, settings[s].second,
+                      true_category.c_str(), class_accuracy);
+      } else {
+        std::snprintf(buffer, kBufferSize, "%s %f\n",
+                      true_category.c_str(), class_accuracy);
+      }
+      sjm::util::AppendStringToFileOrDie(FLAGS_results_file, buffer);
+      mean_accuracy[s] += class_accuracy;
     }
-    float class_accuracy = correct_this_category / total_this_category;
-    // Write this class's accuracy safely to the output file.
-    const int kBufferSize = 256;
-    char buffer[kBufferSize];
-    std::snprintf(buffer, kBufferSize, "%s %f\n",
-                  true_category.c_str(), class_accuracy);
-    sjm::util::AppendStringToFileOrDie(FLAGS_results_file, buffer);
-    mean_accuracy += class_accuracy;
     classes_processed += 1;
   }
-  mean_accuracy /= testing_files.size();
+  for (size_t s = 0; s < settings.size(); ++s) {
+    mean_accuracy[s] /= testing_files.size();
+  }
+  return mean_accuracy;
+}
+
+int main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  GOOGLE_PROTOBUF_VERIFY_VERSION;
+
+  std::srand(std::time(NULL));
+
+  CHECK(!FLAGS_category_list.empty()) << "--category_list is required.";
+  vector<string> categories;
+  sjm::util::ReadLinesFromFileIntoVectorOrDie(FLAGS_category_list,
+                                              &categories);
+  const vector<int> k_values = ParseValuesOrDie(FLAGS_sweep_k, FLAGS_k);
+  const vector<int> b_values = ParseValuesOrDie(FLAGS_sweep_b, FLAGS_b);
+  vector<pair<int, int> > settings;
+  for (size_t i = 0; i < k_values.size(); ++i) {
+    CHECK_GE(k_values[i], 2) << "--k needs to be at least 2.";
+    for (size_t j = 0; j < b_values.size(); ++j) {
+      CHECK_GE(b_values[j], 1) << "--b needs to be at least 1.";
+      settings.push_back(std::make_pair(k_values[i], b_values[j]));
+    }
+  }
+
+  vector<float> mean_accuracy;
+  if (FLAGS_index_type == "kdtree") {
+    mean_accuracy =
+        RunExperiment<flann::Index<flann::L2<uint8_t> > >(categories, settings);
+  } else if (FLAGS_index_type == "kdforest") {
+    mean_accuracy =
+        RunExperiment<sjm::nbnn::KdForestIndex>(categories, settings);
+  } else if (FLAGS_index_type == "hnsw") {
+    mean_accuracy = RunExperiment<sjm::nbnn::HnswIndex>(categories, settings);
+  } else if (FLAGS_index_type == "ivfpq") {
+    mean_accuracy = RunExperiment<sjm::nbnn::IvfPqIndex>(categories, settings);
+  } else if (FLAGS_index_type == "hamming") {
+    mean_accuracy =
+        RunExperiment<sjm::nbnn::HammingIndex>(categories, settings);
+  } else if (FLAGS_index_type == "server") {
+    CHECK(!FLAGS_index_directory.empty()) <<
+        "--index_type server needs the --index_directory being served.";
+    mean_accuracy = RunExperiment<sjm::nbnn::IndexClient>(categories, settings);
+  } else {
+    LOG(FATAL) << "Unknown --index_type " << FLAGS_index_type;
+  }
   // Write the mean accuracy safely to the output file.
   FILE* f = fopen(sjm::util::expand_user(FLAGS_results_file).c_str(), "a");
   CHECK(f != NULL) << "Error opening " << FLAGS_results_file << ".";
-  fprintf(f, "%s %f\n", "total", mean_accuracy);
+  for (size_t s = 0; s < settings.size(); ++s) {
+    if (!FLAGS_sweep_k.empty() || !FLAGS_sweep_b.empty()) {
+      fprintf(f, "%d %d ", settings[s].first, settings[s].second);
+    }
+    fprintf(f, "%s %f\n", "total", mean_accuracy[s]);
+  }
   fclose(f);
 
   return 0;
@@ -0,0 +1,390 @@
+// Copyright (c) 2011, Sancho McCann
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+
+// - Redistributions of source code must retain the above copyright
+//   notice, this list of conditions and the following disclaimer.
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// An approximate nearest neighbor index over uint8_t descriptors that
+// compares binary codes of the descriptors (a Hamming embedding). Each
+// code bit is the sign of a random projection of the centred
+// descriptor, thresholded at the projection's median over a training
+// sample so that each bit splits the data in half. The projections
+// are rows of random rotations, so the bits of each block of
+// dimensions-many are uncorrelated for isotropic data.
+//
+// Queries compare their code against every point's with popcounts,
+// which runs at about the speed of reading the codes from memory: a
+// 256 bit code is 32 bytes, rather than the 128-130 bytes of the
+// descriptor. The rerank nearest candidates by Hamming distance (at
+// least knn) are then re-ranked by their exact distance to the query,
+// which is computed from the data, so the data has to stay mapped.
+// The returned distances are always the exact squared distances that
+// the NBNN classifiers expect.
+//
+// It can be used as the IndexType of an NbnnClassifier or a
+// BasicMergedClassifier (see nbnn_classifier.h).
+
+#ifndef NAIVE_BAYES_NEAREST_NEIGHBOR_HAMMING_INDEX_H_
+#define NAIVE_BAYES_NEAREST_NEIGHBOR_HAMMING_INDEX_H_
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "glog/logging.h"
+
+#include "flann/flann.hpp"
+
+#include "naive_bayes_nearest_neighbor/distance.h"
+#include "naive_bayes_nearest_neighbor/index_io.h"
+#include "util/util.h"
+
+namespace sjm {
+namespace nbnn {
+
+namespace internal {
+
+const char kHammingIndexMagic[8] = {'S', 'J', 'M', 'H', 'A', 'M', 'M', 'G'};
+}  // namespace internal.
+
+// The bits is the length of the codes, which is rounded up to a
+// multiple of 64. The rerank is the number of candidates by Hamming
+// distance that are re-ranked by their exact distance (if it's less
+// than the knn searched for, knn are). The training_rows is the most
+// rows the thresholds are learned from.
+struct HammingIndexParams : public flann::IndexParams {
+  explicit HammingIndexParams(const int bits = 256,
+                              const int rerank = 0,
+                              const int training_rows = 65536) {
+    (*this)["bits"] = bits;
+    (*this)["rerank"] = rerank;
+    (*this)["training_rows"] = training_rows;
+  }
+};
+
+class HammingIndex {
+ public:
+  // The params are usually HammingIndexParams.
+  HammingIndex(const flann::Matrix<uint8_t>& data,
+               const flann::IndexParams& params)
+      : dimensions_(data.cols), size_(0) {
+    AppendRows(data);
+    const std::string filename =
+        flann::get_param<std::string>(params, "filename", "");
+    if (!filename.empty()) {
+      Load(filename);
+    } else {
+      const int bits = flann::get_param(params, "bits", 256);
+      rerank_ = flann::get_param(params, "rerank", 0);
+      training_rows_ = flann::get_param(params, "training_rows", 65536);
+      CHECK_GT(bits, 0);
+      CHECK_GE(rerank_, 0);
+      CHECK_GT(training_rows_, 0);
+      words_ = (bits + 63) / 64;
+    }
+  }
+
+  // Learns the projections and thresholds, if that hasn't been done
+  // yet, and encodes any rows that haven't been encoded.
+  void buildIndex() {
+    if (thresholds_.empty() && !rows_.empty()) {
+      Train();
+    }
+    codes_.resize(rows_.size() * words_);
+    for (; size_ < rows_.size(); ++size_) {
+      Encode(rows_[size_], &codes_[size_ * words_]);
+    }
+  }
+
+  // Adds the points to the index. Nothing is rebuilt: the new points
+  // are encoded with the existing projections, so the
+  // rebuild_threshold is ignored.
+  void addPoints(const flann::Matrix<uint8_t>& points,
+                 float rebuild_threshold = 2) {
+    CHECK_EQ(dimensions_, points.cols);
+    AppendRows(points);
+    buildIndex();
+  }
+
+  // Saves the projections and codes, but not the data, like
+  // flann::Index::save.
+  void save(const std::string& filename) const {
+    FILE* f = fopen(sjm::util::expand_user(filename).c_str(), "wb");
+    CHECK(f != NULL) << "Error opening " << filename << " for writing.";
+    WriteOrDie(internal::kHammingIndexMagic,
+               sizeof(internal::kHammingIndexMagic), f);
+    const int32_t header[] = {
+      static_cast<int32_t>(dimensions_), words_, rerank_, training_rows_,
+      static_cast<int32_t>(size_), static_cast<int32_t>(thresholds_.size())};
+    WriteOrDie(header, sizeof(header), f);
+    WriteOrDie(mean_.data(), mean_.size() * sizeof(float), f);
+    WriteOrDie(projections_.data(), projections_.size() * sizeof(float), f);
+    WriteOrDie(thresholds_.data(), thresholds_.size() * sizeof(float), f);
+    WriteOrDie(codes_.data(), size_ * words_ * sizeof(uint64_t), f);
+    CHECK_EQ(0, fclose(f));
+  }
+
+  // The number of points in the index.
+  size_t size() const {
+    return size_;
+  }
+
+  size_t veclen() const {
+    return dimensions_;
+  }
+
+  // The distances are exact, but the candidates are chosen by their
+  // codes. Every code is compared, so the checks are ignored.
+  int knnSearch(const flann::Matrix<uint8_t>& queries,
+                flann::Matrix<int>& indices,
+                flann::Matrix<float>& dists,
+                size_t knn,
+                const flann::SearchParams& params) const {
+    CheckKnnSearchOrDie(queries, indices, dists, knn, dimensions_);
+    const size_t num_candidates =
+        std::max(knn, static_cast<size_t>(rerank_));
+    std::vector<uint64_t> query_codes(queries.rows * words_);
+    std::vector<std::vector<std::pair<int, int> > > heaps(queries.rows);
+    for (size_t q = 0; q < queries.rows; ++q) {
+      if (!thresholds_.empty()) {
+        Encode(queries[q], &query_codes[q * words_]);
+      }
+      heaps[q].reserve(num_candidates + 1);
+    }
+    // As in BruteForceIndex, the codes are visited in blocks that stay
+    // in cache while every query is compared against them.
+    for (size_t block = 0; block < size_; block += kBlockRows) {
+      const size_t block_end = std::min(size_, block + kBlockRows);
+      for (size_t q = 0; q < queries.rows; ++q) {
+        std::vector<std::pair<int, int> >& heap = heaps[q];
+        const uint64_t* query_code = &query_codes[q * words_];
+        for (size_t row = block; row < block_end; ++row) {
+          const std::pair<int, int> candidate(
+              internal::HammingDistance(query_code, &codes_[row * words_],
+                                        words_),
+              static_cast<int>(row));
+          if (heap.size() < num_candidates) {
+            heap.push_back(candidate);
+            std::push_heap(heap.begin(), heap.end());
+          } else if (num_candidates > 0 && candidate < heap.front()) {
+            std::pop_heap(heap.begin(), heap.end());
+            heap.back() = candidate;
+            std::push_heap(heap.begin(), heap.end());
+          }
+        }
+      }
+    }
+    int found = 0;
+    for (size_t q = 0; q < queries.rows; ++q) {
+      std::vector<std::pair<int, int> >& heap = heaps[q];
+      for (size_t i = 0; i < heap.size(); ++i) {
+        heap[i].first = internal::SquaredDistance(
+            queries[q], rows_[heap[i].second], dimensions_);
+      }
+      std::sort(heap.begin(), heap.end());
+      found += StoreNeighbors(heap, knn, indices[q], dists[q]);
+    }
+    return found;
+  }
+
+ private:
+  // 1024 codes of 256 bits take 32 KiB, about an L1 cache.
+  static const size_t kBlockRows = 1024;
+  static const int kRandomSeed = 100;
+
+  void AppendRows(const flann::Matrix<uint8_t>& data) {
+    for (size_t i = 0; i < data.rows; ++i) {
+      rows_.push_back(data[i]);
+    }
+  }
+
+  // Fills the projections of the centred point, one per bit.
+  void Project(const uint8_t* point, std::vector<float>* projected) const {
+    const int bits = 64 * words_;
+    std::vector<float> centred(dimensions_);
+    for (size_t i = 0; i < dimensions_; ++i) {
+      centred[i] = point[i] - mean_[i];
+    }
+    projected->resize(bits);
+    for (int b = 0; b < bits; ++b) {
+      const float* projection = &projections_[b * dimensions_];
+      float total = 0;
+      for (size_t i = 0; i < dimensions_; ++i) {
+        total += projection[i] * centred[i];
+      }
+      (*projected)[b] = total;
+    }
+  }
+
+  void Encode(const uint8_t* point, uint64_t* code) const {
+    std::vector<float> projected;
+    Project(point, &projected);
+    std::fill(code, code + words_, 0);
+    for (size_t b = 0; b < projected.size(); ++b) {
+      if (projected[b] > thresholds_[b]) {
+        code[b / 64] |= static_cast<uint64_t>(1) << (b % 64);
+      }
+    }
+  }
+
+  // Fills projections_ with blocks of random orthonormal rows, enough
+  // for every bit, by Gram-Schmidt orthogonalization of Gaussian rows.
+  void RandomRotations() {
+    const int bits = 64 * words_;
+    std::mt19937 random(kRandomSeed);
+    std::normal_distribution<float> gaussian(0, 1);
+    projections_.resize(bits * dimensions_);
+    for (int b = 0; b < bits; ++b) {
+      float* row = &projections_[b * dimensions_];
+      // The first row of this row's block.
+      const int block_start = b - b % dimensions_;
+      double norm = 0;
+      while (norm < 1e-6) {
+        for (size_t i = 0; i < dimensions_; ++i) {
+          row[i] = gaussian(random);
+        }
+        for (int other = block_start; other < b; ++other) {
+          const float* other_row = &projections_[other * dimensions_];
+          double dot = 0;
+          for (size_t i = 0; i < dimensions_; ++i) {
+            dot += row[i] * other_row[i];
+          }
+          for (size_t i = 0; i < dimensions_; ++i) {
+            row[i] -= dot * other_row[i];
+          }
+        }
+        norm = 0;
+        for (size_t i = 0; i < dimensions_; ++i) {
+          norm += row[i] * row[i];
+        }
+        norm = std::sqrt(norm);
+      }
+      for (size_t i = 0; i < dimensions_; ++i) {
+        row[i] /= norm;
+      }
+    }
+  }
+
+  void Train() {
+    // An evenly spaced sample of the rows.
+    const size_t sample_size =
+        std::min(rows_.size(), static_cast<size_t>(training_rows_));
+    std::vector<const uint8_t*> sample(sample_size);
+    mean_.assign(dimensions_, 0);
+    for (size_t i = 0; i < sample_size; ++i) {
+      sample[i] = rows_[i * rows_.size() / sample_size];
+      for (size_t d = 0; d < dimensions_; ++d) {
+        mean_[d] += sample[i][d];
+      }
+    }
+    for (size_t d = 0; d < dimensions_; ++d) {
+      mean_[d] /= sample_size;
+    }
+    RandomRotations();
+    // Each bit's threshold is the median of its projections.
+    const int bits = 64 * words_;
+    std::vector<std::vector<float> > projections(
+        bits, std::vector<float>(sample_size));
+    std::vector<float> projected;
+    for (size_t i = 0; i < sample_size; ++i) {
+      Project(sample[i], &projected);
+      for (int b = 0; b < bits; ++b) {
+        projections[b][i] = projected[b];
+      }
+    }
+    thresholds_.resize(bits);
+    for (int b = 0; b < bits; ++b) {
+      std::nth_element(projections[b].begin(),
+                       projections[b].begin() + sample_size / 2,
+                       projections[b].end());
+      thresholds_[b] = projections[b][sample_size / 2];
+    }
+  }
+
+  void Load(const std::string& filename) {
+    std::string data;
+    sjm::util::ReadFileToStringOrDie(filename, &data);
+    const char* read = data.data();
+    const char* end = read + data.size();
+    const size_t magic_size = sizeof(internal::kHammingIndexMagic);
+    CHECK(data.size() >= magic_size &&
+          memcmp(read, internal::kHammingIndexMagic, magic_size) == 0) <<
+        filename << " is not a Hamming index.";
+    read += magic_size;
+    int32_t header[6];
+    ReadOrDie(header, sizeof(header), end, &read);
+    CHECK_EQ(dimensions_, header[0]) <<
+        filename << " was built on different data.";
+    words_ = header[1];
+    rerank_ = header[2];
+    training_rows_ = header[3];
+    size_ = header[4];
+    CHECK_EQ(rows_.size(), size_) <<
+        filename << " was built on different data.";
+    const int bits = header[5];
+    if (bits > 0) {
+      CHECK_EQ(64 * words_, bits);
+      mean_.resize(dimensions_);
+      projections_.resize(bits * dimensions_);
+      thresholds_.resize(bits);
+    }
+    ReadOrDie(mean_.data(), mean_.size() * sizeof(float), end, &read);
+    ReadOrDie(projections_.data(), projections_.size() * sizeof(float), end,
+              &read);
+    ReadOrDie(thresholds_.data(), thresholds_.size() * sizeof(float), end,
+              &read);
+    codes_.resize(size_ * words_);
+    ReadOrDie(codes_.data(), codes_.size() * sizeof(uint64_t), end, &read);
+    CHECK(read == end) << filename << " has trailing data.";
+  }
+
+  const size_t dimensions_;
+  // The number of 64-bit words in each code.
+  int words_;
+  int rerank_;
+  int training_rows_;
+  // The data row of each point, for encoding and re-ranking.
+  std::vector<const uint8_t*> rows_;
+  // The number of rows that have been encoded.
+  size_t size_;
+  // The mean of the training sample, which is subtracted before
+  // projecting.
+  std::vector<float> mean_;
+  // The projection of each bit, one after another.
+  std::vector<float> projections_;
+  // The threshold of each bit's projection.
+  std::vector<float> thresholds_;
+  // The code of each point, one after another.
+  std::vector<uint64_t> codes_;
+
+  HammingIndex(const HammingIndex&);
+  void operator=(const HammingIndex&);
+};
+}}  // Namespace.
+
+#endif  // NAIVE_BAYES_NEAREST_NEIGHBOR_HAMMING_INDEX_H_
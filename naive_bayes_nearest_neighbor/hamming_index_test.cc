@@ -0,0 +1,122 @@
+// Copyright (c) 2011, Sancho McCann
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+
+// - Redistributions of source code must retain the above copyright
+//   notice, this list of conditions and the following disclaimer.
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "naive_bayes_nearest_neighbor/hamming_index.h"
+
+#include <stdint.h>
+
+#include <cstring>
+#include <string>
+
+#include "boost/filesystem.hpp"
+#include "glog/logging.h"
+#include "gtest/gtest.h"
+
+#include "flann/flann.hpp"
+
+#include "naive_bayes_nearest_neighbor/index_test_util.h"
+#include "util/util.h"
+
+using sjm::nbnn::test::kDimensions;
+using sjm::nbnn::test::kQueries;
+using sjm::nbnn::test::kRows;
+
+// What every IndexType must do is tested in index_type_test.cc.
+class HammingIndexTest : public sjm::nbnn::test::IndexTest {};
+
+TEST_F(HammingIndexTest,
+       TestBitsRoundUpToWords) {
+  sjm::nbnn::HammingIndex index(data_, sjm::nbnn::HammingIndexParams(1));
+  index.buildIndex();
+  index.save("/tmp/hamming_index_test_short.hamming");
+  // The magic and header, then the mean, a projection and threshold
+  // for each of the 64 bits, and a word per code.
+  ASSERT_EQ(8 + 6 * 4 + kDimensions * 4 + 64 * (kDimensions + 1) * 4 +
+            kRows * 8,
+            boost::filesystem::file_size(
+                "/tmp/hamming_index_test_short.hamming"));
+  sjm::nbnn::HammingIndex loaded(
+      data_, flann::SavedIndexParams("/tmp/hamming_index_test_short.hamming"));
+  ASSERT_EQ(Search(index, 1), Search(loaded, 1));
+}
+
+TEST_F(HammingIndexTest,
+       TestThresholdsSplitTheDataInHalf) {
+  sjm::nbnn::HammingIndex index(data_, sjm::nbnn::HammingIndexParams(64));
+  index.buildIndex();
+  index.save("/tmp/hamming_index_test_split.hamming");
+  // The codes are the last word of each row in the file.
+  std::string file;
+  sjm::util::ReadFileToStringOrDie("/tmp/hamming_index_test_split.hamming",
+                                   &file);
+  ASSERT_LE(kRows * sizeof(uint64_t), file.size());
+  const char* codes = file.data() + file.size() - kRows * sizeof(uint64_t);
+  int ones[64] = {0};
+  for (int i = 0; i < kRows; ++i) {
+    uint64_t code = 0;
+    memcpy(&code, codes + i * sizeof(code), sizeof(code));
+    for (int b = 0; b < 64; ++b) {
+      ones[b] += (code >> b) & 1;
+    }
+  }
+  // Every row is in the training sample, so each bit's threshold is
+  // the median of its projections over the rows.
+  for (int b = 0; b < 64; ++b) {
+    ASSERT_LE(0.45 * kRows, ones[b]);
+    ASSERT_GE(0.55 * kRows, ones[b]);
+  }
+}
+
+TEST_F(HammingIndexTest,
+       TestDistancesAreExact) {
+  sjm::nbnn::HammingIndex index(data_, sjm::nbnn::HammingIndexParams());
+  index.buildIndex();
+  const int kKnn = 5;
+  flann::Matrix<int> indices(new int[kQueries * kKnn], kQueries, kKnn);
+  flann::Matrix<float> dists(new float[kQueries * kKnn], kQueries, kKnn);
+  index.knnSearch(queries_, indices, dists, kKnn, flann::SearchParams(1));
+  for (int q = 0; q < kQueries; ++q) {
+    for (int k = 0; k < kKnn; ++k) {
+      ASSERT_EQ(static_cast<float>(sjm::nbnn::internal::SquaredDistance(
+                    queries_[q], data_[indices[q][k]], kDimensions)),
+                dists[q][k]);
+    }
+  }
+  delete[] indices.ptr();
+  delete[] dists.ptr();
+}
+
+TEST_F(HammingIndexTest,
+       TestRerankEverythingIsExact) {
+  sjm::nbnn::HammingIndex index(data_,
+                                sjm::nbnn::HammingIndexParams(128, kRows));
+  index.buildIndex();
+  ASSERT_EQ(ExactSearch(), Search(index, 1));
+}
+
+int main(int argc, char** argv) {
+  google::InitGoogleLogging(argv[0]);
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
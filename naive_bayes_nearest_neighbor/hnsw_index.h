@@ -0,0 +1,428 @@
+// Copyright (c) 2011, Sancho McCann
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+
+// - Redistributions of source code must retain the above copyright
+//   notice, this list of conditions and the following disclaimer.
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// An approximate nearest neighbor index over uint8_t descriptors,
+// using a hierarchical navigable small world (HNSW) graph (Malkov and
+// Yashunin, 2016). It can be used as the IndexType of an
+// NbnnClassifier or a BasicMergedClassifier (see nbnn_classifier.h),
+// in place of a FLANN kd-forest. The checks of the search params are
+// used as the size of the search's candidate list (HNSW's ef), so, as
+// with FLANN, more checks give more accurate results at the cost of
+// time.
+
+#ifndef NAIVE_BAYES_NEAREST_NEIGHBOR_HNSW_INDEX_H_
+#define NAIVE_BAYES_NEAREST_NEIGHBOR_HNSW_INDEX_H_
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <queue>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "boost/thread/tss.hpp"
+#include "glog/logging.h"
+
+#include "flann/flann.hpp"
+
+#include "naive_bayes_nearest_neighbor/distance.h"
+#include "naive_bayes_nearest_neighbor/index_io.h"
+#include "util/util.h"
+
+namespace sjm {
+namespace nbnn {
+
+namespace internal {
+
+const char kHnswIndexMagic[8] = {'S', 'J', 'M', 'H', 'N', 'S', 'W', '1'};
+}  // namespace internal.
+
+// The m is the number of links each node keeps per graph layer (twice
+// that on the bottom layer). The ef_construction is the candidate list
+// size used while inserting. Larger values of either give a more
+// accurate graph that is slower to build.
+struct HnswIndexParams : public flann::IndexParams {
+  explicit HnswIndexParams(const int m = 16,
+                           const int ef_construction = 200) {
+    (*this)["m"] = m;
+    (*this)["ef_construction"] = ef_construction;
+  }
+};
+
+class HnswIndex {
+ public:
+  // The params are usually HnswIndexParams.
+  HnswIndex(const flann::Matrix<uint8_t>& data,
+            const flann::IndexParams& params)
+      : dimensions_(data.cols), entry_point_(-1), max_level_(-1),
+        random_(kRandomSeed), visited_(0) {
+    AppendRows(data);
+    const std::string filename =
+        flann::get_param<std::string>(params, "filename", "");
+    if (!filename.empty()) {
+      Load(filename);
+    } else {
+      m_ = flann::get_param(params, "m", 16);
+      ef_construction_ = flann::get_param(params, "ef_construction", 200);
+      CHECK_GT(m_, 1);
+      CHECK_GT(ef_construction_, 0);
+    }
+  }
+
+  // Inserts any rows that aren't in the graph yet.
+  void buildIndex() {
+    const double level_multiplier = 1 / std::log(static_cast<double>(m_));
+    std::uniform_real_distribution<double> uniform(0, 1);
+    for (int node = levels_.size(); node < static_cast<int>(rows_.size());
+         ++node) {
+      const int level = static_cast<int>(
+          -std::log(1 - uniform(random_)) * level_multiplier);
+      Insert(node, level);
+    }
+  }
+
+  // Adds the points to the index. Unlike FLANN, nothing is rebuilt:
+  // the new points are inserted into the existing graph, so the
+  // rebuild_threshold is ignored.
+  void addPoints(const flann::Matrix<uint8_t>& points,
+                 float rebuild_threshold = 2) {
+    CHECK_EQ(dimensions_, points.cols);
+    AppendRows(points);
+    buildIndex();
+  }
+
+  // Saves the graph, but not the data, like flann::Index::save.
+  void save(const std::string& filename) const {
+    FILE* f = fopen(sjm::util::expand_user(filename).c_str(), "wb");
+    CHECK(f != NULL) << "Error opening " << filename << " for writing.";
+    WriteOrDie(internal::kHnswIndexMagic, sizeof(internal::kHnswIndexMagic),
+               f);
+    const int32_t header[] = {
+      m_, ef_construction_, static_cast<int32_t>(levels_.size()),
+      entry_point_, max_level_};
+    WriteOrDie(header, sizeof(header), f);
+    WriteOrDie(levels_.data(), levels_.size() * sizeof(levels_[0]), f);
+    for (size_t node = 0; node < links_.size(); ++node) {
+      for (size_t level = 0; level < links_[node].size(); ++level) {
+        const std::vector<int32_t>& links = links_[node][level];
+        const int32_t num_links = links.size();
+        WriteOrDie(&num_links, sizeof(num_links), f);
+        WriteOrDie(links.data(), links.size() * sizeof(links[0]), f);
+      }
+    }
+    CHECK_EQ(0, fclose(f));
+  }
+
+  // The number of points in the graph.
+  size_t size() const {
+    return levels_.size();
+  }
+
+  size_t veclen() const {
+    return dimensions_;
+  }
+
+  // The checks of the params set how many candidates are kept during
+  // the search (at least knn, and every point if checks is
+  // flann::FLANN_CHECKS_UNLIMITED).
+  int knnSearch(const flann::Matrix<uint8_t>& queries,
+                flann::Matrix<int>& indices,
+                flann::Matrix<float>& dists,
+                size_t knn,
+                const flann::SearchParams& params) const {
+    CheckKnnSearchOrDie(queries, indices, dists, knn, dimensions_);
+    int ef = params.checks;
+    if (ef == flann::FLANN_CHECKS_UNLIMITED) {
+      ef = size();
+    }
+    ef = std::max(ef, static_cast<int>(knn));
+    VisitedSet* visited = GetThreadVisitedSet();
+    visited->Resize(size());
+    int found = 0;
+    for (size_t q = 0; q < queries.rows; ++q) {
+      std::vector<Candidate> nearest;
+      if (entry_point_ >= 0) {
+        const int entry =
+            GreedySearch(queries[q], entry_point_, max_level_, 0);
+        SearchLayer(queries[q], entry, ef, 0, visited, &nearest);
+      }
+      found += StoreNeighbors(nearest, knn, indices[q], dists[q]);
+    }
+    return found;
+  }
+
+ private:
+  // A (squared distance, node) pair. Ties are broken by node.
+  typedef std::pair<int, int> Candidate;
+
+  // Marks nodes as visited during one search, without clearing the
+  // marks between searches.
+  class VisitedSet {
+   public:
+    explicit VisitedSet(const size_t size) : marks_(size, 0), mark_(0) {}
+    void Clear() {
+      ++mark_;
+      if (mark_ == 0) {
+        std::fill(marks_.begin(), marks_.end(), 0);
+        mark_ = 1;
+      }
+    }
+    // Makes room for at least size nodes.
+    void Resize(const size_t size) {
+      if (size > marks_.size()) {
+        marks_.resize(size, 0);
+      }
+    }
+    // Returns true if the node was already visited.
+    bool Visit(const int node) {
+      if (marks_[node] == mark_) {
+        return true;
+      }
+      marks_[node] = mark_;
+      return false;
+    }
+   private:
+    std::vector<uint32_t> marks_;
+    uint32_t mark_;
+  };
+
+  // Returns this thread's visited set for searches. It's shared by the
+  // searches of every index in the thread, which each start by
+  // clearing it, so it's only allocated when it has to grow.
+  static VisitedSet* GetThreadVisitedSet() {
+    static boost::thread_specific_ptr<VisitedSet> visited;
+    if (visited.get() == NULL) {
+      visited.reset(new VisitedSet(0));
+    }
+    return visited.get();
+  }
+
+  static const int kRandomSeed = 100;
+
+  void AppendRows(const flann::Matrix<uint8_t>& data) {
+    for (size_t i = 0; i < data.rows; ++i) {
+      rows_.push_back(data[i]);
+    }
+  }
+
+  int Distance(const uint8_t* query, const int node) const {
+    return internal::SquaredDistance(query, rows_[node], dimensions_);
+  }
+
+  // The maximum number of links a node keeps on the layer.
+  int MaxLinks(const int level) const {
+    return level == 0 ? 2 * m_ : m_;
+  }
+
+  // Starting from the entry node, repeatedly moves to the nearest
+  // neighbor of the current node on each layer from top_level down to
+  // end_level + 1, and returns the node reached.
+  int GreedySearch(const uint8_t* query, int entry, const int top_level,
+                   const int end_level) const {
+    Candidate current(Distance(query, entry), entry);
+    for (int level = top_level; level > end_level; --level) {
+      bool moved = true;
+      while (moved) {
+        moved = false;
+        const std::vector<int32_t>& links = links_[current.second][level];
+        for (size_t i = 0; i < links.size(); ++i) {
+          const Candidate neighbor(Distance(query, links[i]), links[i]);
+          if (neighbor < current) {
+            current = neighbor;
+            moved = true;
+          }
+        }
+      }
+    }
+    return current.second;
+  }
+
+  // Searches the layer for the ef nearest nodes to the query, starting
+  // from the entry node. The result is sorted by increasing distance.
+  void SearchLayer(const uint8_t* query, const int entry, const int ef,
+                   const int level, VisitedSet* visited,
+                   std::vector<Candidate>* result) const {
+    visited->Clear();
+    // The unexpanded candidates, nearest first.
+    std::priority_queue<Candidate, std::vector<Candidate>,
+                        std::greater<Candidate> > candidates;
+    // The nearest nodes found so far, farthest first.
+    std::priority_queue<Candidate> nearest;
+    const Candidate start(Distance(query, entry), entry);
+    visited->Visit(entry);
+    candidates.push(start);
+    nearest.push(start);
+    while (!candidates.empty()) {
+      const Candidate closest = candidates.top();
+      if (closest > nearest.top() &&
+          static_cast<int>(nearest.size()) >= ef) {
+        break;
+      }
+      candidates.pop();
+      const std::vector<int32_t>& links = links_[closest.second][level];
+      for (size_t i = 0; i < links.size(); ++i) {
+        if (visited->Visit(links[i])) {
+          continue;
+        }
+        const Candidate neighbor(Distance(query, links[i]), links[i]);
+        if (static_cast<int>(nearest.size()) < ef ||
+            neighbor < nearest.top()) {
+          candidates.push(neighbor);
+          nearest.push(neighbor);
+          if (static_cast<int>(nearest.size()) > ef) {
+            nearest.pop();
+          }
+        }
+      }
+    }
+    result->resize(nearest.size());
+    for (int i = nearest.size() - 1; i >= 0; --i) {
+      (*result)[i] = nearest.top();
+      nearest.pop();
+    }
+  }
+
+  // Chooses up to max_links of the candidates (sorted by increasing
+  // distance from the base node) as links, skipping candidates that
+  // are closer to an already chosen link than to the base. This keeps
+  // links pointing in diverse directions.
+  void SelectLinks(const std::vector<Candidate>& candidates,
+                   const int max_links,
+                   std::vector<int32_t>* links) const {
+    links->clear();
+    for (size_t i = 0; i < candidates.size() &&
+             static_cast<int>(links->size()) < max_links; ++i) {
+      bool diverse = true;
+      for (size_t j = 0; j < links->size() && diverse; ++j) {
+        diverse = Distance(rows_[candidates[i].second], (*links)[j]) >
+            candidates[i].first;
+      }
+      if (diverse) {
+        links->push_back(candidates[i].second);
+      }
+    }
+  }
+
+  // Adds a link from the node to the new node on the layer, pruning
+  // the node's links if there are too many.
+  void AddLink(const int node, const int new_node, const int level) {
+    std::vector<int32_t>& links = links_[node][level];
+    links.push_back(new_node);
+    if (static_cast<int>(links.size()) <= MaxLinks(level)) {
+      return;
+    }
+    std::vector<Candidate> candidates;
+    for (size_t i = 0; i < links.size(); ++i) {
+      candidates.push_back(
+          Candidate(Distance(rows_[node], links[i]), links[i]));
+    }
+    std::sort(candidates.begin(), candidates.end());
+    SelectLinks(candidates, MaxLinks(level), &links);
+  }
+
+  void Insert(const int node, const int level) {
+    levels_.push_back(level);
+    links_.push_back(std::vector<std::vector<int32_t> >(level + 1));
+    if (entry_point_ < 0) {
+      entry_point_ = node;
+      max_level_ = level;
+      return;
+    }
+    visited_.Resize(levels_.size());
+    const uint8_t* point = rows_[node];
+    int entry = GreedySearch(point, entry_point_, max_level_, level);
+    std::vector<Candidate> candidates;
+    for (int l = std::min(level, max_level_); l >= 0; --l) {
+      SearchLayer(point, entry, ef_construction_, l, &visited_, &candidates);
+      SelectLinks(candidates, m_, &links_[node][l]);
+      for (size_t i = 0; i < links_[node][l].size(); ++i) {
+        AddLink(links_[node][l][i], node, l);
+      }
+      entry = candidates[0].second;
+    }
+    if (level > max_level_) {
+      entry_point_ = node;
+      max_level_ = level;
+    }
+  }
+
+  void Load(const std::string& filename) {
+    std::string data;
+    sjm::util::ReadFileToStringOrDie(filename, &data);
+    const char* read = data.data();
+    const char* end = read + data.size();
+    const size_t magic_size = sizeof(internal::kHnswIndexMagic);
+    CHECK(data.size() >= magic_size &&
+          memcmp(read, internal::kHnswIndexMagic, magic_size) == 0) <<
+        filename << " is not an HNSW index.";
+    read += magic_size;
+    int32_t header[5];
+    ReadOrDie(header, sizeof(header), end, &read);
+    m_ = header[0];
+    ef_construction_ = header[1];
+    const int32_t num_nodes = header[2];
+    entry_point_ = header[3];
+    max_level_ = header[4];
+    CHECK_EQ(rows_.size(), num_nodes) <<
+        filename << " was built on different data.";
+    levels_.resize(num_nodes);
+    ReadOrDie(levels_.data(), num_nodes * sizeof(levels_[0]), end, &read);
+    links_.resize(num_nodes);
+    for (int32_t node = 0; node < num_nodes; ++node) {
+      links_[node].resize(levels_[node] + 1);
+      for (int level = 0; level <= levels_[node]; ++level) {
+        int32_t num_links = 0;
+        ReadOrDie(&num_links, sizeof(num_links), end, &read);
+        links_[node][level].resize(num_links);
+        ReadOrDie(links_[node][level].data(), num_links * sizeof(int32_t),
+                  end, &read);
+      }
+    }
+    CHECK(read == end) << filename << " has trailing data.";
+  }
+
+  const size_t dimensions_;
+  int m_;
+  int ef_construction_;
+  // The data row of each point.
+  std::vector<const uint8_t*> rows_;
+  // The top layer of each node in the graph.
+  std::vector<int32_t> levels_;
+  // The links of each node, on each of its layers.
+  std::vector<std::vector<std::vector<int32_t> > > links_;
+  int32_t entry_point_;
+  int32_t max_level_;
+  std::mt19937 random_;
+  // For searches during insertion.
+  VisitedSet visited_;
+};
+}}  // Namespace.
+
+#endif  // NAIVE_BAYES_NEAREST_NEIGHBOR_HNSW_INDEX_H_
@@ -0,0 +1,323 @@
+// Copyright (c) 2011, Sancho McCann
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+
+// - Redistributions of source code must retain the above copyright
+//   notice, this list of conditions and the following disclaimer.
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// Functions for saving the descriptor data and FLANN indices of the
+// NBNN classifiers to an index directory, and for loading them again
+// without rebuilding anything. The descriptor data is mapped from its
+// file rather than read. The experiments also save their testing files
+// and the flags the index depends on, so that a directory is only
+// reused by the experiment that saved it.
+//
+// It also has the helpers that the IndexTypes in this directory (see
+// nbnn_classifier.h) share to save and load their indices and to
+// return their search results.
+
+#ifndef NAIVE_BAYES_NEAREST_NEIGHBOR_INDEX_IO_H_
+#define NAIVE_BAYES_NEAREST_NEIGHBOR_INDEX_IO_H_
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "boost/lexical_cast.hpp"
+#include "glog/logging.h"
+
+#include "flann/flann.hpp"
+
+#include "util/util.h"
+
+namespace sjm {
+namespace nbnn {
+
+namespace internal {
+
+const char kDescriptorMatrixMagic[8] = {'S', 'J', 'M', 'D', 'E', 'S', 'C', '1'};
+
+struct DescriptorMatrixHeader {
+  char magic[8];
+  uint64_t rows;
+  uint64_t cols;
+};
+}  // namespace internal.
+
+// The parameters that the index directory was saved with.
+const char kIndexParamsName[] = "params.txt";
+// The experiment's testing files, which are written last, so they mark
+// a complete save.
+const char kTestingFilesName[] = "testing_files.txt";
+
+// Writes the size bytes to the file.
+inline void WriteOrDie(const void* source, const size_t size, FILE* f) {
+  if (size > 0) {
+    CHECK_EQ(1, fwrite(source, size, 1, f));
+  }
+}
+
+// Copies the next size bytes of a file that was read into memory, from
+// *read to destination, and advances *read past them. The end is the
+// end of the file's bytes.
+inline void ReadOrDie(void* destination, const size_t size,
+                      const char* end, const char** read) {
+  CHECK_LE(size, static_cast<size_t>(end - *read)) <<
+      "The file is truncated.";
+  if (size > 0) {
+    memcpy(destination, *read, size);
+  }
+  *read += size;
+}
+
+// Dies unless the queries have the index's dimensions, and the
+// indices and dists have room for knn neighbors of each query.
+inline void CheckKnnSearchOrDie(const flann::Matrix<uint8_t>& queries,
+                                const flann::Matrix<int>& indices,
+                                const flann::Matrix<float>& dists,
+                                const size_t knn,
+                                const size_t dimensions) {
+  CHECK_EQ(dimensions, queries.cols);
+  CHECK_GE(indices.rows, queries.rows);
+  CHECK_GE(dists.rows, queries.rows);
+  CHECK_GE(indices.cols, knn);
+  CHECK_GE(dists.cols, knn);
+}
+
+// Stores the first knn of the nearest (distance, row) pairs, which are
+// in order of increasing distance, in a query's row of the indices and
+// dists. If there are fewer than knn, the remaining indices are -1.
+// Returns the number of neighbors stored.
+template <typename Distance>
+int StoreNeighbors(const std::vector<std::pair<Distance, int> >& nearest,
+                   const size_t knn, int* indices, float* dists) {
+  int found = 0;
+  for (size_t k = 0; k < knn; ++k) {
+    if (k < nearest.size()) {
+      indices[k] = nearest[k].second;
+      dists[k] = nearest[k].first;
+      ++found;
+    } else {
+      indices[k] = -1;
+      dists[k] = std::numeric_limits<float>::max();
+    }
+  }
+  return found;
+}
+
+// Saves the rows of data to filename, after a small header.
+inline void WriteDescriptorMatrixOrDie(const std::string& filename,
+                                       const flann::Matrix<uint8_t>& data) {
+  FILE* f = fopen(sjm::util::expand_user(filename).c_str(), "wb");
+  CHECK(f != NULL) << "Error opening " << filename << " for writing.";
+  internal::DescriptorMatrixHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, internal::kDescriptorMatrixMagic,
+         sizeof(header.magic));
+  header.rows = data.rows;
+  header.cols = data.cols;
+  WriteOrDie(&header, sizeof(header), f);
+  for (size_t row = 0; row < data.rows; ++row) {
+    WriteOrDie(data[row], data.cols, f);
+  }
+  CHECK_EQ(0, fclose(f));
+}
+
+// Maps a file written by WriteDescriptorMatrixOrDie, and returns a
+// read-only matrix over the mapped rows. The rows stay mapped until
+// UnmapDescriptorMatrix is called with the returned matrix.
+inline flann::Matrix<uint8_t> MapDescriptorMatrixOrDie(
+    const std::string& filename) {
+  const std::string path = sjm::util::expand_user(filename);
+  const int fd = open(path.c_str(), O_RDONLY);
+  PCHECK(fd >= 0) << "Error opening " << path;
+  struct stat file_stat;
+  PCHECK(fstat(fd, &file_stat) == 0);
+  const size_t file_size = file_stat.st_size;
+  CHECK_GE(file_size, sizeof(internal::DescriptorMatrixHeader)) <<
+      path << " is truncated.";
+  void* mapped = mmap(NULL, file_size, PROT_READ, MAP_SHARED, fd, 0);
+  PCHECK(mapped != MAP_FAILED) << "Error mapping " << path;
+  close(fd);
+  internal::DescriptorMatrixHeader header;
+  memcpy(&header, mapped, sizeof(header));
+  CHECK_EQ(0, memcmp(header.magic, internal::kDescriptorMatrixMagic,
+                     sizeof(header.magic))) <<
+      path << " is not a descriptor matrix.";
+  CHECK_EQ(sizeof(header) + header.rows * header.cols, file_size) <<
+      path << " has the wrong size.";
+  return flann::Matrix<uint8_t>(
+      static_cast<uint8_t*>(mapped) + sizeof(header), header.rows,
+      header.cols);
+}
+
+inline void UnmapDescriptorMatrix(const flann::Matrix<uint8_t>& data) {
+  const size_t header_size = sizeof(internal::DescriptorMatrixHeader);
+  PCHECK(munmap(data.ptr() - header_size,
+                header_size + data.rows * data.cols) == 0);
+}
+
+// Saves the parameters as '<name> <value>' lines.
+inline void WriteIndexParamsOrDie(
+    const std::string& filename,
+    const std::map<std::string, std::string>& params) {
+  std::string data;
+  for (std::map<std::string, std::string>::const_iterator it =
+           params.begin();
+       it != params.end(); ++it) {
+    data += it->first + " " + it->second + "\n";
+  }
+  sjm::util::WriteStringToFileOrDie(filename, data);
+}
+
+inline void ReadIndexParamsOrDie(
+    const std::string& filename,
+    std::map<std::string, std::string>* params) {
+  std::vector<std::string> lines;
+  sjm::util::ReadLinesFromFileIntoVectorOrDie(filename, &lines);
+  params->clear();
+  for (size_t i = 0; i < lines.size(); ++i) {
+    const size_t space = lines[i].find(' ');
+    CHECK_NE(std::string::npos, space) << "Bad line in " << filename;
+    (*params)[lines[i].substr(0, space)] = lines[i].substr(space + 1);
+  }
+}
+
+// Returns the parameter, which must be present in params.
+template <typename T>
+T GetIndexParamOrDie(const std::map<std::string, std::string>& params,
+                     const std::string& name) {
+  std::map<std::string, std::string>::const_iterator it = params.find(name);
+  CHECK(it != params.end()) << "Missing index parameter " << name;
+  return boost::lexical_cast<T>(it->second);
+}
+
+// Adds the parameters to the ones saved in filename, replacing any
+// with the same names.
+inline void AddIndexParamsOrDie(
+    const std::string& filename,
+    const std::map<std::string, std::string>& params) {
+  std::map<std::string, std::string> saved;
+  ReadIndexParamsOrDie(filename, &saved);
+  for (std::map<std::string, std::string>::const_iterator it =
+           params.begin();
+       it != params.end(); ++it) {
+    saved[it->first] = it->second;
+  }
+  WriteIndexParamsOrDie(filename, saved);
+}
+
+// Dies unless each of the parameters was saved in filename with the
+// same value.
+inline void CheckIndexParamsOrDie(
+    const std::string& filename,
+    const std::map<std::string, std::string>& params) {
+  std::map<std::string, std::string> saved;
+  ReadIndexParamsOrDie(filename, &saved);
+  for (std::map<std::string, std::string>::const_iterator it =
+           params.begin();
+       it != params.end(); ++it) {
+    CHECK_EQ(it->second, GetIndexParamOrDie<std::string>(saved, it->first))
+        << filename << " was saved with a different " << it->first << ".";
+  }
+}
+
+// Returns the experiment flags that an index directory's classifier
+// and testing files depend on. An index_type of "server" isn't
+// included, since it searches whatever type of index was saved. alpha
+// is only included without location candidates, since the index
+// doesn't have the location otherwise, and the projection file is
+// identified by the hash of its content.
+inline std::map<std::string, std::string> ExperimentIndexParams(
+    const std::vector<std::string>& categories,
+    const int num_train,
+    const int num_test,
+    const int trees,
+    const std::string& index_type,
+    const float alpha,
+    const int location_candidates,
+    const std::string& projection_file) {
+  std::map<std::string, std::string> params;
+  std::string category_list;
+  for (size_t i = 0; i < categories.size(); ++i) {
+    category_list += (i > 0 ? "," : "") + categories[i];
+  }
+  params["categories"] = category_list;
+  params["num_train"] = boost::lexical_cast<std::string>(num_train);
+  params["num_test"] = boost::lexical_cast<std::string>(num_test);
+  params["trees"] = boost::lexical_cast<std::string>(trees);
+  if (index_type != "server") {
+    params["index_type"] = index_type;
+  }
+  params["location_candidates"] =
+      boost::lexical_cast<std::string>(location_candidates);
+  if (location_candidates == 0) {
+    params["alpha"] = boost::lexical_cast<std::string>(alpha);
+  }
+  std::string projection;
+  if (!projection_file.empty()) {
+    sjm::util::ReadFileToStringOrDie(projection_file, &projection);
+  }
+  params["projection"] =
+      boost::lexical_cast<std::string>(sjm::util::Fnv1aHash(projection));
+  return params;
+}
+
+// Writes the testing files as '<category>\t<file>' lines.
+inline void WriteTestingFilesOrDie(
+    const std::string& filename,
+    const std::map<std::string, std::vector<std::string> >& testing_files) {
+  std::string data;
+  for (std::map<std::string, std::vector<std::string> >::const_iterator it =
+           testing_files.begin();
+       it != testing_files.end(); ++it) {
+    for (size_t i = 0; i < it->second.size(); ++i) {
+      data += it->first + "\t" + it->second[i] + "\n";
+    }
+  }
+  sjm::util::WriteStringToFileOrDie(filename, data);
+}
+
+inline void ReadTestingFilesOrDie(
+    const std::string& filename,
+    std::map<std::string, std::vector<std::string> >* testing_files) {
+  std::vector<std::string> lines;
+  sjm::util::ReadLinesFromFileIntoVectorOrDie(filename, &lines);
+  testing_files->clear();
+  for (size_t i = 0; i < lines.size(); ++i) {
+    const size_t tab = lines[i].find('\t');
+    CHECK_NE(std::string::npos, tab) << "Bad line in " << filename;
+    (*testing_files)[lines[i].substr(0, tab)].push_back(
+        lines[i].substr(tab + 1));
+  }
+}
+}}  // Namespace.
+
+#endif  // NAIVE_BAYES_NEAREST_NEIGHBOR_INDEX_IO_H_
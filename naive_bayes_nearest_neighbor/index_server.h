@@ -0,0 +1,454 @@
+// Copyright (c) 2011, Sancho McCann
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+
+// - Redistributions of source code must retain the above copyright
+//   notice, this list of conditions and the following disclaimer.
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// Serving saved indices to other processes. An IndexServer loads
+// every index in an index directory (saved by NbnnClassifier::Save or
+// BasicMergedClassifier::Save) once, and answers batched knnSearch
+// requests on a Unix-domain socket in that directory. IndexClient is
+// an IndexType for the classifiers that forwards its searches to the
+// server, so several processes on one machine can share one copy of
+// the indices. The descriptor data is mapped MAP_SHARED by every
+// process, so it's shared through the page cache.
+
+#ifndef NAIVE_BAYES_NEAREST_NEIGHBOR_INDEX_SERVER_H_
+#define NAIVE_BAYES_NEAREST_NEIGHBOR_INDEX_SERVER_H_
+
+#include <errno.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "boost/bind.hpp"
+#include "boost/filesystem.hpp"
+#include "boost/thread.hpp"
+#include "glog/logging.h"
+
+#include "flann/flann.hpp"
+
+#include "naive_bayes_nearest_neighbor/index_io.h"
+#include "util/util.h"
+
+namespace sjm {
+namespace nbnn {
+
+namespace internal {
+
+const char kIndexRequestMagic[8] = {'S', 'J', 'M', 'Q', 'U', 'E', 'R', 'Y'};
+
+// A request is this header, the index name, and the rows * cols
+// query bytes.
+struct IndexRequestHeader {
+  char magic[8];
+  uint32_t name_size;
+  uint32_t rows;
+  uint32_t cols;
+  uint32_t knn;
+  int32_t checks;
+};
+
+enum IndexResponseStatus {
+  kIndexResponseOk = 0,
+  kIndexResponseUnknownIndex = 1,
+  kIndexResponseBadQuery = 2
+};
+
+// A response is this header, and if the status is kIndexResponseOk,
+// the rows * knn neighbor indices and then their distances.
+struct IndexResponseHeader {
+  uint32_t status;
+};
+
+// The longest index name, and the most query or result bytes, that a
+// server accepts in one request. A larger request is answered with
+// kIndexResponseBadQuery, and its connection is closed.
+const uint32_t kMaxIndexNameSize = 4096;
+const uint64_t kMaxIndexRequestBytes = 1ULL << 30;
+
+// Writes all of the bytes to the socket. Returns false if the
+// connection was closed.
+inline bool WriteAll(const int fd, const void* data, size_t size) {
+  const char* bytes = static_cast<const char*>(data);
+  while (size > 0) {
+    const ssize_t written = send(fd, bytes, size, MSG_NOSIGNAL);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      return false;
+    }
+    bytes += written;
+    size -= written;
+  }
+  return true;
+}
+
+// Reads exactly size bytes from the socket. Returns false if the
+// connection was closed first.
+inline bool ReadAll(const int fd, void* data, size_t size) {
+  char* bytes = static_cast<char*>(data);
+  while (size > 0) {
+    const ssize_t received = recv(fd, bytes, size, 0);
+    if (received < 0 && errno == EINTR) {
+      continue;
+    }
+    if (received <= 0) {
+      return false;
+    }
+    bytes += received;
+    size -= received;
+  }
+  return true;
+}
+
+inline sockaddr_un SocketAddressOrDie(const std::string& path) {
+  sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  CHECK_LT(path.size(), sizeof(address.sun_path)) <<
+      "The socket path " << path << " is too long.";
+  strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+  return address;
+}
+}  // namespace internal.
+
+// Returns the socket that the server for the index directory listens
+// on.
+inline std::string IndexServerSocket(const std::string& directory) {
+  return (boost::filesystem::path(sjm::util::expand_user(directory)) /
+          "server.sock").string();
+}
+
+template <class IndexType>
+class IndexServer {
+ public:
+  // Loads the indices in the directory. Each saved index is loaded
+  // with its data file, and named by its index file: index.flann for
+  // data.bin, and the .flann file with the same stem for the .data
+  // files. (Some IndexTypes, like BruteForceIndex, save nothing but
+  // their data.) The server listens once it's constructed, so clients
+  // can connect before Serve() is called.
+  explicit IndexServer(const std::string& directory)
+      : listener_(-1), stopping_(false) {
+    const boost::filesystem::path root(sjm::util::expand_user(directory));
+    for (boost::filesystem::directory_iterator it(root);
+         it != boost::filesystem::directory_iterator(); ++it) {
+      const std::string data_name = it->path().filename().string();
+      std::string name;
+      if (data_name == "data.bin") {
+        name = "index.flann";
+      } else if (boost::filesystem::extension(*it) == ".data") {
+        name = it->path().stem().string() + ".flann";
+      } else {
+        continue;
+      }
+      const flann::Matrix<uint8_t> data =
+          MapDescriptorMatrixOrDie(it->path().string());
+      data_.push_back(data);
+      LOG(INFO) << "Loading " << name << " (" << data.rows << " rows).";
+      indices_[name] = new IndexType(
+          data, flann::SavedIndexParams((root / name).string()));
+    }
+    CHECK(!indices_.empty()) << "No saved indices in " << directory;
+
+    socket_path_ = IndexServerSocket(directory);
+    const sockaddr_un address = internal::SocketAddressOrDie(socket_path_);
+    listener_ = socket(AF_UNIX, SOCK_STREAM, 0);
+    PCHECK(listener_ >= 0) << "Error creating a socket.";
+    // A socket left by a server that didn't exit cleanly is replaced.
+    unlink(socket_path_.c_str());
+    PCHECK(bind(listener_, reinterpret_cast<const sockaddr*>(&address),
+                sizeof(address)) == 0) << "Error binding " << socket_path_;
+    PCHECK(listen(listener_, SOMAXCONN) == 0);
+  }
+
+  ~IndexServer() {
+    Stop();
+    close(listener_);
+    unlink(socket_path_.c_str());
+    for (typename std::map<std::string, IndexType*>::iterator it =
+             indices_.begin();
+         it != indices_.end(); ++it) {
+      delete it->second;
+    }
+    for (size_t i = 0; i < data_.size(); ++i) {
+      UnmapDescriptorMatrix(data_[i]);
+    }
+  }
+
+  // Serves each connection on its own thread until Stop() is called
+  // (by another thread). Returns once every connection has closed.
+  void Serve() {
+    while (true) {
+      const int connection = accept(listener_, NULL, NULL);
+      boost::mutex::scoped_lock l(mutex_);
+      if (stopping_) {
+        if (connection >= 0) {
+          close(connection);
+        }
+        break;
+      }
+      if (connection < 0) {
+        PCHECK(errno == EINTR || errno == ECONNABORTED) <<
+            "Error accepting a connection.";
+        continue;
+      }
+      connections_.insert(connection);
+      threads_.create_thread(
+          boost::bind(&IndexServer<IndexType>::ServeConnection, this,
+                      connection));
+    }
+    threads_.join_all();
+  }
+
+  // Stops accepting connections, and closes the open ones.
+  void Stop() {
+    boost::mutex::scoped_lock l(mutex_);
+    stopping_ = true;
+    shutdown(listener_, SHUT_RDWR);
+    for (std::set<int>::const_iterator it = connections_.begin();
+         it != connections_.end(); ++it) {
+      shutdown(*it, SHUT_RDWR);
+    }
+  }
+
+ private:
+  // Answers the connection's requests until it's closed.
+  void ServeConnection(const int connection) {
+    std::string name;
+    std::vector<uint8_t> queries;
+    std::vector<int> indices;
+    std::vector<float> distances;
+    internal::IndexRequestHeader request;
+    while (internal::ReadAll(connection, &request, sizeof(request))) {
+      if (memcmp(request.magic, internal::kIndexRequestMagic,
+                 sizeof(request.magic)) != 0) {
+        LOG(ERROR) << "Closing a connection that sent a bad request.";
+        break;
+      }
+      internal::IndexResponseHeader response;
+      const uint64_t query_bytes =
+          static_cast<uint64_t>(request.rows) * request.cols;
+      const uint64_t result_bytes =
+          static_cast<uint64_t>(request.rows) * request.knn *
+          (sizeof(indices[0]) + sizeof(distances[0]));
+      if (request.name_size > internal::kMaxIndexNameSize ||
+          query_bytes > internal::kMaxIndexRequestBytes ||
+          result_bytes > internal::kMaxIndexRequestBytes) {
+        // The rest of the request isn't read, so the connection can't
+        // be used again.
+        LOG(ERROR) << "Closing a connection that sent a request that's "
+            "too large.";
+        response.status = internal::kIndexResponseBadQuery;
+        internal::WriteAll(connection, &response, sizeof(response));
+        break;
+      }
+      name.resize(request.name_size);
+      queries.resize(static_cast<size_t>(request.rows) * request.cols);
+      if (!internal::ReadAll(connection, &name[0], name.size()) ||
+          !internal::ReadAll(connection, queries.data(), queries.size())) {
+        break;
+      }
+      response.status = internal::kIndexResponseOk;
+      typename std::map<std::string, IndexType*>::const_iterator index =
+          indices_.find(name);
+      if (index == indices_.end()) {
+        response.status = internal::kIndexResponseUnknownIndex;
+      } else if (request.cols != index->second->veclen() ||
+                 request.knn == 0 || request.knn > index->second->size()) {
+        response.status = internal::kIndexResponseBadQuery;
+      }
+      if (!internal::WriteAll(connection, &response, sizeof(response))) {
+        break;
+      }
+      if (response.status != internal::kIndexResponseOk) {
+        continue;
+      }
+      const size_t results = static_cast<size_t>(request.rows) * request.knn;
+      indices.resize(results);
+      distances.resize(results);
+      if (results > 0) {
+        flann::Matrix<uint8_t> query(queries.data(), request.rows,
+                                     request.cols);
+        flann::Matrix<int> nn_index(indices.data(), request.rows,
+                                    request.knn);
+        flann::Matrix<float> dists(distances.data(), request.rows,
+                                   request.knn);
+        index->second->knnSearch(query, nn_index, dists, request.knn,
+                                 flann::SearchParams(request.checks));
+      }
+      if (!internal::WriteAll(connection, indices.data(),
+                              results * sizeof(indices[0])) ||
+          !internal::WriteAll(connection, distances.data(),
+                              results * sizeof(distances[0]))) {
+        break;
+      }
+    }
+    boost::mutex::scoped_lock l(mutex_);
+    connections_.erase(connection);
+    close(connection);
+  }
+
+  std::string socket_path_;
+  // The loaded indices, by name, and the data they were loaded with.
+  std::map<std::string, IndexType*> indices_;
+  std::vector<flann::Matrix<uint8_t> > data_;
+  int listener_;
+  // Guards stopping_ and connections_.
+  boost::mutex mutex_;
+  bool stopping_;
+  std::set<int> connections_;
+  boost::thread_group threads_;
+
+  IndexServer(const IndexServer&);
+  void operator=(const IndexServer&);
+};
+
+// An IndexType whose searches are answered by the IndexServer for the
+// directory that the index was saved in. It can only be constructed
+// as a saved index is loaded, e.g. by NbnnClassifier::Load, and it
+// keeps one connection to the server. Searches through one client are
+// serialized; the classifiers search each index from one thread at a
+// time anyway.
+class IndexClient {
+ public:
+  // The params must be flann::SavedIndexParams, whose file names the
+  // served index. The data is only used for size() and veclen().
+  IndexClient(const flann::Matrix<uint8_t>& data,
+              const flann::IndexParams& params)
+      : rows_(data.rows), cols_(data.cols), socket_(-1) {
+    const std::string filename =
+        flann::get_param<std::string>(params, "filename", "");
+    CHECK(!filename.empty()) << "An IndexClient can only be loaded from an "
+        "index directory that an index server is serving.";
+    const boost::filesystem::path path(filename);
+    name_ = path.filename().string();
+    const std::string socket_path =
+        IndexServerSocket(path.parent_path().string());
+    const sockaddr_un address = internal::SocketAddressOrDie(socket_path);
+    socket_ = socket(AF_UNIX, SOCK_STREAM, 0);
+    PCHECK(socket_ >= 0) << "Error creating a socket.";
+    PCHECK(connect(socket_, reinterpret_cast<const sockaddr*>(&address),
+                   sizeof(address)) == 0) <<
+        "Error connecting to the index server at " << socket_path;
+  }
+
+  ~IndexClient() {
+    close(socket_);
+  }
+
+  // The server's index is already built.
+  void buildIndex() {}
+
+  void addPoints(const flann::Matrix<uint8_t>& points,
+                 float rebuild_threshold = 2) {
+    LOG(FATAL) << "Points can't be added to a served index.";
+  }
+
+  void save(const std::string& filename) const {
+    LOG(FATAL) << "A served index can't be saved again.";
+  }
+
+  size_t size() const {
+    return rows_;
+  }
+
+  size_t veclen() const {
+    return cols_;
+  }
+
+  // As flann::Index::knnSearch, but only params.checks is sent to the
+  // server. The server finds at most size() neighbors, so if knn is
+  // larger, the remaining indices are -1.
+  int knnSearch(const flann::Matrix<uint8_t>& queries,
+                flann::Matrix<int>& indices,
+                flann::Matrix<float>& dists,
+                size_t knn,
+                const flann::SearchParams& params) const {
+    CHECK_EQ(cols_, queries.cols);
+    for (size_t row = 0; row < queries.rows; ++row) {
+      for (size_t k = rows_; k < knn; ++k) {
+        indices[row][k] = -1;
+        dists[row][k] = std::numeric_limits<float>::max();
+      }
+    }
+    knn = std::min(knn, rows_);
+    if (knn == 0) {
+      return 0;
+    }
+    internal::IndexRequestHeader request;
+    memset(&request, 0, sizeof(request));
+    memcpy(request.magic, internal::kIndexRequestMagic,
+           sizeof(request.magic));
+    request.name_size = name_.size();
+    request.rows = queries.rows;
+    request.cols = queries.cols;
+    request.knn = knn;
+    request.checks = params.checks;
+    boost::mutex::scoped_lock l(mutex_);
+    bool sent = internal::WriteAll(socket_, &request, sizeof(request)) &&
+        internal::WriteAll(socket_, name_.data(), name_.size());
+    for (size_t row = 0; sent && row < queries.rows; ++row) {
+      sent = internal::WriteAll(socket_, queries[row], queries.cols);
+    }
+    internal::IndexResponseHeader response;
+    CHECK(sent && internal::ReadAll(socket_, &response, sizeof(response))) <<
+        "Lost the connection to the index server.";
+    CHECK_EQ(internal::kIndexResponseOk, response.status) <<
+        "The index server couldn't search " << name_ << ".";
+    for (size_t row = 0; row < queries.rows; ++row) {
+      CHECK(internal::ReadAll(socket_, indices[row], knn * sizeof(int))) <<
+          "Lost the connection to the index server.";
+    }
+    for (size_t row = 0; row < queries.rows; ++row) {
+      CHECK(internal::ReadAll(socket_, dists[row], knn * sizeof(float))) <<
+          "Lost the connection to the index server.";
+    }
+    return queries.rows * knn;
+  }
+
+ private:
+  size_t rows_;
+  size_t cols_;
+  // The name of the served index.
+  std::string name_;
+  int socket_;
+  // Guards the connection, so that requests and responses from
+  // different threads aren't interleaved.
+  mutable boost::mutex mutex_;
+
+  IndexClient(const IndexClient&);
+  void operator=(const IndexClient&);
+};
+}}  // Namespace.
+
+#endif  // NAIVE_BAYES_NEAREST_NEIGHBOR_INDEX_SERVER_H_
@@ -0,0 +1,91 @@
+// Copyright (c) 2011, Sancho McCann
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+
+// - Redistributions of source code must retain the above copyright
+//   notice, this list of conditions and the following disclaimer.
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// Serves the indices saved in an index directory (by experiment_1 or
+// experiment_3 with --index_directory) to the experiments run with
+// --index_type server and the same --index_directory, so that they
+// share this process's copy of the indices rather than each loading
+// their own.
+
+#include <map>
+#include <string>
+
+#include "boost/filesystem.hpp"
+#include "gflags/gflags.h"
+#include "glog/logging.h"
+
+#include "flann/flann.hpp"
+
+#include "naive_bayes_nearest_neighbor/brute_force_index.h"
+#include "naive_bayes_nearest_neighbor/hamming_index.h"
+#include "naive_bayes_nearest_neighbor/hnsw_index.h"
+#include "naive_bayes_nearest_neighbor/index_io.h"
+#include "naive_bayes_nearest_neighbor/index_server.h"
+#include "naive_bayes_nearest_neighbor/ivf_pq_index.h"
+#include "naive_bayes_nearest_neighbor/kd_forest_index.h"
+#include "util/util.h"
+
+DEFINE_string(index_directory, "",
+              "The index directory to serve.");
+DEFINE_string(index_type, "kdtree",
+              "The type of the saved indices: 'kdtree', 'kdforest', "
+              "'hnsw', 'exact', 'ivfpq' or 'hamming', as passed to the "
+              "experiment that saved them.");
+
+// Serves the directory's indices until the process is killed.
+template <typename IndexType>
+void Serve() {
+  sjm::nbnn::IndexServer<IndexType> server(FLAGS_index_directory);
+  LOG(INFO) << "Serving on " <<
+      sjm::nbnn::IndexServerSocket(FLAGS_index_directory);
+  server.Serve();
+}
+
+int main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+
+  CHECK(!FLAGS_index_directory.empty()) << "--index_directory is required.";
+  std::map<std::string, std::string> params;
+  params["index_type"] = FLAGS_index_type;
+  sjm::nbnn::CheckIndexParamsOrDie(
+      (boost::filesystem::path(sjm::util::expand_user(FLAGS_index_directory))
+       / sjm::nbnn::kIndexParamsName).string(), params);
+  if (FLAGS_index_type == "kdtree") {
+    Serve<flann::Index<flann::L2<uint8_t> > >();
+  } else if (FLAGS_index_type == "kdforest") {
+    Serve<sjm::nbnn::KdForestIndex>();
+  } else if (FLAGS_index_type == "hnsw") {
+    Serve<sjm::nbnn::HnswIndex>();
+  } else if (FLAGS_index_type == "exact") {
+    Serve<sjm::nbnn::BruteForceIndex>();
+  } else if (FLAGS_index_type == "ivfpq") {
+    Serve<sjm::nbnn::IvfPqIndex>();
+  } else if (FLAGS_index_type == "hamming") {
+    Serve<sjm::nbnn::HammingIndex>();
+  } else {
+    LOG(FATAL) << "Unknown --index_type " << FLAGS_index_type;
+  }
+  return 0;
+}
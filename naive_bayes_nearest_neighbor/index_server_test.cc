@@ -0,0 +1,210 @@
+// Copyright (c) 2011, Sancho McCann
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+
+// - Redistributions of source code must retain the above copyright
+//   notice, this list of conditions and the following disclaimer.
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "naive_bayes_nearest_neighbor/index_server.h"
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "boost/bind.hpp"
+#include "boost/filesystem.hpp"
+#include "boost/thread.hpp"
+#include "glog/logging.h"
+#include "gtest/gtest.h"
+
+#include "flann/flann.hpp"
+
+#include "naive_bayes_nearest_neighbor/brute_force_index.h"
+#include "naive_bayes_nearest_neighbor/nbnn_classifier.h"
+#include "sift/sift_descriptors.pb.h"
+
+using std::string;
+using std::vector;
+
+namespace {
+
+const char kIndexDirectory[] = "/tmp/index_server_test_index";
+const int kRows = 300;
+const int kCols = 128;
+
+// Serves the directory's indices on its own thread.
+class ServerThread {
+ public:
+  explicit ServerThread(const string& directory)
+      : server_(directory),
+        thread_(boost::bind(
+            &sjm::nbnn::IndexServer<sjm::nbnn::BruteForceIndex>::Serve,
+            &server_)) {}
+  ~ServerThread() {
+    server_.Stop();
+    thread_.join();
+  }
+ private:
+  sjm::nbnn::IndexServer<sjm::nbnn::BruteForceIndex> server_;
+  boost::thread thread_;
+};
+}  // namespace
+
+class IndexServerTest : public ::testing::Test {
+ protected:
+  // Saves two classes of random rows, the second class's rows
+  // offset from the first's.
+  void SetUp() {
+    boost::filesystem::remove_all(kIndexDirectory);
+    for (int c = 0; c < 2; ++c) {
+      data_[c].resize(kRows * kCols);
+      for (int i = 0; i < kRows * kCols; ++i) {
+        data_[c][i] = 60 * c + std::rand() % 64;
+      }
+    }
+    sjm::nbnn::NbnnClassifier<sjm::nbnn::BruteForceIndex> classifier;
+    for (int c = 0; c < 2; ++c) {
+      const flann::Matrix<uint8_t> data(&data_[c][0], kRows, kCols);
+      classifier.AddClass(string("Class ") + static_cast<char>('1' + c),
+                          new sjm::nbnn::BruteForceIndex(data), data);
+    }
+    classifier.Save(kIndexDirectory);
+  }
+
+  vector<uint8_t> data_[2];
+};
+
+TEST_F(IndexServerTest,
+       TestServedSearchesMatchLocalSearches) {
+  ServerThread server(kIndexDirectory);
+  const flann::Matrix<uint8_t> data(&data_[1][0], kRows, kCols);
+  sjm::nbnn::BruteForceIndex local(data);
+  sjm::nbnn::IndexClient client(
+      data, flann::SavedIndexParams(string(kIndexDirectory) +
+                                    "/class_1.flann"));
+  ASSERT_EQ(kRows, client.size());
+  ASSERT_EQ(kCols, client.veclen());
+  const int kQueries = 20;
+  const int kKnn = 5;
+  vector<uint8_t> queries(kQueries * kCols);
+  for (size_t i = 0; i < queries.size(); ++i) {
+    queries[i] = std::rand() % 128;
+  }
+  const flann::Matrix<uint8_t> query(&queries[0], kQueries, kCols);
+  vector<int> local_indices(kQueries * kKnn);
+  vector<float> local_dists(kQueries * kKnn);
+  vector<int> served_indices(kQueries * kKnn);
+  vector<float> served_dists(kQueries * kKnn);
+  flann::Matrix<int> local_index_matrix(&local_indices[0], kQueries, kKnn);
+  flann::Matrix<float> local_dist_matrix(&local_dists[0], kQueries, kKnn);
+  flann::Matrix<int> served_index_matrix(&served_indices[0], kQueries, kKnn);
+  flann::Matrix<float> served_dist_matrix(&served_dists[0], kQueries, kKnn);
+  local.knnSearch(query, local_index_matrix, local_dist_matrix, kKnn,
+                  flann::SearchParams(1));
+  // The same connection serves several requests.
+  for (int i = 0; i < 2; ++i) {
+    client.knnSearch(query, served_index_matrix, served_dist_matrix, kKnn,
+                     flann::SearchParams(1));
+    ASSERT_EQ(local_indices, served_indices);
+    ASSERT_EQ(local_dists, served_dists);
+  }
+}
+
+TEST_F(IndexServerTest,
+       TestRejectsOversizedRequests) {
+  ServerThread server(kIndexDirectory);
+  const sockaddr_un address = sjm::nbnn::internal::SocketAddressOrDie(
+      sjm::nbnn::IndexServerSocket(kIndexDirectory));
+  const int connection = socket(AF_UNIX, SOCK_STREAM, 0);
+  ASSERT_LE(0, connection);
+  ASSERT_EQ(0, connect(connection, reinterpret_cast<const sockaddr*>(&address),
+                       sizeof(address)));
+  sjm::nbnn::internal::IndexRequestHeader request;
+  memset(&request, 0, sizeof(request));
+  memcpy(request.magic, sjm::nbnn::internal::kIndexRequestMagic,
+         sizeof(request.magic));
+  request.name_size = 13;
+  request.rows = 0xffffffff;
+  request.cols = 0xffffffff;
+  request.knn = 1;
+  ASSERT_TRUE(sjm::nbnn::internal::WriteAll(connection, &request,
+                                            sizeof(request)));
+  sjm::nbnn::internal::IndexResponseHeader response;
+  ASSERT_TRUE(sjm::nbnn::internal::ReadAll(connection, &response,
+                                           sizeof(response)));
+  ASSERT_EQ(sjm::nbnn::internal::kIndexResponseBadQuery, response.status);
+  // The server closes the connection.
+  ASSERT_FALSE(sjm::nbnn::internal::ReadAll(connection, &response,
+                                            sizeof(response)));
+  close(connection);
+}
+
+TEST_F(IndexServerTest,
+       TestMoreNeighborsThanRows) {
+  ServerThread server(kIndexDirectory);
+  const flann::Matrix<uint8_t> data(&data_[0][0], kRows, kCols);
+  sjm::nbnn::IndexClient client(
+      data, flann::SavedIndexParams(string(kIndexDirectory) +
+                                    "/class_0.flann"));
+  const int kKnn = kRows + 2;
+  vector<int> indices(kKnn);
+  vector<float> dists(kKnn);
+  flann::Matrix<int> index_matrix(&indices[0], 1, kKnn);
+  flann::Matrix<float> dist_matrix(&dists[0], 1, kKnn);
+  client.knnSearch(flann::Matrix<uint8_t>(&data_[0][0], 1, kCols),
+                   index_matrix, dist_matrix, kKnn, flann::SearchParams(1));
+  ASSERT_EQ(0, indices[0]);
+  ASSERT_NE(-1, indices[kRows - 1]);
+  ASSERT_EQ(-1, indices[kRows]);
+  ASSERT_EQ(-1, indices[kRows + 1]);
+}
+
+TEST_F(IndexServerTest,
+       TestClassifyWithServedIndices) {
+  ServerThread server(kIndexDirectory);
+  sjm::nbnn::NbnnClassifier<sjm::nbnn::IndexClient> classifier;
+  classifier.SetClassificationParams(1, 0, 1);
+  classifier.SetNumThreads(2);
+  classifier.Load(kIndexDirectory);
+  ASSERT_EQ(2, classifier.GetNumClasses());
+  for (int c = 0; c < 2; ++c) {
+    sjm::sift::DescriptorSet descriptor_set;
+    for (int i = 0; i < 10; ++i) {
+      sjm::sift::SiftDescriptor* d = descriptor_set.add_sift_descriptor();
+      for (int j = 0; j < kCols; ++j) {
+        d->add_bin(data_[c][i * kCols + j]);
+      }
+    }
+    ASSERT_EQ(string("Class ") + static_cast<char>('1' + c),
+              classifier.Classify(descriptor_set).category);
+  }
+}
+
+int main(int argc, char** argv) {
+  google::InitGoogleLogging(argv[0]);
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,144 @@
+// Copyright (c) 2011, Sancho McCann
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+
+// - Redistributions of source code must retain the above copyright
+//   notice, this list of conditions and the following disclaimer.
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// A test fixture shared by the tests of the IndexTypes in this directory
+// (see nbnn_classifier.h). index_type_test.cc tests what every IndexType
+// must do; each index's own test only covers what is particular to it.
+
+#ifndef NAIVE_BAYES_NEAREST_NEIGHBOR_INDEX_TEST_UTIL_H_
+#define NAIVE_BAYES_NEAREST_NEIGHBOR_INDEX_TEST_UTIL_H_
+
+#include <stdint.h>
+
+#include <cstdlib>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "flann/flann.hpp"
+
+#include "naive_bayes_nearest_neighbor/brute_force_index.h"
+
+namespace sjm {
+namespace nbnn {
+namespace test {
+
+const int kRows = 2000;
+const int kQueries = 50;
+const int kDimensions = 130;
+
+class IndexTest : public ::testing::Test {
+ protected:
+  void SetUp() {
+    // The points are noisy copies of a few centers, like descriptors
+    // of similar image patches.
+    std::srand(0);
+    std::vector<std::vector<int> > centers(20,
+                                           std::vector<int>(kDimensions));
+    for (size_t c = 0; c < centers.size(); ++c) {
+      for (int j = 0; j < kDimensions; ++j) {
+        centers[c][j] = std::rand() % 200;
+      }
+    }
+    data_ = flann::Matrix<uint8_t>(new uint8_t[kRows * kDimensions], kRows,
+                                   kDimensions);
+    queries_ = flann::Matrix<uint8_t>(new uint8_t[kQueries * kDimensions],
+                                      kQueries, kDimensions);
+    for (int i = 0; i < kRows; ++i) {
+      const std::vector<int>& center = centers[std::rand() % centers.size()];
+      for (int j = 0; j < kDimensions; ++j) {
+        data_[i][j] = center[j] + std::rand() % 50;
+      }
+    }
+    // Each query is a slightly changed copy of a point, so that its
+    // nearest neighbor stands out from the rest of its cluster.
+    for (int q = 0; q < kQueries; ++q) {
+      for (int j = 0; j < kDimensions; ++j) {
+        queries_[q][j] = data_[q * (kRows / kQueries)][j] + std::rand() % 5;
+      }
+    }
+  }
+
+  void TearDown() {
+    delete[] data_.ptr();
+    delete[] queries_.ptr();
+  }
+
+  // Returns the indices of the nearest neighbor of each query.
+  template <typename IndexType>
+  std::vector<int> Search(const IndexType& index, const int checks) const {
+    flann::Matrix<int> indices(new int[kQueries], kQueries, 1);
+    flann::Matrix<float> dists(new float[kQueries], kQueries, 1);
+    index.knnSearch(queries_, indices, dists, 1, flann::SearchParams(checks));
+    std::vector<int> result(indices.ptr(), indices.ptr() + kQueries);
+    delete[] indices.ptr();
+    delete[] dists.ptr();
+    return result;
+  }
+
+  // Returns the indices of the exact nearest neighbor of each query.
+  std::vector<int> ExactSearch() const {
+    return Search(BruteForceIndex(data_), 1);
+  }
+
+  // Returns the number of queries whose nearest neighbor the index
+  // finds.
+  template <typename IndexType>
+  int CountCorrect(const IndexType& index, const int checks) const {
+    const std::vector<int> expected = ExactSearch();
+    const std::vector<int> approximate = Search(index, checks);
+    int correct = 0;
+    for (int q = 0; q < kQueries; ++q) {
+      if (approximate[q] == expected[q]) {
+        ++correct;
+      }
+    }
+    return correct;
+  }
+
+  // Returns the number of points that the index finds to be their own
+  // nearest neighbor.
+  template <typename IndexType>
+  int CountFoundPoints(const IndexType& index, const int checks) const {
+    flann::Matrix<int> indices(new int[kRows], kRows, 1);
+    flann::Matrix<float> dists(new float[kRows], kRows, 1);
+    index.knnSearch(data_, indices, dists, 1, flann::SearchParams(checks));
+    int found = 0;
+    for (int i = 0; i < kRows; ++i) {
+      if (dists[i][0] == 0) {
+        ++found;
+      }
+    }
+    delete[] indices.ptr();
+    delete[] dists.ptr();
+    return found;
+  }
+
+  flann::Matrix<uint8_t> data_;
+  flann::Matrix<uint8_t> queries_;
+};
+}  // namespace test.
+}}  // Namespace.
+
+#endif  // NAIVE_BAYES_NEAREST_NEIGHBOR_INDEX_TEST_UTIL_H_
@@ -0,0 +1,192 @@
+// Copyright (c) 2011, Sancho McCann
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+
+// - Redistributions of source code must retain the above copyright
+//   notice, this list of conditions and the following disclaimer.
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// Tests what every IndexType in this directory must do (see
+// nbnn_classifier.h).
+
+#include <stdint.h>
+
+#include <limits>
+#include <string>
+
+#include "glog/logging.h"
+#include "gtest/gtest.h"
+
+#include "flann/flann.hpp"
+
+#include "naive_bayes_nearest_neighbor/brute_force_index.h"
+#include "naive_bayes_nearest_neighbor/hamming_index.h"
+#include "naive_bayes_nearest_neighbor/hnsw_index.h"
+#include "naive_bayes_nearest_neighbor/index_test_util.h"
+#include "naive_bayes_nearest_neighbor/ivf_pq_index.h"
+#include "naive_bayes_nearest_neighbor/kd_forest_index.h"
+
+using sjm::nbnn::test::kDimensions;
+using sjm::nbnn::test::kQueries;
+using sjm::nbnn::test::kRows;
+
+// The params each IndexType is tested with, and the checks with which
+// it is expected to find most nearest neighbors.
+template <typename IndexType>
+struct IndexTypeParams;
+
+template <>
+struct IndexTypeParams<sjm::nbnn::BruteForceIndex> {
+  static flann::IndexParams Params() {
+    return flann::IndexParams();
+  }
+  static const int kChecks = 1;
+};
+
+template <>
+struct IndexTypeParams<sjm::nbnn::HnswIndex> {
+  static flann::IndexParams Params() {
+    return sjm::nbnn::HnswIndexParams(8, 100);
+  }
+  static const int kChecks = 64;
+};
+
+template <>
+struct IndexTypeParams<sjm::nbnn::IvfPqIndex> {
+  static flann::IndexParams Params() {
+    return sjm::nbnn::IvfPqIndexParams(64, 16, 32);
+  }
+  static const int kChecks = kRows / 4;
+};
+
+template <>
+struct IndexTypeParams<sjm::nbnn::HammingIndex> {
+  static flann::IndexParams Params() {
+    return sjm::nbnn::HammingIndexParams(256, 32);
+  }
+  static const int kChecks = 1;
+};
+
+template <>
+struct IndexTypeParams<sjm::nbnn::KdForestIndex> {
+  static flann::IndexParams Params() {
+    return sjm::nbnn::KdForestIndexParams(4);
+  }
+  static const int kChecks = kRows / 4;
+};
+
+template <typename IndexType>
+class IndexTypeTest : public sjm::nbnn::test::IndexTest {
+ protected:
+  typedef IndexTypeParams<IndexType> Params;
+};
+
+typedef ::testing::Types<sjm::nbnn::BruteForceIndex,
+                         sjm::nbnn::HnswIndex,
+                         sjm::nbnn::IvfPqIndex,
+                         sjm::nbnn::HammingIndex,
+                         sjm::nbnn::KdForestIndex> IndexTypes;
+TYPED_TEST_CASE(IndexTypeTest, IndexTypes);
+
+TYPED_TEST(IndexTypeTest,
+           TestRecall) {
+  TypeParam index(this->data_, TestFixture::Params::Params());
+  index.buildIndex();
+  ASSERT_EQ(kRows, index.size());
+  ASSERT_EQ(kDimensions, index.veclen());
+  ASSERT_GE(this->CountCorrect(index, TestFixture::Params::kChecks),
+            0.9 * kQueries);
+}
+
+TYPED_TEST(IndexTypeTest,
+           TestFewerRowsThanNeighbors) {
+  const int kFewRows = 3;
+  const int kKnn = 5;
+  flann::Matrix<uint8_t> few_rows(this->data_.ptr(), kFewRows, kDimensions);
+  TypeParam index(few_rows, TestFixture::Params::Params());
+  index.buildIndex();
+  flann::Matrix<uint8_t> query(this->data_.ptr(), 1, kDimensions);
+  flann::Matrix<int> indices(new int[kKnn], 1, kKnn);
+  flann::Matrix<float> dists(new float[kKnn], 1, kKnn);
+  ASSERT_EQ(kFewRows,
+            index.knnSearch(query, indices, dists, kKnn,
+                            flann::SearchParams(
+                                flann::FLANN_CHECKS_UNLIMITED)));
+  ASSERT_EQ(0, indices[0][0]);
+  for (int k = kFewRows; k < kKnn; ++k) {
+    ASSERT_EQ(-1, indices[0][k]);
+    ASSERT_EQ(std::numeric_limits<float>::max(), dists[0][k]);
+  }
+  delete[] indices.ptr();
+  delete[] dists.ptr();
+}
+
+TYPED_TEST(IndexTypeTest,
+           TestFewChecksFindKnn) {
+  // More neighbors than most IVF-PQ lists hold, with a single check.
+  const size_t knn = kRows / 10;
+  TypeParam index(this->data_, TestFixture::Params::Params());
+  index.buildIndex();
+  flann::Matrix<int> indices(new int[kQueries * knn], kQueries, knn);
+  flann::Matrix<float> dists(new float[kQueries * knn], kQueries, knn);
+  ASSERT_EQ(kQueries * knn,
+            index.knnSearch(this->queries_, indices, dists, knn,
+                            flann::SearchParams(1)));
+  for (int q = 0; q < kQueries; ++q) {
+    for (size_t k = 0; k < knn; ++k) {
+      ASSERT_LE(0, indices[q][k]);
+    }
+  }
+  delete[] indices.ptr();
+  delete[] dists.ptr();
+}
+
+TYPED_TEST(IndexTypeTest,
+           TestAddPoints) {
+  flann::Matrix<uint8_t> first_half(this->data_.ptr(), kRows / 2,
+                                    kDimensions);
+  flann::Matrix<uint8_t> second_half(this->data_[kRows / 2], kRows / 2,
+                                     kDimensions);
+  TypeParam index(first_half, TestFixture::Params::Params());
+  index.buildIndex();
+  index.addPoints(second_half);
+  ASSERT_EQ(kRows, index.size());
+  // Every point, including the added ones, is its own nearest
+  // neighbor.
+  ASSERT_EQ(kRows,
+            this->CountFoundPoints(index, TestFixture::Params::kChecks));
+}
+
+TYPED_TEST(IndexTypeTest,
+           TestSaveAndLoad) {
+  const std::string filename = "/tmp/index_type_test.index";
+  TypeParam index(this->data_, TestFixture::Params::Params());
+  index.buildIndex();
+  index.save(filename);
+  TypeParam loaded(this->data_, flann::SavedIndexParams(filename));
+  ASSERT_EQ(kRows, loaded.size());
+  ASSERT_EQ(this->Search(index, TestFixture::Params::kChecks),
+            this->Search(loaded, TestFixture::Params::kChecks));
+}
+
+int main(int argc, char** argv) {
+  google::InitGoogleLogging(argv[0]);
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,524 @@
+// Copyright (c) 2011, Sancho McCann
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+
+// - Redistributions of source code must retain the above copyright
+//   notice, this list of conditions and the following disclaimer.
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// An approximate nearest neighbor index over uint8_t descriptors that
+// stores each descriptor as a short product quantization (PQ) code
+// instead of its raw bytes (Jegou, Douze and Schmid, 2011). The
+// descriptors are first assigned to the nearest of a set of coarse
+// k-means centroids (the inverted file, or IVF), and the residual from
+// that centroid is split into code_size sub-vectors, each replaced by
+// the one byte id of its nearest sub-vector centroid. Queries scan
+// only the lists of their nearest coarse centroids, comparing against
+// the codes through per-list lookup tables.
+//
+// With the default 16 byte codes, each descriptor takes 20 bytes (its
+// code and its 4 byte id in its list), plus the slack of the growing
+// lists, rather than the 128-130 bytes of the descriptor itself. The
+// data must be in memory while it's being encoded, i.e. while the
+// index is built, loaded, or has points added. If rerank is set, the
+// index also keeps a pointer to each row (8 more bytes per
+// descriptor) and reads the rows again when searching; otherwise it
+// doesn't need the data after encoding it, so if the data is mapped
+// from a file (e.g. by BasicMergedClassifier::Load()), it can stay on
+// disk.
+//
+// It can be used as the IndexType of an NbnnClassifier or a
+// BasicMergedClassifier (see nbnn_classifier.h).
+
+#ifndef NAIVE_BAYES_NEAREST_NEIGHBOR_IVF_PQ_INDEX_H_
+#define NAIVE_BAYES_NEAREST_NEIGHBOR_IVF_PQ_INDEX_H_
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "glog/logging.h"
+
+#include "flann/flann.hpp"
+
+#include "naive_bayes_nearest_neighbor/distance.h"
+#include "naive_bayes_nearest_neighbor/index_io.h"
+#include "util/util.h"
+
+namespace sjm {
+namespace nbnn {
+
+namespace internal {
+
+const char kIvfPqIndexMagic[8] = {'S', 'J', 'M', 'I', 'V', 'F', 'P', 'Q'};
+}  // namespace internal.
+
+// The lists is the number of coarse centroids. The code_size is the
+// number of bytes each descriptor is compressed to. If rerank > 0, the
+// rerank nearest candidates by their approximate distance are
+// re-ranked by their exact distance to the query. The training_rows
+// is the most rows the centroids are trained on.
+struct IvfPqIndexParams : public flann::IndexParams {
+  explicit IvfPqIndexParams(const int lists = 1024,
+                            const int code_size = 16,
+                            const int rerank = 0,
+                            const int training_rows = 65536) {
+    (*this)["lists"] = lists;
+    (*this)["code_size"] = code_size;
+    (*this)["rerank"] = rerank;
+    (*this)["training_rows"] = training_rows;
+  }
+};
+
+class IvfPqIndex {
+ public:
+  // The params are usually IvfPqIndexParams.
+  IvfPqIndex(const flann::Matrix<uint8_t>& data,
+             const flann::IndexParams& params)
+      : dimensions_(data.cols), first_row_(0), size_(0),
+        centroid_index_(NULL) {
+    AppendRows(data);
+    const std::string filename =
+        flann::get_param<std::string>(params, "filename", "");
+    if (!filename.empty()) {
+      Load(filename);
+      ReleaseEncodedRows();
+    } else {
+      num_lists_ = flann::get_param(params, "lists", 1024);
+      code_size_ = flann::get_param(params, "code_size", 16);
+      rerank_ = flann::get_param(params, "rerank", 0);
+      training_rows_ = flann::get_param(params, "training_rows", 65536);
+      CHECK_GT(num_lists_, 0);
+      CHECK_GT(code_size_, 0);
+      CHECK_LE(code_size_, static_cast<int>(dimensions_));
+      CHECK_GE(rerank_, 0);
+      CHECK_GT(training_rows_, 0);
+    }
+  }
+
+  ~IvfPqIndex() {
+    delete centroid_index_;
+  }
+
+  // Trains the centroids, if that hasn't been done yet, and encodes
+  // any rows that haven't been encoded.
+  void buildIndex() {
+    if (coarse_centroids_.empty() && !rows_.empty()) {
+      Train();
+    }
+    for (; size_ < first_row_ + rows_.size(); ++size_) {
+      Encode(size_);
+    }
+    ReleaseEncodedRows();
+  }
+
+  // Adds the points to the index. Unlike FLANN, nothing is rebuilt:
+  // the new points are encoded with the existing centroids, so the
+  // rebuild_threshold is ignored.
+  void addPoints(const flann::Matrix<uint8_t>& points,
+                 float rebuild_threshold = 2) {
+    CHECK_EQ(dimensions_, points.cols);
+    AppendRows(points);
+    buildIndex();
+  }
+
+  // Saves the centroids and codes, but not the data, like
+  // flann::Index::save.
+  void save(const std::string& filename) const {
+    FILE* f = fopen(sjm::util::expand_user(filename).c_str(), "wb");
+    CHECK(f != NULL) << "Error opening " << filename << " for writing.";
+    WriteOrDie(internal::kIvfPqIndexMagic,
+               sizeof(internal::kIvfPqIndexMagic), f);
+    const int32_t header[] = {
+      static_cast<int32_t>(dimensions_), num_lists_, code_size_, rerank_,
+      training_rows_, static_cast<int32_t>(size_),
+      static_cast<int32_t>(coarse_centroids_.size() / dimensions_)};
+    WriteOrDie(header, sizeof(header), f);
+    WriteOrDie(coarse_centroids_.data(),
+               coarse_centroids_.size() * sizeof(float), f);
+    for (int s = 0; s < code_size_; ++s) {
+      const int32_t num_centroids = sub_centroids_[s].size() /
+          (sub_begin_[s + 1] - sub_begin_[s]);
+      WriteOrDie(&num_centroids, sizeof(num_centroids), f);
+      WriteOrDie(sub_centroids_[s].data(),
+                 sub_centroids_[s].size() * sizeof(float), f);
+    }
+    for (size_t list = 0; list < list_ids_.size(); ++list) {
+      const int32_t list_size = list_ids_[list].size();
+      WriteOrDie(&list_size, sizeof(list_size), f);
+      WriteOrDie(list_ids_[list].data(), list_size * sizeof(int32_t), f);
+      WriteOrDie(list_codes_[list].data(), list_size * code_size_, f);
+    }
+    CHECK_EQ(0, fclose(f));
+  }
+
+  // The number of points in the index.
+  size_t size() const {
+    return size_;
+  }
+
+  size_t veclen() const {
+    return dimensions_;
+  }
+
+  // The distances are approximate, unless they're re-ranked. The lists
+  // of the nearest coarse centroids are scanned until at least checks
+  // codes, and at least knn (or rerank), have been compared (every list
+  // if checks is flann::FLANN_CHECKS_UNLIMITED).
+  int knnSearch(const flann::Matrix<uint8_t>& queries,
+                flann::Matrix<int>& indices,
+                flann::Matrix<float>& dists,
+                size_t knn,
+                const flann::SearchParams& params) const {
+    CheckKnnSearchOrDie(queries, indices, dists, knn, dimensions_);
+    const size_t num_candidates =
+        std::max(knn, static_cast<size_t>(rerank_));
+    // Enough lists are scanned to fill the candidates, however few
+    // checks are asked for.
+    const size_t min_checks = std::max(
+        num_candidates, static_cast<size_t>(std::max(params.checks, 1)));
+    const int num_centroids = coarse_centroids_.size() / dimensions_;
+    std::vector<float> query(dimensions_);
+    std::vector<float> residual(dimensions_);
+    std::vector<float> table;
+    std::vector<std::pair<float, int> > centroids(num_centroids);
+    std::vector<std::pair<float, int> > heap;
+    int found = 0;
+    for (size_t q = 0; q < queries.rows; ++q) {
+      std::copy(queries[q], queries[q] + dimensions_, query.begin());
+      for (int c = 0; c < num_centroids; ++c) {
+        centroids[c] = std::make_pair(
+            SquaredDistance(&query[0], CoarseCentroid(c), dimensions_), c);
+      }
+      std::sort(centroids.begin(), centroids.end());
+      heap.clear();
+      size_t checked = 0;
+      for (int c = 0; c < num_centroids; ++c) {
+        if (params.checks != flann::FLANN_CHECKS_UNLIMITED &&
+            checked >= min_checks) {
+          break;
+        }
+        const int list = centroids[c].second;
+        checked += list_ids_[list].size();
+        for (size_t i = 0; i < dimensions_; ++i) {
+          residual[i] = query[i] - CoarseCentroid(list)[i];
+        }
+        ComputeDistanceTable(&residual[0], &table);
+        ScanList(list, table, num_candidates, &heap);
+      }
+      std::sort_heap(heap.begin(), heap.end());
+      if (rerank_ > 0) {
+        for (size_t i = 0; i < heap.size(); ++i) {
+          heap[i].first = internal::SquaredDistance(
+              queries[q], Row(heap[i].second), dimensions_);
+        }
+        std::sort(heap.begin(), heap.end());
+      }
+      found += StoreNeighbors(heap, knn, indices[q], dists[q]);
+    }
+    return found;
+  }
+
+ private:
+  // The number of centroids per sub-vector, so that each one's id
+  // fits in a byte.
+  static const int kSubCentroids = 256;
+  static const int kKMeansIterations = 10;
+  // The checks used to assign rows to their coarse centroids.
+  static const int kAssignmentChecks = 64;
+
+  static float SquaredDistance(const float* a, const float* b,
+                               const int dimensions) {
+    float total = 0;
+    for (int i = 0; i < dimensions; ++i) {
+      const float difference = a[i] - b[i];
+      total += difference * difference;
+    }
+    return total;
+  }
+
+  // Clusters the rows of the sample into at most num_clusters
+  // centroids, the same way CodebookBuilder::Cluster() does. If there
+  // are no more rows than clusters, the rows are the centroids.
+  static void KMeans(const flann::Matrix<float>& sample,
+                     const int num_clusters,
+                     std::vector<float>* centroids) {
+    if (sample.rows <= static_cast<size_t>(num_clusters)) {
+      centroids->assign(sample.ptr(), sample.ptr() + sample.rows * sample.cols);
+      return;
+    }
+    flann::KMeansIndex<flann::L2<float> > index(
+        sample, flann::KMeansIndexParams(num_clusters, kKMeansIterations,
+                                         flann::CENTERS_KMEANSPP));
+    index.buildIndex();
+    centroids->resize(num_clusters * sample.cols);
+    flann::Matrix<float> centers(&(*centroids)[0], num_clusters,
+                                 sample.cols);
+    const int found = index.getClusterCenters(centers);
+    CHECK_GT(found, 0);
+    centroids->resize(found * sample.cols);
+  }
+
+  void AppendRows(const flann::Matrix<uint8_t>& data) {
+    for (size_t i = 0; i < data.rows; ++i) {
+      rows_.push_back(data[i]);
+    }
+  }
+
+  const uint8_t* Row(const size_t row) const {
+    return rows_[row - first_row_];
+  }
+
+  // Without re-ranking, the rows aren't needed once they're encoded.
+  void ReleaseEncodedRows() {
+    if (rerank_ == 0 && size_ == first_row_ + rows_.size()) {
+      first_row_ = size_;
+      std::vector<const uint8_t*>().swap(rows_);
+    }
+  }
+
+  const float* CoarseCentroid(const int c) const {
+    return &coarse_centroids_[c * dimensions_];
+  }
+
+  // Returns the coarse centroid nearest to the row, and its residual.
+  int Assign(const int row, float* residual) const {
+    std::vector<float> point(Row(row), Row(row) + dimensions_);
+    flann::Matrix<float> query(&point[0], 1, dimensions_);
+    int nearest = 0;
+    float distance = 0;
+    flann::Matrix<int> index_result(&nearest, 1, 1);
+    flann::Matrix<float> distance_result(&distance, 1, 1);
+    centroid_index_->knnSearch(query, index_result, distance_result, 1,
+                               flann::SearchParams(kAssignmentChecks));
+    for (size_t i = 0; i < dimensions_; ++i) {
+      residual[i] = point[i] - CoarseCentroid(nearest)[i];
+    }
+    return nearest;
+  }
+
+  void BuildCentroidIndex() {
+    centroid_matrix_ = flann::Matrix<float>(
+        &coarse_centroids_[0], coarse_centroids_.size() / dimensions_,
+        dimensions_);
+    delete centroid_index_;
+    centroid_index_ = new flann::Index<flann::L2<float> >(
+        centroid_matrix_, flann::KDTreeIndexParams(4));
+    centroid_index_->buildIndex();
+  }
+
+  // Splits the dimensions into code_size_ nearly equal sub-vectors.
+  void SetSubVectors() {
+    sub_begin_.resize(code_size_ + 1);
+    for (int s = 0; s <= code_size_; ++s) {
+      sub_begin_[s] = s * dimensions_ / code_size_;
+    }
+  }
+
+  void Train() {
+    // An evenly spaced sample of the rows.
+    const size_t sample_size =
+        std::min(rows_.size(), static_cast<size_t>(training_rows_));
+    std::vector<float> sample(sample_size * dimensions_);
+    for (size_t i = 0; i < sample_size; ++i) {
+      const uint8_t* row = Row(first_row_ + i * rows_.size() / sample_size);
+      std::copy(row, row + dimensions_, &sample[i * dimensions_]);
+    }
+    KMeans(flann::Matrix<float>(&sample[0], sample_size, dimensions_),
+           num_lists_, &coarse_centroids_);
+    BuildCentroidIndex();
+    list_ids_.resize(coarse_centroids_.size() / dimensions_);
+    list_codes_.resize(list_ids_.size());
+    // The sub-vector centroids are trained on the sample's residuals.
+    std::vector<float> residuals(sample_size * dimensions_);
+    for (size_t i = 0; i < sample_size; ++i) {
+      Assign(first_row_ + i * rows_.size() / sample_size,
+             &residuals[i * dimensions_]);
+    }
+    SetSubVectors();
+    sub_centroids_.resize(code_size_);
+    for (int s = 0; s < code_size_; ++s) {
+      const int sub_dimensions = sub_begin_[s + 1] - sub_begin_[s];
+      std::vector<float> sub_sample(sample_size * sub_dimensions);
+      for (size_t i = 0; i < sample_size; ++i) {
+        std::copy(&residuals[i * dimensions_ + sub_begin_[s]],
+                  &residuals[i * dimensions_ + sub_begin_[s + 1]],
+                  &sub_sample[i * sub_dimensions]);
+      }
+      KMeans(flann::Matrix<float>(&sub_sample[0], sample_size,
+                                  sub_dimensions),
+             kSubCentroids, &sub_centroids_[s]);
+    }
+  }
+
+  // Adds the row's code to the list of its coarse centroid.
+  void Encode(const int row) {
+    std::vector<float> residual(dimensions_);
+    const int list = Assign(row, &residual[0]);
+    list_ids_[list].push_back(row);
+    for (int s = 0; s < code_size_; ++s) {
+      const int sub_dimensions = sub_begin_[s + 1] - sub_begin_[s];
+      const int num_centroids = sub_centroids_[s].size() / sub_dimensions;
+      int nearest = 0;
+      float nearest_distance = std::numeric_limits<float>::max();
+      for (int c = 0; c < num_centroids; ++c) {
+        const float distance =
+            SquaredDistance(&residual[sub_begin_[s]],
+                            &sub_centroids_[s][c * sub_dimensions],
+                            sub_dimensions);
+        if (distance < nearest_distance) {
+          nearest = c;
+          nearest_distance = distance;
+        }
+      }
+      list_codes_[list].push_back(nearest);
+    }
+  }
+
+  // Fills the table with the squared distance from each sub-vector of
+  // the residual to each of that sub-vector's centroids.
+  void ComputeDistanceTable(const float* residual,
+                            std::vector<float>* table) const {
+    table->assign(code_size_ * kSubCentroids,
+                  std::numeric_limits<float>::max());
+    for (int s = 0; s < code_size_; ++s) {
+      const int sub_dimensions = sub_begin_[s + 1] - sub_begin_[s];
+      const int num_centroids = sub_centroids_[s].size() / sub_dimensions;
+      for (int c = 0; c < num_centroids; ++c) {
+        (*table)[s * kSubCentroids + c] =
+            SquaredDistance(residual + sub_begin_[s],
+                            &sub_centroids_[s][c * sub_dimensions],
+                            sub_dimensions);
+      }
+    }
+  }
+
+  // Adds the list's points to the heap of the nearest candidates,
+  // which has the farthest on top.
+  void ScanList(const int list, const std::vector<float>& table,
+                const size_t num_candidates,
+                std::vector<std::pair<float, int> >* heap) const {
+    const std::vector<int32_t>& ids = list_ids_[list];
+    const uint8_t* code = list_codes_[list].data();
+    for (size_t i = 0; i < ids.size(); ++i, code += code_size_) {
+      float distance = 0;
+      const float* sub_table = &table[0];
+      for (int s = 0; s < code_size_; ++s, sub_table += kSubCentroids) {
+        distance += sub_table[code[s]];
+      }
+      const std::pair<float, int> candidate(distance, ids[i]);
+      if (heap->size() < num_candidates) {
+        heap->push_back(candidate);
+        std::push_heap(heap->begin(), heap->end());
+      } else if (candidate < heap->front()) {
+        std::pop_heap(heap->begin(), heap->end());
+        heap->back() = candidate;
+        std::push_heap(heap->begin(), heap->end());
+      }
+    }
+  }
+
+  void Load(const std::string& filename) {
+    std::string data;
+    sjm::util::ReadFileToStringOrDie(filename, &data);
+    const char* read = data.data();
+    const char* end = read + data.size();
+    const size_t magic_size = sizeof(internal::kIvfPqIndexMagic);
+    CHECK(data.size() >= magic_size &&
+          memcmp(read, internal::kIvfPqIndexMagic, magic_size) == 0) <<
+        filename << " is not an IVF-PQ index.";
+    read += magic_size;
+    int32_t header[7];
+    ReadOrDie(header, sizeof(header), end, &read);
+    CHECK_EQ(dimensions_, header[0]) <<
+        filename << " was built on different data.";
+    num_lists_ = header[1];
+    code_size_ = header[2];
+    rerank_ = header[3];
+    training_rows_ = header[4];
+    size_ = header[5];
+    CHECK_EQ(rows_.size(), size_) <<
+        filename << " was built on different data.";
+    const int num_centroids = header[6];
+    coarse_centroids_.resize(num_centroids * dimensions_);
+    ReadOrDie(coarse_centroids_.data(),
+              coarse_centroids_.size() * sizeof(float), end, &read);
+    if (num_centroids > 0) {
+      BuildCentroidIndex();
+    }
+    SetSubVectors();
+    sub_centroids_.resize(code_size_);
+    for (int s = 0; s < code_size_; ++s) {
+      int32_t num_sub_centroids = 0;
+      ReadOrDie(&num_sub_centroids, sizeof(num_sub_centroids), end, &read);
+      sub_centroids_[s].resize(
+          num_sub_centroids * (sub_begin_[s + 1] - sub_begin_[s]));
+      ReadOrDie(sub_centroids_[s].data(),
+                sub_centroids_[s].size() * sizeof(float), end, &read);
+    }
+    list_ids_.resize(num_centroids);
+    list_codes_.resize(num_centroids);
+    for (int list = 0; list < num_centroids; ++list) {
+      int32_t list_size = 0;
+      ReadOrDie(&list_size, sizeof(list_size), end, &read);
+      list_ids_[list].resize(list_size);
+      ReadOrDie(list_ids_[list].data(), list_size * sizeof(int32_t), end,
+                &read);
+      list_codes_[list].resize(list_size * code_size_);
+      ReadOrDie(list_codes_[list].data(), list_size * code_size_, end,
+                &read);
+    }
+    CHECK(read == end) << filename << " has trailing data.";
+  }
+
+  const size_t dimensions_;
+  int num_lists_;
+  int code_size_;
+  int rerank_;
+  int training_rows_;
+  // The data row of each point from first_row_ on. Without
+  // re-ranking, only the rows that haven't been encoded yet are kept.
+  size_t first_row_;
+  std::vector<const uint8_t*> rows_;
+  // The number of rows that have been encoded.
+  size_t size_;
+  // The coarse centroids, one after another, and an index over them.
+  std::vector<float> coarse_centroids_;
+  flann::Matrix<float> centroid_matrix_;
+  flann::Index<flann::L2<float> >* centroid_index_;
+  // The first dimension of each sub-vector, and one past the last.
+  std::vector<int> sub_begin_;
+  // The centroids of each sub-vector, one after another.
+  std::vector<std::vector<float> > sub_centroids_;
+  // The points in each coarse centroid's list, and their codes.
+  std::vector<std::vector<int32_t> > list_ids_;
+  std::vector<std::vector<uint8_t> > list_codes_;
+
+  IvfPqIndex(const IvfPqIndex&);
+  void operator=(const IvfPqIndex&);
+};
+}}  // Namespace.
+
+#endif  // NAIVE_BAYES_NEAREST_NEIGHBOR_IVF_PQ_INDEX_H_
@@ -0,0 +1,74 @@
+// Copyright (c) 2011, Sancho McCann
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+
+// - Redistributions of source code must retain the above copyright
+//   notice, this list of conditions and the following disclaimer.
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "naive_bayes_nearest_neighbor/ivf_pq_index.h"
+
+#include "glog/logging.h"
+#include "gtest/gtest.h"
+
+#include "flann/flann.hpp"
+
+#include "naive_bayes_nearest_neighbor/index_test_util.h"
+
+using sjm::nbnn::test::kDimensions;
+using sjm::nbnn::test::kQueries;
+using sjm::nbnn::test::kRows;
+
+// What every IndexType must do is tested in index_type_test.cc.
+class IvfPqIndexTest : public sjm::nbnn::test::IndexTest {};
+
+TEST_F(IvfPqIndexTest,
+       TestRecallWithoutReranking) {
+  sjm::nbnn::IvfPqIndex index(data_, sjm::nbnn::IvfPqIndexParams(16, 16));
+  index.buildIndex();
+  ASSERT_GE(CountCorrect(index, kRows / 4), 0.9 * kQueries);
+}
+
+TEST_F(IvfPqIndexTest,
+       TestAddPointsWithoutReranking) {
+  // The index keeps none of the first half's rows once they're encoded.
+  flann::Matrix<uint8_t> first_half(data_.ptr(), kRows / 2, kDimensions);
+  flann::Matrix<uint8_t> second_half(data_[kRows / 2], kRows / 2,
+                                     kDimensions);
+  sjm::nbnn::IvfPqIndex index(first_half,
+                              sjm::nbnn::IvfPqIndexParams(16, 16));
+  index.buildIndex();
+  index.addPoints(second_half);
+  ASSERT_EQ(kRows, index.size());
+  ASSERT_GE(CountCorrect(index, kRows / 4), 0.9 * kQueries);
+}
+
+TEST_F(IvfPqIndexTest,
+       TestRerankEverythingIsExact) {
+  sjm::nbnn::IvfPqIndex index(data_,
+                              sjm::nbnn::IvfPqIndexParams(16, 8, kRows));
+  index.buildIndex();
+  ASSERT_EQ(ExactSearch(), Search(index, flann::FLANN_CHECKS_UNLIMITED));
+}
+
+int main(int argc, char** argv) {
+  google::InitGoogleLogging(argv[0]);
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,512 @@
+// Copyright (c) 2011, Sancho McCann
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+
+// - Redistributions of source code must retain the above copyright
+//   notice, this list of conditions and the following disclaimer.
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// An approximate nearest neighbor index over uint8_t descriptors: a
+// forest of randomized kd-trees, like FLANN's KDTreeIndex, laid out
+// for the cache. Each tree's nodes are stored in one array in
+// breadth-first order, with the two children of a node next to each
+// other, and each leaf holds up to leaf_size points whose rows are
+// copied next to each other in the tree's leaf order. A search
+// descends every tree, then keeps descending from the closest
+// unexplored branches (over all the trees) until checks distinct
+// points have been compared, as FLANN's does. Each leaf's rows are
+// compared in one pass over contiguous memory, with the AVX2 distance
+// when it's enabled (e.g. by scons native=1), and the node of the
+// branch that will be explored next is prefetched while the leaf is
+// compared.
+//
+// The copied rows take trees times the memory of the data. It can be
+// used as the IndexType of an NbnnClassifier or a
+// BasicMergedClassifier (see nbnn_classifier.h).
+
+#ifndef NAIVE_BAYES_NEAREST_NEIGHBOR_KD_FOREST_INDEX_H_
+#define NAIVE_BAYES_NEAREST_NEIGHBOR_KD_FOREST_INDEX_H_
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "glog/logging.h"
+
+#include "flann/flann.hpp"
+
+#include "naive_bayes_nearest_neighbor/distance.h"
+#include "naive_bayes_nearest_neighbor/index_io.h"
+#include "util/util.h"
+
+namespace sjm {
+namespace nbnn {
+
+namespace internal {
+
+const char kKdForestIndexMagic[8] = {'S', 'J', 'M', 'K', 'D', 'F', 'S', 'T'};
+}  // namespace internal.
+
+// The trees is the number of randomized kd-trees, as in FLANN's
+// KDTreeIndexParams. The leaf_size is the most points in a leaf.
+struct KdForestIndexParams : public flann::IndexParams {
+  explicit KdForestIndexParams(const int trees = 4,
+                               const int leaf_size = 32) {
+    (*this)["trees"] = trees;
+    (*this)["leaf_size"] = leaf_size;
+  }
+};
+
+class KdForestIndex {
+ public:
+  // The params are usually KdForestIndexParams (or FLANN's
+  // KDTreeIndexParams).
+  KdForestIndex(const flann::Matrix<uint8_t>& data,
+                const flann::IndexParams& params)
+      : dimensions_(data.cols), built_rows_(0) {
+    AppendRows(data);
+    const std::string filename =
+        flann::get_param<std::string>(params, "filename", "");
+    if (!filename.empty()) {
+      Load(filename);
+    } else {
+      num_trees_ = flann::get_param(params, "trees", 4);
+      leaf_size_ = flann::get_param(params, "leaf_size", 32);
+      CHECK_GT(num_trees_, 0);
+      CHECK_GT(leaf_size_, 0);
+    }
+  }
+
+  // Builds the trees over all of the points.
+  void buildIndex() {
+    built_rows_ = rows_.size();
+    std::mt19937 random(kRandomSeed);
+    trees_.resize(num_trees_);
+    for (int t = 0; t < num_trees_; ++t) {
+      BuildTree(&random, &trees_[t]);
+    }
+  }
+
+  // Adds the points to the index. They're compared with every query
+  // until the trees are rebuilt, which is done here once the index
+  // has grown to rebuild_threshold times its size when it was last
+  // built (if rebuild_threshold > 1), as FLANN does.
+  void addPoints(const flann::Matrix<uint8_t>& points,
+                 float rebuild_threshold = 2) {
+    CHECK_EQ(dimensions_, points.cols);
+    AppendRows(points);
+    if (rebuild_threshold > 1 &&
+        rows_.size() > rebuild_threshold * built_rows_) {
+      buildIndex();
+    }
+  }
+
+  // Saves the trees, but not the data, like flann::Index::save.
+  void save(const std::string& filename) const {
+    FILE* f = fopen(sjm::util::expand_user(filename).c_str(), "wb");
+    CHECK(f != NULL) << "Error opening " << filename << " for writing.";
+    WriteOrDie(internal::kKdForestIndexMagic,
+               sizeof(internal::kKdForestIndexMagic), f);
+    const int32_t header[] = {
+      static_cast<int32_t>(dimensions_), num_trees_, leaf_size_,
+      static_cast<int32_t>(built_rows_), static_cast<int32_t>(trees_.size())};
+    WriteOrDie(header, sizeof(header), f);
+    for (size_t t = 0; t < trees_.size(); ++t) {
+      const int32_t num_nodes = trees_[t].nodes.size();
+      WriteOrDie(&num_nodes, sizeof(num_nodes), f);
+      WriteOrDie(trees_[t].nodes.data(), num_nodes * sizeof(Node), f);
+      WriteOrDie(trees_[t].ids.data(), built_rows_ * sizeof(int32_t), f);
+    }
+    CHECK_EQ(0, fclose(f));
+  }
+
+  // The number of points in the index.
+  size_t size() const {
+    return rows_.size();
+  }
+
+  size_t veclen() const {
+    return dimensions_;
+  }
+
+  // Compares at least checks distinct points from the trees. Like
+  // FLANN's, a branch's distance bound adds the squared distance to
+  // each split on the way to it, which can overestimate when a
+  // dimension is split more than once, so branches are skipped once
+  // they're no nearer than the knn found. If checks is
+  // flann::FLANN_CHECKS_UNLIMITED, none are skipped and every point is
+  // compared, so the search is exact.
+  int knnSearch(const flann::Matrix<uint8_t>& queries,
+                flann::Matrix<int>& indices,
+                flann::Matrix<float>& dists,
+                size_t knn,
+                const flann::SearchParams& params) const {
+    CheckKnnSearchOrDie(queries, indices, dists, knn, dimensions_);
+    const bool unlimited = params.checks == flann::FLANN_CHECKS_UNLIMITED;
+    Search search(built_rows_, knn,
+                  unlimited ? built_rows_ : std::max(params.checks, 1),
+                  !unlimited);
+    int found = 0;
+    for (size_t q = 0; q < queries.rows; ++q) {
+      search.Start(queries[q]);
+      if (built_rows_ > 0) {
+        for (size_t t = 0; t < trees_.size(); ++t) {
+          Descend(t, 0, 0, &search);
+        }
+        while (!search.branches.empty() &&
+               (search.checks < search.max_checks || !search.Full())) {
+          std::pop_heap(search.branches.begin(), search.branches.end(),
+                        std::greater<Branch>());
+          const Branch branch = search.branches.back();
+          search.branches.pop_back();
+          if (search.Prune(branch.first)) {
+            // Every other branch is at least as far.
+            break;
+          }
+          Descend(branch.second.first, branch.second.second, branch.first,
+                  &search);
+        }
+      }
+      // Points added since the trees were built are all compared.
+      for (size_t row = built_rows_; row < rows_.size(); ++row) {
+        search.Add(internal::SquaredDistance(queries[q], rows_[row],
+                                             dimensions_),
+                   row);
+      }
+      std::vector<std::pair<int, int> >& nearest = search.nearest;
+      std::sort_heap(nearest.begin(), nearest.end());
+      found += StoreNeighbors(nearest, knn, indices[q], dists[q]);
+    }
+    return found;
+  }
+
+ private:
+  // A node of a tree. A split node's children are nodes child and
+  // child + 1, for points whose dimension is less than the split and
+  // the rest. A leaf (with dimension -1) holds the count points from
+  // position child of the tree's leaf order.
+  struct Node {
+    int32_t dimension;
+    float split;
+    int32_t child;
+    int32_t count;
+  };
+
+  struct Tree {
+    std::vector<Node> nodes;
+    // The row of each point, in leaf order.
+    std::vector<int32_t> ids;
+    // The rows themselves, in leaf order.
+    std::vector<uint8_t> leaf_rows;
+  };
+
+  // An unexplored branch: its distance bound, tree and node.
+  typedef std::pair<int, std::pair<int, int> > Branch;
+
+  // The state of one query's search, which is reused between queries.
+  struct Search {
+    Search(const size_t size, const size_t knn, const int max_checks,
+           const bool prune)
+        : knn(knn), max_checks(max_checks), prune(prune), marks(size, 0),
+          mark(0) {
+      nearest.reserve(knn + 1);
+    }
+    void Start(const uint8_t* new_query) {
+      query = new_query;
+      checks = 0;
+      nearest.clear();
+      branches.clear();
+      ++mark;
+      if (mark == 0) {
+        std::fill(marks.begin(), marks.end(), 0);
+        mark = 1;
+      }
+    }
+    // Returns true if the point was already compared.
+    bool Visit(const int row) {
+      if (marks[row] == mark) {
+        return true;
+      }
+      marks[row] = mark;
+      return false;
+    }
+    bool Full() const {
+      return nearest.size() >= knn;
+    }
+    // Returns true if a branch with the distance bound can be skipped.
+    bool Prune(const int distance) const {
+      return prune && Full() && distance >= nearest.front().first;
+    }
+    void Add(const int distance, const int row) {
+      const std::pair<int, int> candidate(distance, row);
+      if (nearest.size() < knn) {
+        nearest.push_back(candidate);
+        std::push_heap(nearest.begin(), nearest.end());
+      } else if (knn > 0 && candidate < nearest.front()) {
+        std::pop_heap(nearest.begin(), nearest.end());
+        nearest.back() = candidate;
+        std::push_heap(nearest.begin(), nearest.end());
+      }
+    }
+
+    const size_t knn;
+    const int max_checks;
+    const bool prune;
+    const uint8_t* query;
+    int checks;
+    // The nearest (distance, row) pairs so far, with the farthest on
+    // top.
+    std::vector<std::pair<int, int> > nearest;
+    // The unexplored branches, with the nearest on top.
+    std::vector<Branch> branches;
+    // The leaf's distances, before they're added to nearest.
+    std::vector<int> leaf_distances;
+    std::vector<uint32_t> marks;
+    uint32_t mark;
+  };
+
+  static const int kRandomSeed = 100;
+  // The split dimension is chosen from this many of the highest
+  // variance dimensions, which are estimated from this many points,
+  // as FLANN does.
+  static const int kRandomDimensions = 5;
+  static const int kSampleSize = 100;
+
+  void AppendRows(const flann::Matrix<uint8_t>& data) {
+    for (size_t i = 0; i < data.rows; ++i) {
+      rows_.push_back(data[i]);
+    }
+  }
+
+  // Chooses a high variance dimension of the points of ids from begin
+  // to end, and splits at its mean.
+  void ChooseSplit(const std::vector<int32_t>& ids, const int begin,
+                   const int end, std::mt19937* random, int* dimension,
+                   float* split) const {
+    const int sample_end = std::min(end, begin + kSampleSize);
+    std::vector<double> sums(dimensions_, 0);
+    std::vector<double> squares(dimensions_, 0);
+    for (int i = begin; i < sample_end; ++i) {
+      const uint8_t* row = rows_[ids[i]];
+      for (size_t d = 0; d < dimensions_; ++d) {
+        sums[d] += row[d];
+        squares[d] += static_cast<double>(row[d]) * row[d];
+      }
+    }
+    const int count = sample_end - begin;
+    std::vector<std::pair<double, int> > variances(dimensions_);
+    for (size_t d = 0; d < dimensions_; ++d) {
+      const double mean = sums[d] / count;
+      variances[d] = std::make_pair(-(squares[d] / count - mean * mean), d);
+    }
+    const int candidates =
+        std::min(kRandomDimensions, static_cast<int>(dimensions_));
+    std::partial_sort(variances.begin(), variances.begin() + candidates,
+                      variances.end());
+    *dimension = variances[(*random)() % candidates].second;
+    *split = sums[*dimension] / count;
+  }
+
+  // Builds the tree breadth first, so that the nodes are stored in
+  // breadth-first order, then copies the rows in leaf order.
+  void BuildTree(std::mt19937* random, Tree* tree) const {
+    const int n = built_rows_;
+    tree->ids.resize(n);
+    for (int i = 0; i < n; ++i) {
+      tree->ids[i] = i;
+    }
+    tree->nodes.assign(1, Node());
+    // The nodes to split, with the positions of their points.
+    struct Pending {
+      int node;
+      int begin;
+      int end;
+    };
+    std::vector<Pending> pending;
+    const Pending root = {0, 0, n};
+    pending.push_back(root);
+    for (size_t next = 0; next < pending.size(); ++next) {
+      const Pending current = pending[next];
+      if (current.end - current.begin <= leaf_size_) {
+        Node& leaf = tree->nodes[current.node];
+        leaf.dimension = -1;
+        leaf.split = 0;
+        leaf.child = current.begin;
+        leaf.count = current.end - current.begin;
+        continue;
+      }
+      int dimension;
+      float split;
+      ChooseSplit(tree->ids, current.begin, current.end, random, &dimension,
+                  &split);
+      int middle = std::partition(
+          tree->ids.begin() + current.begin, tree->ids.begin() + current.end,
+          RowIsBelow(rows_, dimension, split)) - tree->ids.begin();
+      if (middle == current.begin || middle == current.end) {
+        // All the points have the same value in that dimension.
+        middle = (current.begin + current.end) / 2;
+      }
+      const int child = tree->nodes.size();
+      Node& node = tree->nodes[current.node];
+      node.dimension = dimension;
+      node.split = split;
+      node.child = child;
+      node.count = 0;
+      tree->nodes.resize(child + 2);
+      const Pending left = {child, current.begin, middle};
+      const Pending right = {child + 1, middle, current.end};
+      pending.push_back(left);
+      pending.push_back(right);
+    }
+    CopyLeafRows(tree);
+  }
+
+  void CopyLeafRows(Tree* tree) const {
+    tree->leaf_rows.resize(tree->ids.size() * dimensions_);
+    for (size_t i = 0; i < tree->ids.size(); ++i) {
+      memcpy(&tree->leaf_rows[i * dimensions_], rows_[tree->ids[i]],
+             dimensions_);
+    }
+  }
+
+  // Partitions row ids by whether their dimension is below the split.
+  class RowIsBelow {
+   public:
+    RowIsBelow(const std::vector<const uint8_t*>& rows, const int dimension,
+               const float split)
+        : rows_(rows), dimension_(dimension), split_(split) {}
+    bool operator()(const int32_t id) const {
+      return rows_[id][dimension_] < split_;
+    }
+   private:
+    const std::vector<const uint8_t*>& rows_;
+    int dimension_;
+    float split_;
+  };
+
+  // Descends the tree from the node to a leaf, adding the branches
+  // not taken, and compares the leaf's points. The distance is the
+  // node's distance bound.
+  void Descend(const int tree_index, int node_index, const int distance,
+               Search* search) const {
+    const Tree& tree = trees_[tree_index];
+    const Node* node = &tree.nodes[node_index];
+    while (node->dimension >= 0) {
+      const Node* children = &tree.nodes[node->child];
+      const float difference = search->query[node->dimension] - node->split;
+      const int near = difference < 0 ? 0 : 1;
+      const int far_distance =
+          distance + static_cast<int>(difference * difference);
+      if (!search->Prune(far_distance)) {
+        search->branches.push_back(Branch(
+            far_distance, std::make_pair(tree_index, node->child + 1 - near)));
+        std::push_heap(search->branches.begin(), search->branches.end(),
+                       std::greater<Branch>());
+      }
+      node = children + near;
+    }
+    if (!search->branches.empty()) {
+      const Branch& next = search->branches.front();
+      __builtin_prefetch(
+          &trees_[next.second.first].nodes[next.second.second]);
+    }
+    ScanLeaf(tree, *node, search);
+  }
+
+  // Compares the leaf's points that haven't been compared yet.
+  void ScanLeaf(const Tree& tree, const Node& leaf, Search* search) const {
+    const uint8_t* leaf_rows = &tree.leaf_rows[leaf.child * dimensions_];
+    const int32_t* ids = &tree.ids[leaf.child];
+    search->leaf_distances.resize(leaf.count);
+    // The rows are compared in one pass, then the distances are
+    // added, so that the comparisons aren't interleaved with the
+    // heap's branches.
+    for (int i = 0; i < leaf.count; ++i) {
+      search->leaf_distances[i] =
+          search->Visit(ids[i]) ? -1 :
+          internal::SquaredDistance(search->query,
+                                    leaf_rows + i * dimensions_,
+                                    dimensions_);
+    }
+    for (int i = 0; i < leaf.count; ++i) {
+      if (search->leaf_distances[i] >= 0) {
+        ++search->checks;
+        search->Add(search->leaf_distances[i], ids[i]);
+      }
+    }
+  }
+
+  void Load(const std::string& filename) {
+    std::string data;
+    sjm::util::ReadFileToStringOrDie(filename, &data);
+    const char* read = data.data();
+    const char* end = read + data.size();
+    const size_t magic_size = sizeof(internal::kKdForestIndexMagic);
+    CHECK(data.size() >= magic_size &&
+          memcmp(read, internal::kKdForestIndexMagic, magic_size) == 0) <<
+        filename << " is not a kd-forest index.";
+    read += magic_size;
+    int32_t header[5];
+    ReadOrDie(header, sizeof(header), end, &read);
+    CHECK_EQ(dimensions_, header[0]) <<
+        filename << " was built on different data.";
+    num_trees_ = header[1];
+    leaf_size_ = header[2];
+    built_rows_ = header[3];
+    // Points added after building were saved too, but not in the
+    // trees.
+    CHECK_LE(built_rows_, rows_.size()) <<
+        filename << " was built on different data.";
+    trees_.resize(header[4]);
+    for (size_t t = 0; t < trees_.size(); ++t) {
+      int32_t num_nodes = 0;
+      ReadOrDie(&num_nodes, sizeof(num_nodes), end, &read);
+      trees_[t].nodes.resize(num_nodes);
+      ReadOrDie(trees_[t].nodes.data(), num_nodes * sizeof(Node), end,
+                &read);
+      trees_[t].ids.resize(built_rows_);
+      ReadOrDie(trees_[t].ids.data(), built_rows_ * sizeof(int32_t), end,
+                &read);
+      CopyLeafRows(&trees_[t]);
+    }
+    CHECK(read == end) << filename << " has trailing data.";
+  }
+
+  const size_t dimensions_;
+  int num_trees_;
+  int leaf_size_;
+  // The data row of each point.
+  std::vector<const uint8_t*> rows_;
+  // The number of rows that the trees were built on.
+  size_t built_rows_;
+  std::vector<Tree> trees_;
+
+  KdForestIndex(const KdForestIndex&);
+  void operator=(const KdForestIndex&);
+};
+}}  // Namespace.
+
+#endif  // NAIVE_BAYES_NEAREST_NEIGHBOR_KD_FOREST_INDEX_H_
@@ -0,0 +1,152 @@
+// Copyright (c) 2011, Sancho McCann
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+
+// - Redistributions of source code must retain the above copyright
+//   notice, this list of conditions and the following disclaimer.
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "naive_bayes_nearest_neighbor/kd_forest_index.h"
+
+#include <stdint.h>
+
+#include <cstdlib>
+#include <vector>
+
+#include "glog/logging.h"
+#include "gtest/gtest.h"
+
+#include "flann/flann.hpp"
+
+#include "naive_bayes_nearest_neighbor/brute_force_index.h"
+#include "naive_bayes_nearest_neighbor/index_test_util.h"
+
+using std::vector;
+using sjm::nbnn::test::kDimensions;
+using sjm::nbnn::test::kQueries;
+using sjm::nbnn::test::kRows;
+
+// What every IndexType must do is tested in index_type_test.cc.
+class KdForestIndexTest : public sjm::nbnn::test::IndexTest {};
+
+TEST_F(KdForestIndexTest,
+       TestUnlimitedChecksAreExact) {
+  const int leaf_sizes[] = {1, 32};
+  for (int i = 0; i < 2; ++i) {
+    sjm::nbnn::KdForestIndex index(
+        data_, sjm::nbnn::KdForestIndexParams(2, leaf_sizes[i]));
+    index.buildIndex();
+    ASSERT_EQ(ExactSearch(), Search(index, flann::FLANN_CHECKS_UNLIMITED));
+  }
+}
+
+TEST_F(KdForestIndexTest,
+       TestUnlimitedChecksAreExactInFewDimensions) {
+  // With few dimensions, each dimension is split many times on the way
+  // to a leaf.
+  const int kFewDimensions = 2;
+  const size_t knn = 5;
+  vector<uint8_t> points(kRows * kFewDimensions);
+  for (size_t i = 0; i < points.size(); ++i) {
+    points[i] = std::rand() % 256;
+  }
+  const flann::Matrix<uint8_t> data(&points[0], kRows - kQueries,
+                                    kFewDimensions);
+  const flann::Matrix<uint8_t> queries(data[kRows - kQueries], kQueries,
+                                       kFewDimensions);
+  sjm::nbnn::KdForestIndex index(data,
+                                 sjm::nbnn::KdForestIndexParams(1, 1));
+  index.buildIndex();
+  vector<int> indices(kQueries * knn);
+  vector<float> dists(kQueries * knn);
+  vector<int> exact_indices(kQueries * knn);
+  vector<float> exact_dists(kQueries * knn);
+  flann::Matrix<int> index_matrix(&indices[0], kQueries, knn);
+  flann::Matrix<float> dist_matrix(&dists[0], kQueries, knn);
+  flann::Matrix<int> exact_index_matrix(&exact_indices[0], kQueries, knn);
+  flann::Matrix<float> exact_dist_matrix(&exact_dists[0], kQueries, knn);
+  index.knnSearch(queries, index_matrix, dist_matrix, knn,
+                  flann::SearchParams(flann::FLANN_CHECKS_UNLIMITED));
+  sjm::nbnn::BruteForceIndex(data).knnSearch(
+      queries, exact_index_matrix, exact_dist_matrix, knn,
+      flann::SearchParams(1));
+  // The points tie often, so only the distances are compared.
+  ASSERT_EQ(exact_dists, dists);
+}
+
+TEST_F(KdForestIndexTest,
+       TestOneLeafIsExact) {
+  sjm::nbnn::KdForestIndex index(data_,
+                                 sjm::nbnn::KdForestIndexParams(1, kRows));
+  index.buildIndex();
+  // The only leaf holds every point, and is compared in full.
+  ASSERT_EQ(ExactSearch(), Search(index, 1));
+}
+
+TEST_F(KdForestIndexTest,
+       TestFindsKnnWithFewChecks) {
+  sjm::nbnn::KdForestIndex index(data_, sjm::nbnn::KdForestIndexParams());
+  index.buildIndex();
+  // The search keeps going until knn points are found, however few
+  // checks are asked for.
+  const size_t knn = 100;
+  flann::Matrix<int> indices(new int[kQueries * knn], kQueries, knn);
+  flann::Matrix<float> dists(new float[kQueries * knn], kQueries, knn);
+  ASSERT_EQ(kQueries * knn,
+            index.knnSearch(queries_, indices, dists, knn,
+                            flann::SearchParams(1)));
+  for (int q = 0; q < kQueries; ++q) {
+    for (size_t k = 1; k < knn; ++k) {
+      ASSERT_LE(dists[q][k - 1], dists[q][k]);
+      ASSERT_NE(indices[q][k - 1], indices[q][k]);
+    }
+  }
+  delete[] indices.ptr();
+  delete[] dists.ptr();
+}
+
+TEST_F(KdForestIndexTest,
+       TestPointsAddedAfterBuildingAreCompared) {
+  flann::Matrix<uint8_t> first_half(data_.ptr(), kRows / 2, kDimensions);
+  flann::Matrix<uint8_t> second_half(data_[kRows / 2], kRows / 2,
+                                     kDimensions);
+  sjm::nbnn::KdForestIndex index(first_half,
+                                 sjm::nbnn::KdForestIndexParams());
+  index.buildIndex();
+  // The added points aren't in the trees until they're rebuilt, which
+  // a rebuild_threshold of 0 never does, so they're compared with
+  // every query.
+  index.addPoints(second_half, 0);
+  ASSERT_EQ(kRows, index.size());
+  // Even with one check, each added point finds itself.
+  flann::Matrix<int> indices(new int[kRows / 2], kRows / 2, 1);
+  flann::Matrix<float> dists(new float[kRows / 2], kRows / 2, 1);
+  index.knnSearch(second_half, indices, dists, 1, flann::SearchParams(1));
+  for (int i = 0; i < kRows / 2; ++i) {
+    ASSERT_EQ(0, dists[i][0]);
+  }
+  delete[] indices.ptr();
+  delete[] dists.ptr();
+}
+
+int main(int argc, char** argv) {
+  google::InitGoogleLogging(argv[0]);
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
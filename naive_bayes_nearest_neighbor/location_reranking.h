@@ -0,0 +1,91 @@
+// Copyright (c) 2011, Sancho McCann
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+
+// - Redistributions of source code must retain the above copyright
+//   notice, this list of conditions and the following disclaimer.
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// Re-ranking of appearance-only nearest neighbors by the
+// alpha-weighted location term. An index built on the 128 appearance
+// dimensions, with the descriptors' (x, y) locations stored beside
+// it, can then serve any alpha: the candidates it returns are
+// re-ranked by exactly the distance that an index built with the
+// location dimensions for that alpha would have used.
+
+#ifndef NAIVE_BAYES_NEAREST_NEIGHBOR_LOCATION_RERANKING_H_
+#define NAIVE_BAYES_NEAREST_NEIGHBOR_LOCATION_RERANKING_H_
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "sift/sift_descriptors.pb.h"
+#include "sift/sift_util.h"
+
+namespace sjm {
+namespace nbnn {
+
+// Appends the descriptor's (x, y) location to the locations.
+inline void AppendLocation(const sjm::sift::SiftDescriptor& descriptor,
+                           std::vector<float>* locations) {
+  locations->push_back(descriptor.x());
+  locations->push_back(descriptor.y());
+}
+
+// Returns the squared distance between the locations' weighted
+// dimensions, as stored by ConvertProtobufDescriptorToWeightedArray.
+inline float WeightedLocationDistance(const float* a, const float* b,
+                                      const float alpha) {
+  const int dx = static_cast<int>(sjm::sift::WeightLocation(a[0], alpha)) -
+      sjm::sift::WeightLocation(b[0], alpha);
+  const int dy = static_cast<int>(sjm::sift::WeightLocation(a[1], alpha)) -
+      sjm::sift::WeightLocation(b[1], alpha);
+  return dx * dx + dy * dy;
+}
+
+// Re-ranks one query's candidates, given their appearance distances,
+// by adding the weighted location distances. The locations hold an
+// (x, y) pair per indexed descriptor. Candidates of -1 (which some
+// indices return when they find fewer) are skipped. On return, ranked
+// holds the (distance, index) pairs in increasing order.
+inline void RerankByLocation(const int* candidates,
+                             const float* appearance_distances,
+                             const size_t num_candidates,
+                             const float* query_location,
+                             const float* locations,
+                             const float alpha,
+                             std::vector<std::pair<float, int> >* ranked) {
+  ranked->clear();
+  for (size_t i = 0; i < num_candidates; ++i) {
+    const int candidate = candidates[i];
+    if (candidate < 0) {
+      continue;
+    }
+    ranked->push_back(std::make_pair(
+        appearance_distances[i] +
+        WeightedLocationDistance(query_location, locations + 2 * candidate,
+                                 alpha),
+        candidate));
+  }
+  std::sort(ranked->begin(), ranked->end());
+}
+}}  // Namespace.
+
+#endif  // NAIVE_BAYES_NEAREST_NEIGHBOR_LOCATION_RERANKING_H_
@@ -25,38 +25,64 @@
 #ifndef NAIVE_BAYES_NEAREST_NEIGHBOR_MERGED_CLASSIFIER_H_
 #define NAIVE_BAYES_NEAREST_NEIGHBOR_MERGED_CLASSIFIER_H_
 
+#include <stdint.h>
+
 #include <algorithm>
+#include <limits>
 #include <map>
-#include <set>
+#include <sstream>
 #include <string>
+#include <typeinfo>
+#include <utility>
 #include <vector>
 
+#include "boost/filesystem.hpp"
+#include "boost/lexical_cast.hpp"
+#include "boost/thread/locks.hpp"
+#include "boost/thread/mutex.hpp"
+#include "boost/thread/shared_mutex.hpp"
 #include "glog/logging.h"
 
+#include "naive_bayes_nearest_neighbor/index_io.h"
+#include "naive_bayes_nearest_neighbor/location_reranking.h"
+#include "naive_bayes_nearest_neighbor/neighbor_list.h"
+#include "naive_bayes_nearest_neighbor/query_batch.h"
 // TODO(sanchom): Extract Result to a common header.
 #include "naive_bayes_nearest_neighbor/nbnn_classifier.h"
 #include "sift/sift_descriptors.pb.h"
+#include "util/growable_matrix.h"
+#include "util/util.h"
 
 namespace sjm {
 namespace nbnn {
 
-class MergedClassifier {
+// The IndexType can be flann::Index<flann::L2<uint8_t> > or any class
+// with the same interface (see nbnn_classifier.h), such as HnswIndex.
+//
+// Data can be added after the index is built: it's inserted into the
+// index, and BuildIndex() can be called again to rebalance the index
+// over all of the data. Classify() (and the other const functions) can
+// be called from other threads during both; they wait only while the
+// new rows or the rebuilt index are put in place.
+template <class IndexType>
+class BasicMergedClassifier {
  public:
-  MergedClassifier() :
+  BasicMergedClassifier() :
       nearest_neighbors_(1),
       background_index_(2),
       alpha_(0), checks_(1), data_size_(0),
-      index_built_(false), data_(NULL), data_dimensions_(0), index_(NULL),
-      params_set_(false) {}
+      index_built_(false), data_dimensions_(0), index_(NULL),
+      params_set_(false), data_mapped_(false), location_candidates_(0),
+      max_descriptors_(
+          sjm::util::GrowableMatrix<uint8_t>::kDefaultMaxRows) {}
 
-  ~MergedClassifier() {
-    if (data_) {
-      delete[] data_->ptr();
-      delete data_;
-    }
+  ~BasicMergedClassifier() {
     if (index_) {
       delete index_;
     }
+    if (data_mapped_) {
+      UnmapDescriptorMatrix(mapped_data_);
+    }
   }
 
   void SetClassifierParams(const int nearest_neighbors,
@@ -72,13 +98,54 @@ class MergedClassifier {
     params_set_ = true;
   }
 
+  // Sets parameters for building the index, in addition to the number
+  // of trees, for IndexTypes other than FLANN's (e.g. HnswIndexParams).
+  void SetIndexParams(const flann::IndexParams& index_params) {
+    index_params_ = index_params;
+  }
+
+  // Builds the index on the descriptors' appearance only, storing
+  // their locations beside it. Classify() then re-ranks the nearest
+  // candidates by appearance with the location term weighted by the
+  // current alpha, so alpha can be changed with SetClassifierParams()
+  // without rebuilding (or can differ from a loaded classifier's). The
+  // results are the same as with the location in the index whenever
+  // each query's true neighbors are among its candidates. Must be
+  // called before adding data.
+  void SetLocationReranking(const int candidates) {
+    CHECK_GT(candidates, 0);
+    CHECK_EQ(0, data_size_) << "Must SetLocationReranking() before adding "
+        "data.";
+    location_candidates_ = candidates;
+  }
+
+  // Sets the most descriptors that can be added. The rows can't move
+  // once an index is built over them, so this is reserved up front,
+  // but it only costs address space. Must be called before adding
+  // data.
+  void SetCapacity(const size_t max_descriptors) {
+    CHECK_EQ(0, data_size_) << "Must SetCapacity() before adding data.";
+    max_descriptors_ = max_descriptors;
+  }
+
+  // Adds the descriptors to the class. After BuildIndex(), they're
+  // also inserted into the index, which searches them from then on,
+  // though it may search them less accurately than a rebuilt index
+  // would. Adding to a loaded classifier first copies its data into
+  // memory.
   void AddData(const std::string& class_name,
                const sjm::sift::DescriptorSet& descriptors) {
     CHECK(params_set_) << "Must SetClassifierParams() before adding data.";
-    class_set_.insert(class_name);
+    boost::mutex::scoped_lock update_lock(update_mutex_);
+    uint16_t class_id;
+    {
+      boost::unique_lock<boost::shared_mutex> lock(mutex_);
+      class_id = InternClass(class_name);
+    }
+    const float indexed_alpha = IndexedAlpha();
     if (descriptors.sift_descriptor_size() > 0 && data_dimensions_ == 0) {
       data_dimensions_ = descriptors.sift_descriptor(0).bin_size();
-      if (alpha_ > 0) {
+      if (indexed_alpha > 0) {
         data_dimensions_ += 2;
       }
     } else if (descriptors.sift_descriptor_size() == 0) {
@@ -86,185 +153,402 @@ class MergedClassifier {
       return;
     }
 
-    if (!data_) {
-      // On the initial AddData, we just allocate enough storage for
-      // 100% of the descriptors.
-      data_ = new flann::Matrix<uint8_t>(
-          new uint8_t[descriptors.sift_descriptor_size() * data_dimensions_],
-          descriptors.sift_descriptor_size(), data_dimensions_);
-    } else {
-      // On subsequent additions, we double the size of the storage
-      // until there's enough storage for the 100% of the additional
-      // data.
-      int required_data_size = data_size_ + descriptors.sift_descriptor_size();
-      // TODO(sanchom): Handle the case where doubling the memory
-      // allocation would fail, and adaptively back-off the requested
-      // amount by calling new(nothrow).
-      while (data_->rows < required_data_size) {
-        uint64_t new_size = data_->rows * 2;
-        LOG(INFO) << "Growing data matrix to " << new_size * data_dimensions_ <<
-            " bytes";
-        flann::Matrix<uint8_t>* larger_data =
-            new flann::Matrix<uint8_t>(new uint8_t[new_size * data_dimensions_],
-                                     new_size, data_dimensions_);
-        // Copy old data into larger data space.
-        std::copy((*data_)[0],
-                  (*data_)[data_->rows - 1] + (data_->cols),
-                  (*larger_data)[0]);
-        // Delete smaller data structure.
-        delete[] data_->ptr();
-        delete data_;
-        // Re-assign pointer to point to new, larger data structure.
-        data_ = larger_data;
-      }
+    CopyMappedData();
+    if (data_.data() == NULL) {
+      data_.Reserve(data_dimensions_, max_descriptors_);
     }
+    CHECK_LE(data_.rows() + descriptors.sift_descriptor_size(),
+             data_.max_rows()) << "The classifier is full. SetCapacity() "
+        "to add more than " << data_.max_rows() << " descriptors.";
+    // The new rows are filled in before taking the lock, since the
+    // index doesn't search them yet.
+    const size_t first_row = data_.rows();
+    data_.AddRows(descriptors.sift_descriptor_size());
+    std::vector<float> locations;
 
     // Put the descriptors into the data.
     for (int i = 0; i < descriptors.sift_descriptor_size(); ++i) {
       int converted_length =
           sjm::sift::ConvertProtobufDescriptorToWeightedArray(
-              descriptors.sift_descriptor(i), alpha_,
-              (*data_)[data_size_]);
+              descriptors.sift_descriptor(i), indexed_alpha,
+              data_[first_row + i]);
       CHECK(converted_length == data_dimensions_) <<
           "Adding data with inconsistent dimensions.";
-      class_vector_.push_back(class_name);
-      ++data_size_;
+      if (location_candidates_ > 0) {
+        AppendLocation(descriptors.sift_descriptor(i), &locations);
+      }
+    }
+
+    boost::unique_lock<boost::shared_mutex> lock(mutex_);
+    class_ids_.insert(class_ids_.end(), descriptors.sift_descriptor_size(),
+                      class_id);
+    locations_.insert(locations_.end(), locations.begin(), locations.end());
+    data_size_ = data_.rows();
+    index_data_ = flann::Matrix<uint8_t>(data_.data(), data_size_,
+                                         data_dimensions_);
+    if (index_built_) {
+      InsertRows(first_row, index_);
     }
   }
 
   int DataSize() const {
+    boost::shared_lock<boost::shared_mutex> lock(mutex_);
     return data_size_;
   }
 
+  // Builds the index over all of the data added so far. Calling it
+  // again rebuilds the index, rebalancing it after AddData() calls
+  // (and releasing a loaded classifier's mapped data). The old index
+  // is searched until the new one is built, and data added in the
+  // meantime is inserted into the new one.
   void BuildIndex() {
-    // First, truncate the data to the actual usage. This
-    // unfortunately requires allocating additional memory, just to
-    // get rid of memory.
-    //
-    // TODO(sanchom): Use realloc here, but it's complicated because
-    // the Matrix object holds pointers to and info about the
-    // allocated memory.
-    flann::Matrix<uint8_t>* truncated_matrix =
-        new flann::Matrix<uint8_t>(new uint8_t[data_size_ * data_dimensions_],
-                                   data_size_, data_dimensions_);
-    // Copy the data into smaller data space.
-    std::copy((*data_)[0],
-              (*data_)[data_size_ - 1] + (data_->cols),
-              (*truncated_matrix)[0]);
-    // Delete original, larger data structure.
-    delete[] data_->ptr();
-    delete data_;
-    // Re-assign pointer to new, smaller data structure.
-    data_ = truncated_matrix;
+    boost::mutex::scoped_lock build_lock(build_mutex_);
+    flann::Matrix<uint8_t> data;
+    {
+      boost::mutex::scoped_lock update_lock(update_mutex_);
+      CopyMappedData();
+      data = flann::Matrix<uint8_t>(data_.data(), data_size_,
+                                    data_dimensions_);
+    }
+    // The index is built directly over the stored rows, which never
+    // move. AddData() only appends rows after them.
     // TODO(sanchom): Make num trees a parameter.
-    index_ = new flann::Index<flann::L2<uint8_t> >(
-        *data_, flann::KDTreeIndexParams(trees_));
-    index_->buildIndex();
+    flann::IndexParams params = flann::KDTreeIndexParams(trees_);
+    params.insert(index_params_.begin(), index_params_.end());
+    IndexType* index = new IndexType(data, params);
+    index->buildIndex();
+    boost::mutex::scoped_lock update_lock(update_mutex_);
+    {
+      boost::unique_lock<boost::shared_mutex> lock(mutex_);
+      InsertRows(data.rows, index);
+      std::swap(index, index_);
+      index_data_ = flann::Matrix<uint8_t>(data_.data(), data_size_,
+                                           data_dimensions_);
+      index_built_ = true;
+    }
+    // The old index was the last user of any mapped rows.
+    delete index;
+    if (data_mapped_) {
+      UnmapDescriptorMatrix(mapped_data_);
+      data_mapped_ = false;
+    }
+  }
+
+  // Saves the data, class labels, and index to the directory, which
+  // is created if needed. Load() restores them without rebuilding
+  // the index.
+  void Save(const std::string& directory) const {
+    boost::shared_lock<boost::shared_mutex> lock(mutex_);
+    CHECK(index_built_) << "Must call .BuildIndex() before .Save()";
+    const boost::filesystem::path root(sjm::util::expand_user(directory));
+    boost::filesystem::create_directories(root);
+    std::map<std::string, std::string> params;
+    params["alpha"] = boost::lexical_cast<std::string>(alpha_);
+    params["trees"] = boost::lexical_cast<std::string>(trees_);
+    params["data_size"] = boost::lexical_cast<std::string>(data_size_);
+    params["locations"] =
+        boost::lexical_cast<std::string>(location_candidates_ > 0);
+    WriteIndexParamsOrDie((root / kIndexParamsName).string(), params);
+    WriteDescriptorMatrixOrDie((root / "data.bin").string(), index_data_);
+    if (location_candidates_ > 0) {
+      sjm::util::WriteStringToFileOrDie(
+          (root / "locations.bin").string(),
+          std::string(reinterpret_cast<const char*>(locations_.data()),
+                      locations_.size() * sizeof(locations_[0])));
+    }
+    std::string class_ids;
+    if (!class_ids_.empty()) {
+      class_ids.assign(reinterpret_cast<const char*>(&class_ids_[0]),
+                       class_ids_.size() * sizeof(class_ids_[0]));
+    }
+    sjm::util::WriteStringToFileOrDie((root / "class_ids.bin").string(),
+                                      class_ids);
+    std::string class_names;
+    for (size_t i = 0; i < class_names_.size(); ++i) {
+      class_names += class_names_[i] + "\n";
+    }
+    sjm::util::WriteStringToFileOrDie((root / "classes.txt").string(),
+                                      class_names);
+    index_->save((root / "index.flann").string());
+  }
+
+  // Loads a classifier saved by Save(). SetClassifierParams() must be
+  // called first with the same alpha that the saved classifier was
+  // built with, and SetLocationReranking() must be called if and only
+  // if it was called for the saved classifier (in which case alpha can
+  // differ). The other parameters only affect Classify(), so they can
+  // differ from the saved ones (the trees can't change).
+  void Load(const std::string& directory) {
+    CHECK(params_set_) << "Must SetClassifierParams() before loading.";
+    CHECK_EQ(0, data_size_) << "Can only load into an empty classifier.";
+    const boost::filesystem::path root(sjm::util::expand_user(directory));
+    std::map<std::string, std::string> params;
+    ReadIndexParamsOrDie((root / kIndexParamsName).string(), &params);
+    const bool locations = params.count("locations") > 0 &&
+        GetIndexParamOrDie<bool>(params, "locations");
+    CHECK_EQ(location_candidates_ > 0, locations) << directory <<
+        (locations ? " was" : " wasn't") << " saved with location reranking.";
+    if (!locations) {
+      CHECK_EQ(alpha_, GetIndexParamOrDie<float>(params, "alpha")) <<
+          directory << " was saved with a different alpha.";
+    }
+    trees_ = GetIndexParamOrDie<int>(params, "trees");
+    mapped_data_ = MapDescriptorMatrixOrDie((root / "data.bin").string());
+    data_mapped_ = true;
+    index_data_ = mapped_data_;
+    data_size_ = index_data_.rows;
+    data_dimensions_ = index_data_.cols;
+    CHECK_EQ(GetIndexParamOrDie<uint64_t>(params, "data_size"), data_size_);
+    std::string class_ids;
+    sjm::util::ReadFileToStringOrDie((root / "class_ids.bin").string(),
+                                     &class_ids);
+    CHECK_EQ(data_size_ * sizeof(uint16_t), class_ids.size());
+    class_ids_.resize(data_size_);
+    if (data_size_ > 0) {
+      memcpy(&class_ids_[0], class_ids.data(), class_ids.size());
+    }
+    if (locations) {
+      std::string location_bytes;
+      sjm::util::ReadFileToStringOrDie((root / "locations.bin").string(),
+                                       &location_bytes);
+      CHECK_EQ(2 * data_size_ * sizeof(float), location_bytes.size());
+      locations_.resize(2 * data_size_);
+      if (data_size_ > 0) {
+        memcpy(&locations_[0], location_bytes.data(), location_bytes.size());
+      }
+    }
+    std::vector<std::string> class_names;
+    sjm::util::ReadLinesFromFileIntoVectorOrDie(
+        (root / "classes.txt").string(), &class_names);
+    for (size_t i = 0; i < class_names.size(); ++i) {
+      CHECK_EQ(i, InternClass(class_names[i]));
+    }
+    index_ = new IndexType(
+        index_data_,
+        flann::SavedIndexParams((root / "index.flann").string()));
     index_built_ = true;
   }
 
   Result Classify(const sjm::sift::DescriptorSet& descriptor_set,
                   const float subsample_percentage) const {
+    NeighborList neighbors;
+    FindNeighbors(descriptor_set, subsample_percentage, background_index_,
+                  &neighbors);
+    return ClassifyNeighbors(neighbors, nearest_neighbors_,
+                             background_index_);
+  }
+
+  // Classifies each of the descriptor sets, as Classify() would, but
+  // with one search of the index for all of them. The buffers are
+  // reused between batches (by each thread), so their memory use is
+  // proportional to the largest batch.
+  std::vector<Result> ClassifyBatch(
+      const std::vector<const sjm::sift::DescriptorSet*>& descriptor_sets,
+      const float subsample_percentage) const {
+    internal::QueryBuffers* buffers = internal::GetQueryBuffers();
+    FindNeighbors(descriptor_sets, subsample_percentage, background_index_,
+                  &buffers->neighbors);
+    std::vector<Result> results;
+    for (size_t i = 0; i < descriptor_sets.size(); ++i) {
+      results.push_back(ClassifyNeighbors(buffers->neighbors[i],
+                                          nearest_neighbors_,
+                                          background_index_));
+    }
+    return results;
+  }
+
+  // Finds the num_neighbors nearest neighbors (capped at the data
+  // size) of a subsample of the descriptors. Classify() is
+  // FindNeighbors() with background_index neighbors, followed by
+  // ClassifyNeighbors(). With an approximate index, the nearest
+  // neighbors can change slightly with num_neighbors.
+  void FindNeighbors(const sjm::sift::DescriptorSet& descriptor_set,
+                     const float subsample_percentage,
+                     const int num_neighbors,
+                     NeighborList* neighbors) const {
+    const std::vector<const sjm::sift::DescriptorSet*> descriptor_sets(
+        1, &descriptor_set);
+    std::vector<NeighborList> found;
+    FindNeighbors(descriptor_sets, subsample_percentage, num_neighbors,
+                  &found);
+    std::swap(*neighbors, found[0]);
+  }
+
+  // As above, for each of the descriptor sets, with one search of the
+  // index for all of them.
+  void FindNeighbors(
+      const std::vector<const sjm::sift::DescriptorSet*>& descriptor_sets,
+      const float subsample_percentage,
+      const int num_neighbors,
+      std::vector<NeighborList>* neighbors) const {
+    boost::shared_lock<boost::shared_mutex> lock(mutex_);
     CHECK(index_built_) << "Must call .BuildIndex() before .Classify()";
-    // We'll fetch background_index_ features for estimation, capped
-    // at the data_size_.
+    // We'll fetch num_neighbors features, capped at the data_size_.
     int b =
-        std::min(data_size_, static_cast<uint64_t>(background_index_));
-    // We'll use nearest_neighbors_ for foreground, capped at b - 1.
-    int k =
-        std::min(b - 1, nearest_neighbors_);
-    // Set up the class distance accumulator.
-    std::map<std::string, float> category_totals;
-    for (std::set<std::string>::const_iterator it = class_set_.begin();
-         it != class_set_.end();
-         ++it) {
-      category_totals[*it] = 0;
+        std::min(data_size_, static_cast<uint64_t>(num_neighbors));
+    // With location reranking, more candidates are fetched by
+    // appearance, and the b nearest after reranking are used.
+    const int num_candidates = std::max(
+        b, static_cast<int>(std::min(
+            data_size_, static_cast<uint64_t>(location_candidates_))));
+    // Put a subsample of the data into one query matrix.
+    internal::QueryBuffers* buffers = internal::GetQueryBuffers();
+    PackQueries(descriptor_sets, IndexedAlpha(), data_dimensions_,
+                subsample_percentage, &buffers->queries,
+                location_candidates_ > 0 ? &buffers->locations : NULL,
+                &buffers->image_rows);
+    const size_t rows = buffers->image_rows.back();
+    buffers->indices.resize(rows * num_candidates);
+    buffers->distances.resize(rows * num_candidates);
+    flann::Matrix<uint8_t> batch_query(buffers->queries.data(), rows,
+                                       data_dimensions_);
+    flann::Matrix<int> nn_index(buffers->indices.data(), rows,
+                                num_candidates);
+    flann::Matrix<float> dists(buffers->distances.data(), rows,
+                               num_candidates);
+    // Execute the query, getting indices and dists.
+    if (rows > 0) {
+      index_->knnSearch(batch_query, nn_index, dists, num_candidates,
+                        flann::SearchParams(checks_));
     }
-    // Set up the data for the batch query.
-    // First, create a temp array for up to as many descriptors as 100%.
-    const size_t kTempSize =
-        descriptor_set.sift_descriptor_size() * data_dimensions_;
-    uint8_t* temp =
-        new uint8_t[kTempSize];
-    // Put a subsample of the data into the temp array.
-    int next_matrix_index = 0;
-    for (int i = 0; i < descriptor_set.sift_descriptor_size(); ++i) {
-      if (std::rand() / static_cast<float>(RAND_MAX) < subsample_percentage) {
-        sjm::sift::ConvertProtobufDescriptorToWeightedArray(
-            descriptor_set.sift_descriptor(i),
-            alpha_,
-            temp + (next_matrix_index * data_dimensions_));
-        ++next_matrix_index;
+    // Scatter each image's rows into its neighbor list.
+    neighbors->resize(descriptor_sets.size());
+    std::vector<std::pair<float, int> > ranked;
+    for (size_t i = 0; i < descriptor_sets.size(); ++i) {
+      NeighborList& list = (*neighbors)[i];
+      const size_t first_row = buffers->image_rows[i];
+      list.rows = buffers->image_rows[i + 1] - first_row;
+      list.neighbors = b;
+      list.classes.resize(list.rows * b);
+      list.distances.resize(list.rows * b);
+      for (size_t row = first_row; row < first_row + list.rows; ++row) {
+        if (location_candidates_ > 0) {
+          RerankByLocation(nn_index[row], dists[row], num_candidates,
+                           &buffers->locations[2 * row], locations_.data(),
+                           alpha_, &ranked);
+          for (int neighbor = 0; neighbor < b; ++neighbor) {
+            if (neighbor < static_cast<int>(ranked.size())) {
+              dists[row][neighbor] = ranked[neighbor].first;
+              nn_index[row][neighbor] = ranked[neighbor].second;
+            } else {
+              dists[row][neighbor] = std::numeric_limits<float>::max();
+              nn_index[row][neighbor] = -1;
+            }
+          }
+        }
+        const size_t offset = (row - first_row) * b;
+        for (int neighbor = 0; neighbor < b; ++neighbor) {
+          const int index = nn_index[row][neighbor];
+          list.classes[offset + neighbor] =
+              index < 0 ? kNoNeighborClass : class_ids_[index];
+          list.distances[offset + neighbor] = dists[row][neighbor];
+        }
       }
     }
-    // Move the actually used data from the temp array into one that
-    // fits.  We don't need to delete this later because it's cleaned up
-    // when we delete[] batch_query->data.
-    const size_t kQuerySize =
-        next_matrix_index * data_dimensions_;
-    uint8_t* query_array =
-        new uint8_t[kQuerySize];
-    std::copy(temp, temp + (next_matrix_index * data_dimensions_),
-              query_array);
-    delete[] temp;
-
-    // Set up the query for k + 1 nn.
-    flann::Matrix<uint8_t> batch_query =
-        flann::Matrix<uint8_t>(query_array,
-                               next_matrix_index,
-                               data_dimensions_);
-    flann::Matrix<int> nn_index(new int[batch_query.rows * b],
-                                batch_query.rows, b);
-    flann::Matrix<float> dists(new float[batch_query.rows * b],
-                               batch_query.rows, b);
-    // Execute the query, getting indices and dists.
-    index_->knnSearch(batch_query, nn_index, dists, b,
-                      flann::SearchParams(checks_));
-    // For each row, make a category adjustment map
-    for (size_t row = 0; row < dists.rows; ++row) {
-      std::map<std::string, float> category_distances;
-      // The k+1st neighbor is used for the background distance.
-      float background_distance = dists[row][b - 1] / 16129.0;
+  }
+
+  // Returns a hash of the indexed data, the classes, and the index's
+  // type and parameters, which identifies the index for keying cached
+  // neighbor lists. The search parameters (checks, and alpha with
+  // location reranking) aren't included. This reads all of the data.
+  uint64_t Fingerprint() const {
+    boost::shared_lock<boost::shared_mutex> lock(mutex_);
+    CHECK(index_built_) << "Must call .BuildIndex() before .Fingerprint()";
+    std::ostringstream description;
+    description << typeid(IndexType).name() << " " << trees_ << " " <<
+        location_candidates_ << " " << data_size_ << " " << data_dimensions_;
+    for (flann::IndexParams::const_iterator it = index_params_.begin();
+         it != index_params_.end(); ++it) {
+      description << " " << it->first << "=" << it->second;
+    }
+    for (size_t i = 0; i < class_names_.size(); ++i) {
+      description << " " << class_names_[i];
+    }
+    const std::string header = description.str();
+    uint64_t hash = sjm::util::Fnv1aHash(header);
+    for (size_t row = 0; row < index_data_.rows; ++row) {
+      hash = sjm::util::Fnv1aHash(index_data_[row], index_data_.cols, hash);
+    }
+    hash = sjm::util::Fnv1aHash(
+        class_ids_.data(), class_ids_.size() * sizeof(class_ids_[0]), hash);
+    return sjm::util::Fnv1aHash(
+        locations_.data(), locations_.size() * sizeof(locations_[0]), hash);
+  }
+
+  // Classifies the query from its neighbors, as found by
+  // FindNeighbors(). The nearest_neighbors nearest are used for the
+  // foreground, and the background_index-th for the background
+  // distance, so the neighbors must include at least background_index
+  // (unless they include all the data). Any nearest_neighbors and
+  // background_index can be used with the same neighbors.
+  Result ClassifyNeighbors(const NeighborList& neighbors,
+                           const int nearest_neighbors,
+                           const int background_index) const {
+    boost::shared_lock<boost::shared_mutex> lock(mutex_);
+    // We'll use background_index features for estimation, capped
+    // at the data_size_.
+    int b =
+        std::min(data_size_, static_cast<uint64_t>(background_index));
+    CHECK_LE(b, static_cast<int>(neighbors.neighbors)) <<
+        "Not enough neighbors for the background index.";
+    // We'll use nearest_neighbors for foreground, capped at b - 1.
+    int k =
+        std::min(b - 1, nearest_neighbors);
+    // Set up the class distance accumulator, indexed by class id.
+    std::vector<float> category_totals(class_names_.size(), 0);
+    // The last row in which each class was seen among the neighbors.
+    std::vector<int> seen_in_row(class_names_.size(), -1);
+    // For each row, adjust the totals of the categories among the
+    // neighbors.
+    for (size_t row = 0; row < neighbors.rows; ++row) {
+      const uint16_t* neighbor_classes =
+          &neighbors.classes[row * neighbors.neighbors];
+      const float* neighbor_distances =
+          &neighbors.distances[row * neighbors.neighbors];
+      // The k+1st neighbor is used for the background distance. If the
+      // index didn't find that many, the farthest one it found is.
+      int background = b - 1;
+      while (background >= 0 &&
+             neighbor_classes[background] == kNoNeighborClass) {
+        --background;
+      }
+      if (background < 0) {
+        continue;
+      }
+      float background_distance = neighbor_distances[background] / 16129.0;
       for (size_t neighbor = 0; neighbor < k; ++neighbor) {
         // Find the category of this neighbor.
-        int neighbor_index = nn_index[row][neighbor];
-        std::string neighbor_class = class_vector_[neighbor_index];
-        // If it's not already been seen,
-        if (category_distances.find(neighbor_class) ==
-            category_distances.end()) {
-          // Put its distance in the map, substracting the background
-          // distance.
+        const uint16_t neighbor_class = neighbor_classes[neighbor];
+        if (neighbor_class == kNoNeighborClass) {
+          break;
+        }
+        // Only the nearest neighbor of each category counts.
+        if (seen_in_row[neighbor_class] != static_cast<int>(row)) {
+          seen_in_row[neighbor_class] = row;
+          // Adjust its total by its distance, substracting the
+          // background distance.
 
           // This scales down the distance to be as if the original values
           // had been in [0,1] instead of in [0,127]. Useful in order to
           // avoid overflow errors in some of the probability estimate
           // models. (16129 = 127 * 127
-          float distance_squared = dists[row][neighbor] / 16129.0;
-          category_distances[neighbor_class] =
+          float distance_squared = neighbor_distances[neighbor] / 16129.0;
+          category_totals[neighbor_class] +=
               distance_squared - background_distance;
         }
       }
-      // Now, adjust the distance totals.
-      for (std::map<std::string, float>::const_iterator it =
-               category_distances.begin();
-           it != category_distances.end();
-           ++it) {
-        category_totals[it->first] += it->second;
-      }
     }
-    delete[] batch_query.ptr();
-    delete[] nn_index.ptr();
-    delete[] dists.ptr();
 
-    // Get the result.
+    // Get the result. The classes are compared in name order, so
+    // ties go to the first name.
     std::string best_class = "";
     float smallest_distance = 99999999999;
-    for (std::map<std::string, float>::const_iterator it =
-             category_totals.begin();
-         it != category_totals.end(); ++it) {
-      if (it->second < smallest_distance) {
+    for (std::map<std::string, uint16_t>::const_iterator it =
+             class_id_map_.begin();
+         it != class_id_map_.end(); ++it) {
+      if (category_totals[it->second] < smallest_distance) {
         best_class = it->first;
-        smallest_distance = it->second;
+        smallest_distance = category_totals[it->second];
       }
     }
     Result result;
@@ -272,20 +556,96 @@ class MergedClassifier {
     return result;
   }
  private:
+  // Returns the alpha that the location is weighted by in the index.
+  float IndexedAlpha() const {
+    return location_candidates_ > 0 ? 0 : alpha_;
+  }
+
+  // Copies the mapped rows of a loaded classifier into data_, if they
+  // haven't been, so that rows can be added after them. The index
+  // keeps searching the mapped rows until it's rebuilt.
+  void CopyMappedData() {
+    if (!data_mapped_ || data_.data() != NULL || data_size_ == 0) {
+      return;
+    }
+    data_.Reserve(data_dimensions_,
+                  std::max(max_descriptors_, static_cast<size_t>(data_size_)));
+    data_.AddRows(data_size_);
+    memcpy(data_.data(), mapped_data_.ptr(), data_size_ * data_dimensions_);
+  }
+
+  // Inserts the rows of data_ from first_row on into the index.
+  void InsertRows(const size_t first_row, IndexType* index) {
+    if (data_size_ > first_row) {
+      // A rebuild threshold of 0 means that FLANN never rebuilds the
+      // index here, where Classify() would have to wait for it.
+      index->addPoints(
+          flann::Matrix<uint8_t>(data_[first_row], data_size_ - first_row,
+                                 data_dimensions_),
+          0);
+    }
+  }
+
+  // Returns the id of the class, assigning the next one if it's new.
+  uint16_t InternClass(const std::string& class_name) {
+    std::map<std::string, uint16_t>::const_iterator it =
+        class_id_map_.find(class_name);
+    if (it != class_id_map_.end()) {
+      return it->second;
+    }
+    CHECK_LT(class_names_.size(), std::numeric_limits<uint16_t>::max()) <<
+        "Too many classes.";
+    const uint16_t class_id = class_names_.size();
+    class_names_.push_back(class_name);
+    class_id_map_[class_name] = class_id;
+    return class_id;
+  }
+
   int nearest_neighbors_;
   int background_index_;
   float alpha_;
   int checks_;
   uint64_t data_size_;
   bool index_built_;
-  flann::Matrix<uint8_t>* data_;
+  sjm::util::GrowableMatrix<uint8_t> data_;
+  // All of the rows: either the rows of data_, or the rows mapped by
+  // Load() if none have been added since.
+  flann::Matrix<uint8_t> index_data_;
+  // The rows mapped by Load(), while data_mapped_.
+  flann::Matrix<uint8_t> mapped_data_;
   int data_dimensions_;
-  flann::Index<flann::L2<uint8_t> >* index_;
+  IndexType* index_;
   bool params_set_;
+  bool data_mapped_;
   int trees_;
-  std::vector<std::string> class_vector_;
-  std::set<std::string> class_set_;
+  flann::IndexParams index_params_;
+  // The class id of each descriptor in data_.
+  std::vector<uint16_t> class_ids_;
+  // The class names, indexed by id.
+  std::vector<std::string> class_names_;
+  std::map<std::string, uint16_t> class_id_map_;
+  // The number of candidates reranked by location, or 0 if the
+  // location is in the index.
+  int location_candidates_;
+  // The (x, y) location of each descriptor in data_, with location
+  // reranking.
+  std::vector<float> locations_;
+  // The most rows that data_ can hold (see SetCapacity()).
+  size_t max_descriptors_;
+  // Guards the index and the class and row data that searches read.
+  // Searches share it, and AddData() and BuildIndex() hold it only
+  // while putting new rows or the rebuilt index in place.
+  mutable boost::shared_mutex mutex_;
+  // Held while rows are added to data_, so that only one thread adds
+  // them at a time.
+  boost::mutex update_mutex_;
+  // Held while building the index, so that only one thread builds it
+  // at a time.
+  boost::mutex build_mutex_;
 };
+
+typedef BasicMergedClassifier<flann::Index<flann::L2<uint8_t> > >
+    MergedClassifier;
 }}  // Namespace.
 
 #endif  // NAIVE_BAYES_NEAREST_NEIGHBOR_MERGED_CLASSIFIER_H_
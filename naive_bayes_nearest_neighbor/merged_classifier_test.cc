@@ -24,17 +24,73 @@
 
 #include "naive_bayes_nearest_neighbor/merged_classifier.h"
 
+#include <stdint.h>
+
+#include <algorithm>
+#include <limits>
+
+#include "boost/bind.hpp"
+#include "boost/thread.hpp"
 #include "glog/logging.h"
 #include "gtest/gtest.h"
 
 #include "flann/flann.hpp"
 
+#include "naive_bayes_nearest_neighbor/brute_force_index.h"
 #include "sift/sift_descriptors.pb.h"
 #include "sift/sift_util.h"
 
 class MergedClassifierTest : public ::testing::Test {
 };
 
+namespace {
+typedef sjm::nbnn::BasicMergedClassifier<sjm::nbnn::BruteForceIndex>
+    ExactMergedClassifier;
+
+// An exact index that only ever finds the two nearest neighbors,
+// padding the rest with -1 as the IndexType contract allows.
+class TwoNeighborIndex : public sjm::nbnn::BruteForceIndex {
+ public:
+  TwoNeighborIndex(const flann::Matrix<uint8_t>& data,
+                   const flann::IndexParams& params)
+      : sjm::nbnn::BruteForceIndex(data, params) {}
+
+  int knnSearch(const flann::Matrix<uint8_t>& queries,
+                flann::Matrix<int>& indices,
+                flann::Matrix<float>& dists,
+                size_t knn,
+                const flann::SearchParams& params) const {
+    sjm::nbnn::BruteForceIndex::knnSearch(queries, indices, dists, knn,
+                                          params);
+    for (size_t q = 0; q < queries.rows; ++q) {
+      for (size_t k = 2; k < knn; ++k) {
+        indices[q][k] = -1;
+        dists[q][k] = std::numeric_limits<float>::max();
+      }
+    }
+    return std::min(knn, static_cast<size_t>(2)) * queries.rows;
+  }
+};
+
+// Classifies the query until told to stop, failing if it's ever
+// classified as anything but the category.
+void ClassifyUntilStopped(const ExactMergedClassifier* classifier,
+                          const sjm::sift::DescriptorSet* query,
+                          const std::string category,
+                          const bool* stop,
+                          boost::mutex* stop_mutex) {
+  while (true) {
+    {
+      boost::mutex::scoped_lock lock(*stop_mutex);
+      if (*stop) {
+        return;
+      }
+    }
+    ASSERT_EQ(category, classifier->Classify(*query, 1.0).category);
+  }
+}
+}  // namespace
+
 TEST_F(MergedClassifierTest,
        TestConstructor) {
   sjm::nbnn::MergedClassifier classifier;
@@ -69,6 +125,39 @@ TEST_F(MergedClassifierTest,
   ASSERT_EQ(5596 + 5471, classifier.DataSize());
 }
 
+TEST_F(MergedClassifierTest,
+       TestClassifyWithMissingNeighbors) {
+  sjm::sift::DescriptorSet faces_descriptors;
+  sjm::sift::ReadDescriptorSetFromFile(
+      "../naive_bayes_nearest_neighbor/test_data/caltech_faces_set.sift",
+      &faces_descriptors);
+  sjm::sift::DescriptorSet emu_descriptors;
+  sjm::sift::ReadDescriptorSetFromFile(
+      "../naive_bayes_nearest_neighbor/test_data/caltech_emu_set.sift",
+      &emu_descriptors);
+  sjm::sift::DescriptorSet faces_query;
+  for (int i = 0; i < 5; ++i) {
+    faces_query.add_sift_descriptor()->CopyFrom(
+        faces_descriptors.sift_descriptor(i));
+  }
+  // With and without location reranking, the neighbors the index
+  // doesn't find are skipped.
+  for (int candidates = 0; candidates <= 10; candidates += 10) {
+    sjm::nbnn::BasicMergedClassifier<TwoNeighborIndex> classifier;
+    classifier.SetClassifierParams(5, 5 + 1, 0, 1, 1);
+    if (candidates > 0) {
+      classifier.SetLocationReranking(candidates);
+    }
+    classifier.AddData("Faces", faces_descriptors);
+    classifier.AddData("Emu", emu_descriptors);
+    classifier.BuildIndex();
+    sjm::nbnn::NeighborList neighbors;
+    classifier.FindNeighbors(faces_query, 1.0, 6, &neighbors);
+    ASSERT_EQ(sjm::nbnn::kNoNeighborClass, neighbors.classes[2]);
+    ASSERT_EQ("Faces", classifier.ClassifyNeighbors(neighbors, 5, 6).category);
+  }
+}
+
 TEST_F(MergedClassifierTest,
        TestDieWhenClassifyBeforeBuild) {
   sjm::nbnn::MergedClassifier classifier;
@@ -91,6 +180,20 @@ TEST_F(MergedClassifierTest,
   ASSERT_DEATH(classifier.Classify(query, 1.0), ".*");
 }
 
+TEST_F(MergedClassifierTest,
+       TestDieWhenAddingPastCapacity) {
+  sjm::nbnn::MergedClassifier classifier;
+  sjm::sift::DescriptorSet faces_descriptors;
+  sjm::sift::ReadDescriptorSetFromFile(
+      "../naive_bayes_nearest_neighbor/test_data/caltech_faces_set.sift",
+      &faces_descriptors);
+  classifier.SetClassifierParams(5, 5 + 1, 1.5, 32, 2);
+  classifier.SetCapacity(faces_descriptors.sift_descriptor_size());
+  classifier.AddData("Faces", faces_descriptors);
+  ASSERT_EQ(faces_descriptors.sift_descriptor_size(), classifier.DataSize());
+  ASSERT_DEATH(classifier.AddData("Faces", faces_descriptors), ".*");
+}
+
 TEST_F(MergedClassifierTest,
        TestClassifyWorks) {
   sjm::nbnn::MergedClassifier classifier;
@@ -123,6 +226,276 @@ TEST_F(MergedClassifierTest,
   ASSERT_EQ(result2.category, "Emu");
 }
 
+TEST_F(MergedClassifierTest,
+       TestSaveAndLoad) {
+  sjm::sift::DescriptorSet faces_descriptors;
+  sjm::sift::ReadDescriptorSetFromFile(
+      "../naive_bayes_nearest_neighbor/test_data/caltech_faces_set.sift",
+      &faces_descriptors);
+  sjm::sift::DescriptorSet emu_descriptors;
+  sjm::sift::ReadDescriptorSetFromFile(
+      "../naive_bayes_nearest_neighbor/test_data/caltech_emu_set.sift",
+      &emu_descriptors);
+  {
+    sjm::nbnn::MergedClassifier classifier;
+    classifier.SetClassifierParams(5, 5 + 1, 1.5, 32, 2);
+    classifier.AddData("Faces", faces_descriptors);
+    classifier.AddData("Emu", emu_descriptors);
+    classifier.BuildIndex();
+    classifier.Save("/tmp/merged_classifier_test_index");
+  }
+  sjm::nbnn::MergedClassifier loaded;
+  loaded.SetClassifierParams(5, 5 + 1, 1.5, 32, 2);
+  loaded.Load("/tmp/merged_classifier_test_index");
+  ASSERT_EQ(5596 + 5471, loaded.DataSize());
+  sjm::sift::DescriptorSet faces_query;
+  sjm::sift::DescriptorSet emu_query;
+  for (int i = 0; i < 5; ++i) {
+    faces_query.add_sift_descriptor()->CopyFrom(
+        faces_descriptors.sift_descriptor(i));
+    emu_query.add_sift_descriptor()->CopyFrom(
+        emu_descriptors.sift_descriptor(i));
+  }
+  ASSERT_EQ("Faces", loaded.Classify(faces_query, 1.0).category);
+  ASSERT_EQ("Emu", loaded.Classify(emu_query, 1.0).category);
+
+  // The saved index can't be used with a different alpha.
+  sjm::nbnn::MergedClassifier wrong_alpha;
+  wrong_alpha.SetClassifierParams(5, 5 + 1, 0, 32, 2);
+  ASSERT_DEATH(wrong_alpha.Load("/tmp/merged_classifier_test_index"), ".*");
+}
+
+TEST_F(MergedClassifierTest,
+       TestLocationRerankingMatchesWeightedIndex) {
+  sjm::sift::DescriptorSet faces_descriptors;
+  sjm::sift::ReadDescriptorSetFromFile(
+      "../naive_bayes_nearest_neighbor/test_data/caltech_faces_set.sift",
+      &faces_descriptors);
+  sjm::sift::DescriptorSet emu_descriptors;
+  sjm::sift::ReadDescriptorSetFromFile(
+      "../naive_bayes_nearest_neighbor/test_data/caltech_emu_set.sift",
+      &emu_descriptors);
+  // With every descriptor as a candidate, the reranking is exact, so
+  // one appearance index matches the exact index built for each
+  // alpha.
+  sjm::nbnn::BasicMergedClassifier<sjm::nbnn::BruteForceIndex> reranked;
+  reranked.SetClassifierParams(5, 5 + 1, 0, 1, 1);
+  reranked.SetLocationReranking(5596 + 5471);
+  reranked.AddData("Faces", faces_descriptors);
+  reranked.AddData("Emu", emu_descriptors);
+  reranked.BuildIndex();
+  reranked.Save("/tmp/merged_classifier_test_reranked_index");
+  const float kAlphas[] = {0, 0.5, 1.5};
+  for (int a = 0; a < 3; ++a) {
+    sjm::nbnn::BasicMergedClassifier<sjm::nbnn::BruteForceIndex> weighted;
+    weighted.SetClassifierParams(5, 5 + 1, kAlphas[a], 1, 1);
+    weighted.AddData("Faces", faces_descriptors);
+    weighted.AddData("Emu", emu_descriptors);
+    weighted.BuildIndex();
+    reranked.SetClassifierParams(5, 5 + 1, kAlphas[a], 1, 1);
+    sjm::nbnn::BasicMergedClassifier<sjm::nbnn::BruteForceIndex> loaded;
+    loaded.SetClassifierParams(5, 5 + 1, kAlphas[a], 1, 1);
+    loaded.SetLocationReranking(5596 + 5471);
+    loaded.Load("/tmp/merged_classifier_test_reranked_index");
+    // Each query mixes descriptors from both classes, so that the
+    // result depends on the distances.
+    for (int q = 0; q < 10; ++q) {
+      sjm::sift::DescriptorSet query;
+      for (int i = 0; i < 3; ++i) {
+        query.add_sift_descriptor()->CopyFrom(
+            faces_descriptors.sift_descriptor(100 * q + 7 * i));
+        query.add_sift_descriptor()->CopyFrom(
+            emu_descriptors.sift_descriptor(100 * q + 11 * i));
+      }
+      const std::string expected = weighted.Classify(query, 1.0).category;
+      ASSERT_EQ(expected, reranked.Classify(query, 1.0).category);
+      ASSERT_EQ(expected, loaded.Classify(query, 1.0).category);
+    }
+  }
+}
+
+TEST_F(MergedClassifierTest,
+       TestClassifyCachedNeighbors) {
+  sjm::sift::DescriptorSet faces_descriptors;
+  sjm::sift::ReadDescriptorSetFromFile(
+      "../naive_bayes_nearest_neighbor/test_data/caltech_faces_set.sift",
+      &faces_descriptors);
+  sjm::sift::DescriptorSet emu_descriptors;
+  sjm::sift::ReadDescriptorSetFromFile(
+      "../naive_bayes_nearest_neighbor/test_data/caltech_emu_set.sift",
+      &emu_descriptors);
+  sjm::nbnn::BasicMergedClassifier<sjm::nbnn::BruteForceIndex> classifier;
+  classifier.SetClassifierParams(5, 5 + 1, 1.5, 1, 1);
+  classifier.AddData("Faces", faces_descriptors);
+  classifier.AddData("Emu", emu_descriptors);
+  classifier.BuildIndex();
+  sjm::sift::DescriptorSet query;
+  for (int i = 0; i < 10; ++i) {
+    query.add_sift_descriptor()->CopyFrom(
+        faces_descriptors.sift_descriptor(13 * i));
+    query.add_sift_descriptor()->CopyFrom(
+        emu_descriptors.sift_descriptor(17 * i));
+  }
+  sjm::nbnn::NeighborList neighbors;
+  classifier.FindNeighbors(query, 1.0, 20, &neighbors);
+  ASSERT_EQ(20, neighbors.rows);
+  ASSERT_EQ(20, neighbors.neighbors);
+
+  // The cached neighbors can only be read with the same key.
+  const std::string cache_file = sjm::nbnn::NeighborCacheFilename(
+      "/tmp", "merged_classifier_test");
+  sjm::nbnn::WriteNeighborListOrDie(cache_file, "merged_classifier_test",
+                                    neighbors);
+  sjm::nbnn::NeighborList cached;
+  ASSERT_FALSE(sjm::nbnn::ReadNeighborList(cache_file, "another key",
+                                           &cached));
+  ASSERT_TRUE(sjm::nbnn::ReadNeighborList(cache_file,
+                                          "merged_classifier_test", &cached));
+  ASSERT_EQ(neighbors.classes, cached.classes);
+  ASSERT_EQ(neighbors.distances, cached.distances);
+
+  // Any k and b up to 20 neighbors scores the same as searching with
+  // them.
+  const int kKs[] = {2, 5, 10};
+  const int kBs[] = {1, 4, 10};
+  for (int i = 0; i < 3; ++i) {
+    for (int j = 0; j < 3; ++j) {
+      classifier.SetClassifierParams(kKs[i], kKs[i] + kBs[j], 1.5, 1, 1);
+      ASSERT_EQ(classifier.Classify(query, 1.0).category,
+                classifier.ClassifyNeighbors(cached, kKs[i],
+                                             kKs[i] + kBs[j]).category);
+    }
+  }
+  // There aren't enough neighbors for a larger b.
+  ASSERT_DEATH(classifier.ClassifyNeighbors(cached, 10, 21), ".*");
+}
+
+TEST_F(MergedClassifierTest,
+       TestClassifyBatch) {
+  sjm::sift::DescriptorSet faces_descriptors;
+  sjm::sift::ReadDescriptorSetFromFile(
+      "../naive_bayes_nearest_neighbor/test_data/caltech_faces_set.sift",
+      &faces_descriptors);
+  sjm::sift::DescriptorSet emu_descriptors;
+  sjm::sift::ReadDescriptorSetFromFile(
+      "../naive_bayes_nearest_neighbor/test_data/caltech_emu_set.sift",
+      &emu_descriptors);
+  sjm::nbnn::BasicMergedClassifier<sjm::nbnn::BruteForceIndex> classifier;
+  classifier.SetClassifierParams(5, 5 + 1, 1.5, 1, 1);
+  classifier.AddData("Faces", faces_descriptors);
+  classifier.AddData("Emu", emu_descriptors);
+  classifier.BuildIndex();
+  // Queries that mix the two classes in different proportions.
+  std::vector<sjm::sift::DescriptorSet> queries(8);
+  std::vector<const sjm::sift::DescriptorSet*> batch;
+  for (int q = 0; q < 8; ++q) {
+    for (int i = 0; i < 8; ++i) {
+      const sjm::sift::DescriptorSet& source =
+          i < q ? faces_descriptors : emu_descriptors;
+      queries[q].add_sift_descriptor()->CopyFrom(
+          source.sift_descriptor(31 * q + 5 * i));
+    }
+    batch.push_back(&queries[q]);
+  }
+  const std::vector<sjm::nbnn::Result> results =
+      classifier.ClassifyBatch(batch, 1.0);
+  ASSERT_EQ(8, results.size());
+  for (int q = 0; q < 8; ++q) {
+    ASSERT_EQ(classifier.Classify(queries[q], 1.0).category,
+              results[q].category);
+  }
+  ASSERT_EQ("Emu", results[0].category);
+  ASSERT_EQ("Faces", results[7].category);
+}
+
+TEST_F(MergedClassifierTest,
+       TestAddDataAfterBuildIndex) {
+  sjm::sift::DescriptorSet faces_descriptors;
+  sjm::sift::ReadDescriptorSetFromFile(
+      "../naive_bayes_nearest_neighbor/test_data/caltech_faces_set.sift",
+      &faces_descriptors);
+  sjm::sift::DescriptorSet emu_descriptors;
+  sjm::sift::ReadDescriptorSetFromFile(
+      "../naive_bayes_nearest_neighbor/test_data/caltech_emu_set.sift",
+      &emu_descriptors);
+  ExactMergedClassifier rebuilt;
+  rebuilt.SetClassifierParams(5, 5 + 1, 1.5, 1, 1);
+  rebuilt.AddData("Faces", faces_descriptors);
+  rebuilt.AddData("Emu", emu_descriptors);
+  rebuilt.BuildIndex();
+  sjm::sift::DescriptorSet faces_query;
+  sjm::sift::DescriptorSet emu_query;
+  for (int i = 0; i < 5; ++i) {
+    faces_query.add_sift_descriptor()->CopyFrom(
+        faces_descriptors.sift_descriptor(i));
+    emu_query.add_sift_descriptor()->CopyFrom(
+        emu_descriptors.sift_descriptor(i));
+  }
+
+  ExactMergedClassifier incremental;
+  incremental.SetClassifierParams(5, 5 + 1, 1.5, 1, 1);
+  incremental.AddData("Faces", faces_descriptors);
+  incremental.BuildIndex();
+  ASSERT_EQ("Faces", incremental.Classify(emu_query, 1.0).category);
+  // Queries keep being answered while the class is added and the
+  // index is rebuilt.
+  bool stop = false;
+  boost::mutex stop_mutex;
+  boost::thread classifying(boost::bind(&ClassifyUntilStopped, &incremental,
+                                        &faces_query, "Faces", &stop,
+                                        &stop_mutex));
+  incremental.AddData("Emu", emu_descriptors);
+  ASSERT_EQ(rebuilt.DataSize(), incremental.DataSize());
+  ASSERT_EQ(rebuilt.Fingerprint(), incremental.Fingerprint());
+  ASSERT_EQ("Emu", incremental.Classify(emu_query, 1.0).category);
+  incremental.BuildIndex();
+  ASSERT_EQ("Emu", incremental.Classify(emu_query, 1.0).category);
+  {
+    boost::mutex::scoped_lock lock(stop_mutex);
+    stop = true;
+  }
+  classifying.join();
+}
+
+TEST_F(MergedClassifierTest,
+       TestAddDataToLoadedClassifier) {
+  sjm::sift::DescriptorSet faces_descriptors;
+  sjm::sift::ReadDescriptorSetFromFile(
+      "../naive_bayes_nearest_neighbor/test_data/caltech_faces_set.sift",
+      &faces_descriptors);
+  sjm::sift::DescriptorSet emu_descriptors;
+  sjm::sift::ReadDescriptorSetFromFile(
+      "../naive_bayes_nearest_neighbor/test_data/caltech_emu_set.sift",
+      &emu_descriptors);
+  ExactMergedClassifier rebuilt;
+  rebuilt.SetClassifierParams(5, 5 + 1, 1.5, 1, 1);
+  rebuilt.AddData("Faces", faces_descriptors);
+  rebuilt.AddData("Emu", emu_descriptors);
+  rebuilt.BuildIndex();
+  {
+    ExactMergedClassifier faces;
+    faces.SetClassifierParams(5, 5 + 1, 1.5, 1, 1);
+    faces.AddData("Faces", faces_descriptors);
+    faces.BuildIndex();
+    faces.Save("/tmp/merged_classifier_test_incremental_index");
+  }
+  ExactMergedClassifier loaded;
+  loaded.SetClassifierParams(5, 5 + 1, 1.5, 1, 1);
+  loaded.Load("/tmp/merged_classifier_test_incremental_index");
+  loaded.AddData("Emu", emu_descriptors);
+  ASSERT_EQ(rebuilt.Fingerprint(), loaded.Fingerprint());
+  sjm::sift::DescriptorSet emu_query;
+  for (int i = 0; i < 5; ++i) {
+    emu_query.add_sift_descriptor()->CopyFrom(
+        emu_descriptors.sift_descriptor(i));
+  }
+  ASSERT_EQ("Emu", loaded.Classify(emu_query, 1.0).category);
+  // Rebuilding releases the mapped rows.
+  loaded.BuildIndex();
+  ASSERT_EQ(rebuilt.Fingerprint(), loaded.Fingerprint());
+  ASSERT_EQ("Emu", loaded.Classify(emu_query, 1.0).category);
+}
+
 // TODO(sanchom): Test checks for insertion of inconsistent
 // descriptors.
 
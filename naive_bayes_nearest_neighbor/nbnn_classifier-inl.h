@@ -26,21 +26,56 @@
 #define NAIVE_BAYES_NEAREST_NEIGHBOR_NBNN_CLASSIFIER_INL_H_
 
 #include <algorithm>
+#include <cmath>
 #include <cstdlib>
+#include <cstring>
 #include <map>
 #include <string>
+#include <utility>
 #include <vector>
 
+#include "boost/bind.hpp"
+#include "boost/filesystem.hpp"
+#include "boost/lexical_cast.hpp"
+
 #include "glog/logging.h"
 
 #include "flann/flann.hpp"
 
+#include "naive_bayes_nearest_neighbor/index_io.h"
+#include "naive_bayes_nearest_neighbor/location_reranking.h"
+#include "naive_bayes_nearest_neighbor/query_batch.h"
 #include "sift/sift_descriptors.pb.h"
 #include "sift/sift_util.h"
+#include "util/thread_pool.h"
 
 namespace sjm {
 namespace nbnn {
 
+namespace internal {
+
+// Anytime classification doesn't drop classes until they've been
+// searched with this many queries, so that the distances' sample
+// variances are reliable.
+const size_t kMinAnytimeQueries = 30;
+
+// Returns the z for which a standard normal variable exceeds z with
+// the probability.
+inline double NormalUpperQuantile(const double probability) {
+  double low = 0;
+  double high = 40;
+  for (int i = 0; i < 100; ++i) {
+    const double middle = (low + high) / 2;
+    if (0.5 * std::erfc(middle / std::sqrt(2.0)) > probability) {
+      low = middle;
+    } else {
+      high = middle;
+    }
+  }
+  return high;
+}
+}  // namespace internal.
+
 template <typename IndexType>
 NbnnClassifier<IndexType>::~NbnnClassifier() {
   for (typename std::map<std::string, IndexType*>::iterator it =
@@ -50,6 +85,10 @@ NbnnClassifier<IndexType>::~NbnnClassifier() {
     delete it->second;
   }
   indices_.clear();
+  for (size_t i = 0; i < mapped_data_.size(); ++i) {
+    UnmapDescriptorMatrix(mapped_data_[i]);
+  }
+  delete pool_;
 }
 
 template <typename IndexType>
@@ -73,6 +112,32 @@ void NbnnClassifier<IndexType>::SetClassificationParams(
   checks_ = checks;
 }
 
+template <typename IndexType>
+void NbnnClassifier<IndexType>::SetNumThreads(const int num_threads) {
+  CHECK_GT(num_threads, 0);
+  num_threads_ = num_threads;
+  delete pool_;
+  pool_ = num_threads > 1 ? new sjm::util::ThreadPool(num_threads) : NULL;
+}
+
+template <typename IndexType>
+void NbnnClassifier<IndexType>::SetAnytimeParams(const int batch_size,
+                                                 const float error_tolerance) {
+  CHECK_GT(batch_size, 0);
+  CHECK_GE(error_tolerance, 0);
+  CHECK_LT(error_tolerance, 0.5);
+  anytime_batch_size_ = batch_size;
+  anytime_error_tolerance_ = error_tolerance;
+}
+
+template <typename IndexType>
+void NbnnClassifier<IndexType>::SetLocationReranking(const int candidates) {
+  CHECK_GT(candidates, 0);
+  CHECK(class_list_.empty()) << "Must SetLocationReranking() before adding "
+      "classes.";
+  location_candidates_ = candidates;
+}
+
 template <typename IndexType>
 void NbnnClassifier<IndexType>::AddClass(const std::string& class_name,
                                          IndexType* index) {
@@ -82,6 +147,102 @@ void NbnnClassifier<IndexType>::AddClass(const std::string& class_name,
   indices_[class_name] = index;
 }
 
+template <typename IndexType>
+void NbnnClassifier<IndexType>::AddClass(const std::string& class_name,
+                                         IndexType* index,
+                                         const flann::Matrix<uint8_t>& data) {
+  AddClass(class_name, index);
+  class_data_[class_name] = data;
+}
+
+template <typename IndexType>
+void NbnnClassifier<IndexType>::AddClass(const std::string& class_name,
+                                         IndexType* index,
+                                         const flann::Matrix<uint8_t>& data,
+                                         const std::vector<float>& locations) {
+  CHECK_GT(location_candidates_, 0) << "Locations are only used with "
+      "location reranking.";
+  CHECK_EQ(2 * data.rows, locations.size());
+  AddClass(class_name, index, data);
+  class_locations_[class_name] = locations;
+}
+
+template <typename IndexType>
+void NbnnClassifier<IndexType>::Save(const std::string& directory) const {
+  const boost::filesystem::path root(sjm::util::expand_user(directory));
+  boost::filesystem::create_directories(root);
+  std::map<std::string, std::string> params;
+  params["alpha"] = boost::lexical_cast<std::string>(alpha_);
+  params["locations"] =
+      boost::lexical_cast<std::string>(location_candidates_ > 0);
+  WriteIndexParamsOrDie((root / kIndexParamsName).string(), params);
+  std::string class_names;
+  for (size_t i = 0; i < class_list_.size(); ++i) {
+    const std::string& class_name = class_list_[i];
+    typename std::map<std::string, flann::Matrix<uint8_t> >::const_iterator
+        data = class_data_.find(class_name);
+    CHECK(data != class_data_.end()) <<
+        "Class " << class_name << " was added without its data.";
+    const std::string stem = "class_" + boost::lexical_cast<std::string>(i);
+    WriteDescriptorMatrixOrDie((root / (stem + ".data")).string(),
+                               data->second);
+    indices_.find(class_name)->second->save(
+        (root / (stem + ".flann")).string());
+    if (location_candidates_ > 0) {
+      const std::vector<float>& locations =
+          class_locations_.find(class_name)->second;
+      sjm::util::WriteStringToFileOrDie(
+          (root / (stem + ".locations")).string(),
+          std::string(reinterpret_cast<const char*>(locations.data()),
+                      locations.size() * sizeof(locations[0])));
+    }
+    class_names += class_name + "\n";
+  }
+  sjm::util::WriteStringToFileOrDie((root / "classes.txt").string(),
+                                    class_names);
+}
+
+template <typename IndexType>
+void NbnnClassifier<IndexType>::Load(const std::string& directory) {
+  CHECK(class_list_.empty()) << "Can only load into an empty classifier.";
+  const boost::filesystem::path root(sjm::util::expand_user(directory));
+  std::map<std::string, std::string> params;
+  ReadIndexParamsOrDie((root / kIndexParamsName).string(), &params);
+  const bool locations = params.count("locations") > 0 &&
+      GetIndexParamOrDie<bool>(params, "locations");
+  CHECK_EQ(location_candidates_ > 0, locations) << directory <<
+      (locations ? " was" : " wasn't") << " saved with location reranking.";
+  if (!locations) {
+    CHECK_EQ(alpha_, GetIndexParamOrDie<float>(params, "alpha")) <<
+        directory << " was saved with a different alpha.";
+  }
+  std::vector<std::string> class_names;
+  sjm::util::ReadLinesFromFileIntoVectorOrDie(
+      (root / "classes.txt").string(), &class_names);
+  for (size_t i = 0; i < class_names.size(); ++i) {
+    const std::string stem = "class_" + boost::lexical_cast<std::string>(i);
+    const flann::Matrix<uint8_t> data =
+        MapDescriptorMatrixOrDie((root / (stem + ".data")).string());
+    mapped_data_.push_back(data);
+    IndexType* index = new IndexType(
+        data, flann::SavedIndexParams((root / (stem + ".flann")).string()));
+    if (!locations) {
+      AddClass(class_names[i], index, data);
+      continue;
+    }
+    std::string location_bytes;
+    sjm::util::ReadFileToStringOrDie((root / (stem + ".locations")).string(),
+                                     &location_bytes);
+    CHECK_EQ(2 * data.rows * sizeof(float), location_bytes.size());
+    std::vector<float> class_locations(2 * data.rows);
+    if (data.rows > 0) {
+      memcpy(&class_locations[0], location_bytes.data(),
+             location_bytes.size());
+    }
+    AddClass(class_names[i], index, data, class_locations);
+  }
+}
+
 template <typename IndexType>
 Result NbnnClassifier<IndexType>::Classify(
     const sjm::sift::DescriptorSet& descriptor_set) const {
@@ -92,16 +253,13 @@ template <typename IndexType>
 Result NbnnClassifier<IndexType>::Classify(
     const sjm::sift::DescriptorSet& descriptor_set,
     const float subsample_percentage) const {
-  // Set up accumulator.
-  std::map<std::string, float> distance_totals;
-  for (size_t i = 0; i < class_list_.size(); ++i) {
-    distance_totals[class_list_[i]] = 0;
-  }
+  // With location reranking, the location isn't in the indices.
+  const float indexed_alpha = location_candidates_ > 0 ? 0 : alpha_;
   // Get the dimensions.
   uint8_t *destination = new uint8_t[130];
   int dimensions =
       sjm::sift::ConvertProtobufDescriptorToWeightedArray(
-          descriptor_set.sift_descriptor(0), alpha_, destination);
+          descriptor_set.sift_descriptor(0), indexed_alpha, destination);
   delete[] destination;
   // Set up the data for the batch query.
   // First, create a temp array for up to 100% of the descriptors.
@@ -109,12 +267,16 @@ Result NbnnClassifier<IndexType>::Classify(
       new uint8_t[descriptor_set.sift_descriptor_size() * dimensions];
   // Put a subsample of the data into the temp array.
   int next_matrix_index = 0;
+  std::vector<float> query_locations;
   for (int i = 0; i < descriptor_set.sift_descriptor_size(); ++i) {
     if (std::rand() / static_cast<float>(RAND_MAX) < subsample_percentage) {
       sjm::sift::ConvertProtobufDescriptorToWeightedArray(
           descriptor_set.sift_descriptor(i),
-          alpha_,
+          indexed_alpha,
           temp + (next_matrix_index * dimensions));
+      if (location_candidates_ > 0) {
+        AppendLocation(descriptor_set.sift_descriptor(i), &query_locations);
+      }
       ++next_matrix_index;
     }
   }
@@ -133,54 +295,313 @@ Result NbnnClassifier<IndexType>::Classify(
                              next_matrix_index,
                              dimensions);
 
-  // NN query Result matrices.
-  flann::Matrix<int> nn_index(new int[batch_query.rows * nearest_neighbors_],
-                              batch_query.rows, nearest_neighbors_);
-  flann::Matrix<float> dists(new float[batch_query.rows * nearest_neighbors_],
-                             batch_query.rows, nearest_neighbors_);
-  // Shuffle the order in which the classes are queried. This does not
-  // affect the results, but is important for avoiding resource
-  // contention when this is run in parallel and IndexType is a
-  // connection to a FLANN server.
-  std::vector<std::string> query_ordering = class_list_;
-  std::random_shuffle(query_ordering.begin(), query_ordering.end());
+  // The classes in name order.
+  std::vector<std::string> class_names;
+  std::vector<IndexType*> class_indices;
+  std::vector<const std::vector<float>*> class_locations;
+  ListClasses(&class_names, &class_indices, &class_locations);
+  // Each class's distance from each query has its own slot, so the
+  // searches can run in parallel without locking.
+  std::vector<std::vector<float> > distances(
+      class_indices.size(), std::vector<float>(batch_query.rows));
+  std::vector<int> classes;
+  for (size_t c = 0; c < class_indices.size(); ++c) {
+    classes.push_back(c);
+  }
   // This is the implmentation of the NBNN algorithm.
-  for (size_t i = 0; i < query_ordering.size(); ++i) {
-    IndexType* class_index = indices_.find(query_ordering[i])->second;
-    // For all query descriptors, find their nearest neighbor(s) in
-    // this class_index.
-    class_index->knnSearch(
-        batch_query, nn_index, dists, nearest_neighbors_,
-        flann::SearchParams(checks_));
-    // Total up the squared distances from each query descriptor to
-    // their nearest neighbors in this class.
-    for (size_t j = 0; j < dists.rows; ++j) {
-      // This scaling is necessary because descriptor values are
-      // stored in [0,127] (for space savings), so we divide the
-      // distance squared (dists[j][0]) by 127^2. This avoids
-      // overflows if these distances are later used in probability
-      // estimate models.
-      float distance_squared = dists[j][0] / 16129.0;
-      distance_totals[query_ordering[i]] += distance_squared;
-    }
+  size_t num_searched = batch_query.rows;
+  if (anytime_error_tolerance_ > 0) {
+    SearchClassesAnytime(class_indices, class_locations, batch_query,
+                         query_locations, pool_, &classes, &distances,
+                         &num_searched);
+  } else {
+    SearchClasses(class_indices, class_locations, classes, batch_query,
+                  query_locations.data(), 0, pool_, &distances);
   }
   delete[] batch_query.ptr();
-  delete[] nn_index.ptr();
-  delete[] dists.ptr();
+  // The reduction is done in class name order, so ties are broken the
+  // same way regardless of the number of threads.
   std::string best_class = "";
   float smallest_distance = 99999999999;
-  for (std::map<std::string, float>::const_iterator it =
-           distance_totals.begin();
-       it != distance_totals.end(); ++it) {
-    if (it->second < smallest_distance) {
-      best_class = it->first;
-      smallest_distance = it->second;
+  for (size_t i = 0; i < classes.size(); ++i) {
+    const int c = classes[i];
+    float distance_total = 0;
+    for (size_t j = 0; j < num_searched; ++j) {
+      distance_total += distances[c][j];
+    }
+    if (distance_total < smallest_distance) {
+      best_class = class_names[c];
+      smallest_distance = distance_total;
     }
   }
   Result r;
   r.category = best_class;
   return r;
 }
+
+template <typename IndexType>
+std::vector<Result> NbnnClassifier<IndexType>::ClassifyBatch(
+    const std::vector<const sjm::sift::DescriptorSet*>& descriptor_sets,
+    const float subsample_percentage) const {
+  std::vector<Result> results;
+  if (anytime_error_tolerance_ > 0) {
+    for (size_t i = 0; i < descriptor_sets.size(); ++i) {
+      results.push_back(Classify(*descriptor_sets[i], subsample_percentage));
+    }
+    return results;
+  }
+  // With location reranking, the location isn't in the indices.
+  const float indexed_alpha = location_candidates_ > 0 ? 0 : alpha_;
+  const int dimensions = WeightedDimensions(descriptor_sets, indexed_alpha);
+  internal::QueryBuffers* buffers = internal::GetQueryBuffers();
+  PackQueries(descriptor_sets, indexed_alpha, dimensions,
+              subsample_percentage, &buffers->queries,
+              location_candidates_ > 0 ? &buffers->locations : NULL,
+              &buffers->image_rows);
+  const size_t rows = buffers->image_rows.back();
+  const flann::Matrix<uint8_t> batch_query(buffers->queries.data(), rows,
+                                           dimensions);
+  std::vector<std::string> class_names;
+  std::vector<IndexType*> class_indices;
+  std::vector<const std::vector<float>*> class_locations;
+  ListClasses(&class_names, &class_indices, &class_locations);
+  std::vector<std::vector<float> >& distances = buffers->class_distances;
+  distances.resize(class_indices.size());
+  std::vector<int> classes;
+  for (size_t c = 0; c < class_indices.size(); ++c) {
+    distances[c].resize(rows);
+    classes.push_back(c);
+  }
+  if (rows > 0) {
+    SearchClasses(class_indices, class_locations, classes, batch_query,
+                  buffers->locations.data(), 0, pool_, &distances);
+  }
+  // Each set's rows are reduced as in Classify().
+  for (size_t i = 0; i < descriptor_sets.size(); ++i) {
+    std::string best_class = "";
+    float smallest_distance = 99999999999;
+    for (size_t c = 0; c < class_indices.size(); ++c) {
+      float distance_total = 0;
+      for (size_t j = buffers->image_rows[i]; j < buffers->image_rows[i + 1];
+           ++j) {
+        distance_total += distances[c][j];
+      }
+      if (distance_total < smallest_distance) {
+        best_class = class_names[c];
+        smallest_distance = distance_total;
+      }
+    }
+    Result r;
+    r.category = best_class;
+    results.push_back(r);
+  }
+  return results;
+}
+
+template <typename IndexType>
+void NbnnClassifier<IndexType>::ListClasses(
+    std::vector<std::string>* class_names,
+    std::vector<IndexType*>* class_indices,
+    std::vector<const std::vector<float>*>* class_locations) const {
+  for (typename std::map<std::string, IndexType*>::const_iterator it =
+           indices_.begin();
+       it != indices_.end(); ++it) {
+    class_names->push_back(it->first);
+    class_indices->push_back(it->second);
+    const std::vector<float>* locations = NULL;
+    if (location_candidates_ > 0) {
+      std::map<std::string, std::vector<float> >::const_iterator location =
+          class_locations_.find(it->first);
+      CHECK(location != class_locations_.end()) <<
+          "Class " << it->first << " was added without its locations.";
+      locations = &location->second;
+    }
+    class_locations->push_back(locations);
+  }
+}
+
+template <typename IndexType>
+void NbnnClassifier<IndexType>::SearchClasses(
+    const std::vector<IndexType*>& class_indices,
+    const std::vector<const std::vector<float>*>& class_locations,
+    const std::vector<int>& classes,
+    const flann::Matrix<uint8_t>& batch_query,
+    const float* query_locations,
+    const size_t offset,
+    sjm::util::ThreadPool* pool,
+    std::vector<std::vector<float> >* distances) const {
+  // Shuffle the order in which the classes are queried. This does not
+  // affect the results, but is important for avoiding resource
+  // contention when this is run in parallel and IndexType is a
+  // connection to a FLANN server.
+  std::vector<int> query_ordering(classes);
+  std::random_shuffle(query_ordering.begin(), query_ordering.end());
+  // Other calls can be searching on the same pool, so only this call's
+  // searches are waited for.
+  sjm::util::TaskGroup searches;
+  for (size_t i = 0; i < query_ordering.size(); ++i) {
+    const int c = query_ordering[i];
+    if (pool) {
+      pool->Schedule(boost::bind(&NbnnClassifier<IndexType>::SearchClass,
+                                 this, class_indices[c], class_locations[c],
+                                 boost::cref(batch_query), query_locations,
+                                 (*distances)[c].data() + offset),
+                     &searches);
+    } else {
+      SearchClass(class_indices[c], class_locations[c], batch_query,
+                  query_locations, (*distances)[c].data() + offset);
+    }
+  }
+  searches.Wait();
+}
+
+template <typename IndexType>
+void NbnnClassifier<IndexType>::SearchClassesAnytime(
+    const std::vector<IndexType*>& class_indices,
+    const std::vector<const std::vector<float>*>& class_locations,
+    const flann::Matrix<uint8_t>& batch_query,
+    const std::vector<float>& query_locations,
+    sjm::util::ThreadPool* pool,
+    std::vector<int>* classes,
+    std::vector<std::vector<float> >* distances,
+    size_t* num_searched) const {
+  const size_t num_queries = batch_query.rows;
+  const size_t dimensions = batch_query.cols;
+  // The queries in a random order, so that each batch is a random
+  // sample of the ones that haven't been searched.
+  std::vector<int> order;
+  for (size_t i = 0; i < num_queries; ++i) {
+    order.push_back(i);
+  }
+  std::random_shuffle(order.begin(), order.end());
+  std::vector<uint8_t> shuffled(num_queries * dimensions);
+  std::vector<float> shuffled_locations(query_locations.size());
+  for (size_t i = 0; i < num_queries; ++i) {
+    std::copy(batch_query[order[i]], batch_query[order[i]] + dimensions,
+              &shuffled[i * dimensions]);
+    if (!query_locations.empty()) {
+      shuffled_locations[2 * i] = query_locations[2 * order[i]];
+      shuffled_locations[2 * i + 1] = query_locations[2 * order[i] + 1];
+    }
+  }
+  *num_searched = 0;
+  while (*num_searched < num_queries && classes->size() > 1) {
+    const size_t batch_end =
+        std::min(num_queries, *num_searched + anytime_batch_size_);
+    const flann::Matrix<uint8_t> batch(&shuffled[*num_searched * dimensions],
+                                       batch_end - *num_searched,
+                                       dimensions);
+    const float* batch_locations = query_locations.empty() ?
+        NULL : &shuffled_locations[2 * *num_searched];
+    SearchClasses(class_indices, class_locations, *classes, batch,
+                  batch_locations, *num_searched, pool, distances);
+    *num_searched = batch_end;
+    if (*num_searched < num_queries &&
+        *num_searched >= internal::kMinAnytimeQueries) {
+      PruneClasses(*distances, *num_searched, num_queries, classes);
+    }
+  }
+}
+
+template <typename IndexType>
+void NbnnClassifier<IndexType>::PruneClasses(
+    const std::vector<std::vector<float> >& distances,
+    const size_t num_searched,
+    const size_t num_queries,
+    std::vector<int>* classes) const {
+  // The current leader is the class with the smallest total so far.
+  int leader = -1;
+  double smallest_total = 0;
+  for (size_t i = 0; i < classes->size(); ++i) {
+    const int c = (*classes)[i];
+    double total = 0;
+    for (size_t j = 0; j < num_searched; ++j) {
+      total += distances[c][j];
+    }
+    if (leader < 0 || total < smallest_total) {
+      leader = c;
+      smallest_total = total;
+    }
+  }
+  // Each other class's per-query excess over the leader is a sample,
+  // without replacement, of its excess over all the queries. The
+  // class is dropped if a one-sided confidence bound on the mean
+  // excess is above 0.
+  const double z =
+      internal::NormalUpperQuantile(anytime_error_tolerance_);
+  const double population_correction =
+      (num_queries - num_searched) / (num_queries - 1.0);
+  std::vector<int> remaining;
+  for (size_t i = 0; i < classes->size(); ++i) {
+    const int c = (*classes)[i];
+    if (c == leader) {
+      remaining.push_back(c);
+      continue;
+    }
+    double sum = 0;
+    double sum_of_squares = 0;
+    for (size_t j = 0; j < num_searched; ++j) {
+      const double excess = distances[c][j] - distances[leader][j];
+      sum += excess;
+      sum_of_squares += excess * excess;
+    }
+    const double mean = sum / num_searched;
+    const double variance = std::max(
+        0.0, (sum_of_squares - sum * mean) / (num_searched - 1));
+    const double lower_bound = mean -
+        z * std::sqrt(variance / num_searched * population_correction);
+    if (lower_bound <= 0) {
+      remaining.push_back(c);
+    }
+  }
+  classes->swap(remaining);
+}
+
+template <typename IndexType>
+void NbnnClassifier<IndexType>::SearchClass(
+    IndexType* class_index,
+    const std::vector<float>* class_locations,
+    const flann::Matrix<uint8_t>& batch_query,
+    const float* query_locations,
+    float* distances) const {
+  // With location reranking, more candidates are fetched by
+  // appearance, capped at the class size.
+  int knn = nearest_neighbors_;
+  if (class_locations) {
+    knn = std::max(knn, std::min(
+        location_candidates_, static_cast<int>(class_locations->size() / 2)));
+  }
+  // NN query Result matrices.
+  flann::Matrix<int> nn_index(new int[batch_query.rows * knn],
+                              batch_query.rows, knn);
+  flann::Matrix<float> dists(new float[batch_query.rows * knn],
+                             batch_query.rows, knn);
+  // For all query descriptors, find their nearest neighbor(s) in
+  // this class_index.
+  class_index->knnSearch(
+      batch_query, nn_index, dists, knn,
+      flann::SearchParams(checks_));
+  std::vector<std::pair<float, int> > ranked;
+  // Store the squared distances from each query descriptor to
+  // their nearest neighbors in this class.
+  for (size_t j = 0; j < dists.rows; ++j) {
+    float distance = dists[j][0];
+    if (class_locations) {
+      RerankByLocation(nn_index[j], dists[j], knn, query_locations + 2 * j,
+                       class_locations->data(), alpha_, &ranked);
+      CHECK(!ranked.empty());
+      distance = ranked[0].first;
+    }
+    // This scaling is necessary because descriptor values are
+    // stored in [0,127] (for space savings), so we divide the
+    // distance squared (dists[j][0]) by 127^2. This avoids
+    // overflows if these distances are later used in probability
+    // estimate models.
+    distances[j] = distance / 16129.0;
+  }
+  delete[] nn_index.ptr();
+  delete[] dists.ptr();
+}
 }}  // Namespace.
 
 #endif  // NAIVE_BAYES_NEAREST_NEIGHBOR_NBNN_CLASSIFIER_INL_H_
@@ -32,6 +32,7 @@
 
 #include "flann/flann.hpp"
 #include "sift/sift_descriptors.pb.h"
+#include "util/thread_pool.h"
 
 namespace sjm {
 namespace nbnn {
@@ -40,33 +41,176 @@ struct Result {
   std::string category;
 };
 
-// The IndexType can be any class that provides the following function:
+// The IndexType can be flann::Index<flann::L2<uint8_t> > or any class
+// with the same interface, like the indices in this directory:
 //
-// IndexType::knnSearch(flann::Matrix<uint8_t>, flann::Matrix<int>,
-//                      flann::Matrix<float>, int, flann::SearchParams)
+// - IndexType(const flann::Matrix<uint8_t>& data,
+//             const flann::IndexParams& params)
+//   The data is not copied, and must outlive the index. Params that
+//   the type doesn't use are ignored, and missing ones take their
+//   defaults, so every type can be given the same params. With
+//   flann::SavedIndexParams, the index that save() wrote for the same
+//   data is loaded instead of being built.
+// - void buildIndex()
+// - void addPoints(const flann::Matrix<uint8_t>& points,
+//                  float rebuild_threshold)
+//   The points are numbered after the existing ones, and must outlive
+//   the index too.
+// - void save(const std::string& filename) const
+//   Saves the index, but not its data.
+// - size_t size() const and size_t veclen() const
+// - int knnSearch(const flann::Matrix<uint8_t>& queries,
+//                 flann::Matrix<int>& indices,
+//                 flann::Matrix<float>& dists,
+//                 size_t knn,
+//                 const flann::SearchParams& params) const
+//   Finds (approximately) the knn nearest points to each query, in
+//   order of increasing squared distance, with more checks giving
+//   more accurate results. If fewer than knn are found, the remaining
+//   indices are -1 and their distances the largest float. It returns
+//   the number found, and can be called from several threads at once.
 template <class IndexType>
 class NbnnClassifier {
  public:
-  NbnnClassifier() : nearest_neighbors_(1), alpha_(0), checks_(1) {}
+  NbnnClassifier()
+      : nearest_neighbors_(1), alpha_(0), checks_(1), num_threads_(1),
+        pool_(NULL), anytime_batch_size_(0), anytime_error_tolerance_(0),
+        location_candidates_(0) {}
   ~NbnnClassifier();
   int GetNumClasses() const;
   const std::vector<std::string>& GetClassList() const;
   void SetClassificationParams(const int nearest_neighbors,
                                const float alpha,
                                const int checks);
+  // The per-class searches in Classify are spread over this many
+  // threads, which are started here and shared by every Classify
+  // call, including concurrent ones. The results don't depend on the
+  // number of threads.
+  void SetNumThreads(const int num_threads);
+  // Enables anytime classification: the query descriptors are searched
+  // in random batches of batch_size, and after each batch, any class
+  // whose total distance is (statistically) unlikely to end up
+  // smallest is no longer searched. A class is dropped when the chance
+  // that it would have won, had all the descriptors been searched, is
+  // below error_tolerance. Classification stops once one class is
+  // left. An error_tolerance of 0 (the default) searches every class
+  // with every descriptor.
+  void SetAnytimeParams(const int batch_size, const float error_tolerance);
+  // Enables location reranking: the classes' indices are built on the
+  // descriptors' appearance only (without the alpha-weighted location
+  // dimensions), and are added with the descriptors' locations. Each
+  // query's candidates nearest by appearance are reranked by their
+  // distances with the location weighted by the current alpha, so one
+  // set of indices serves any alpha. Must be called before adding
+  // classes.
+  void SetLocationReranking(const int candidates);
   // The index object is owned by this NbnnClassifier object now. It
   // will be deleted properly upon destruction.
   void AddClass(const std::string& class_name,
                 IndexType* index);
+  // As above, but also records the data that the index was built on,
+  // so that the classifier can be saved. The data is not owned, and
+  // must outlive this NbnnClassifier object.
+  void AddClass(const std::string& class_name,
+                IndexType* index,
+                const flann::Matrix<uint8_t>& data);
+  // As above, with location reranking, also taking the (x, y)
+  // location of each row of the data.
+  void AddClass(const std::string& class_name,
+                IndexType* index,
+                const flann::Matrix<uint8_t>& data,
+                const std::vector<float>& locations);
+  // Saves the classes, their data, and their indices to the directory,
+  // which is created if needed. Every class must have been added with
+  // its data. Requires IndexType to provide save(filename).
+  void Save(const std::string& directory) const;
+  // Loads the classes saved by Save() into this empty classifier. The
+  // data is mapped from the saved files rather than read. Requires
+  // IndexType to be constructible from (data, flann::SavedIndexParams).
+  // SetClassificationParams() must be called first with the same alpha
+  // that the saved classifier was built with, unless it was saved with
+  // location reranking, which must then be enabled first.
+  void Load(const std::string& directory);
   Result Classify(const sjm::sift::DescriptorSet& descriptor_set) const;
   Result Classify(const sjm::sift::DescriptorSet& descriptor_set,
                   const float subsample_percentage) const;
+  // Classifies each of the descriptor sets, as Classify() would, but
+  // with one search of each class's index for all of them. The
+  // buffers are reused between batches (by each thread). Anytime
+  // classification drops classes for each set separately, so with it,
+  // the sets are classified one at a time.
+  std::vector<Result> ClassifyBatch(
+      const std::vector<const sjm::sift::DescriptorSet*>& descriptor_sets,
+      const float subsample_percentage) const;
  private:
+  // Lists the classes in name order, with their indices and (with
+  // location reranking) their locations.
+  void ListClasses(
+      std::vector<std::string>* class_names,
+      std::vector<IndexType*>* class_indices,
+      std::vector<const std::vector<float>*>* class_locations) const;
+  // Searches the class index for the nearest neighbors of the queries,
+  // and stores their scaled squared distances. With location
+  // reranking, the class_locations and query_locations hold the (x, y)
+  // locations of the class's data and the queries.
+  void SearchClass(IndexType* class_index,
+                   const std::vector<float>* class_locations,
+                   const flann::Matrix<uint8_t>& batch_query,
+                   const float* query_locations,
+                   float* distances) const;
+  // Searches each of the classes (positions in class_indices) with the
+  // queries, storing each class's distances in its row of distances,
+  // starting at the offset. The searches are spread over the pool's
+  // threads, if there is a pool.
+  void SearchClasses(const std::vector<IndexType*>& class_indices,
+                     const std::vector<const std::vector<float>*>&
+                         class_locations,
+                     const std::vector<int>& classes,
+                     const flann::Matrix<uint8_t>& batch_query,
+                     const float* query_locations,
+                     const size_t offset,
+                     sjm::util::ThreadPool* pool,
+                     std::vector<std::vector<float> >* distances) const;
+  // Searches the classes with random batches of the queries, dropping
+  // classes as they fall behind (see SetAnytimeParams()). On return,
+  // classes holds the classes that were not dropped, and
+  // num_searched the number of queries they were searched with.
+  void SearchClassesAnytime(const std::vector<IndexType*>& class_indices,
+                            const std::vector<const std::vector<float>*>&
+                                class_locations,
+                            const flann::Matrix<uint8_t>& batch_query,
+                            const std::vector<float>& query_locations,
+                            sjm::util::ThreadPool* pool,
+                            std::vector<int>* classes,
+                            std::vector<std::vector<float> >* distances,
+                            size_t* num_searched) const;
+  // Drops the classes that are unlikely to have the smallest total
+  // distance over all num_queries queries, given their distances to
+  // the first num_searched (randomly ordered) queries.
+  void PruneClasses(const std::vector<std::vector<float> >& distances,
+                    const size_t num_searched,
+                    const size_t num_queries,
+                    std::vector<int>* classes) const;
+
   std::vector<std::string> class_list_;
   std::map<std::string, IndexType*> indices_;
+  std::map<std::string, flann::Matrix<uint8_t> > class_data_;
+  // The (x, y) locations of each class's data, with location reranking.
+  std::map<std::string, std::vector<float> > class_locations_;
+  // The data that was mapped by Load(), to be unmapped on destruction.
+  std::vector<flann::Matrix<uint8_t> > mapped_data_;
   int nearest_neighbors_;
   float alpha_;
   float checks_;
+  int num_threads_;
+  // The threads that search the classes, if num_threads_ > 1. Each
+  // call waits only for its own searches.
+  sjm::util::ThreadPool* pool_;
+  int anytime_batch_size_;
+  float anytime_error_tolerance_;
+  // The number of candidates reranked by location, or 0 if the
+  // location is in the indices.
+  int location_candidates_;
 };
 }}  // Namespace.
 
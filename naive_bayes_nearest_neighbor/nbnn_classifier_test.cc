@@ -24,15 +24,38 @@
 
 #include "naive_bayes_nearest_neighbor/nbnn_classifier.h"
 
+#include <cstdlib>
+#include <string>
 #include <vector>
 
 #include "glog/logging.h"
 #include "gtest/gtest.h"
 
+#include "naive_bayes_nearest_neighbor/brute_force_index.h"
 #include "sift/sift_descriptors.pb.h"
 
+using std::string;
 using std::vector;
 
+// An exact index that counts how many queries it has been searched
+// with.
+class CountingIndex : public sjm::nbnn::BruteForceIndex {
+ public:
+  CountingIndex(const flann::Matrix<uint8_t>& data, int* num_queries)
+      : sjm::nbnn::BruteForceIndex(data), num_queries_(num_queries) {}
+  int knnSearch(const flann::Matrix<uint8_t>& queries,
+                flann::Matrix<int>& indices,
+                flann::Matrix<float>& dists,
+                size_t knn,
+                const flann::SearchParams& params) const {
+    *num_queries_ += queries.rows;
+    return sjm::nbnn::BruteForceIndex::knnSearch(queries, indices, dists,
+                                                 knn, params);
+  }
+ private:
+  int* num_queries_;
+};
+
 class NbnnClassifierTest : public ::testing::Test {
  protected:
   void SetUp() {
@@ -115,6 +138,129 @@ TEST_F(NbnnClassifierTest,
   ASSERT_EQ("Class 1", classifier.Classify(descriptor_set).category);
 }
 
+TEST_F(NbnnClassifierTest,
+       TestClassifyWithThreads) {
+  sjm::nbnn::NbnnClassifier<flann::Index<flann::L2<uint8_t> > > classifier;
+  classifier.SetClassificationParams(1, 0, 32);
+  classifier.SetNumThreads(4);
+  classifier.AddClass("Class 2", class_2_index_);
+  classifier.AddClass("Class 1", class_1_index_);
+  sjm::sift::DescriptorSet descriptor_set = GetFakeDescriptorSet();
+  ASSERT_EQ("Class 1", classifier.Classify(descriptor_set).category);
+}
+
+TEST_F(NbnnClassifierTest,
+       TestClassifyBatch) {
+  sjm::nbnn::NbnnClassifier<flann::Index<flann::L2<uint8_t> > > classifier;
+  classifier.SetClassificationParams(1, 0, 32);
+  classifier.SetNumThreads(2);
+  classifier.AddClass("Class 1", class_1_index_);
+  classifier.AddClass("Class 2", class_2_index_);
+  // Sets of 2s and 4s, which are nearest to class 1 and 2, and an
+  // empty set.
+  vector<sjm::sift::DescriptorSet> descriptor_sets(5);
+  vector<const sjm::sift::DescriptorSet*> batch;
+  for (size_t i = 0; i < descriptor_sets.size(); ++i) {
+    for (size_t j = 0; i < 4 && j < 2 + i; ++j) {
+      sjm::sift::SiftDescriptor* d =
+          descriptor_sets[i].add_sift_descriptor();
+      for (int k = 0; k < 128; ++k) {
+        d->add_bin(i % 2 == 0 ? 2 : 4);
+      }
+    }
+    batch.push_back(&descriptor_sets[i]);
+  }
+  const vector<sjm::nbnn::Result> results =
+      classifier.ClassifyBatch(batch, 1.0);
+  ASSERT_EQ(5, results.size());
+  ASSERT_EQ("Class 1", results[0].category);
+  ASSERT_EQ("Class 2", results[1].category);
+  ASSERT_EQ("Class 1", results[2].category);
+  ASSERT_EQ("Class 2", results[3].category);
+  ASSERT_EQ("Class 1", results[4].category);
+  // The buffers are reused by the next batch.
+  batch.resize(2);
+  ASSERT_EQ("Class 2", classifier.ClassifyBatch(batch, 1.0)[1].category);
+}
+
+TEST_F(NbnnClassifierTest,
+       TestClassifyAnytime) {
+  // Class i's descriptors are all 10 * i, and the query descriptors
+  // are around 2, so class 0 wins and the others can be dropped early.
+  const int kNumClasses = 10;
+  const int kNumQueries = 200;
+  vector<uint8_t> data(kNumClasses * 128);
+  for (int i = 0; i < kNumClasses; ++i) {
+    std::fill(&data[i * 128], &data[(i + 1) * 128], 10 * i);
+  }
+  sjm::sift::DescriptorSet descriptor_set;
+  for (int i = 0; i < kNumQueries; ++i) {
+    sjm::sift::SiftDescriptor* d = descriptor_set.add_sift_descriptor();
+    for (int j = 0; j < 128; ++j) {
+      d->add_bin(std::rand() % 5);
+    }
+  }
+  int num_queries = 0;
+  sjm::nbnn::NbnnClassifier<CountingIndex> classifier;
+  classifier.SetClassificationParams(1, 0, 1);
+  classifier.SetAnytimeParams(10, 0.001);
+  for (int i = 0; i < kNumClasses; ++i) {
+    classifier.AddClass(
+        "Class " + string(1, '0' + i),
+        new CountingIndex(flann::Matrix<uint8_t>(&data[i * 128], 1, 128),
+                          &num_queries));
+  }
+  ASSERT_EQ("Class 0", classifier.Classify(descriptor_set).category);
+  // Every class is searched with the first few batches, but after
+  // that, the losing classes are dropped.
+  ASSERT_LT(num_queries, kNumClasses * kNumQueries / 2);
+}
+
+TEST_F(NbnnClassifierTest,
+       TestClassifyWithLocationReranking) {
+  // The query is 3s at (0.1, 0.1). By appearance, it's nearest to
+  // Far's only descriptor, but Near has a descriptor that is slightly
+  // further in appearance at the query's location, which wins once
+  // the location is weighted.
+  vector<uint8_t> far_data(128, 3);
+  vector<float> far_locations(2, 0.9);
+  vector<uint8_t> near_data(2 * 128, 4);
+  std::fill(near_data.begin() + 128, near_data.end(), 3);
+  near_data[128] = 4;
+  vector<float> near_locations(2, 0.1);
+  near_locations.resize(4, 0.95);
+  const flann::Matrix<uint8_t> far(&far_data[0], 1, 128);
+  const flann::Matrix<uint8_t> near(&near_data[0], 2, 128);
+  sjm::sift::DescriptorSet descriptor_set;
+  sjm::sift::SiftDescriptor* d = descriptor_set.add_sift_descriptor();
+  for (int j = 0; j < 128; ++j) {
+    d->add_bin(3);
+  }
+  d->set_x(0.1);
+  d->set_y(0.1);
+
+  sjm::nbnn::NbnnClassifier<sjm::nbnn::BruteForceIndex> classifier;
+  classifier.SetLocationReranking(2);
+  classifier.SetClassificationParams(1, 0, 1);
+  classifier.AddClass("Far", new sjm::nbnn::BruteForceIndex(far), far,
+                      far_locations);
+  classifier.AddClass("Near", new sjm::nbnn::BruteForceIndex(near), near,
+                      near_locations);
+  ASSERT_EQ("Far", classifier.Classify(descriptor_set).category);
+  // The same indices serve another alpha.
+  classifier.SetClassificationParams(1, 1, 1);
+  ASSERT_EQ("Near", classifier.Classify(descriptor_set).category);
+
+  // The locations are saved, so the loaded classifier can also use
+  // any alpha.
+  classifier.Save("/tmp/nbnn_classifier_test_index");
+  sjm::nbnn::NbnnClassifier<sjm::nbnn::BruteForceIndex> loaded;
+  loaded.SetLocationReranking(2);
+  loaded.SetClassificationParams(1, 1, 1);
+  loaded.Load("/tmp/nbnn_classifier_test_index");
+  ASSERT_EQ("Near", loaded.Classify(descriptor_set).category);
+}
+
 // TODO(sanchom): Write a test for the subsampled classify call.
 
 int main(int argc, char** argv) {
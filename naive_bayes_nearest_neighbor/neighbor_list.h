@@ -0,0 +1,151 @@
+// Copyright (c) 2011, Sancho McCann
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+
+// - Redistributions of source code must retain the above copyright
+//   notice, this list of conditions and the following disclaimer.
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// The nearest neighbors of a query image's descriptors in the merged
+// index, and a cache of them on disk. Local NBNN's scores for any k
+// and b can be computed from a list with at least k + b neighbors, so
+// sweeps over k and b only need to search each image once.
+
+#ifndef NAIVE_BAYES_NEAREST_NEIGHBOR_NEIGHBOR_LIST_H_
+#define NAIVE_BAYES_NEAREST_NEIGHBOR_NEIGHBOR_LIST_H_
+
+#include <stdint.h>
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "boost/filesystem.hpp"
+#include "glog/logging.h"
+
+#include "naive_bayes_nearest_neighbor/index_io.h"
+#include "util/util.h"
+
+namespace sjm {
+namespace nbnn {
+
+// The class id of a neighbor that the index didn't find (see the
+// IndexType's knnSearch in nbnn_classifier.h). Such neighbors come
+// after the found ones, with the largest float distance.
+const uint16_t kNoNeighborClass = 0xffff;
+
+// The class ids and squared distances of each query descriptor's
+// nearest neighbors, in increasing order of distance.
+struct NeighborList {
+  NeighborList() : rows(0), neighbors(0) {}
+  // The number of query descriptors.
+  uint32_t rows;
+  // The number of neighbors of each.
+  uint32_t neighbors;
+  // The rows * neighbors class ids and distances, row by row.
+  std::vector<uint16_t> classes;
+  std::vector<float> distances;
+};
+
+namespace internal {
+
+const char kNeighborListMagic[8] = {'S', 'J', 'M', 'N', 'B', 'R', 'S', '1'};
+}  // namespace internal.
+
+// Returns the file in the cache directory that holds the neighbor
+// list for the key. The key should describe everything the list
+// depends on: the query file, the index, and the search parameters.
+inline std::string NeighborCacheFilename(const std::string& directory,
+                                         const std::string& key) {
+  char name[32];
+  snprintf(name, sizeof(name), "%016llx.nbrs",
+           static_cast<unsigned long long>(sjm::util::Fnv1aHash(key)));
+  return (boost::filesystem::path(sjm::util::expand_user(directory)) /
+          name).string();
+}
+
+// Saves the list, tagged with its key, as a header followed by the
+// raw class ids and distances.
+inline void WriteNeighborListOrDie(const std::string& filename,
+                                   const std::string& key,
+                                   const NeighborList& list) {
+  CHECK_EQ(list.rows * list.neighbors, list.classes.size());
+  CHECK_EQ(list.classes.size(), list.distances.size());
+  const std::string path = sjm::util::expand_user(filename);
+  // Written to a temporary file and renamed, so that readers never
+  // see a partial list.
+  const std::string temporary_path = path + ".tmp";
+  FILE* f = fopen(temporary_path.c_str(), "wb");
+  CHECK(f != NULL) << "Error opening " << temporary_path << " for writing.";
+  const uint32_t key_size = key.size();
+  WriteOrDie(internal::kNeighborListMagic,
+             sizeof(internal::kNeighborListMagic), f);
+  WriteOrDie(&key_size, sizeof(key_size), f);
+  WriteOrDie(key.data(), key_size, f);
+  WriteOrDie(&list.rows, sizeof(list.rows), f);
+  WriteOrDie(&list.neighbors, sizeof(list.neighbors), f);
+  WriteOrDie(list.classes.data(),
+             list.classes.size() * sizeof(list.classes[0]), f);
+  WriteOrDie(list.distances.data(),
+             list.distances.size() * sizeof(list.distances[0]), f);
+  CHECK_EQ(0, fclose(f));
+  PCHECK(rename(temporary_path.c_str(), path.c_str()) == 0);
+}
+
+// Reads a list saved by WriteNeighborListOrDie with the same key.
+// Returns false if there is no such file, or if it was saved with
+// another key (whose hash collided).
+inline bool ReadNeighborList(const std::string& filename,
+                             const std::string& key,
+                             NeighborList* list) {
+  if (!boost::filesystem::exists(sjm::util::expand_user(filename))) {
+    return false;
+  }
+  std::string data;
+  sjm::util::ReadFileToStringOrDie(filename, &data);
+  const char* read = data.data();
+  const char* end = read + data.size();
+  const size_t magic_size = sizeof(internal::kNeighborListMagic);
+  CHECK(data.size() >= magic_size &&
+        memcmp(read, internal::kNeighborListMagic, magic_size) == 0) <<
+      filename << " is not a neighbor list.";
+  read += magic_size;
+  uint32_t key_size = 0;
+  ReadOrDie(&key_size, sizeof(key_size), end, &read);
+  CHECK_LE(key_size, static_cast<size_t>(end - read)) <<
+      filename << " is truncated.";
+  if (std::string(read, key_size) != key) {
+    return false;
+  }
+  read += key_size;
+  ReadOrDie(&list->rows, sizeof(list->rows), end, &read);
+  ReadOrDie(&list->neighbors, sizeof(list->neighbors), end, &read);
+  const size_t size = static_cast<size_t>(list->rows) * list->neighbors;
+  list->classes.resize(size);
+  list->distances.resize(size);
+  ReadOrDie(list->classes.data(), size * sizeof(list->classes[0]), end,
+            &read);
+  ReadOrDie(list->distances.data(), size * sizeof(list->distances[0]), end,
+            &read);
+  return true;
+}
+}}  // Namespace.
+
+#endif  // NAIVE_BAYES_NEAREST_NEIGHBOR_NEIGHBOR_LIST_H_
@@ -0,0 +1,141 @@
+// Copyright (c) 2011, Sancho McCann
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+
+// - Redistributions of source code must retain the above copyright
+//   notice, this list of conditions and the following disclaimer.
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// Packing of several query images' descriptors into one query matrix,
+// so that the NBNN classifiers can search each index once per batch
+// of images rather than once per image.
+
+#ifndef NAIVE_BAYES_NEAREST_NEIGHBOR_QUERY_BATCH_H_
+#define NAIVE_BAYES_NEAREST_NEIGHBOR_QUERY_BATCH_H_
+
+#include <stdint.h>
+
+#include <cstdlib>
+#include <vector>
+
+#include "boost/thread/tss.hpp"
+#include "glog/logging.h"
+
+#include "naive_bayes_nearest_neighbor/location_reranking.h"
+#include "naive_bayes_nearest_neighbor/neighbor_list.h"
+#include "sift/sift_descriptors.pb.h"
+#include "sift/sift_util.h"
+
+namespace sjm {
+namespace nbnn {
+
+namespace internal {
+
+// The buffers used to classify a batch. Each thread keeps its own
+// between batches, so once they've grown to the size of the batches,
+// classifying doesn't allocate them again.
+struct QueryBuffers {
+  // The packed query rows.
+  std::vector<uint8_t> queries;
+  // The (x, y) location of each query row, with location reranking.
+  std::vector<float> locations;
+  // The first query row of each image, followed by the number of rows.
+  std::vector<size_t> image_rows;
+  // The indices and distances of each query row's neighbors.
+  std::vector<int> indices;
+  std::vector<float> distances;
+  // The distances from each class to each query row.
+  std::vector<std::vector<float> > class_distances;
+  // The neighbors of each image's query rows.
+  std::vector<NeighborList> neighbors;
+};
+
+// Returns this thread's buffers.
+inline QueryBuffers* GetQueryBuffers() {
+  static boost::thread_specific_ptr<QueryBuffers> buffers;
+  if (buffers.get() == NULL) {
+    buffers.reset(new QueryBuffers);
+  }
+  return buffers.get();
+}
+}  // namespace internal.
+
+// Returns the number of dimensions of the descriptors in the sets
+// after weighting their locations with alpha, or 0 if the sets are
+// all empty.
+inline int WeightedDimensions(
+    const std::vector<const sjm::sift::DescriptorSet*>& descriptor_sets,
+    const float alpha) {
+  for (size_t i = 0; i < descriptor_sets.size(); ++i) {
+    if (descriptor_sets[i]->sift_descriptor_size() > 0) {
+      return descriptor_sets[i]->sift_descriptor(0).bin_size() +
+          (alpha > 0 ? 2 : 0);
+    }
+  }
+  return 0;
+}
+
+// Converts a subsample of each set's descriptors, with their locations
+// weighted by alpha, into consecutive rows of queries. Records the
+// first row of each set, followed by the total number of rows, in
+// image_rows. If locations isn't NULL, the (x, y) location of each row
+// is stored in it. The descriptors are subsampled in the same order as
+// when the sets are classified one at a time, so the results match.
+inline void PackQueries(
+    const std::vector<const sjm::sift::DescriptorSet*>& descriptor_sets,
+    const float alpha,
+    const int dimensions,
+    const float subsample_percentage,
+    std::vector<uint8_t>* queries,
+    std::vector<float>* locations,
+    std::vector<size_t>* image_rows) {
+  size_t max_rows = 0;
+  for (size_t i = 0; i < descriptor_sets.size(); ++i) {
+    max_rows += descriptor_sets[i]->sift_descriptor_size();
+  }
+  // Resizing doesn't release capacity, so a buffer that's big enough
+  // is reused.
+  queries->resize(max_rows * dimensions);
+  if (locations) {
+    locations->clear();
+  }
+  image_rows->clear();
+  size_t rows = 0;
+  for (size_t i = 0; i < descriptor_sets.size(); ++i) {
+    image_rows->push_back(rows);
+    const sjm::sift::DescriptorSet& descriptor_set = *descriptor_sets[i];
+    for (int j = 0; j < descriptor_set.sift_descriptor_size(); ++j) {
+      if (std::rand() / static_cast<float>(RAND_MAX) < subsample_percentage) {
+        CHECK_EQ(dimensions,
+                 sjm::sift::ConvertProtobufDescriptorToWeightedArray(
+                     descriptor_set.sift_descriptor(j), alpha,
+                     &(*queries)[rows * dimensions])) <<
+            "Querying with inconsistent dimensions.";
+        if (locations) {
+          AppendLocation(descriptor_set.sift_descriptor(j), locations);
+        }
+        ++rows;
+      }
+    }
+  }
+  image_rows->push_back(rows);
+}
+}}  // Namespace.
+
+#endif  // NAIVE_BAYES_NEAREST_NEIGHBOR_QUERY_BATCH_H_
@@ -22,6 +22,8 @@
 // (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
 // OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
+#include "sift/sift_util.h"
+
 #include <iostream>
 #include <fstream>
 #include <string>
@@ -105,11 +107,13 @@ int ConvertProtobufDescriptorToWeightedArray(
     destination[i] = descriptor.bin(i);
   }
   if (alpha > 0) {
-    destination[dimensions - 2] =
-        static_cast<int>(descriptor.x() * 127 * alpha + 0.5);
-    destination[dimensions - 1] =
-        static_cast<int>(descriptor.y() * 127 * alpha + 0.5);
+    destination[dimensions - 2] = WeightLocation(descriptor.x(), alpha);
+    destination[dimensions - 1] = WeightLocation(descriptor.y(), alpha);
   }
   return dimensions;
 }
+
+uint8_t WeightLocation(const float coordinate, const float alpha) {
+  return static_cast<int>(coordinate * 127 * alpha + 0.5);
+}
 }}  // namespaces
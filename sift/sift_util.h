@@ -66,5 +66,10 @@ int ConvertProtobufDescriptorToWeightedArray(
     const float alpha,
     uint8_t *destination);
 
+// Returns the weighted location dimension that
+// ConvertProtobufDescriptorToWeightedArray stores for a coordinate
+// in [0,1].
+uint8_t WeightLocation(const float coordinate, const float alpha);
+
 } // namespace sift
 } // namespace sjm
@@ -0,0 +1,94 @@
+// Copyright 2011 Sancho McCann
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+
+// - Redistributions of source code must retain the above copyright
+//   notice, this list of conditions and the following disclaimer.
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// This command line tool converts libsvm text models, trained by
+// trainer_cli on a precomputed kernel, into the binary .svmb format
+// that validate_cli loads without parsing.
+
+#include <string>
+#include <vector>
+
+#include "boost/algorithm/string.hpp"
+#include "boost/foreach.hpp"
+
+#include "gflags/gflags.h"
+#include "glog/logging.h"
+
+#include "spatial_pyramid/precomputed_model.h"
+#include "svm/svm.h"
+#include "util/util.h"
+
+DEFINE_string(
+    model_list, "",
+    "A list of libsvm model files - one for each category. Each line is "
+    "'<model_file>:<category>'.");
+DEFINE_string(
+    output_model_list, "",
+    "The list of the converted models to write, in the same format as "
+    "--model_list. Each model is saved next to its text model, with the "
+    "extension replaced by .svmb.");
+
+using std::string;
+using std::vector;
+using sjm::spatial_pyramid::PrecomputedModel;
+
+int main(int argc, char* argv[]) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+
+  CHECK(!FLAGS_model_list.empty()) << "--model_list needed.";
+  CHECK(!FLAGS_output_model_list.empty()) << "--output_model_list needed.";
+
+  vector<string> model_list;
+  sjm::util::ReadLinesFromFileIntoVectorOrDie(FLAGS_model_list, &model_list);
+  string output_model_list;
+  BOOST_FOREACH(string t, model_list) {
+    vector<string> model_parts;
+    boost::split(model_parts, t, boost::is_any_of(":"));
+    const string model_file = sjm::util::expand_user(model_parts[0]);
+    svm_model* model = svm_load_model(model_file.c_str());
+    CHECK(model != NULL) << "Error loading " << model_file;
+    PrecomputedModel compact_model;
+    sjm::spatial_pyramid::CompactPrecomputedModel(model_parts[1], *model,
+                                                  &compact_model);
+    svm_free_and_destroy_model(&model);
+
+    string binary_file = model_file;
+    const size_t extension = binary_file.rfind('.');
+    if (extension != string::npos &&
+        binary_file.find('/', extension) == string::npos) {
+      binary_file.erase(extension);
+    }
+    binary_file += ".svmb";
+    sjm::spatial_pyramid::WritePrecomputedModelOrDie(binary_file,
+                                                     compact_model);
+    LOG(INFO) << "[" << model_parts[1] << "] Converted " << model_file <<
+        " to " << binary_file << ".";
+    output_model_list += binary_file + ":" + model_parts[1] + "\n";
+  }
+  sjm::util::WriteStringToFileOrDie(FLAGS_output_model_list,
+                                    output_model_list);
+
+  return 0;
+}
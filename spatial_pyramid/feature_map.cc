@@ -0,0 +1,193 @@
+// Copyright 2011 Sancho McCann
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+
+// - Redistributions of source code must retain the above copyright
+//   notice, this list of conditions and the following disclaimer.
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "spatial_pyramid/feature_map.h"
+
+#include <cmath>
+#include <vector>
+
+#include "glog/logging.h"
+
+#include "spatial_pyramid/spatial_pyramid.pb.h"
+#include "spatial_pyramid/spatial_pyramid_kernel.h"
+
+using std::vector;
+
+namespace sjm {
+namespace spatial_pyramid {
+
+namespace {
+
+// The spectrum of the intersection kernel, min(x, y), written as a
+// function of log(y / x).
+double IntersectionSpectrum(const double lambda) {
+  return 2.0 / M_PI / (1 + 4 * lambda * lambda);
+}
+}  // namespace.
+
+void InitIntersectionFeatureMap(const int num_levels,
+                                const int order,
+                                const float sampling_step,
+                                FeatureMap* map) {
+  CHECK_GT(num_levels, 0);
+  CHECK_GE(order, 0);
+  map->Clear();
+  map->set_kernel(FeatureMap::INTERSECTION);
+  map->set_num_levels(num_levels);
+  map->set_order(order);
+  if (sampling_step > 0) {
+    map->set_sampling_step(sampling_step);
+  } else {
+    // This period for the sampled spectrum was fit empirically to
+    // minimize the approximation error for each order.
+    const double period = 2.38 * std::log(order + 0.8) + 5.6;
+    map->set_sampling_step(2 * M_PI / period);
+  }
+}
+
+void MapIntersectionValue(const FeatureMap& map,
+                          const float value,
+                          float* result) {
+  const int order = map.order();
+  if (value <= 0) {
+    for (int j = 0; j < 2 * order + 1; ++j) {
+      result[j] = 0;
+    }
+    return;
+  }
+  const double step = map.sampling_step();
+  const double log_value = std::log(value);
+  result[0] = std::sqrt(value * step * IntersectionSpectrum(0));
+  for (int j = 1; j <= order; ++j) {
+    const double magnitude =
+        std::sqrt(2 * value * step * IntersectionSpectrum(j * step));
+    result[2 * j - 1] = magnitude * std::cos(j * step * log_value);
+    result[2 * j] = magnitude * std::sin(j * step * log_value);
+  }
+}
+
+void MapNystromKernelValues(const FeatureMap& map,
+                            const vector<float>& kernel_values,
+                            SparseVectorFloat* result) {
+  const int rank = map.landmark_size();
+  CHECK_EQ(rank, static_cast<int>(kernel_values.size()));
+  CHECK_EQ(rank * (rank + 1) / 2, map.cholesky_factor_size());
+  // Solve L * f = k by forward substitution, so that
+  // Dot(f_x, f_y) = k_x' * inverse(L * L') * k_y.
+  vector<double> features(rank);
+  int row_start = 0;
+  for (int i = 0; i < rank; ++i) {
+    double sum = kernel_values[i];
+    for (int j = 0; j < i; ++j) {
+      sum -= map.cholesky_factor(row_start + j) * features[j];
+    }
+    features[i] = sum / map.cholesky_factor(row_start + i);
+    row_start += i + 1;
+  }
+  result->Clear();
+  for (int i = 0; i < rank; ++i) {
+    SparseValueFloat* value = result->add_value();
+    value->set_index(i);
+    value->set_value(features[i]);
+  }
+}
+
+void MapFeatures(const FeatureMap& map,
+                 const SpatialPyramid& pyramid,
+                 SparseVectorFloat* result,
+                 int* result_dimensions) {
+  if (map.kernel() == FeatureMap::LINEAR) {
+    UnrollHistograms(pyramid, result, result_dimensions);
+    return;
+  }
+  if (map.kernel() == FeatureMap::NYSTROM_INTERSECTION) {
+    vector<float> kernel_values(map.landmark_size());
+    for (int i = 0; i < map.landmark_size(); ++i) {
+      kernel_values[i] = SpmKernel(pyramid, map.landmark(i), map.num_levels());
+    }
+    MapNystromKernelValues(map, kernel_values, result);
+    if (result_dimensions != NULL) {
+      *result_dimensions = map.landmark_size();
+    }
+    return;
+  }
+  CHECK_EQ(FeatureMap::INTERSECTION, map.kernel());
+  CHECK_GE(pyramid.level_size(), map.num_levels());
+  result->Clear();
+  const int features_per_bin = 2 * map.order() + 1;
+  float* mapped_value = new float[features_per_bin];
+  int base_index = 0;
+  for (int level_id = 0; level_id < map.num_levels(); ++level_id) {
+    const PyramidLevel& level = pyramid.level(level_id);
+    const float weight = SpmLevelWeight(level_id, map.num_levels());
+    for (int histogram_id = 0; histogram_id < level.histogram_size();
+         ++histogram_id) {
+      const SparseVectorFloat& histogram = level.histogram(histogram_id);
+      CHECK_NE(-1, histogram.non_sparse_length()) <<
+          "Can't map this spatial pyramid because the non_sparse_length "
+          "wasn't recorded.";
+      for (int i = 0; i < histogram.value_size(); ++i) {
+        MapIntersectionValue(map, weight * histogram.value(i).value(),
+                             mapped_value);
+        const int index =
+            (base_index + histogram.value(i).index()) * features_per_bin;
+        for (int j = 0; j < features_per_bin; ++j) {
+          SparseValueFloat* value = result->add_value();
+          value->set_index(index + j);
+          value->set_value(mapped_value[j]);
+        }
+      }
+      base_index += histogram.non_sparse_length();
+    }
+  }
+  delete[] mapped_value;
+  if (result_dimensions != NULL) {
+    *result_dimensions = base_index * features_per_bin;
+  }
+}
+
+double KernelApproximationError(const FeatureMap& map,
+                                const vector<SpatialPyramid>& pyramids) {
+  CHECK_NE(FeatureMap::LINEAR, map.kernel());
+  vector<SparseVectorFloat> mapped(pyramids.size());
+  for (size_t i = 0; i < pyramids.size(); ++i) {
+    MapFeatures(map, pyramids[i], &mapped[i]);
+  }
+  double error = 0;
+  double norm = 0;
+  for (size_t i = 0; i < pyramids.size(); ++i) {
+    for (size_t j = 0; j < pyramids.size(); ++j) {
+      const double kernel =
+          SpmKernel(pyramids[i], pyramids[j], map.num_levels());
+      const double difference = kernel - Dot(mapped[i], mapped[j]);
+      error += difference * difference;
+      norm += kernel * kernel;
+    }
+  }
+  if (norm == 0) {
+    return 0;
+  }
+  return std::sqrt(error / norm);
+}
+}}  // namespace.
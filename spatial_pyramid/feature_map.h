@@ -0,0 +1,90 @@
+// Copyright 2011 Sancho McCann
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+
+// - Redistributions of source code must retain the above copyright
+//   notice, this list of conditions and the following disclaimer.
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// Explicit feature maps for the unrolled pyramid representation. The
+// dot product of two mapped pyramids approximates a nonlinear kernel
+// between the pyramids, so that a linear SVM (see linear_svm.h) on
+// the mapped pyramids approximates a kernel SVM without a gram matrix.
+//
+// The intersection map is the homogeneous kernel map of Vedaldi and
+// Zisserman ("Efficient Additive Kernels via Explicit Feature Maps",
+// CVPR 2010). min(x, y) is homogeneous, so weighting each level before
+// the map is the same as weighting its intersections, and the map
+// approximates SpmKernel. Zero bins map to zero features, so the
+// mapped pyramids stay sparse.
+//
+// The Nystrom map (see nystrom.h) instead represents each pyramid by
+// its kernel values with a set of landmark pyramids, whitened by the
+// landmarks' gram matrix.
+
+#ifndef SPATIAL_PYRAMID_FEATURE_MAP_H_
+#define SPATIAL_PYRAMID_FEATURE_MAP_H_
+
+#include <vector>
+
+namespace sjm {
+namespace spatial_pyramid {
+
+// Forward declarations.
+class FeatureMap;
+class SpatialPyramid;
+class SparseVectorFloat;
+
+// Sets up map to approximate SpmKernel(a, b, num_levels). Each bin is
+// expanded into 2 * order + 1 features. If sampling_step is 0, a step
+// that works well for the given order is chosen.
+void InitIntersectionFeatureMap(const int num_levels,
+                                const int order,
+                                const float sampling_step,
+                                FeatureMap* map);
+
+// Maps a single histogram value, writing 2 * order + 1 features
+// to result.
+void MapIntersectionValue(const FeatureMap& map,
+                          const float value,
+                          float* result);
+
+// Maps the SpmKernel values between a pyramid and each of the
+// landmarks of a NYSTROM_INTERSECTION map. The result is dense.
+void MapNystromKernelValues(const FeatureMap& map,
+                            const std::vector<float>& kernel_values,
+                            SparseVectorFloat* result);
+
+// Applies the map to the pyramid. For a LINEAR map, this is the same
+// as UnrollHistograms. The total dimensionality of the mapped
+// representation is returned in result_dimensions.
+void MapFeatures(const FeatureMap& map,
+                 const SpatialPyramid& pyramid,
+                 SparseVectorFloat* result,
+                 int* result_dimensions = 0);
+
+// Returns the relative error, ||K - K'|| / ||K|| in the Frobenius
+// norm, between the SpmKernel gram matrix K of the pyramids and the
+// gram matrix K' of their mapped representations. The map must
+// approximate SpmKernel.
+double KernelApproximationError(const FeatureMap& map,
+                                const std::vector<SpatialPyramid>& pyramids);
+}}  // namespace.
+
+#endif  // SPATIAL_PYRAMID_FEATURE_MAP_H_
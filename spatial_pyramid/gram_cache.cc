@@ -0,0 +1,217 @@
+// Copyright 2011 Sancho McCann
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+
+// - Redistributions of source code must retain the above copyright
+//   notice, this list of conditions and the following disclaimer.
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "spatial_pyramid/gram_cache.h"
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "glog/logging.h"
+
+#include "util/util.h"
+
+using std::string;
+using std::vector;
+
+namespace sjm {
+namespace spatial_pyramid {
+
+namespace {
+
+const char kMagic[8] = {'S', 'J', 'M', 'G', 'R', 'A', 'M', '1'};
+
+struct GramCacheHeader {
+  char magic[8];
+  uint32_t kernel;
+  uint32_t reserved_a;
+  uint64_t num_items;
+  uint64_t reserved_b;
+};
+}  // namespace.
+
+uint64_t GramCache::RowOffset(const uint64_t item) {
+  // Each earlier row j holds a hash and j + 1 floats.
+  return sizeof(GramCacheHeader) + item * sizeof(uint64_t) +
+      item * (item + 1) / 2 * sizeof(float);
+}
+
+void GramCache::OpenOrDie(const string& filename, const SvmKernel kernel) {
+  Close();
+  filename_ = sjm::util::expand_user(filename);
+  fd_ = open(filename_.c_str(), O_RDWR | O_CREAT, 0644);
+  PCHECK(fd_ >= 0) << "Error opening " << filename_;
+  // Writing the header of a new file needs the exclusive lock.
+  PCHECK(flock(fd_, LOCK_EX) == 0);
+  struct stat file_stat;
+  PCHECK(fstat(fd_, &file_stat) == 0);
+  if (file_stat.st_size == 0) {
+    GramCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.kernel = kernel;
+    PCHECK(pwrite(fd_, &header, sizeof(header), 0) == sizeof(header));
+    LOG(INFO) << "Created gram cache " << filename_ << ".";
+  }
+  Load();
+  const GramCacheHeader* header =
+      reinterpret_cast<const GramCacheHeader*>(data_);
+  CHECK_EQ(0, memcmp(header->magic, kMagic, sizeof(kMagic))) <<
+      filename_ << " is not a gram cache.";
+  CHECK_EQ(static_cast<uint32_t>(kernel), header->kernel) <<
+      filename_ << " caches a different kernel.";
+  PCHECK(flock(fd_, LOCK_UN) == 0);
+  LOG(INFO) << "Opened gram cache " << filename_ << " with " << num_items_ <<
+      " items.";
+}
+
+void GramCache::Load() {
+  Unmap();
+  struct stat file_stat;
+  PCHECK(fstat(fd_, &file_stat) == 0);
+  CHECK_GE(static_cast<uint64_t>(file_stat.st_size), sizeof(GramCacheHeader))
+      << filename_ << " is truncated.";
+  mapped_size_ = file_stat.st_size;
+  void* mapped = mmap(NULL, mapped_size_, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      fd_, 0);
+  PCHECK(mapped != MAP_FAILED) << "Error mapping " << filename_;
+  data_ = static_cast<char*>(mapped);
+  const GramCacheHeader* header =
+      reinterpret_cast<const GramCacheHeader*>(data_);
+  // Rows past the end of the file (from an interrupted addition) are
+  // ignored.
+  num_items_ = header->num_items;
+  CHECK_LE(RowOffset(num_items_), mapped_size_) << filename_ <<
+      " is truncated.";
+  item_of_hash_.clear();
+  for (int i = 0; i < num_items_; ++i) {
+    uint64_t hash;
+    memcpy(&hash, data_ + RowOffset(i), sizeof(hash));
+    item_of_hash_[hash] = i;
+  }
+}
+
+void GramCache::Unmap() {
+  if (data_ != NULL) {
+    PCHECK(munmap(data_, mapped_size_) == 0);
+    data_ = NULL;
+    mapped_size_ = 0;
+  }
+}
+
+void GramCache::Close() {
+  Unmap();
+  if (fd_ >= 0) {
+    close(fd_);
+    fd_ = -1;
+  }
+  num_items_ = 0;
+  item_of_hash_.clear();
+}
+
+void GramCache::FindOrAddItems(const vector<uint64_t>& hashes,
+                               vector<int>* indices) {
+  CHECK_GE(fd_, 0) << "The gram cache isn't open.";
+  // Another process may have added items since this one loaded the
+  // file, so reload under the exclusive lock.
+  PCHECK(flock(fd_, LOCK_EX) == 0);
+  Load();
+  vector<uint64_t> new_hashes;
+  for (size_t i = 0; i < hashes.size(); ++i) {
+    if (!sjm::util::HasKey(item_of_hash_, hashes[i])) {
+      item_of_hash_[hashes[i]] = num_items_ + new_hashes.size();
+      new_hashes.push_back(hashes[i]);
+    }
+  }
+  if (!new_hashes.empty()) {
+    const int old_num_items = num_items_;
+    const int new_num_items = num_items_ + new_hashes.size();
+    PCHECK(ftruncate(fd_, RowOffset(new_num_items)) == 0);
+    Unmap();
+    void* mapped = mmap(NULL, RowOffset(new_num_items),
+                        PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    PCHECK(mapped != MAP_FAILED) << "Error mapping " << filename_;
+    data_ = static_cast<char*>(mapped);
+    mapped_size_ = RowOffset(new_num_items);
+    const float kUnknown = std::numeric_limits<float>::quiet_NaN();
+    for (int i = old_num_items; i < new_num_items; ++i) {
+      char* row = data_ + RowOffset(i);
+      memcpy(row, &new_hashes[i - old_num_items], sizeof(uint64_t));
+      float* values = reinterpret_cast<float*>(row + sizeof(uint64_t));
+      for (int j = 0; j <= i; ++j) {
+        values[j] = kUnknown;
+      }
+    }
+    // The count is updated last, so an interrupted addition leaves a
+    // valid cache.
+    PCHECK(msync(data_, mapped_size_, MS_SYNC) == 0);
+    num_items_ = new_num_items;
+    reinterpret_cast<GramCacheHeader*>(data_)->num_items = num_items_;
+    LOG(INFO) << "Added " << new_hashes.size() << " items to gram cache " <<
+        filename_ << ".";
+  }
+  PCHECK(flock(fd_, LOCK_UN) == 0);
+  indices->resize(hashes.size());
+  for (size_t i = 0; i < hashes.size(); ++i) {
+    (*indices)[i] = item_of_hash_[hashes[i]];
+  }
+}
+
+float* GramCache::Entry(const int a, const int b) const {
+  DCHECK_LT(a, num_items_);
+  DCHECK_LT(b, num_items_);
+  const int row = std::max(a, b);
+  const int column = std::min(a, b);
+  return reinterpret_cast<float*>(data_ + RowOffset(row) + sizeof(uint64_t))
+      + column;
+}
+
+int GramCache::FindItem(const uint64_t hash) const {
+  std::map<uint64_t, int>::const_iterator it = item_of_hash_.find(hash);
+  return it == item_of_hash_.end() ? -1 : it->second;
+}
+
+bool GramCache::Get(const int a, const int b, float* value) const {
+  const float cached = *Entry(a, b);
+  if (std::isnan(cached)) {
+    return false;
+  }
+  *value = cached;
+  return true;
+}
+
+void GramCache::Set(const int a, const int b, const float value) {
+  *Entry(a, b) = value;
+}
+}}  // namespace.
@@ -0,0 +1,110 @@
+// Copyright 2011 Sancho McCann
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+
+// - Redistributions of source code must retain the above copyright
+//   notice, this list of conditions and the following disclaimer.
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// A persistent cache of kernel values between spatial pyramids, so
+// that repeated trainer_cli and validate_cli runs over the same
+// pyramids (e.g. sweeps over C, folds, or categories) don't recompute
+// them.
+//
+// Items are identified by a hash of their content (see
+// sjm::util::Fnv1aHash), not by path or position, so a cache can be
+// shared by lists that order, subset, or extend the same pyramids.
+// The file holds the lower triangle of the gram matrix of all the
+// items ever added, one row per item, so adding items only appends to
+// the file. Entries that haven't been computed yet are NaN.
+//
+// File layout (native byte order):
+//   char[8] magic ("SJMGRAM1"), uint32 kernel (SvmKernel),
+//   uint32 reserved, uint64 num_items, uint64 reserved.
+//   Then for each item i: uint64 hash, float[i + 1] kernel values
+//   with items 0..i.
+//
+// The file is memory mapped. Several processes can use the same cache
+// at once: creating the file and adding items are serialized with a
+// file lock, which is released as soon as they're done, and concurrent
+// writes of the same entry write the same value.
+
+#ifndef SPATIAL_PYRAMID_GRAM_CACHE_H_
+#define SPATIAL_PYRAMID_GRAM_CACHE_H_
+
+#include <stdint.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "spatial_pyramid/spatial_pyramid_kernel.h"
+
+namespace sjm {
+namespace spatial_pyramid {
+
+class GramCache {
+ public:
+  GramCache() : fd_(-1), data_(NULL), mapped_size_(0), num_items_(0) {}
+  ~GramCache() {
+    Close();
+  }
+  // Opens the cache at filename, creating it if it doesn't exist. Dies
+  // if the file holds values for a different kernel.
+  void OpenOrDie(const std::string& filename, const SvmKernel kernel);
+  // Unmaps and closes the file. Any values that were set are flushed.
+  void Close();
+  // Stores the item index for each of the hashes in indices, adding
+  // items for the hashes that aren't in the cache yet. This remaps the
+  // file, so it must not be called concurrently with Get or Set.
+  void FindOrAddItems(const std::vector<uint64_t>& hashes,
+                      std::vector<int>* indices);
+  // Returns the item index of the hash, or -1 if it isn't in the
+  // cache, without adding it. Items that other processes added since
+  // this one last opened or added to the cache aren't found. It can be
+  // called concurrently with Get and Set.
+  int FindItem(const uint64_t hash) const;
+  // Returns true and stores the kernel value between items a and b in
+  // value if it has been computed.
+  bool Get(const int a, const int b, float* value) const;
+  // Stores the kernel value between items a and b. Different entries
+  // can be set concurrently.
+  void Set(const int a, const int b, const float value);
+  // Returns the number of items in the cache.
+  int size() const {
+    return num_items_;
+  }
+ private:
+  // Maps the whole file and reads the item hashes.
+  void Load();
+  void Unmap();
+  // Returns the byte offset of the row of the given item.
+  static uint64_t RowOffset(const uint64_t item);
+  float* Entry(const int a, const int b) const;
+
+  std::string filename_;
+  int fd_;
+  char* data_;
+  uint64_t mapped_size_;
+  int num_items_;
+  std::map<uint64_t, int> item_of_hash_;
+};
+}}  // namespace.
+
+#endif  // SPATIAL_PYRAMID_GRAM_CACHE_H_
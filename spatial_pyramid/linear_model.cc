@@ -0,0 +1,101 @@
+// Copyright 2011 Sancho McCann
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+
+// - Redistributions of source code must retain the above copyright
+//   notice, this list of conditions and the following disclaimer.
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "spatial_pyramid/linear_model.h"
+
+#include <string>
+#include <vector>
+
+#include "glog/logging.h"
+
+#include "spatial_pyramid/spatial_pyramid.pb.h"
+#include "spatial_pyramid/svm/svm.h"
+
+namespace sjm {
+namespace spatial_pyramid {
+
+void FoldPrecomputedLinearModel(
+    const svm_model& model,
+    const std::vector<SparseVectorFloat>& training_vectors,
+    const int dimensions,
+    LinearCategoryModel* result) {
+  CHECK_EQ(PRECOMPUTED, model.param.kernel_type) <<
+      "Only precomputed-kernel models can be folded.";
+  CHECK_EQ(2, model.nr_class) << "Expected a one-vs-rest model.";
+  result->clear_weight();
+  std::vector<float> weight(dimensions, 0);
+  // The decision value is for the class in label[0]. We flip the sign
+  // if needed so that positive scores always mean the +1 class.
+  const double sign = (model.label[0] == 1) ? 1 : -1;
+  for (int i = 0; i < model.l; ++i) {
+    // For precomputed kernels, the first node of each support vector
+    // holds the 1-based id of the training example.
+    const int example_id = static_cast<int>(model.SV[i][0].value) - 1;
+    CHECK_GE(example_id, 0);
+    CHECK_LT(example_id, static_cast<int>(training_vectors.size()));
+    const double coefficient = sign * model.sv_coef[0][i];
+    const SparseVectorFloat& x = training_vectors[example_id];
+    for (int j = 0; j < x.value_size(); ++j) {
+      CHECK_LT(x.value(j).index(), dimensions);
+      weight[x.value(j).index()] += coefficient * x.value(j).value();
+    }
+  }
+  for (int i = 0; i < dimensions; ++i) {
+    result->add_weight(weight[i]);
+  }
+  result->set_bias(-sign * model.rho[0]);
+}
+
+float LinearScore(const LinearCategoryModel& model,
+                  const SparseVectorFloat& x) {
+  const float* weight = model.weight().data();
+  const int dimensions = model.weight_size();
+  float score = model.bias();
+  for (int i = 0; i < x.value_size(); ++i) {
+    const int index = x.value(i).index();
+    if (index < dimensions) {
+      score += weight[index] * x.value(i).value();
+    }
+  }
+  return score;
+}
+
+std::string PredictCategory(const LinearModel& model,
+                            const SparseVectorFloat& x,
+                            float* score) {
+  std::string max_category = "";
+  float max_score = 0;
+  for (int i = 0; i < model.category_model_size(); ++i) {
+    float category_score = LinearScore(model.category_model(i), x);
+    if (i == 0 || category_score > max_score) {
+      max_score = category_score;
+      max_category = model.category_model(i).category();
+    }
+  }
+  if (score != NULL) {
+    *score = max_score;
+  }
+  return max_category;
+}
+}}  // namespace.
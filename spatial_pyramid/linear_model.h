@@ -0,0 +1,73 @@
+// Copyright 2011 Sancho McCann
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+
+// - Redistributions of source code must retain the above copyright
+//   notice, this list of conditions and the following disclaimer.
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// These functions convert one-vs-rest libsvm models that were trained
+// with a precomputed linear kernel into explicit weight vectors, and
+// use those weight vectors for prediction. A folded model is scored
+// with a single sparse-dense dot product per category instead of one
+// kernel evaluation per support vector.
+
+#ifndef SPATIAL_PYRAMID_LINEAR_MODEL_H_
+#define SPATIAL_PYRAMID_LINEAR_MODEL_H_
+
+#include <string>
+#include <vector>
+
+// Forward declaration.
+struct svm_model;
+
+namespace sjm {
+namespace spatial_pyramid {
+
+// Forward declarations.
+class LinearCategoryModel;
+class LinearModel;
+class SparseVectorFloat;
+
+// Folds sum_i alpha_i y_i x_i into a dense weight vector of the given
+// dimensions. The model must have been trained with kernel_type ==
+// PRECOMPUTED, where the kernel was the LinearKernel, and where the
+// 1-based example ids in the gram matrix rows refer to
+// training_vectors (which are the unrolled training pyramids). The
+// weight vector and bias are oriented so that a positive score means
+// the +1 label, regardless of the label order inside the model.
+void FoldPrecomputedLinearModel(
+    const svm_model& model,
+    const std::vector<SparseVectorFloat>& training_vectors,
+    const int dimensions,
+    LinearCategoryModel* result);
+
+// Returns Dot(model.weight, x) + model.bias. Indices in x that are
+// outside the weight vector contribute nothing.
+float LinearScore(const LinearCategoryModel& model,
+                  const SparseVectorFloat& x);
+
+// Returns the category whose model gives x the highest score. If
+// score is not NULL, the winning score is stored there.
+std::string PredictCategory(const LinearModel& model,
+                            const SparseVectorFloat& x,
+                            float* score = NULL);
+}}  // namespace.
+
+#endif  // SPATIAL_PYRAMID_LINEAR_MODEL_H_
@@ -0,0 +1,305 @@
+// Copyright 2011 Sancho McCann
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+
+// - Redistributions of source code must retain the above copyright
+//   notice, this list of conditions and the following disclaimer.
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "spatial_pyramid/linear_svm.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "boost/thread.hpp"
+#include "glog/logging.h"
+
+#include "spatial_pyramid/spatial_pyramid.pb.h"
+#include "util/util.h"
+
+using std::string;
+using std::vector;
+
+namespace sjm {
+namespace spatial_pyramid {
+
+namespace {
+
+// The examples in compressed sparse row form. The solver touches every
+// nonzero of every example on each pass, so this is much cheaper to
+// iterate over than the repeated protobuf messages.
+struct SparseRows {
+  vector<size_t> row_start;
+  vector<int> index;
+  vector<float> value;
+};
+
+// Builds the rows of the examples at the given indices, in order.
+void BuildSparseRows(const vector<SparseVectorFloat>& examples,
+                     const vector<int>& indices,
+                     const int dimensions,
+                     SparseRows* rows) {
+  size_t nonzeros = 0;
+  for (size_t i = 0; i < indices.size(); ++i) {
+    nonzeros += examples[indices[i]].value_size();
+  }
+  rows->row_start.resize(indices.size() + 1);
+  rows->index.resize(nonzeros);
+  rows->value.resize(nonzeros);
+  size_t next = 0;
+  for (size_t i = 0; i < indices.size(); ++i) {
+    const SparseVectorFloat& example = examples[indices[i]];
+    rows->row_start[i] = next;
+    for (int j = 0; j < example.value_size(); ++j) {
+      CHECK_LT(example.value(j).index(), dimensions) <<
+          "Example " << indices[i] <<
+          " is longer than the model dimensions.";
+      rows->index[next] = example.value(j).index();
+      rows->value[next] = example.value(j).value();
+      ++next;
+    }
+  }
+  rows->row_start[indices.size()] = next;
+}
+
+void BuildSparseRows(const vector<SparseVectorFloat>& examples,
+                     const int dimensions,
+                     SparseRows* rows) {
+  vector<int> all_examples(examples.size());
+  for (size_t i = 0; i < examples.size(); ++i) {
+    all_examples[i] = i;
+  }
+  BuildSparseRows(examples, all_examples, dimensions, rows);
+}
+
+// This follows solve_l2r_l1l2_svc from LIBLINEAR, including the
+// shrinking of the active set.
+void SolveDual(const SparseRows& rows,
+               const vector<int>& labels,
+               const int dimensions,
+               const LinearSvmParameters& params,
+               LinearCategoryModel* result) {
+  const int l = static_cast<int>(labels.size());
+  const double kInfinity = std::numeric_limits<double>::infinity();
+  // The bias weight is kept separately from w.
+  vector<double> w(dimensions, 0);
+  double w_bias = 0;
+  vector<double> alpha(l, 0);
+  // The diagonal of the dual Hessian (Q_ii + D_ii), D_ii, and the box
+  // constraint on each alpha.
+  vector<double> qd(l);
+  vector<double> diagonal(l);
+  vector<double> upper_bound(l);
+  vector<int> index(l);
+  for (int i = 0; i < l; ++i) {
+    CHECK(labels[i] == 1 || labels[i] == -1) << "Labels must be +1 or -1.";
+    const double c = labels[i] > 0 ? params.c_positive : params.c_negative;
+    if (params.loss == L1_LOSS) {
+      diagonal[i] = 0;
+      upper_bound[i] = c;
+    } else {
+      diagonal[i] = 0.5 / c;
+      upper_bound[i] = kInfinity;
+    }
+    double squared_norm = params.bias * params.bias;
+    for (size_t j = rows.row_start[i]; j < rows.row_start[i + 1]; ++j) {
+      squared_norm += rows.value[j] * rows.value[j];
+    }
+    qd[i] = squared_norm + diagonal[i];
+    index[i] = i;
+  }
+
+  // A fixed seed keeps training deterministic.
+  std::mt19937 random_number_generator(0);
+  int active_size = l;
+  double projected_gradient_max_old = kInfinity;
+  double projected_gradient_min_old = -kInfinity;
+  int iteration = 0;
+  while (iteration < params.max_iterations) {
+    double projected_gradient_max_new = -kInfinity;
+    double projected_gradient_min_new = kInfinity;
+    std::shuffle(index.begin(), index.begin() + active_size,
+                 random_number_generator);
+    for (int s = 0; s < active_size; ++s) {
+      const int i = index[s];
+      const int y = labels[i];
+      double gradient = w_bias * params.bias;
+      for (size_t j = rows.row_start[i]; j < rows.row_start[i + 1]; ++j) {
+        gradient += w[rows.index[j]] * rows.value[j];
+      }
+      gradient = gradient * y - 1 + alpha[i] * diagonal[i];
+
+      double projected_gradient = 0;
+      if (alpha[i] == 0) {
+        if (gradient > projected_gradient_max_old) {
+          // Shrink this variable out of the active set.
+          --active_size;
+          std::swap(index[s], index[active_size]);
+          --s;
+          continue;
+        } else if (gradient < 0) {
+          projected_gradient = gradient;
+        }
+      } else if (alpha[i] == upper_bound[i]) {
+        if (gradient < projected_gradient_min_old) {
+          --active_size;
+          std::swap(index[s], index[active_size]);
+          --s;
+          continue;
+        } else if (gradient > 0) {
+          projected_gradient = gradient;
+        }
+      } else {
+        projected_gradient = gradient;
+      }
+
+      projected_gradient_max_new =
+          std::max(projected_gradient_max_new, projected_gradient);
+      projected_gradient_min_new =
+          std::min(projected_gradient_min_new, projected_gradient);
+
+      if (std::fabs(projected_gradient) > 1.0e-12) {
+        const double alpha_old = alpha[i];
+        alpha[i] = std::min(std::max(alpha[i] - gradient / qd[i], 0.0),
+                            upper_bound[i]);
+        const double step = (alpha[i] - alpha_old) * y;
+        for (size_t j = rows.row_start[i]; j < rows.row_start[i + 1]; ++j) {
+          w[rows.index[j]] += step * rows.value[j];
+        }
+        w_bias += step * params.bias;
+      }
+    }
+    ++iteration;
+
+    if (projected_gradient_max_new - projected_gradient_min_new <=
+        params.epsilon) {
+      if (active_size == l) {
+        break;
+      } else {
+        // Check the optimality of the shrunk variables with a full pass.
+        active_size = l;
+        projected_gradient_max_old = kInfinity;
+        projected_gradient_min_old = -kInfinity;
+        continue;
+      }
+    }
+    projected_gradient_max_old = projected_gradient_max_new;
+    projected_gradient_min_old = projected_gradient_min_new;
+    if (projected_gradient_max_old <= 0) {
+      projected_gradient_max_old = kInfinity;
+    }
+    if (projected_gradient_min_old >= 0) {
+      projected_gradient_min_old = -kInfinity;
+    }
+  }
+  if (iteration >= params.max_iterations) {
+    LOG(WARNING) << "Dual coordinate descent reached the maximum of " <<
+        params.max_iterations << " iterations.";
+  }
+
+  result->clear_weight();
+  for (int d = 0; d < dimensions; ++d) {
+    result->add_weight(w[d]);
+  }
+  result->set_bias(w_bias * params.bias);
+}
+
+// The worker function for the one-vs-rest training.
+void TrainCategory(const SparseRows& rows,
+                   const vector<string>& categories,
+                   const string& category,
+                   const int dimensions,
+                   const LinearSvmParameters& params,
+                   LinearCategoryModel* result) {
+  vector<int> labels(categories.size());
+  for (size_t i = 0; i < categories.size(); ++i) {
+    labels[i] = (categories[i] == category) ? 1 : -1;
+  }
+  result->set_category(category);
+  SolveDual(rows, labels, dimensions, params, result);
+  LOG(INFO) << "[" << category << "] Trained linear model.";
+}
+}  // namespace.
+
+void TrainLinearSvm(const vector<SparseVectorFloat>& examples,
+                    const vector<int>& labels,
+                    const int dimensions,
+                    const LinearSvmParameters& params,
+                    LinearCategoryModel* result) {
+  CHECK_EQ(examples.size(), labels.size());
+  SparseRows rows;
+  BuildSparseRows(examples, dimensions, &rows);
+  SolveDual(rows, labels, dimensions, params, result);
+}
+
+void TrainLinearSvm(const vector<SparseVectorFloat>& examples,
+                    const vector<int>& indices,
+                    const vector<int>& labels,
+                    const int dimensions,
+                    const LinearSvmParameters& params,
+                    LinearCategoryModel* result) {
+  CHECK_EQ(indices.size(), labels.size());
+  SparseRows rows;
+  BuildSparseRows(examples, indices, dimensions, &rows);
+  SolveDual(rows, labels, dimensions, params, result);
+}
+
+void TrainOneVsRestLinearSvm(const vector<SparseVectorFloat>& examples,
+                             const vector<string>& categories,
+                             const std::set<string>& category_set,
+                             const int dimensions,
+                             const LinearSvmParameters& params,
+                             const int num_threads,
+                             LinearModel* result) {
+  CHECK_EQ(examples.size(), categories.size());
+  CHECK_GT(num_threads, 0);
+  result->Clear();
+  result->set_dimensions(dimensions);
+  // The examples are shared, read-only, by all of the worker threads.
+  SparseRows rows;
+  BuildSparseRows(examples, dimensions, &rows);
+  // Allocate all the result messages up front so that each thread
+  // only writes to its own message.
+  for (size_t i = 0; i < category_set.size(); ++i) {
+    result->add_category_model();
+  }
+  vector<boost::thread*> thread_pool;
+  int category_index = 0;
+  for (std::set<string>::const_iterator category = category_set.begin();
+       category != category_set.end(); ++category) {
+    sjm::util::PollForAvailablePoolSpace(num_threads, 10, &thread_pool);
+    boost::thread* t = new boost::thread(
+        TrainCategory,
+        boost::cref(rows),
+        boost::cref(categories),
+        *category,
+        dimensions,
+        boost::cref(params),
+        result->mutable_category_model(category_index));
+    thread_pool.push_back(t);
+    ++category_index;
+  }
+  sjm::util::JoinWithPool(&thread_pool);
+}
+}}  // namespace.
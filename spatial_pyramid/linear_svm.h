@@ -0,0 +1,102 @@
+// Copyright 2011 Sancho McCann
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+
+// - Redistributions of source code must retain the above copyright
+//   notice, this list of conditions and the following disclaimer.
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// A dual coordinate descent solver for L2-regularized linear SVMs
+// (Hsieh et al., "A Dual Coordinate Descent Method for Large-scale
+// Linear SVM", ICML 2008). This is the algorithm used by LIBLINEAR's
+// L2R_L1LOSS_SVC_DUAL and L2R_L2LOSS_SVC_DUAL solvers, working
+// directly on unrolled pyramids (see UnrollHistograms). Memory use is
+// O(N * nnz) rather than the O(N^2) of a precomputed gram matrix.
+
+#ifndef SPATIAL_PYRAMID_LINEAR_SVM_H_
+#define SPATIAL_PYRAMID_LINEAR_SVM_H_
+
+#include <set>
+#include <string>
+#include <vector>
+
+namespace sjm {
+namespace spatial_pyramid {
+
+// Forward declarations.
+class LinearCategoryModel;
+class LinearModel;
+class SparseVectorFloat;
+
+enum LinearSvmLoss {
+  L1_LOSS,  // The standard hinge loss.
+  L2_LOSS   // The squared hinge loss.
+};
+
+struct LinearSvmParameters {
+  LinearSvmParameters()
+      : loss(L1_LOSS), c_positive(1), c_negative(1), epsilon(0.1),
+        max_iterations(1000), bias(1) {}
+  LinearSvmLoss loss;
+  // The regularizers for the positive and negative examples.
+  double c_positive;
+  double c_negative;
+  // The stopping tolerance on the projected gradient.
+  double epsilon;
+  int max_iterations;
+  // If > 0, every example is augmented with a constant feature of
+  // this value, so the (regularized) bias is learned like LIBLINEAR's
+  // -B option.
+  double bias;
+};
+
+// Trains a binary classifier. labels[i] must be +1 or -1. The
+// resulting weight vector has the given dimensions, and positive
+// scores (see LinearScore) mean the +1 class.
+void TrainLinearSvm(const std::vector<SparseVectorFloat>& examples,
+                    const std::vector<int>& labels,
+                    const int dimensions,
+                    const LinearSvmParameters& params,
+                    LinearCategoryModel* result);
+
+// Trains on just the examples at the given indices, without copying
+// them (e.g. for cross validation). labels[i] is the label of
+// examples[indices[i]].
+void TrainLinearSvm(const std::vector<SparseVectorFloat>& examples,
+                    const std::vector<int>& indices,
+                    const std::vector<int>& labels,
+                    const int dimensions,
+                    const LinearSvmParameters& params,
+                    LinearCategoryModel* result);
+
+// Trains one classifier per category in category_set, with the
+// examples labeled with that category as the positive class and all
+// others as the negative class. The categories are trained in
+// parallel with up to num_threads threads. The models are stored in
+// result in the iteration order of category_set.
+void TrainOneVsRestLinearSvm(const std::vector<SparseVectorFloat>& examples,
+                             const std::vector<std::string>& categories,
+                             const std::set<std::string>& category_set,
+                             const int dimensions,
+                             const LinearSvmParameters& params,
+                             const int num_threads,
+                             LinearModel* result);
+}}  // namespace.
+
+#endif  // SPATIAL_PYRAMID_LINEAR_SVM_H_
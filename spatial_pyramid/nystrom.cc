@@ -0,0 +1,258 @@
+// Copyright 2011 Sancho McCann
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+
+// - Redistributions of source code must retain the above copyright
+//   notice, this list of conditions and the following disclaimer.
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "spatial_pyramid/nystrom.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <random>
+#include <vector>
+
+#include "boost/thread.hpp"
+#include "glog/logging.h"
+
+#include "spatial_pyramid/feature_map.h"
+#include "spatial_pyramid/spatial_pyramid.pb.h"
+#include "spatial_pyramid/spatial_pyramid_kernel.h"
+#include "util/util.h"
+
+using std::vector;
+
+namespace sjm {
+namespace spatial_pyramid {
+
+namespace {
+
+// Computes the kernel values between the landmark and every
+// num_shards-th example, starting at shard. If landmark is NULL, each
+// example's kernel value with itself is computed instead.
+void ComputeKernelColumnShard(const vector<SpatialPyramid>& examples,
+                              const SpatialPyramid* landmark,
+                              const int num_levels,
+                              const int shard,
+                              const int num_shards,
+                              vector<float>* column) {
+  for (size_t i = shard; i < examples.size(); i += num_shards) {
+    const SpatialPyramid& other = landmark != NULL ? *landmark : examples[i];
+    (*column)[i] = SpmKernel(examples[i], other, num_levels);
+  }
+}
+
+void ComputeKernelColumn(const vector<SpatialPyramid>& examples,
+                         const SpatialPyramid* landmark,
+                         const int num_levels,
+                         const int num_threads,
+                         vector<float>* column) {
+  column->resize(examples.size());
+  vector<boost::thread*> threads;
+  for (int shard = 0; shard < num_threads; ++shard) {
+    threads.push_back(new boost::thread(
+        ComputeKernelColumnShard, boost::cref(examples), landmark,
+        num_levels, shard, num_threads, column));
+  }
+  sjm::util::JoinWithPool(&threads);
+}
+
+// Maps every num_shards-th example, starting at shard, from its column
+// of kernel values with the landmarks.
+void MapExamplesShard(const FeatureMap& map,
+                      const vector<vector<float> >& columns,
+                      const int shard,
+                      const int num_shards,
+                      vector<SparseVectorFloat>* mapped) {
+  vector<float> kernel_values(columns.size());
+  for (size_t i = shard; i < mapped->size(); i += num_shards) {
+    for (size_t j = 0; j < columns.size(); ++j) {
+      kernel_values[j] = columns[j][i];
+    }
+    MapNystromKernelValues(map, kernel_values, &(*mapped)[i]);
+  }
+}
+
+// Computes the Cholesky factor of the n x n symmetric positive
+// semi-definite matrix (row major), packed row by row. Nearly
+// duplicate landmarks make the matrix singular, so if a pivot is too
+// small, a small multiple of the mean diagonal is added to the
+// diagonal and the factorization is retried.
+void FactorLandmarkGramMatrix(const vector<double>& matrix,
+                              const int n,
+                              vector<double>* factor) {
+  double mean_diagonal = 0;
+  for (int i = 0; i < n; ++i) {
+    mean_diagonal += matrix[i * n + i];
+  }
+  mean_diagonal /= n;
+  CHECK_GT(mean_diagonal, 0) << "The landmarks are all empty.";
+  const double kMinimumPivot = 1e-7 * mean_diagonal;
+  double jitter = 0;
+  while (true) {
+    factor->assign(n * (n + 1) / 2, 0);
+    bool success = true;
+    for (int i = 0; i < n && success; ++i) {
+      double* row_i = &(*factor)[i * (i + 1) / 2];
+      for (int j = 0; j <= i; ++j) {
+        const double* row_j = &(*factor)[j * (j + 1) / 2];
+        double sum = matrix[i * n + j];
+        for (int k = 0; k < j; ++k) {
+          sum -= row_i[k] * row_j[k];
+        }
+        if (i == j) {
+          sum += jitter;
+          if (sum <= kMinimumPivot) {
+            success = false;
+            break;
+          }
+          row_i[i] = std::sqrt(sum);
+        } else {
+          row_i[j] = sum / row_j[j];
+        }
+      }
+    }
+    if (success) {
+      break;
+    }
+    jitter = (jitter == 0) ? 1e-6 * mean_diagonal : jitter * 10;
+    LOG(INFO) << "Landmark gram matrix is near singular. Retrying with " <<
+        "jitter " << jitter << ".";
+  }
+}
+}  // namespace.
+
+void BuildNystromFeatureMap(const vector<SpatialPyramid>& examples,
+                            const int num_levels,
+                            const int rank,
+                            const LandmarkSelection selection,
+                            const int num_threads,
+                            FeatureMap* map,
+                            vector<SparseVectorFloat>* mapped,
+                            vector<int>* landmarks) {
+  CHECK_GT(rank, 0);
+  CHECK_GT(num_threads, 0);
+  CHECK(!examples.empty());
+  const int num_examples = examples.size();
+  const int num_landmarks = std::min(rank, num_examples);
+  // A fixed seed keeps the landmarks deterministic.
+  std::mt19937 random_number_generator(0);
+  vector<int> landmark_indices;
+  // columns[j][i] is the kernel value between example i and landmark j.
+  vector<vector<float> > columns;
+
+  if (selection == UNIFORM_LANDMARKS) {
+    vector<int> order(num_examples);
+    for (int i = 0; i < num_examples; ++i) {
+      order[i] = i;
+    }
+    std::shuffle(order.begin(), order.end(), random_number_generator);
+    landmark_indices.assign(order.begin(), order.begin() + num_landmarks);
+    for (int j = 0; j < num_landmarks; ++j) {
+      columns.push_back(vector<float>());
+      ComputeKernelColumn(examples, &examples[landmark_indices[j]],
+                          num_levels, num_threads, &columns.back());
+    }
+  } else {
+    CHECK_EQ(KMEANS_PLUS_PLUS_LANDMARKS, selection);
+    vector<float> diagonal;
+    ComputeKernelColumn(examples, NULL, num_levels, num_threads, &diagonal);
+    vector<double> distance(num_examples,
+                            std::numeric_limits<double>::infinity());
+    int next = std::uniform_int_distribution<int>(
+        0, num_examples - 1)(random_number_generator);
+    while (true) {
+      landmark_indices.push_back(next);
+      columns.push_back(vector<float>());
+      ComputeKernelColumn(examples, &examples[next], num_levels, num_threads,
+                          &columns.back());
+      if (static_cast<int>(landmark_indices.size()) == num_landmarks) {
+        break;
+      }
+      // The kernel values with the new landmark are all that's needed
+      // to update each example's distance to its nearest landmark.
+      const vector<float>& column = columns.back();
+      double total = 0;
+      for (int i = 0; i < num_examples; ++i) {
+        const double d = std::max(
+            0.0, diagonal[i] + diagonal[next] - 2.0 * column[i]);
+        distance[i] = std::min(distance[i], d);
+        total += distance[i];
+      }
+      distance[next] = 0;
+      if (total <= 0) {
+        LOG(INFO) << "All examples coincide with a landmark. Stopping at " <<
+            landmark_indices.size() << " landmarks.";
+        break;
+      }
+      // Sample the next landmark with probability proportional to its
+      // squared distance.
+      double target = std::uniform_real_distribution<double>(
+          0, total)(random_number_generator);
+      next = -1;
+      for (int i = 0; i < num_examples; ++i) {
+        if (distance[i] > 0) {
+          next = i;
+          target -= distance[i];
+          if (target <= 0) {
+            break;
+          }
+        }
+      }
+      CHECK_GE(next, 0);
+    }
+  }
+
+  const int m = landmark_indices.size();
+  vector<double> landmark_gram(m * m);
+  for (int a = 0; a < m; ++a) {
+    for (int b = 0; b < m; ++b) {
+      landmark_gram[a * m + b] = columns[b][landmark_indices[a]];
+    }
+  }
+  vector<double> factor;
+  FactorLandmarkGramMatrix(landmark_gram, m, &factor);
+
+  map->Clear();
+  map->set_kernel(FeatureMap::NYSTROM_INTERSECTION);
+  map->set_num_levels(num_levels);
+  for (int j = 0; j < m; ++j) {
+    map->add_landmark()->CopyFrom(examples[landmark_indices[j]]);
+  }
+  for (size_t i = 0; i < factor.size(); ++i) {
+    map->add_cholesky_factor(factor[i]);
+  }
+
+  if (mapped != NULL) {
+    mapped->resize(num_examples);
+    vector<boost::thread*> threads;
+    for (int shard = 0; shard < num_threads; ++shard) {
+      threads.push_back(new boost::thread(
+          MapExamplesShard, boost::cref(*map), boost::cref(columns),
+          shard, num_threads, mapped));
+    }
+    sjm::util::JoinWithPool(&threads);
+  }
+  if (landmarks != NULL) {
+    *landmarks = landmark_indices;
+  }
+}
+}}  // namespace.
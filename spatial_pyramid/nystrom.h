@@ -0,0 +1,72 @@
+// Copyright 2011 Sancho McCann
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+
+// - Redistributions of source code must retain the above copyright
+//   notice, this list of conditions and the following disclaimer.
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// The Nystrom approximation of the SpmKernel gram matrix. Given m
+// landmark pyramids, the N x N gram matrix is approximated by
+// C * inverse(W) * C', where C holds the N x m kernel values between
+// the examples and the landmarks, and W is the m x m gram matrix of
+// the landmarks. Only the N x m block is computed. Factoring W = L * L'
+// gives each example the m-dimensional representation
+// inverse(L) * c_i, which can be used with a linear SVM (see
+// linear_svm.h).
+
+#ifndef SPATIAL_PYRAMID_NYSTROM_H_
+#define SPATIAL_PYRAMID_NYSTROM_H_
+
+#include <vector>
+
+namespace sjm {
+namespace spatial_pyramid {
+
+// Forward declarations.
+class FeatureMap;
+class SpatialPyramid;
+class SparseVectorFloat;
+
+enum LandmarkSelection {
+  // The landmarks are sampled uniformly without replacement.
+  UNIFORM_LANDMARKS,
+  // The landmarks are sampled with k-means++ seeding, using the
+  // distance induced by the kernel:
+  // d(x, y)^2 = K(x, x) + K(y, y) - 2 * K(x, y).
+  KMEANS_PLUS_PLUS_LANDMARKS
+};
+
+// Selects rank landmarks from the examples, and builds a
+// NYSTROM_INTERSECTION map for SpmKernel(a, b, num_levels). The kernel
+// values are computed with up to num_threads threads. If mapped is not
+// NULL, the mapped examples are stored there (this reuses the kernel
+// values that were computed to build the map). If landmarks is not
+// NULL, the indices of the landmark examples are stored there.
+void BuildNystromFeatureMap(const std::vector<SpatialPyramid>& examples,
+                            const int num_levels,
+                            const int rank,
+                            const LandmarkSelection selection,
+                            const int num_threads,
+                            FeatureMap* map,
+                            std::vector<SparseVectorFloat>* mapped = 0,
+                            std::vector<int>* landmarks = 0);
+}}  // namespace.
+
+#endif  // SPATIAL_PYRAMID_NYSTROM_H_
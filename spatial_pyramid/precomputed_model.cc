@@ -0,0 +1,168 @@
+// Copyright 2011 Sancho McCann
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+
+// - Redistributions of source code must retain the above copyright
+//   notice, this list of conditions and the following disclaimer.
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include "spatial_pyramid/precomputed_model.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <string>
+
+#include "glog/logging.h"
+
+#include "spatial_pyramid/svm/svm.h"
+#include "util/util.h"
+
+namespace sjm {
+namespace spatial_pyramid {
+
+namespace {
+
+const char kMagic[8] = {'S', 'J', 'M', 'S', 'V', 'M', 'B', '1'};
+
+struct BinaryModelHeader {
+  char magic[8];
+  uint32_t num_support_vectors;
+  uint32_t category_length;
+  float bias;
+  uint32_t reserved;
+};
+
+// The arrays start at a multiple of 4 bytes after the category name.
+size_t ArrayOffset(const size_t category_length) {
+  return sizeof(BinaryModelHeader) + (category_length + 3) / 4 * 4;
+}
+}  // namespace.
+
+void CompactPrecomputedModel(const std::string& category,
+                             const svm_model& model,
+                             PrecomputedModel* result) {
+  CHECK_EQ(PRECOMPUTED, model.param.kernel_type) <<
+      "Only precomputed-kernel models can be compacted.";
+  CHECK_EQ(2, model.nr_class) << "Expected a one-vs-rest model.";
+  // The decision value is for the class in label[0].
+  const double sign = (model.label[0] == 1) ? 1 : -1;
+  result->category = category;
+  result->support_vectors.resize(model.l);
+  result->coefficients.resize(model.l);
+  for (int i = 0; i < model.l; ++i) {
+    // The first node of each support vector holds the 1-based id of
+    // the training example.
+    result->support_vectors[i] = static_cast<int>(model.SV[i][0].value) - 1;
+    CHECK_GE(result->support_vectors[i], 0);
+    result->coefficients[i] = sign * model.sv_coef[0][i];
+  }
+  result->bias = -sign * model.rho[0];
+}
+
+float PrecomputedScore(const PrecomputedModel& model,
+                       const float* kernel_values) {
+  const int* support_vectors = model.support_vectors.data();
+  const float* coefficients = model.coefficients.data();
+  const int num_support_vectors = model.support_vectors.size();
+  float score = model.bias;
+  for (int i = 0; i < num_support_vectors; ++i) {
+    score += coefficients[i] * kernel_values[support_vectors[i]];
+  }
+  return score;
+}
+
+void WritePrecomputedModelOrDie(const std::string& filename,
+                                const PrecomputedModel& model) {
+  CHECK_EQ(model.support_vectors.size(), model.coefficients.size());
+  const size_t num_support_vectors = model.support_vectors.size();
+  const size_t array_offset = ArrayOffset(model.category.size());
+  std::string data(array_offset + num_support_vectors *
+                   (sizeof(int32_t) + sizeof(float)), '\0');
+  BinaryModelHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.num_support_vectors = num_support_vectors;
+  header.category_length = model.category.size();
+  header.bias = model.bias;
+  memcpy(&data[0], &header, sizeof(header));
+  memcpy(&data[sizeof(header)], model.category.data(), model.category.size());
+  for (size_t i = 0; i < num_support_vectors; ++i) {
+    const int32_t index = model.support_vectors[i];
+    memcpy(&data[array_offset + i * sizeof(index)], &index, sizeof(index));
+  }
+  if (num_support_vectors > 0) {
+    memcpy(&data[array_offset + num_support_vectors * sizeof(int32_t)],
+           &model.coefficients[0], num_support_vectors * sizeof(float));
+  }
+  sjm::util::WriteStringToFileOrDie(filename, data);
+}
+
+void ReadPrecomputedModelOrDie(const std::string& filename,
+                               PrecomputedModel* result) {
+  const std::string path = sjm::util::expand_user(filename);
+  const int fd = open(path.c_str(), O_RDONLY);
+  PCHECK(fd >= 0) << "Error opening " << path;
+  struct stat file_stat;
+  PCHECK(fstat(fd, &file_stat) == 0);
+  const size_t file_size = file_stat.st_size;
+  CHECK_GE(file_size, sizeof(BinaryModelHeader)) << path << " is truncated.";
+  void* mapped = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  PCHECK(mapped != MAP_FAILED) << "Error mapping " << path;
+  close(fd);
+  const char* data = static_cast<const char*>(mapped);
+
+  BinaryModelHeader header;
+  memcpy(&header, data, sizeof(header));
+  CHECK_EQ(0, memcmp(header.magic, kMagic, sizeof(kMagic))) <<
+      path << " is not a binary model.";
+  const size_t num_support_vectors = header.num_support_vectors;
+  const size_t array_offset = ArrayOffset(header.category_length);
+  CHECK_EQ(array_offset + num_support_vectors *
+           (sizeof(int32_t) + sizeof(float)), file_size) <<
+      path << " has the wrong size.";
+  result->category.assign(data + sizeof(header), header.category_length);
+  result->bias = header.bias;
+  result->support_vectors.resize(num_support_vectors);
+  result->coefficients.resize(num_support_vectors);
+  if (num_support_vectors > 0) {
+    // int is int32_t on all the platforms we build on.
+    memcpy(&result->support_vectors[0], data + array_offset,
+           num_support_vectors * sizeof(int32_t));
+    memcpy(&result->coefficients[0],
+           data + array_offset + num_support_vectors * sizeof(int32_t),
+           num_support_vectors * sizeof(float));
+  }
+  PCHECK(munmap(mapped, file_size) == 0);
+}
+
+bool IsBinaryPrecomputedModel(const std::string& filename) {
+  FILE* f = fopen(sjm::util::expand_user(filename).c_str(), "rb");
+  CHECK(f != NULL) << "Error opening " << filename;
+  char magic[sizeof(kMagic)];
+  const bool is_binary = fread(magic, 1, sizeof(magic), f) == sizeof(magic) &&
+      memcmp(magic, kMagic, sizeof(kMagic)) == 0;
+  CHECK_EQ(0, fclose(f));
+  return is_binary;
+}
+}}  // namespace.
@@ -0,0 +1,82 @@
+// Copyright 2011 Sancho McCann
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+
+// - Redistributions of source code must retain the above copyright
+//   notice, this list of conditions and the following disclaimer.
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// A compact form of the one-vs-rest libsvm models that were trained on
+// a precomputed kernel. Only the support vectors' training example
+// indices and coefficients are kept, so a model can score a row of
+// kernel values (e.g. from ComputeKernelBlock) directly, without
+// building libsvm's svm_node vectors.
+
+#ifndef SPATIAL_PYRAMID_PRECOMPUTED_MODEL_H_
+#define SPATIAL_PYRAMID_PRECOMPUTED_MODEL_H_
+
+#include <string>
+#include <vector>
+
+// Forward declaration.
+struct svm_model;
+
+namespace sjm {
+namespace spatial_pyramid {
+
+struct PrecomputedModel {
+  PrecomputedModel() : bias(0) {}
+  std::string category;
+  // The 0-based indices of the support vectors among the training
+  // examples, in the order of the training gram matrix.
+  std::vector<int> support_vectors;
+  // The coefficients are oriented, like the bias, so that a positive
+  // score means category.
+  std::vector<float> coefficients;
+  float bias;
+};
+
+// Extracts the support vectors, coefficients, and bias from a model
+// that was trained with kernel_type == PRECOMPUTED.
+void CompactPrecomputedModel(const std::string& category,
+                             const svm_model& model,
+                             PrecomputedModel* result);
+
+// Returns the model's score for an example, given the kernel values
+// between the example and each of the training examples.
+float PrecomputedScore(const PrecomputedModel& model,
+                       const float* kernel_values);
+
+// Saves the model in a binary format that loads without any parsing: a
+// fixed header, the category name, and then the support vector indices
+// and coefficients as int32 and float arrays.
+void WritePrecomputedModelOrDie(const std::string& filename,
+                                const PrecomputedModel& model);
+
+// Loads a model saved by WritePrecomputedModelOrDie. The file is
+// mapped, and its arrays are copied out directly.
+void ReadPrecomputedModelOrDie(const std::string& filename,
+                               PrecomputedModel* result);
+
+// Returns true if the file starts with the header written by
+// WritePrecomputedModelOrDie (as opposed to being a libsvm text model).
+bool IsBinaryPrecomputedModel(const std::string& filename);
+}}  // namespace.
+
+#endif  // SPATIAL_PYRAMID_PRECOMPUTED_MODEL_H_
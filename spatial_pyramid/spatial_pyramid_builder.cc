@@ -33,6 +33,7 @@
 #include "glog/logging.h"
 
 #include "codebooks/dictionary.pb.h"
+#include "codebooks/pca.h"
 #include "sift/sift_descriptors.pb.h"
 #include "spatial_pyramid/spatial_pyramid.pb.h"
 #include "util/util.h"
@@ -51,26 +52,13 @@ bool SpatialPyramidBuilder::Init(
     return false;
   }
 
-  // Delete any previous data/indices.
-  for (size_t i = 0; i < dictionary_data_.size(); ++i) {
-    if (dictionary_data_[i]) {
-      delete[] dictionary_data_[i]->ptr();
-      delete dictionary_data_[i];
-    }
-  }
-  for (size_t i = 0; i < dictionary_indices_.size(); ++i) {
-    if (dictionary_indices_[i]) {
-      delete dictionary_indices_[i];
-    }
-  }
-  dictionary_data_.clear();
-  dictionary_indices_.clear();
-  location_weightings_.clear();
+  FreeData();
 
   // Making room in the vectors for the dictionary/index data.
   dictionary_data_.resize(dictionaries.size());
   dictionary_indices_.resize(dictionaries.size());
   location_weightings_.resize(dictionaries.size());
+  projections_.resize(dictionaries.size());
 
   // Creating the approximate nearest neighbor indices for codeword
   // matching. This (optionally) uses multiple threads in the case
@@ -94,6 +82,27 @@ bool SpatialPyramidBuilder::Init(
   return true;
 }
 
+void SpatialPyramidBuilder::FreeData() {
+  for (size_t i = 0; i < dictionary_data_.size(); ++i) {
+    if (dictionary_data_[i]) {
+      delete[] dictionary_data_[i]->ptr();
+      delete dictionary_data_[i];
+    }
+  }
+  for (size_t i = 0; i < dictionary_indices_.size(); ++i) {
+    if (dictionary_indices_[i]) {
+      delete dictionary_indices_[i];
+    }
+  }
+  for (size_t i = 0; i < projections_.size(); ++i) {
+    delete projections_[i];
+  }
+  dictionary_data_.clear();
+  dictionary_indices_.clear();
+  location_weightings_.clear();
+  projections_.clear();
+}
+
 // This is the worker function for the dictionary building. It is run
 // multi-threaded by the Init function.
 void SpatialPyramidBuilder::InitADictionary(
@@ -102,6 +111,11 @@ void SpatialPyramidBuilder::InitADictionary(
   int dimensions = dictionaries[dictionary_id].centroid(0).bin_size();
   location_weightings_[dictionary_id] =
       dictionaries[dictionary_id].location_weighting();
+  projections_[dictionary_id] = NULL;
+  if (dictionaries[dictionary_id].has_projection()) {
+    projections_[dictionary_id] = new sjm::codebooks::Projection(
+        dictionaries[dictionary_id].projection());
+  }
 
   // Store the new dictionary data in a matrix.
   flann::Matrix<float>* data = new flann::Matrix<float>(
@@ -178,14 +192,28 @@ void SpatialPyramidBuilder::BuildPyramid(
     int capped_k =
         std::min(k, static_cast<int>(dictionary_data_[dictionary_id]->rows));
 
+    // Descriptors are coded in the space the dictionary was learned
+    // in.
+    const sjm::sift::DescriptorSet* coded = &descriptors;
+    sjm::sift::DescriptorSet projected;
+    if (projections_[dictionary_id]) {
+      projected.CopyFrom(descriptors);
+      sjm::codebooks::ProjectDescriptorSet(*projections_[dictionary_id],
+                                           &projected);
+      coded = &projected;
+    }
+
     // The feature dimensionality includes at least all of the
     // appearance bins.
-    int dimensions = descriptors.sift_descriptor(0).bin_size();
+    int dimensions = coded->sift_descriptor(0).bin_size();
     // If location weighting is used, then the feature also includes
     // two bins for the spatial location.
     if (location_weightings_[dictionary_id] > 0) {
       dimensions += 2;
     }
+    CHECK_EQ(static_cast<size_t>(dimensions),
+             dictionary_data_[dictionary_id]->cols) <<
+        "The descriptors don't have the dictionary's dimensions.";
 
     // This creates the FLANN query matrix out of the query
     // descriptors. This is done for each dictionary because the
@@ -197,8 +225,8 @@ void SpatialPyramidBuilder::BuildPyramid(
         descriptors.sift_descriptor_size(),
         dimensions);
     for (int i = 0; i < descriptors.sift_descriptor_size(); ++i) {
-      for (int j = 0; j < descriptors.sift_descriptor(i).bin_size(); ++j) {
-        query[i][j] = descriptors.sift_descriptor(i).bin(j);
+      for (int j = 0; j < coded->sift_descriptor(i).bin_size(); ++j) {
+        query[i][j] = coded->sift_descriptor(i).bin(j);
       }
       if (location_weightings_[dictionary_id] > 0) {
         query[i][dimensions - 2] =
@@ -49,6 +49,7 @@
 namespace sjm {
 namespace codebooks {
 class Dictionary;
+class Projection;
 }}
 
 namespace sjm {
@@ -75,29 +76,15 @@ class SpatialPyramidBuilder {
     beta_ = 10;
   }
   ~SpatialPyramidBuilder() {
-    // TODO(sanchom): Refactor this out to a private FreeData
-    // function.
-    for (size_t i = 0; i < dictionary_data_.size(); ++i) {
-      if (dictionary_data_[i]) {
-        delete[] dictionary_data_[i]->ptr();
-        delete dictionary_data_[i];
-      }
-    }
-    for (size_t i = 0; i < dictionary_indices_.size(); ++i) {
-      if (dictionary_indices_[i]) {
-        delete dictionary_indices_[i];
-      }
-    }
-    dictionary_data_.clear();
-    dictionary_indices_.clear();
-    location_weightings_.clear();
+    FreeData();
   }
   // Prepares the object for building spatial pyramids using the
   // provided dictionary (dictionaries). If more than one dictionary
   // is provided, features are coded using all dictionaries
   // simultaneously, and the histograms are concatenated within each
   // spatial bin. Use dictionaries built with location weighting > 0
-  // to use Spatially Local Coding.
+  // to use Spatially Local Coding. If a dictionary has a projection,
+  // descriptors are projected with it before they're coded.
   //
   // num_threads gives the maximum number of threads that will be used
   // when initializing the indices and when performing the searches
@@ -138,12 +125,16 @@ class SpatialPyramidBuilder {
                         sjm::spatial_pyramid::SpatialPyramid* pyramid) const;
 
  private:
+  // Frees the dictionary data, indices and projections.
+  void FreeData();
   void InitADictionary(
       const std::vector<sjm::codebooks::Dictionary>& dictionaries,
       const size_t dictionary_id);
   std::vector<flann::Matrix<float>* > dictionary_data_;
   std::vector<flann::Index<flann::L2<float> >* > dictionary_indices_;
   std::vector<float> location_weightings_;
+  // The projection of each dictionary, or NULL if it has none.
+  std::vector<sjm::codebooks::Projection*> projections_;
   float beta_;
   int num_threads_;
 };
@@ -25,10 +25,15 @@
 #include "spatial_pyramid/spatial_pyramid_kernel.h"
 
 #include <algorithm>
+#include <vector>
 
+#include "boost/bind.hpp"
 #include "glog/logging.h"
 
 #include "spatial_pyramid/spatial_pyramid.pb.h"
+#include "util/thread_pool.h"
+
+using std::vector;
 
 namespace sjm {
 namespace spatial_pyramid {
@@ -76,30 +81,83 @@ float LinearKernel(const SpatialPyramid& pyramid_a,
   return dot;
 }
 
+float SpmLevelWeight(const int level, const int num_levels) {
+  int max_level = num_levels - 1;
+  if (level == 0) {
+    return 1.0 / (1 << max_level);
+  }
+  return 1.0 / (1 << (max_level - level + 1));
+}
+
 float SpmKernel(const SpatialPyramid& pyramid_a,
                 const SpatialPyramid& pyramid_b,
                 const int num_levels) {
   CHECK_EQ(pyramid_a.level_size(), pyramid_b.level_size());
   CHECK_GE(pyramid_a.level_size(), num_levels);
 
-  int max_level = num_levels - 1;  // Switch to 0-based level ids.
   float intersection = 0;
-  for (int h = 0; h < pyramid_a.level(0).histogram_size(); ++h) {
-    intersection += HistogramIntersection(
-        pyramid_a.level(0).histogram(h),
-        pyramid_b.level(0).histogram(h)) / (1 << max_level);
-  }
-
-  for (int level = 1; level <= max_level; ++level) {
+  for (int level = 0; level < num_levels; ++level) {
+    const float weight = SpmLevelWeight(level, num_levels);
     for (int h = 0; h < pyramid_a.level(level).histogram_size(); ++h) {
       intersection += HistogramIntersection(
           pyramid_a.level(level).histogram(h),
-          pyramid_b.level(level).histogram(h)) / (1 << (max_level - level + 1));
+          pyramid_b.level(level).histogram(h)) * weight;
     }
   }
   return intersection;
 }
 
+float EvaluateKernel(const SvmKernel kernel,
+                     const SpatialPyramid& pyramid_a,
+                     const SpatialPyramid& pyramid_b) {
+  if (kernel == INTERSECTION_KERNEL) {
+    return SpmKernel(pyramid_a, pyramid_b, pyramid_a.level_size());
+  }
+  CHECK_EQ(LINEAR_KERNEL, kernel);
+  return LinearKernel(pyramid_a, pyramid_b);
+}
+
+namespace {
+
+// The block is split into tiles of this many rows and columns.
+const int kTileRows = 8;
+const int kTileColumns = 64;
+
+void ComputeKernelTile(const SvmKernel kernel,
+                       const vector<const SpatialPyramid*>& rows,
+                       const vector<const SpatialPyramid*>& columns,
+                       const size_t first_row,
+                       const size_t first_column,
+                       vector<float>* block) {
+  const size_t end_row = std::min(rows.size(), first_row + kTileRows);
+  const size_t end_column =
+      std::min(columns.size(), first_column + kTileColumns);
+  for (size_t i = first_row; i < end_row; ++i) {
+    for (size_t j = first_column; j < end_column; ++j) {
+      (*block)[i * columns.size() + j] =
+          EvaluateKernel(kernel, *rows[i], *columns[j]);
+    }
+  }
+}
+}  // namespace.
+
+void ComputeKernelBlock(const SvmKernel kernel,
+                        const vector<const SpatialPyramid*>& rows,
+                        const vector<const SpatialPyramid*>& columns,
+                        sjm::util::ThreadPool* pool,
+                        vector<float>* block) {
+  block->resize(rows.size() * columns.size());
+  sjm::util::TaskGroup tiles;
+  for (size_t i = 0; i < rows.size(); i += kTileRows) {
+    for (size_t j = 0; j < columns.size(); j += kTileColumns) {
+      pool->Schedule(boost::bind(ComputeKernelTile, kernel, boost::cref(rows),
+                                 boost::cref(columns), i, j, block),
+                     &tiles);
+    }
+  }
+  tiles.Wait();
+}
+
 void UnrollHistograms(const SpatialPyramid& pyramid,
                       SparseVectorFloat* result_histogram,
                       int* result_dimensions) {
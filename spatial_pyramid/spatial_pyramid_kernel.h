@@ -29,6 +29,13 @@
 #ifndef SPATIAL_PYRAMID_SPATIAL_PYRAMID_KERNEL_H_
 #define SPATIAL_PYRAMID_SPATIAL_PYRAMID_KERNEL_H_
 
+#include <vector>
+
+namespace sjm {
+namespace util {
+class ThreadPool;
+}}
+
 namespace sjm {
 namespace spatial_pyramid {
 
@@ -36,6 +43,13 @@ namespace spatial_pyramid {
 class SpatialPyramid;
 class SparseVectorFloat;
 
+// The kernels that the SVM tools train with. These values are stored
+// in gram matrix caches, so they must not be renumbered.
+enum SvmKernel {
+  LINEAR_KERNEL = 0,  // LinearKernel.
+  INTERSECTION_KERNEL = 1  // SpmKernel over all of the pyramid levels.
+};
+
 // Computes the Spatial Pyramid Match Kernel as described in
 // Lazebnik's 2006 CVPR paper. The input pyramids must have the same
 // geometry (number of levels, and number of spatial bins per level),
@@ -53,11 +67,31 @@ float SpmKernel(const SpatialPyramid& pyramid_a,
                 const SpatialPyramid& pyramid_b,
                 const int num_levels);
 
+// Returns the weight that SpmKernel gives to the histogram
+// intersections at the given (0-based) level when num_levels levels
+// are used.
+float SpmLevelWeight(const int level, const int num_levels);
+
 // Computes a simple linear kernel over the unweighted, concatenated
 // histograms (a dot product).
 float LinearKernel(const SpatialPyramid& pyramid_a,
                    const SpatialPyramid& pyramid_b);
 
+// Evaluates the given kernel between the two pyramids.
+float EvaluateKernel(const SvmKernel kernel,
+                     const SpatialPyramid& pyramid_a,
+                     const SpatialPyramid& pyramid_b);
+
+// Evaluates the kernel between every row and column pyramid, storing
+// the value for row i and column j in block[i * columns.size() + j].
+// The block is computed in tiles, which are the tasks for the pool,
+// so that each task reuses a small set of pyramids.
+void ComputeKernelBlock(const SvmKernel kernel,
+                        const std::vector<const SpatialPyramid*>& rows,
+                        const std::vector<const SpatialPyramid*>& columns,
+                        sjm::util::ThreadPool* pool,
+                        std::vector<float>* block);
+
 // Computes the histogram intersection over two sparse vectors.
 float HistogramIntersection(const SparseVectorFloat& a,
                             const SparseVectorFloat& b);
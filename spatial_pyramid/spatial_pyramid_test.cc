@@ -25,12 +25,23 @@
 // File under test.
 #include "spatial_pyramid/spatial_pyramid_builder.h"
 
+#include <cstdio>
+#include <set>
+#include <string>
 #include <vector>
 
 #include "codebooks/dictionary.pb.h"
 #include "sift/sift_descriptors.pb.h"
+#include "spatial_pyramid/feature_map.h"
+#include "spatial_pyramid/gram_cache.h"
+#include "spatial_pyramid/linear_model.h"
+#include "spatial_pyramid/linear_svm.h"
+#include "spatial_pyramid/nystrom.h"
+#include "spatial_pyramid/precomputed_model.h"
 #include "spatial_pyramid/spatial_pyramid.pb.h"
 #include "spatial_pyramid/spatial_pyramid_kernel.h"
+#include "spatial_pyramid/svm/svm.h"
+#include "util/thread_pool.h"
 
 // Third party includes.
 #include "glog/logging.h"
@@ -485,6 +496,428 @@ TEST(SpatialPyramidKernelTest,
                   sjm::spatial_pyramid::SpmKernel(pyramid_1, pyramid_2, 1));
 }
 
+TEST(LinearModelTest,
+     LinearScoreIsSparseDenseDotPlusBias) {
+  sjm::spatial_pyramid::LinearCategoryModel model;
+  model.add_weight(1.0);
+  model.add_weight(-2.0);
+  model.add_weight(0.5);
+  model.set_bias(0.25);
+  sjm::spatial_pyramid::SparseVectorFloat x;
+  sjm::spatial_pyramid::SparseValueFloat* v = x.add_value();
+  v->set_index(1);
+  v->set_value(3.0);
+  v = x.add_value();
+  v->set_index(2);
+  v->set_value(4.0);
+  // Out of range indices are ignored.
+  v = x.add_value();
+  v->set_index(7);
+  v->set_value(100.0);
+  ASSERT_FLOAT_EQ(-2.0 * 3.0 + 0.5 * 4.0 + 0.25,
+                  sjm::spatial_pyramid::LinearScore(model, x));
+}
+
+TEST(LinearModelTest,
+     PredictCategoryPicksHighestScore) {
+  sjm::spatial_pyramid::LinearModel model;
+  model.set_dimensions(2);
+  sjm::spatial_pyramid::LinearCategoryModel* category_model =
+      model.add_category_model();
+  category_model->set_category("first");
+  category_model->add_weight(1.0);
+  category_model->add_weight(0.0);
+  category_model = model.add_category_model();
+  category_model->set_category("second");
+  category_model->add_weight(0.0);
+  category_model->add_weight(1.0);
+  sjm::spatial_pyramid::SparseVectorFloat x;
+  sjm::spatial_pyramid::SparseValueFloat* v = x.add_value();
+  v->set_index(1);
+  v->set_value(0.5);
+  float score = 0;
+  ASSERT_EQ("second", sjm::spatial_pyramid::PredictCategory(model, x, &score));
+  ASSERT_FLOAT_EQ(0.5, score);
+}
+
+TEST(LinearModelTest,
+     FoldedAndCompactModelsMatchPrecomputedKernelDecisionValues) {
+  // Four one-level pyramids over a 3-word vocabulary. The first two
+  // are the positive class.
+  const float kHistograms[4][3] = {
+    {0.8, 0.1, 0.1}, {0.6, 0.3, 0.1}, {0.1, 0.2, 0.7}, {0.2, 0.7, 0.1}};
+  std::vector<sjm::spatial_pyramid::SpatialPyramid> pyramids(4);
+  std::vector<sjm::spatial_pyramid::SparseVectorFloat> unrolled(4);
+  for (int i = 0; i < 4; ++i) {
+    sjm::spatial_pyramid::PyramidLevel* level = pyramids[i].add_level();
+    sjm::spatial_pyramid::SparseVectorFloat* histogram =
+        level->add_histogram();
+    histogram->set_non_sparse_length(3);
+    for (int j = 0; j < 3; ++j) {
+      sjm::spatial_pyramid::SparseValueFloat* v = histogram->add_value();
+      v->set_index(j);
+      v->set_value(kHistograms[i][j]);
+    }
+    sjm::spatial_pyramid::UnrollHistograms(pyramids[i], &unrolled[i]);
+  }
+
+  svm_problem problem;
+  problem.l = 4;
+  double y[4] = {1, 1, -1, -1};
+  problem.y = y;
+  svm_node nodes[4][6];
+  svm_node* x[4];
+  for (int i = 0; i < 4; ++i) {
+    nodes[i][0].index = 0;
+    nodes[i][0].value = i + 1;
+    for (int j = 0; j < 4; ++j) {
+      nodes[i][j + 1].index = j + 1;
+      nodes[i][j + 1].value =
+          sjm::spatial_pyramid::LinearKernel(pyramids[i], pyramids[j]);
+    }
+    nodes[i][5].index = -1;
+    x[i] = nodes[i];
+  }
+  problem.x = x;
+  svm_parameter param;
+  param.svm_type = C_SVC;
+  param.kernel_type = PRECOMPUTED;
+  param.C = 10;
+  param.coef0 = 0;
+  param.degree = 3;
+  param.gamma = 0;
+  param.nr_weight = 0;
+  param.weight_label = NULL;
+  param.weight = NULL;
+  param.shrinking = 0;
+  param.cache_size = 10;
+  param.probability = 0;
+  param.eps = 0.001;
+  svm_model* model = svm_train(&problem, &param);
+
+  sjm::spatial_pyramid::LinearCategoryModel folded;
+  sjm::spatial_pyramid::FoldPrecomputedLinearModel(*model, unrolled, 3,
+                                                   &folded);
+  ASSERT_EQ(3, folded.weight_size());
+  // The compact model scores rows of kernel values directly.
+  sjm::spatial_pyramid::PrecomputedModel compact;
+  sjm::spatial_pyramid::CompactPrecomputedModel("positive", *model, &compact);
+  // And it round trips through the binary model format.
+  const std::string binary_filename = "/tmp/test.svmb";
+  sjm::spatial_pyramid::WritePrecomputedModelOrDie(binary_filename, compact);
+  ASSERT_TRUE(
+      sjm::spatial_pyramid::IsBinaryPrecomputedModel(binary_filename));
+  sjm::spatial_pyramid::PrecomputedModel loaded;
+  sjm::spatial_pyramid::ReadPrecomputedModelOrDie(binary_filename, &loaded);
+  ASSERT_EQ("positive", loaded.category);
+  ASSERT_EQ(compact.support_vectors, loaded.support_vectors);
+  ASSERT_EQ(compact.coefficients, loaded.coefficients);
+  ASSERT_EQ(compact.bias, loaded.bias);
+  int labels[2];
+  svm_get_labels(model, labels);
+  for (int i = 0; i < 4; ++i) {
+    double decision_value = 0;
+    svm_predict_values(model, x[i], &decision_value);
+    if (labels[0] != 1) {
+      decision_value = -decision_value;
+    }
+    ASSERT_NEAR(decision_value,
+                sjm::spatial_pyramid::LinearScore(folded, unrolled[i]),
+                1e-4);
+    float kernel_values[4];
+    for (int j = 0; j < 4; ++j) {
+      kernel_values[j] = nodes[i][j + 1].value;
+    }
+    ASSERT_NEAR(decision_value,
+                sjm::spatial_pyramid::PrecomputedScore(compact, kernel_values),
+                1e-4);
+  }
+  svm_free_and_destroy_model(&model);
+}
+
+TEST(SpatialPyramidKernelTest,
+     ComputeKernelBlockMatchesEvaluateKernel) {
+  std::vector<sjm::spatial_pyramid::SpatialPyramid> pyramids(20);
+  for (int i = 0; i < 20; ++i) {
+    sjm::spatial_pyramid::SparseVectorFloat* histogram =
+        pyramids[i].add_level()->add_histogram();
+    histogram->set_non_sparse_length(3);
+    for (int j = 0; j < 3; ++j) {
+      sjm::spatial_pyramid::SparseValueFloat* v = histogram->add_value();
+      v->set_index(j);
+      v->set_value(((i + 1) * (j + 2)) % 7 / 7.0);
+    }
+  }
+  // More columns than fit in one tile.
+  std::vector<const sjm::spatial_pyramid::SpatialPyramid*> rows;
+  std::vector<const sjm::spatial_pyramid::SpatialPyramid*> columns;
+  for (int i = 0; i < 11; ++i) {
+    rows.push_back(&pyramids[i]);
+  }
+  for (int i = 0; i < 100; ++i) {
+    columns.push_back(&pyramids[i % 20]);
+  }
+  sjm::util::ThreadPool pool(3);
+  std::vector<float> block;
+  sjm::spatial_pyramid::ComputeKernelBlock(
+      sjm::spatial_pyramid::INTERSECTION_KERNEL, rows, columns, &pool, &block);
+  ASSERT_EQ(11u * 100u, block.size());
+  for (int i = 0; i < 11; ++i) {
+    for (int j = 0; j < 100; ++j) {
+      ASSERT_EQ(sjm::spatial_pyramid::EvaluateKernel(
+                    sjm::spatial_pyramid::INTERSECTION_KERNEL,
+                    *rows[i], *columns[j]),
+                block[i * 100 + j]);
+    }
+  }
+}
+
+TEST(FeatureMapTest,
+     IntersectionMapApproximatesSpmKernel) {
+  // Two-level pyramids over a 4-word vocabulary, with some empty bins.
+  const float kBins[2][5][4] = {
+    {{0.4, 0.3, 0.2, 0.1},
+     {0.5, 0.5, 0, 0}, {0.2, 0.2, 0.3, 0.3}, {0, 0, 1, 0}, {0.1, 0, 0, 0.9}},
+    {{0.1, 0.2, 0.3, 0.4},
+     {0.3, 0.2, 0.1, 0.4}, {0, 0.6, 0.4, 0}, {0, 0.1, 0.8, 0.1}, {1, 0, 0, 0}}};
+  sjm::spatial_pyramid::SpatialPyramid pyramids[2];
+  for (int p = 0; p < 2; ++p) {
+    for (int level_id = 0; level_id < 2; ++level_id) {
+      sjm::spatial_pyramid::PyramidLevel* level = pyramids[p].add_level();
+      level->set_rows(level_id + 1);
+      level->set_columns(level_id + 1);
+      for (int h = 0; h < (level_id + 1) * (level_id + 1); ++h) {
+        sjm::spatial_pyramid::SparseVectorFloat* histogram =
+            level->add_histogram();
+        histogram->set_non_sparse_length(4);
+        for (int j = 0; j < 4; ++j) {
+          if (kBins[p][level_id + h][j] > 0) {
+            sjm::spatial_pyramid::SparseValueFloat* v = histogram->add_value();
+            v->set_index(j);
+            v->set_value(kBins[p][level_id + h][j]);
+          }
+        }
+      }
+    }
+  }
+  sjm::spatial_pyramid::FeatureMap map;
+  sjm::spatial_pyramid::InitIntersectionFeatureMap(2, 3, 0, &map);
+  sjm::spatial_pyramid::SparseVectorFloat mapped[2];
+  int dimensions = 0;
+  for (int p = 0; p < 2; ++p) {
+    sjm::spatial_pyramid::MapFeatures(map, pyramids[p], &mapped[p],
+                                      &dimensions);
+  }
+  ASSERT_EQ(20 * 7, dimensions);
+  // The map truncates the kernel's spectrum, so it underestimates the
+  // kernel, by up to about 10% at this order.
+  for (int a = 0; a < 2; ++a) {
+    for (int b = 0; b < 2; ++b) {
+      const float kernel =
+          sjm::spatial_pyramid::SpmKernel(pyramids[a], pyramids[b], 2);
+      ASSERT_NEAR(kernel, sjm::spatial_pyramid::Dot(mapped[a], mapped[b]),
+                  0.15 * kernel);
+    }
+  }
+
+  // The default map is just the unrolled pyramid.
+  sjm::spatial_pyramid::FeatureMap linear_map;
+  sjm::spatial_pyramid::SparseVectorFloat unrolled;
+  sjm::spatial_pyramid::UnrollHistograms(pyramids[0], &unrolled);
+  sjm::spatial_pyramid::MapFeatures(linear_map, pyramids[0], &mapped[0]);
+  ASSERT_EQ(unrolled.SerializeAsString(), mapped[0].SerializeAsString());
+}
+
+TEST(NystromTest,
+     FullRankMapReproducesSpmKernel) {
+  // One-level pyramids over a 5-word vocabulary.
+  const float kHistograms[6][5] = {
+    {0.5, 0.2, 0.1, 0.1, 0.1}, {0.1, 0.6, 0.1, 0, 0.2},
+    {0, 0.1, 0.7, 0.2, 0}, {0.3, 0.3, 0, 0.4, 0},
+    {0.2, 0, 0.2, 0.2, 0.4}, {0.5, 0.2, 0.1, 0.1, 0.1}};
+  std::vector<sjm::spatial_pyramid::SpatialPyramid> pyramids(6);
+  for (int i = 0; i < 6; ++i) {
+    sjm::spatial_pyramid::SparseVectorFloat* histogram =
+        pyramids[i].add_level()->add_histogram();
+    histogram->set_non_sparse_length(5);
+    for (int j = 0; j < 5; ++j) {
+      if (kHistograms[i][j] > 0) {
+        sjm::spatial_pyramid::SparseValueFloat* v = histogram->add_value();
+        v->set_index(j);
+        v->set_value(kHistograms[i][j]);
+      }
+    }
+  }
+  for (int selection = 0; selection < 2; ++selection) {
+    sjm::spatial_pyramid::FeatureMap map;
+    std::vector<sjm::spatial_pyramid::SparseVectorFloat> mapped;
+    std::vector<int> landmarks;
+    sjm::spatial_pyramid::BuildNystromFeatureMap(
+        pyramids, 1, 6,
+        selection == 0 ? sjm::spatial_pyramid::UNIFORM_LANDMARKS :
+        sjm::spatial_pyramid::KMEANS_PLUS_PLUS_LANDMARKS,
+        2, &map, &mapped, &landmarks);
+    // The first and last pyramids are duplicates, which k-means++ never
+    // picks twice.
+    ASSERT_EQ(selection == 0 ? 6 : 5, map.landmark_size());
+    ASSERT_EQ(static_cast<int>(landmarks.size()), map.landmark_size());
+    for (int a = 0; a < 6; ++a) {
+      // The mapped training examples match mapping from scratch.
+      sjm::spatial_pyramid::SparseVectorFloat remapped;
+      sjm::spatial_pyramid::MapFeatures(map, pyramids[a], &remapped);
+      for (int b = 0; b < 6; ++b) {
+        ASSERT_NEAR(sjm::spatial_pyramid::SpmKernel(pyramids[a], pyramids[b],
+                                                    1),
+                    sjm::spatial_pyramid::Dot(mapped[a], mapped[b]), 1e-3);
+        ASSERT_NEAR(sjm::spatial_pyramid::Dot(mapped[a], mapped[b]),
+                    sjm::spatial_pyramid::Dot(remapped, mapped[b]), 1e-4);
+      }
+    }
+    ASSERT_GT(1e-3, sjm::spatial_pyramid::KernelApproximationError(
+        map, pyramids));
+  }
+}
+
+TEST(GramCacheTest,
+     KeepsValuesAcrossReopeningAndAdditions) {
+  const std::string filename = "/tmp/test.gram";
+  remove(filename.c_str());
+  std::vector<uint64_t> hashes;
+  hashes.push_back(11);
+  hashes.push_back(22);
+  std::vector<int> items;
+  {
+    sjm::spatial_pyramid::GramCache cache;
+    cache.OpenOrDie(filename, sjm::spatial_pyramid::INTERSECTION_KERNEL);
+    cache.FindOrAddItems(hashes, &items);
+    ASSERT_EQ(2, cache.size());
+    float value = 0;
+    ASSERT_FALSE(cache.Get(items[0], items[1], &value));
+    cache.Set(items[1], items[0], 0.5);
+    cache.Set(items[1], items[1], 2.0);
+    ASSERT_TRUE(cache.Get(items[0], items[1], &value));
+    ASSERT_FLOAT_EQ(0.5, value);
+  }
+  sjm::spatial_pyramid::GramCache cache;
+  cache.OpenOrDie(filename, sjm::spatial_pyramid::INTERSECTION_KERNEL);
+  ASSERT_EQ(2, cache.size());
+  // Items are found by hash, in any order, and new ones are appended.
+  std::vector<uint64_t> more_hashes;
+  more_hashes.push_back(33);
+  more_hashes.push_back(22);
+  more_hashes.push_back(11);
+  std::vector<int> more_items;
+  cache.FindOrAddItems(more_hashes, &more_items);
+  ASSERT_EQ(3, cache.size());
+  ASSERT_EQ(more_items[1], cache.FindItem(22));
+  ASSERT_EQ(-1, cache.FindItem(44));
+  ASSERT_EQ(3, cache.size());
+  ASSERT_EQ(2, more_items[0]);
+  ASSERT_EQ(items[1], more_items[1]);
+  ASSERT_EQ(items[0], more_items[2]);
+  float value = 0;
+  ASSERT_TRUE(cache.Get(more_items[2], more_items[1], &value));
+  ASSERT_FLOAT_EQ(0.5, value);
+  ASSERT_TRUE(cache.Get(more_items[1], more_items[1], &value));
+  ASSERT_FLOAT_EQ(2.0, value);
+  ASSERT_FALSE(cache.Get(more_items[0], more_items[1], &value));
+  cache.Set(more_items[0], more_items[1], 3.0);
+  ASSERT_TRUE(cache.Get(more_items[1], more_items[0], &value));
+  ASSERT_FLOAT_EQ(3.0, value);
+}
+
+TEST(GramCacheTest,
+     SharesTheFileBetweenOpenCaches) {
+  const std::string filename = "/tmp/test_shared.gram";
+  remove(filename.c_str());
+  // Each cache has its own file descriptor, and so its own file lock,
+  // as if they were in different processes.
+  sjm::spatial_pyramid::GramCache first;
+  first.OpenOrDie(filename, sjm::spatial_pyramid::INTERSECTION_KERNEL);
+  sjm::spatial_pyramid::GramCache second;
+  second.OpenOrDie(filename, sjm::spatial_pyramid::INTERSECTION_KERNEL);
+  std::vector<uint64_t> hashes(1, 11);
+  std::vector<int> first_items;
+  first.FindOrAddItems(hashes, &first_items);
+  hashes.push_back(22);
+  std::vector<int> second_items;
+  second.FindOrAddItems(hashes, &second_items);
+  ASSERT_EQ(2, second.size());
+  ASSERT_EQ(first_items[0], second_items[0]);
+  second.Set(second_items[0], second_items[1], 0.5);
+  hashes.push_back(33);
+  first.FindOrAddItems(hashes, &first_items);
+  ASSERT_EQ(3, first.size());
+  ASSERT_EQ(second_items[1], first_items[1]);
+  float value = 0;
+  ASSERT_TRUE(first.Get(first_items[1], first_items[0], &value));
+  ASSERT_FLOAT_EQ(0.5, value);
+}
+
+TEST(LinearSvmTest,
+     OneVsRestSeparatesCategories) {
+  // Each category puts most of its mass in its own dimension.
+  const char* kCategories[3] = {"a", "b", "c"};
+  std::vector<sjm::spatial_pyramid::SparseVectorFloat> examples;
+  std::vector<std::string> categories;
+  std::set<std::string> category_set;
+  for (int c = 0; c < 3; ++c) {
+    category_set.insert(kCategories[c]);
+    for (int i = 0; i < 5; ++i) {
+      examples.push_back(sjm::spatial_pyramid::SparseVectorFloat());
+      for (int d = 0; d < 3; ++d) {
+        sjm::spatial_pyramid::SparseValueFloat* v = examples.back().add_value();
+        v->set_index(d);
+        v->set_value(d == c ? 0.6 + 0.05 * i : 0.2 - 0.025 * i);
+      }
+      categories.push_back(kCategories[c]);
+    }
+  }
+  for (int loss = 0; loss < 2; ++loss) {
+    sjm::spatial_pyramid::LinearSvmParameters params;
+    params.loss = loss == 0 ? sjm::spatial_pyramid::L1_LOSS :
+        sjm::spatial_pyramid::L2_LOSS;
+    params.c_positive = 10;
+    params.c_negative = 10;
+    params.epsilon = 0.001;
+    sjm::spatial_pyramid::LinearModel model;
+    sjm::spatial_pyramid::TrainOneVsRestLinearSvm(
+        examples, categories, category_set, 3, params, 2, &model);
+    ASSERT_EQ(3, model.category_model_size());
+    ASSERT_EQ("a", model.category_model(0).category());
+    for (size_t i = 0; i < examples.size(); ++i) {
+      ASSERT_EQ(categories[i],
+                sjm::spatial_pyramid::PredictCategory(model, examples[i]));
+    }
+  }
+}
+
+TEST(LinearSvmTest,
+     TrainsOnAnIndexSubsetLikeOnACopy) {
+  std::vector<sjm::spatial_pyramid::SparseVectorFloat> examples;
+  for (int i = 0; i < 10; ++i) {
+    examples.push_back(sjm::spatial_pyramid::SparseVectorFloat());
+    sjm::spatial_pyramid::SparseValueFloat* v = examples.back().add_value();
+    v->set_index(i % 2);
+    v->set_value(0.1 * (i + 1));
+  }
+  std::vector<int> indices;
+  std::vector<int> labels;
+  std::vector<sjm::spatial_pyramid::SparseVectorFloat> subset;
+  for (int i = 1; i < 10; i += 3) {
+    indices.push_back(i);
+    labels.push_back(i % 2 == 0 ? 1 : -1);
+    subset.push_back(examples[i]);
+  }
+  sjm::spatial_pyramid::LinearSvmParameters params;
+  sjm::spatial_pyramid::LinearCategoryModel from_copy;
+  sjm::spatial_pyramid::TrainLinearSvm(subset, labels, 2, params, &from_copy);
+  sjm::spatial_pyramid::LinearCategoryModel from_indices;
+  sjm::spatial_pyramid::TrainLinearSvm(examples, indices, labels, 2, params,
+                                       &from_indices);
+  ASSERT_EQ(from_copy.SerializeAsString(), from_indices.SerializeAsString());
+}
+
 TEST_F(SpatialPyramidTest,
        GivesRequestedNumberOfLevels) {
   sjm::spatial_pyramid::SpatialPyramidBuilder builder;
@@ -586,6 +1019,60 @@ TEST_F(SpatialPyramidTest,
   ASSERT_FLOAT_EQ(1.0 / 3.0, pyramid.level(0).histogram(0).value(1).value());
 }
 
+TEST_F(SpatialPyramidTest,
+       ProjectsDescriptorsWithTheDictionarysProjection) {
+  // This projection keeps the first two of three bins, offset by 64,
+  // so it codes the descriptors of GivesCorrectBagOfWords (with a
+  // third bin appended) against the shifted test dictionary.
+  std::vector<sjm::codebooks::Dictionary> dictionary = GetTestDictionary();
+  sjm::codebooks::Projection* projection =
+      dictionary[0].mutable_projection();
+  for (int d = 0; d < 3; ++d) {
+    projection->add_mean(0);
+  }
+  for (int c = 0; c < 2; ++c) {
+    sjm::codebooks::PrincipalComponent* component =
+        projection->add_component();
+    for (int d = 0; d < 3; ++d) {
+      component->add_weight(c == d ? 1 : 0);
+    }
+  }
+  for (int i = 0; i < dictionary[0].centroid_size(); ++i) {
+    sjm::codebooks::Centroid* c = dictionary[0].mutable_centroid(i);
+    for (int j = 0; j < c->bin_size(); ++j) {
+      c->set_bin(j, c->bin(j) + 64);
+    }
+  }
+  sjm::spatial_pyramid::SpatialPyramidBuilder builder;
+  builder.Init(dictionary, 1);
+
+  sjm::sift::DescriptorSet descriptors;
+  sjm::sift::SiftDescriptor* d;
+  d = descriptors.add_sift_descriptor();
+  d->add_bin(4);
+  d->add_bin(6);
+  d->add_bin(100);
+  d = descriptors.add_sift_descriptor();
+  d->add_bin(8);
+  d->add_bin(7);
+  d->add_bin(0);
+  d = descriptors.add_sift_descriptor();
+  d->add_bin(12);
+  d->add_bin(0);
+  d->add_bin(50);
+  sjm::spatial_pyramid::SpatialPyramid pyramid;
+  builder.BuildPyramid(descriptors, 1, 1, sjm::spatial_pyramid::AVERAGE_POOLING,
+                       &pyramid);
+
+  ASSERT_EQ(2, pyramid.level(0).histogram(0).value_size());
+  ASSERT_EQ(0, pyramid.level(0).histogram(0).value(0).index());
+  ASSERT_FLOAT_EQ(2.0 / 3.0, pyramid.level(0).histogram(0).value(0).value());
+  ASSERT_EQ(1, pyramid.level(0).histogram(0).value(1).index());
+  ASSERT_FLOAT_EQ(1.0 / 3.0, pyramid.level(0).histogram(0).value(1).value());
+  // The caller's descriptors are left unprojected.
+  ASSERT_EQ(3, descriptors.sift_descriptor(0).bin_size());
+}
+
 TEST_F(SpatialPyramidWithLocationWeightedDictionaryTest,
        GivesCorrectBagOfWordsWithLowLocationWeighting) {
   sjm::spatial_pyramid::SpatialPyramidBuilder builder;
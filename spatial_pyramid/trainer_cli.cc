@@ -25,6 +25,7 @@
 // This command line tool trains the SVM models for bag-of-words, SPM,
 // or Spatially Local Coding classification.
 
+#include <algorithm>
 #include <cstdlib>
 #include <map>
 #include <deque>
@@ -32,6 +33,8 @@
 #include <string>
 #include <vector>
 
+#include "boost/bind.hpp"
+#include "boost/function.hpp"
 #include "boost/lexical_cast.hpp"
 #include "boost/thread.hpp"
 #include "boost/filesystem.hpp"
@@ -40,9 +43,16 @@
 #include "gflags/gflags.h"
 #include "glog/logging.h"
 
+#include "spatial_pyramid/feature_map.h"
+#include "spatial_pyramid/gram_cache.h"
+#include "spatial_pyramid/linear_model.h"
+#include "spatial_pyramid/linear_svm.h"
+#include "spatial_pyramid/nystrom.h"
+#include "spatial_pyramid/precomputed_model.h"
 #include "spatial_pyramid/spatial_pyramid.pb.h"
 #include "spatial_pyramid/spatial_pyramid_kernel.h"
 #include "svm/svm.h"
+#include "util/thread_pool.h"
 #include "util/util.h"
 
 DEFINE_string(
@@ -62,10 +72,78 @@ DEFINE_double(
     c, 0,
     "The regularizer for the SVM. If 0, the trainer will do cross "
     "validation to determine the appropriate setting.");
+DEFINE_bool(
+    export_linear_model, true,
+    "With --kernel=linear, also fold the category models into explicit "
+    "weight vectors and save them together in "
+    "<output_directory>/linear_model.pb. validate_cli can classify with "
+    "that file using --linear_model, at one dot product per category.");
+DEFINE_bool(
+    binary_models, true,
+    "With --solver=libsvm, also save each category's model in the "
+    "binary format as <output_directory>/<category>.svmb. validate_cli "
+    "loads these without parsing any text.");
+DEFINE_string(
+    solver, "libsvm",
+    "The SVM solver. Options are \"libsvm\", which trains on a "
+    "precomputed gram matrix, or \"dcd\", which trains linear models "
+    "directly on the unrolled pyramids with dual coordinate descent "
+    "and saves them to <output_directory>/linear_model.pb. With "
+    "--kernel=intersection, \"dcd\" trains on an explicit feature map "
+    "that approximates the intersection kernel.");
+DEFINE_string(
+    dcd_loss, "l1",
+    "The loss for --solver=dcd. Options are \"l1\" (hinge) or \"l2\" "
+    "(squared hinge).");
+DEFINE_double(
+    dcd_epsilon, 0.1,
+    "The stopping tolerance for --solver=dcd.");
+DEFINE_int32(
+    dcd_max_iterations, 1000,
+    "The maximum number of passes over the data for --solver=dcd.");
+DEFINE_int32(
+    feature_map_order, 2,
+    "For --solver=dcd with --kernel=intersection, each histogram bin is "
+    "mapped to 2 * order + 1 features. Higher orders approximate the "
+    "kernel more closely.");
+DEFINE_double(
+    feature_map_sampling_step, 0,
+    "The spectrum sampling step of the intersection feature map. If 0, "
+    "a step is chosen for the order.");
+DEFINE_int32(
+    nystrom_rank, 0,
+    "If > 0, the intersection kernel is approximated with this many "
+    "landmark pyramids (the Nystrom method), and linear models are "
+    "trained on the resulting features with dual coordinate descent. "
+    "Only the kernel values between the examples and the landmarks are "
+    "computed. The landmarks are saved with "
+    "<output_directory>/linear_model.pb.");
+DEFINE_string(
+    nystrom_landmarks, "kmeans++",
+    "How the Nystrom landmarks are chosen. Options are \"uniform\" or "
+    "\"kmeans++\".");
+DEFINE_int32(
+    nystrom_error_sample, 100,
+    "The number of non-landmark examples on which the error of the "
+    "Nystrom approximation is reported.");
+DEFINE_string(
+    gram_cache, "",
+    "If set, kernel values are read from and saved to this gram cache "
+    "file, so they are only computed once over repeated runs. The "
+    "cache can be shared with validate_cli, and with other training "
+    "lists over the same pyramids. It only applies to --solver=libsvm.");
+DEFINE_string(
+    c_search, "geometric",
+    "How c is searched for when --c=0. Options are \"geometric\", which "
+    "doubles c until the cross validation accuracy stops improving, or "
+    "\"halving\", which evaluates a fixed range of c one fold at a time "
+    "and drops the worse half after each fold. Either way, the folds and "
+    "categories of every c are trained in parallel.");
 DEFINE_string(gram_matrix_checkpoint_file, "",
               "A file that is touched when gram matrix is completed.");
 DEFINE_string(cross_validation_checkpoint_file, "",
-              "A file that is touched when cross validation is completed.");
+              "A file that the selected c is written to when cross "
+              "validation is completed.");
 
 using std::make_pair;
 using std::map;
@@ -74,32 +152,60 @@ using std::deque;
 using std::set;
 using std::string;
 using std::vector;
+using sjm::spatial_pyramid::FeatureMap;
+using sjm::spatial_pyramid::GramCache;
+using sjm::spatial_pyramid::LinearModel;
+using sjm::spatial_pyramid::LinearSvmParameters;
+using sjm::spatial_pyramid::PrecomputedModel;
 using sjm::spatial_pyramid::SpatialPyramid;
 using sjm::spatial_pyramid::SparseVectorFloat;
+using sjm::spatial_pyramid::SvmKernel;
+using sjm::spatial_pyramid::INTERSECTION_KERNEL;
+using sjm::spatial_pyramid::LINEAR_KERNEL;
 
 typedef map<string, pair<SpatialPyramid, string> > TrainingExampleMap;
 
-enum SvmKernel {
-  LINEAR_KERNEL,
-  INTERSECTION_KERNEL
-};
+// Trains the one-vs-rest model for a category with the regularizer c
+// on all but one fold of the examples, and stores its scores for the
+// examples of the held out fold, in order. Example i is in fold
+// i % num_folds.
+typedef boost::function<void (float, int, int, const string&,
+                              vector<float>*)> FoldScoringFunction;
+
+// Returns the indices of the examples in the testing fold and in the
+// training folds.
+// Eg. If num_folds = 3:
+// [1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13]
+//  ^        ^        ^        ^            ^  Testing fold 1
+//     ^        ^        ^         ^           Testing fold 2
+//        ^        ^        ^          ^       Testing fold 3
+void SplitFolds(const int num_examples,
+                const int fold,
+                const int num_folds,
+                vector<int>* testing_indices,
+                vector<int>* training_indices) {
+  for (int i = 0; i < num_examples; ++i) {
+    if ((i - fold) % num_folds == 0) {
+      testing_indices->push_back(i);
+    } else {
+      training_indices->push_back(i);
+    }
+  }
+}
 
-void DoEnsembleCrossValidation(const TrainingExampleMap& training_examples,
-                               const set<string>& category_set,
-                               const int num_categories,
-                               const SvmKernel svm_kernel,
-                               const float c,
-                               const int num_folds,
-                               const svm_problem* problem,
-                               map<float, float>* result_map,
-                               boost::mutex* result_mutex) {
-  // Split problem into (num_folds - 1) / num_folds training,
-  // 1 / num_folds testing.
-  // Eg. If num_folds = 3:
-  // [1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13]
-  //  ^        ^        ^        ^            ^  Testing fold 1
-  //     ^        ^        ^         ^           Testing fold 2
-  //        ^        ^        ^          ^       Testing fold 3
+// Scores a fold with a model trained on the precomputed gram matrix in
+// problem. The training subset shares the gram matrix rows: with
+// precomputed kernels, libsvm looks up the kernel value between two
+// examples by the id in the first node of each row, which is the
+// example's position in the full gram matrix.
+void ScoreEnsembleFold(const vector<string>& categories,
+                       const int num_categories,
+                       const svm_problem* problem,
+                       const float c,
+                       const int fold,
+                       const int num_folds,
+                       const string& category,
+                       vector<float>* scores) {
   svm_parameter param;
   param.svm_type = C_SVC;
   param.kernel_type = PRECOMPUTED;
@@ -117,157 +223,195 @@ void DoEnsembleCrossValidation(const TrainingExampleMap& training_examples,
   param.probability = 0;
   param.eps = 0.001;
 
-  int num_correct = 0;
-  int num_test = 0;
-  for (int fold = 0; fold < num_folds; ++fold) {
-    LOG(INFO) << "c = " << c << ", cross validation fold: " << fold;
-    // Iterate through the problem, picking out rows to be training and testing.
-    int i = 0;
-    vector<string> true_training_categories;
-    vector<string> true_testing_categories;
-    vector<int> training_indices;
-    vector<int> testing_indices;
-    for (TrainingExampleMap::const_iterator it = training_examples.begin();
-         it != training_examples.end(); ++it) {
-      if ((i - fold) % num_folds == 0) {
-        testing_indices.push_back(i);
-        true_testing_categories.push_back(it->second.second);
-      } else {
-        training_indices.push_back(i);
-        true_training_categories.push_back(it->second.second);
-      }
-      ++i;
+  vector<int> testing_indices;
+  vector<int> training_indices;
+  SplitFolds(problem->l, fold, num_folds, &testing_indices,
+             &training_indices);
+  svm_problem subset_problem;
+  subset_problem.l = training_indices.size();
+  subset_problem.y = new double[subset_problem.l];
+  subset_problem.x = new svm_node*[subset_problem.l];
+  for (int i = 0; i < subset_problem.l; ++i) {
+    subset_problem.x[i] = problem->x[training_indices[i]];
+    // Set up the target vector to be +1 for this category, -1 otherwise.
+    if (categories[training_indices[i]] == category) {
+      subset_problem.y[i] = 1;
+    } else {
+      subset_problem.y[i] = -1;
     }
-    // Extract subset of gram matrix associated with training examples.
-    svm_problem subset_problem;
-    subset_problem.l = training_indices.size();
-    subset_problem.y = new double[subset_problem.l];
-    subset_problem.x = new svm_node*[subset_problem.l];
-    int row_index = 0;
-    for (vector<int>::const_iterator a = training_indices.begin();
-         a != training_indices.end(); ++a) {
-      // Extract the appropriate columns from
-      // this row.
-      subset_problem.x[row_index] = new svm_node[subset_problem.l + 2];
-      subset_problem.x[row_index][0].index = 0;
-      subset_problem.x[row_index][0].value = row_index + 1;
-      int col_index = 1;
-      for (vector<int>::const_iterator b = training_indices.begin();
-           b != training_indices.end(); ++b) {
-        // Take the value from the a-th row, and the *b+1st colum.
-        // We add 1 to b because the first element in the row is the id.
-        subset_problem.x[row_index][col_index].index = col_index;
-        subset_problem.x[row_index][col_index].value =
-            problem->x[*a][*b + 1].value;
-        ++col_index;
-      }
-      // The last item has index -1. The value is ignored.
-      subset_problem.x[row_index][subset_problem.l + 1].index = -1;
-      ++row_index;
+  }
+  const char* check = svm_check_parameter(&subset_problem, &param);
+  if (check != NULL) {
+    LOG(INFO) << check;
+  }
+  svm_model* model = svm_train(&subset_problem, &param);
+
+  // The full gram matrix row of each test example is its kernel vector
+  // against all the training examples, so it can be used directly.
+  int label_vector[2];
+  svm_get_labels(model, label_vector);
+  for (vector<int>::const_iterator i = testing_indices.begin();
+       i != testing_indices.end(); ++i) {
+    double decision_value = 0;
+    svm_predict_values(model, problem->x[*i], &decision_value);
+    // The meaning of decision_value depends on what label is in
+    // position [0].
+    if (label_vector[0] == 1) {
+      scores->push_back(decision_value);
+    } else {
+      scores->push_back(-decision_value);
     }
+  }
 
-    // Train an SVM model for each class using the given C.
-    map<string, svm_model*> ensemble;
-    for (set<string>::const_iterator category = category_set.begin();
-         category != category_set.end(); ++category) {
-      // Set up the target vector to be +1 for this category, -1 otherwise.
-      for (int i = 0; i < subset_problem.l; ++i) {
-        if (true_training_categories[i] == *category) {
-          subset_problem.y[i] = 1;
-        } else {
-          subset_problem.y[i] = -1;
+  svm_free_and_destroy_model(&model);
+  svm_destroy_param(&param);
+  delete[] subset_problem.y;
+  delete[] subset_problem.x;
+}
+
+// Does the same as ScoreEnsembleFold, but trains the linear model
+// directly on the unrolled examples with dual coordinate descent
+// instead of on a precomputed gram matrix. The regularizers of
+// base_params are scaled by c.
+void ScoreLinearFold(const vector<SparseVectorFloat>& examples,
+                     const vector<string>& categories,
+                     const int dimensions,
+                     const LinearSvmParameters& base_params,
+                     const float c,
+                     const int fold,
+                     const int num_folds,
+                     const string& category,
+                     vector<float>* scores) {
+  LinearSvmParameters params = base_params;
+  params.c_positive *= c;
+  params.c_negative *= c;
+
+  vector<int> testing_indices;
+  vector<int> training_indices;
+  SplitFolds(examples.size(), fold, num_folds, &testing_indices,
+             &training_indices);
+  vector<int> labels;
+  for (vector<int>::const_iterator i = training_indices.begin();
+       i != training_indices.end(); ++i) {
+    labels.push_back(categories[*i] == category ? 1 : -1);
+  }
+  sjm::spatial_pyramid::LinearCategoryModel model;
+  sjm::spatial_pyramid::TrainLinearSvm(examples, training_indices, labels,
+                                       dimensions, params, &model);
+  for (vector<int>::const_iterator i = testing_indices.begin();
+       i != testing_indices.end(); ++i) {
+    scores->push_back(sjm::spatial_pyramid::LinearScore(model, examples[*i]));
+  }
+}
+
+// Runs the cross validations for many values of c at once. The unit of
+// work is one (c, fold, category) model, so the thread pool stays busy
+// even when only a few values of c are being evaluated. The accuracy
+// of each (c, fold) is kept, so no fold is evaluated twice.
+class CrossValidator {
+ public:
+  CrossValidator(const FoldScoringFunction& score_fold,
+                 const vector<string>& categories,
+                 const set<string>& category_set,
+                 const int num_folds)
+      : score_fold_(score_fold), categories_(categories),
+        category_set_(category_set), num_folds_(num_folds),
+        pool_(FLAGS_thread_limit) {}
+
+  int num_folds() const { return num_folds_; }
+
+  // Evaluates each c in cs on the folds [first_fold, end_fold).
+  void EvaluateFolds(const vector<float>& cs,
+                     const int first_fold,
+                     const int end_fold) {
+    vector<pair<float, int> > jobs;
+    BOOST_FOREACH(float c, cs) {
+      for (int fold = first_fold; fold < end_fold; ++fold) {
+        if (fold_results_[c].count(fold) == 0) {
+          jobs.push_back(make_pair(c, fold));
         }
       }
-      const char* check = svm_check_parameter(&subset_problem, &param);
-      if (check != NULL) {
-        LOG(INFO) << check;
-      }
-      svm_model* model = svm_train(&subset_problem, &param);
-      ensemble[*category] = model;
     }
-
-    // Get the predictive accuracy for this ensemble on the test instances.
-    // For each test instance, build the kernel vector.
-    svm_node* test_vector = NULL;
-    int* label_vector = new int[2];
-    double decision_value = 0;
-    for (size_t i = 0; i < testing_indices.size(); ++i) {
-      int testing_index = testing_indices[i];
-      int vector_length = 0;
-      // Problem size, +1 for index 0, +1 for final index.
-      vector_length = subset_problem.l + 2;
-      test_vector = new svm_node[vector_length];
-      // This is where we look up the kernel values between the test
-      // instance and the training instances.
-      for (size_t j = 0; j < training_indices.size(); ++j) {
-        int training_index = training_indices[j];
-        test_vector[j + 1].index = j + 1;
-        test_vector[j + 1].value =
-            problem->x[testing_index][training_index + 1].value;
+    // Each task writes the scores to its own slot.
+    const int num_categories = category_set_.size();
+    vector<vector<float> > scores(jobs.size() * num_categories);
+    sjm::util::TaskGroup folds;
+    for (size_t j = 0; j < jobs.size(); ++j) {
+      LOG(INFO) << "c = " << jobs[j].first << ", cross validation fold: " <<
+          jobs[j].second;
+      int k = 0;
+      for (set<string>::const_iterator category = category_set_.begin();
+           category != category_set_.end(); ++category, ++k) {
+        pool_.Schedule(boost::bind(
+            score_fold_, jobs[j].first, jobs[j].second, num_folds_,
+            boost::cref(*category), &scores[j * num_categories + k]), &folds);
       }
-      // The first index is zero, and its value doesn't matter for
-      // test instances.
-      test_vector[0].index = 0;
-      test_vector[0].value = 0;
-      // The last index is -1 by convension, and the value doesn't matter.
-      test_vector[vector_length - 1].index = -1;
-      test_vector[vector_length - 1].value = 0;
-
-      // Now, get the predictions that the models give.
-      string max_category = "";
-      double max_score = -10000;
-      for (map<string, svm_model*>::const_iterator model_it = ensemble.begin();
-           model_it != ensemble.end(); ++model_it) {
-        const string category = model_it->first;
-        const svm_model* model = model_it->second;
-        // The meaning of decision_value depends on what label is in
-        // position [0].
-        svm_get_labels(model, label_vector);
-        svm_predict_values(model, test_vector, &decision_value);
-        double category_score;
-        if (label_vector[0] == 1) {
-          category_score = decision_value;
-        } else {
-          category_score = -decision_value;
+    }
+    folds.Wait();
+
+    // Find the category scored most strongly for each of the test
+    // examples.
+    for (size_t j = 0; j < jobs.size(); ++j) {
+      vector<int> testing_indices;
+      vector<int> training_indices;
+      SplitFolds(categories_.size(), jobs[j].second, num_folds_,
+                 &testing_indices, &training_indices);
+      int num_correct = 0;
+      for (size_t i = 0; i < testing_indices.size(); ++i) {
+        string max_category = "";
+        double max_score = -10000;
+        int k = 0;
+        for (set<string>::const_iterator category = category_set_.begin();
+             category != category_set_.end(); ++category, ++k) {
+          const float category_score = scores[j * num_categories + k][i];
+          if (category_score > max_score) {
+            max_score = category_score;
+            max_category = *category;
+          }
         }
-        if (category_score > max_score) {
-          max_score = category_score;
-          max_category = category;
+        if (max_category == categories_[testing_indices[i]]) {
+          ++num_correct;
         }
       }
-      ++num_test;
-      if (max_category == true_testing_categories[i]) {
-        ++num_correct;
-      }
-      delete[] test_vector;
-      test_vector = NULL;
+      fold_results_[jobs[j].first][jobs[j].second] =
+          make_pair(num_correct, static_cast<int>(testing_indices.size()));
     }
-    delete[] label_vector;
+  }
 
-    for (map<string, svm_model*>::iterator it = ensemble.begin();
-         it != ensemble.end(); ++it) {
-      svm_free_and_destroy_model(&(it->second));
+  // Returns the accuracy of c over the folds evaluated so far.
+  float Accuracy(const float c) {
+    int num_correct = 0;
+    int num_test = 0;
+    const map<int, pair<int, int> >& results = fold_results_[c];
+    for (map<int, pair<int, int> >::const_iterator it = results.begin();
+         it != results.end(); ++it) {
+      num_correct += it->second.first;
+      num_test += it->second.second;
     }
-    delete[] subset_problem.y;
-    for (int i = 0; i < subset_problem.l; ++i) {
-      delete[] subset_problem.x[i];
-    }
-    delete[] subset_problem.x;
+    CHECK_GT(num_test, 0) << "No folds were evaluated for c = " << c;
+    return num_correct / static_cast<float>(num_test);
   }
-  LOG(INFO) << "Cross validation accuracy for c = " << c << ": " <<
-      num_correct / static_cast<float>(num_test);
-  if (result_mutex != NULL) {
-    boost::mutex::scoped_lock l(*result_mutex);
-    (*result_map)[c] = num_correct / static_cast<float>(num_test);
-  } else {
-    (*result_map)[c] = num_correct / static_cast<float>(num_test);
-  }
-}
 
+ private:
+  FoldScoringFunction score_fold_;
+  const vector<string>& categories_;
+  const set<string>& category_set_;
+  const int num_folds_;
+  sjm::util::ThreadPool pool_;
+  // The (correct, total) counts of each evaluated fold, keyed by c and
+  // then fold.
+  map<float, map<int, pair<int, int> > > fold_results_;
+};
+
+// Fills this shard's rows of the upper triangle of the gram matrix. If
+// gram_cache is not NULL, cache_indices holds each example's item in
+// the cache, and only the values that aren't cached are computed.
 void BuildGramMatrixShard(svm_node** x,
                           const int shard,
                           const SvmKernel svm_kernel,
-                          const TrainingExampleMap& example_map) {
+                          const TrainingExampleMap& example_map,
+                          GramCache* gram_cache,
+                          const vector<int>* cache_indices) {
   int one_past_end = static_cast<int>(
       example_map.size() *
       (1 - std::sqrt(static_cast<float>(shard) / FLAGS_thread_limit)));
@@ -302,18 +446,18 @@ void BuildGramMatrixShard(svm_node** x,
         // including the diagonal.
         if (j >= row_index + 1) {
           x[row_index][j].index = j;
-          if (svm_kernel == INTERSECTION_KERNEL) {
-            x[row_index][j].value =
-                sjm::spatial_pyramid::SpmKernel(
-                    it_a->second.first,
-                    it_b->second.first,
-                    it_a->second.first.level_size());
-          } else if (svm_kernel == LINEAR_KERNEL) {
-            x[row_index][j].value =
-                sjm::spatial_pyramid::LinearKernel(
-                    it_a->second.first,
-                    it_b->second.first);
+          float value = 0;
+          if (gram_cache == NULL ||
+              !gram_cache->Get((*cache_indices)[row_index],
+                               (*cache_indices)[j - 1], &value)) {
+            value = sjm::spatial_pyramid::EvaluateKernel(
+                svm_kernel, it_a->second.first, it_b->second.first);
+            if (gram_cache != NULL) {
+              gram_cache->Set((*cache_indices)[row_index],
+                              (*cache_indices)[j - 1], value);
+            }
           }
+          x[row_index][j].value = value;
         }
         ++j;
       }
@@ -366,6 +510,255 @@ float KeyWithMaxValue(const map<float, float>& result_map) {
   return max_key;
 }
 
+// Evaluates the candidates one fold at a time. After each fold, only
+// the better half of them (by accuracy over the folds so far) go on to
+// the next fold. Returns the best of the remaining candidates.
+float SuccessiveHalving(vector<float> candidates,
+                        CrossValidator* validator) {
+  for (int fold = 0; fold < validator->num_folds(); ++fold) {
+    validator->EvaluateFolds(candidates, fold, fold + 1);
+    vector<pair<float, float> > ranked;
+    BOOST_FOREACH(float c, candidates) {
+      // Ties go to the smaller c.
+      ranked.push_back(make_pair(-validator->Accuracy(c), c));
+    }
+    std::sort(ranked.begin(), ranked.end());
+    const size_t num_kept = fold == validator->num_folds() - 1 ?
+        1 : (ranked.size() + 1) / 2;
+    candidates.clear();
+    for (size_t i = 0; i < num_kept; ++i) {
+      LOG(INFO) << "Fold " << fold << " kept c = " << ranked[i].second <<
+          ", accuracy = " << -ranked[i].first;
+      candidates.push_back(ranked[i].second);
+    }
+  }
+  return candidates[0];
+}
+
+// Searches for the regularizer with the best cross-validation
+// accuracy. First, a geometric search is done: with
+// --c_search=geometric, until the accuracy stops improving, and with
+// --c_search=halving, over a fixed range with successive halving. Then,
+// a finer linear search is done around the best value in the same way.
+float SearchForC(const FoldScoringFunction& score_fold,
+                 const vector<string>& categories,
+                 const set<string>& category_set) {
+  const int kNumFolds = 5;
+  const float kMinC = 0.03125;
+  // The upper end of the fixed range for --c_search=halving.
+  const float kMaxC = 32768;
+  CrossValidator validator(score_fold, categories, category_set, kNumFolds);
+  const bool halving = FLAGS_c_search == "halving";
+  CHECK(halving || FLAGS_c_search == "geometric") <<
+      "Unrecognized --c_search.";
+
+  float best_c = 0;
+  if (halving) {
+    vector<float> candidates;
+    for (float c = kMinC; c <= kMaxC; c *= 2) {
+      candidates.push_back(c);
+    }
+    best_c = SuccessiveHalving(candidates, &validator);
+  } else {
+    // Enough values of c are evaluated at once to give every thread a
+    // task.
+    const int tasks_per_c = kNumFolds * category_set.size();
+    const int cs_per_round =
+        std::max(1, (FLAGS_thread_limit + tasks_per_c - 1) / tasks_per_c);
+    map<float, float> result_map;
+    float c = kMinC;
+    while (!StopCondition(result_map)) {
+      vector<float> cs;
+      for (int i = 0; i < cs_per_round; ++i) {
+        cs.push_back(c);
+        c *= 2;
+      }
+      validator.EvaluateFolds(cs, 0, kNumFolds);
+      BOOST_FOREACH(float c, cs) {
+        result_map[c] = validator.Accuracy(c);
+        LOG(INFO) << "Cross validation accuracy for c = " << c << ": " <<
+            result_map[c];
+      }
+    }
+    best_c = KeyWithMaxValue(result_map);
+  }
+
+  // Then, do a finer search.
+  float lower_bound = best_c / 2;
+  float upper_bound = best_c * 2;
+  float step = (upper_bound - lower_bound) / 10;
+  vector<float> candidates;
+  for (float c = lower_bound; c <= upper_bound; c += step) {
+    candidates.push_back(c);
+  }
+  if (halving) {
+    best_c = SuccessiveHalving(candidates, &validator);
+  } else {
+    validator.EvaluateFolds(candidates, 0, kNumFolds);
+    map<float, float> result_map;
+    BOOST_FOREACH(float c, candidates) {
+      result_map[c] = validator.Accuracy(c);
+      LOG(INFO) << "Cross validation accuracy for c = " << c << ": " <<
+          result_map[c];
+    }
+    best_c = KeyWithMaxValue(result_map);
+  }
+  LOG(INFO) << "Selected c: " << best_c << ".";
+  return best_c;
+}
+
+// Writes the selected c to --cross_validation_checkpoint_file, if it's
+// set.
+void WriteCrossValidationCheckpoint(const float selected_c) {
+  if (!FLAGS_cross_validation_checkpoint_file.empty()) {
+    sjm::util::WriteStringToFileOrDie(
+        FLAGS_cross_validation_checkpoint_file,
+        boost::lexical_cast<string>(selected_c) + "\n");
+  }
+}
+
+// Builds a Nystrom feature map from the training examples, and maps
+// them with it. The pyramids are moved out of file_to_example. The
+// approximation error is reported on a sample of the examples that
+// weren't chosen as landmarks.
+void BuildNystromExamples(TrainingExampleMap* file_to_example,
+                          FeatureMap* feature_map,
+                          vector<SparseVectorFloat>* examples,
+                          vector<string>* categories) {
+  sjm::spatial_pyramid::LandmarkSelection selection;
+  if (FLAGS_nystrom_landmarks == "uniform") {
+    selection = sjm::spatial_pyramid::UNIFORM_LANDMARKS;
+  } else if (FLAGS_nystrom_landmarks == "kmeans++") {
+    selection = sjm::spatial_pyramid::KMEANS_PLUS_PLUS_LANDMARKS;
+  } else {
+    LOG(FATAL) << "Unrecognized --nystrom_landmarks.";
+  }
+  vector<SpatialPyramid> pyramids;
+  for (TrainingExampleMap::iterator it = file_to_example->begin();
+       it != file_to_example->end(); ++it) {
+    pyramids.push_back(SpatialPyramid());
+    pyramids.back().Swap(&it->second.first);
+    categories->push_back(it->second.second);
+  }
+  LOG(INFO) << "Building a Nystrom feature map of rank " <<
+      FLAGS_nystrom_rank << ".";
+  vector<int> landmarks;
+  sjm::spatial_pyramid::BuildNystromFeatureMap(
+      pyramids, pyramids[0].level_size(), FLAGS_nystrom_rank, selection,
+      FLAGS_thread_limit, feature_map, examples, &landmarks);
+
+  // Spread the error sample evenly over the non-landmark examples.
+  set<int> landmark_set(landmarks.begin(), landmarks.end());
+  vector<int> held_out;
+  for (int i = 0; i < static_cast<int>(pyramids.size()); ++i) {
+    if (landmark_set.count(i) == 0) {
+      held_out.push_back(i);
+    }
+  }
+  if (!held_out.empty() && FLAGS_nystrom_error_sample > 0) {
+    const int stride = std::max(
+        1, static_cast<int>(held_out.size()) / FLAGS_nystrom_error_sample);
+    vector<SpatialPyramid> sample;
+    for (size_t i = 0; i < held_out.size() &&
+             static_cast<int>(sample.size()) < FLAGS_nystrom_error_sample;
+         i += stride) {
+      sample.push_back(pyramids[held_out[i]]);
+    }
+    LOG(INFO) << "Relative error of the Nystrom approximation on " <<
+        sample.size() << " held out examples: " <<
+        sjm::spatial_pyramid::KernelApproximationError(*feature_map, sample);
+  }
+}
+
+// Trains linear models on the unrolled training examples with dual
+// coordinate descent, and saves them to
+// <output_directory>/linear_model.pb. No gram matrix is built. For the
+// intersection kernel, the examples are first expanded with an
+// explicit feature map (or a Nystrom map, with --nystrom_rank), which
+// is saved with the model.
+void TrainWithDualCoordinateDescent(TrainingExampleMap* file_to_example,
+                                    const set<string>& category_set,
+                                    const SvmKernel svm_kernel) {
+  FeatureMap feature_map;
+  if (svm_kernel == INTERSECTION_KERNEL && FLAGS_nystrom_rank == 0) {
+    sjm::spatial_pyramid::InitIntersectionFeatureMap(
+        file_to_example->begin()->second.first.level_size(),
+        FLAGS_feature_map_order, FLAGS_feature_map_sampling_step,
+        &feature_map);
+    LOG(INFO) << "Using an intersection feature map of order " <<
+        feature_map.order() << " with sampling step " <<
+        feature_map.sampling_step() << ".";
+  }
+
+  LinearSvmParameters params;
+  if (FLAGS_dcd_loss == "l1") {
+    params.loss = sjm::spatial_pyramid::L1_LOSS;
+  } else if (FLAGS_dcd_loss == "l2") {
+    params.loss = sjm::spatial_pyramid::L2_LOSS;
+  } else {
+    LOG(FATAL) << "Unrecognized --dcd_loss.";
+  }
+  params.epsilon = FLAGS_dcd_epsilon;
+  params.max_iterations = FLAGS_dcd_max_iterations;
+  // The negative examples are weighted down by the number of
+  // categories. These are scaled by c.
+  params.c_positive = 1;
+  params.c_negative = 1.0 / category_set.size();
+
+  vector<SparseVectorFloat> examples;
+  vector<string> categories;
+  int dimensions = 0;
+  if (FLAGS_nystrom_rank > 0) {
+    BuildNystromExamples(file_to_example, &feature_map, &examples,
+                         &categories);
+    dimensions = feature_map.landmark_size();
+  } else {
+    // The pyramids are released as they are unrolled, so only one copy
+    // of the training data is held in memory.
+    LOG(INFO) << "Mapping the training examples.";
+    for (TrainingExampleMap::iterator it = file_to_example->begin();
+         it != file_to_example->end(); ++it) {
+      examples.push_back(SparseVectorFloat());
+      sjm::spatial_pyramid::MapFeatures(
+          feature_map, it->second.first, &examples.back(), &dimensions);
+      categories.push_back(it->second.second);
+      it->second.first.Clear();
+    }
+  }
+
+  float selected_c = 0;
+  if (FLAGS_c == 0) {
+    selected_c = SearchForC(
+        boost::bind(ScoreLinearFold,
+                    boost::cref(examples),
+                    boost::cref(categories),
+                    dimensions,
+                    boost::cref(params),
+                    _1, _2, _3, _4, _5),
+        categories, category_set);
+  } else {
+    selected_c = FLAGS_c;
+  }
+
+  WriteCrossValidationCheckpoint(selected_c);
+
+  params.c_positive = selected_c;
+  params.c_negative = selected_c / category_set.size();
+  LinearModel linear_model;
+  sjm::spatial_pyramid::TrainOneVsRestLinearSvm(
+      examples, categories, category_set, dimensions, params,
+      FLAGS_thread_limit, &linear_model);
+  linear_model.mutable_feature_map()->CopyFrom(feature_map);
+
+  boost::filesystem::path full_output_path =
+      boost::filesystem::path(FLAGS_output_directory) / "linear_model.pb";
+  string serialized_model;
+  linear_model.SerializeToString(&serialized_model);
+  sjm::util::WriteStringToFileOrDie(full_output_path.string(),
+                                    serialized_model);
+  LOG(INFO) << "Saved linear model to " << full_output_path << ".";
+}
+
 int main(int argc, char* argv[]) {
   google::ParseCommandLineFlags(&argc, &argv, true);
   google::InitGoogleLogging(argv[0]);
@@ -374,9 +767,6 @@ int main(int argc, char* argv[]) {
   CHECK(!FLAGS_training_list.empty()) << "--training_list is required.";
   CHECK(!FLAGS_output_directory.empty()) << "--output_basename is required.";
 
-  const int kGeometricFolds = 5;
-  const int kLinearFolds = 5;
-
   SvmKernel svm_kernel;
   vector<string> svm_kernel_parts;
   if (FLAGS_kernel == "intersection") {
@@ -386,6 +776,8 @@ int main(int argc, char* argv[]) {
   } else {
     LOG(FATAL) << "Unrecognized SVM kernel.";
   }
+  CHECK(FLAGS_solver == "libsvm" || FLAGS_solver == "dcd") <<
+      "Unrecognized --solver.";
 
   vector<boost::thread*> training_threads;
   vector<string> training_lines;
@@ -395,6 +787,9 @@ int main(int argc, char* argv[]) {
   set<string> category_set;
   // Maps from an id (the path on disk) to a pair <pyramid, category>.
   TrainingExampleMap file_to_example;
+  // Maps from the path to a hash of the pyramid's content, which
+  // identifies it in the gram cache.
+  map<string, uint64_t> file_to_hash;
   BOOST_FOREACH(string t, training_lines) {
     if (!t.empty()) {
       LOG(INFO) << "Loading " << t;
@@ -407,6 +802,7 @@ int main(int argc, char* argv[]) {
       sjm::util::ReadFileToStringOrDie(path, &pyramid_data);
       pyramid.ParseFromString(pyramid_data);
       file_to_example[path] = make_pair(pyramid, category);
+      file_to_hash[path] = sjm::util::Fnv1aHash(pyramid_data);
       category_set.insert(category);
     }
   }
@@ -417,11 +813,30 @@ int main(int argc, char* argv[]) {
         ", label: " << it->second.second;
   }
 
+  CHECK(FLAGS_nystrom_rank == 0 || svm_kernel == INTERSECTION_KERNEL) <<
+      "--nystrom_rank requires --kernel=intersection.";
+  if (FLAGS_solver == "dcd" || FLAGS_nystrom_rank > 0) {
+    TrainWithDualCoordinateDescent(&file_to_example, category_set,
+                                   svm_kernel);
+    return 0;
+  }
+
   LOG(INFO) << "Building the gram matrix.";
   svm_problem problem;
   problem.l = file_to_example.size();
   problem.y = new double[problem.l];
   problem.x = new svm_node*[problem.l];
+  GramCache gram_cache;
+  vector<int> cache_indices;
+  if (!FLAGS_gram_cache.empty()) {
+    gram_cache.OpenOrDie(FLAGS_gram_cache, svm_kernel);
+    vector<uint64_t> hashes;
+    for (TrainingExampleMap::const_iterator it = file_to_example.begin();
+         it != file_to_example.end(); ++it) {
+      hashes.push_back(file_to_hash[it->first]);
+    }
+    gram_cache.FindOrAddItems(hashes, &cache_indices);
+  }
   // Create the gram matrix once. Split into threads to fill up the
   // matrix in blocks.
   vector<boost::thread*> gram_threads;
@@ -429,7 +844,9 @@ int main(int argc, char* argv[]) {
     boost::thread* gram_thread =
         new boost::thread(
             BuildGramMatrixShard, problem.x, shard, svm_kernel,
-            boost::ref(file_to_example));
+            boost::ref(file_to_example),
+            FLAGS_gram_cache.empty() ? NULL : &gram_cache,
+            &cache_indices);
     gram_threads.push_back(gram_thread);
   }
   // Join to all gram matrix threads.
@@ -452,104 +869,23 @@ int main(int argc, char* argv[]) {
 
   float selected_c = 0;
   if (FLAGS_c == 0) {
-    // Do cross-validation on the training set.
-    // First, do a geometric search.
-    float c = 0.03125;
-    bool done = false;
-    map<float, float> result_map;
-    boost::mutex result_mutex;
-    vector<boost::thread*> thread_list;
-    while (!done) {
-      // If the thread limit has been reached, we wait to join and
-      // delete with one of them.
-      while (static_cast<int>(thread_list.size()) >= FLAGS_thread_limit) {
-        for (vector<boost::thread*>::iterator thread_it = thread_list.begin();
-             thread_it != thread_list.end();
-             ++thread_it) {
-          if ((*thread_it)->timed_join(boost::posix_time::milliseconds(1))) {
-            delete (*thread_it);
-            thread_list.erase(thread_it);
-            break;
-          }
-        }
-      }
-      done = StopCondition(result_map);
-      if (!done) {
-        // Add a cross-validation thread and increment the c value for
-        // the next one.
-        boost::thread* t = new boost::thread(
-            DoEnsembleCrossValidation,
-            boost::ref(file_to_example),
-            boost::ref(category_set),
-            category_set.size(),
-            svm_kernel,
-            c,
-            kGeometricFolds,
-            &problem,
-            &result_map,
-            &result_mutex);
-        thread_list.push_back(t);
-        c *= 2;
-      } else {
-        // Wait for all remaining threads to finish.
-        for (vector<boost::thread*>::iterator thread_it = thread_list.begin();
-             thread_it != thread_list.end();
-             ++thread_it) {
-          (*thread_it)->join();
-          delete (*thread_it);
-        }
-      }
-    }
-    // Then, do a finer search.
-    float lower_bound = KeyWithMaxValue(result_map) / 2;
-    float upper_bound = KeyWithMaxValue(result_map) * 2;
-    float step = (upper_bound - lower_bound) / 10;
-    result_map.clear();
-    thread_list.clear();
-    for (float c = lower_bound; c <= upper_bound; c += step) {
-      // If the thread limit has been reached, we wait to join and
-      // delete with one of them.
-      while (static_cast<int>(thread_list.size()) >= FLAGS_thread_limit) {
-        for (vector<boost::thread*>::iterator thread_it = thread_list.begin();
-             thread_it != thread_list.end();
-             ++thread_it) {
-          if ((*thread_it)->timed_join(boost::posix_time::milliseconds(1))) {
-            delete (*thread_it);
-            thread_list.erase(thread_it);
-            break;
-          }
-        }
-      }
-      boost::thread* t = new boost::thread(
-          DoEnsembleCrossValidation,
-          boost::ref(file_to_example),
-          boost::ref(category_set),
-          category_set.size(),
-          svm_kernel,
-          c,
-          kLinearFolds,
-          &problem,
-          &result_map,
-          &result_mutex);
-      thread_list.push_back(t);
-    }
-    // Wait for all threads to be finished.
-    for (vector<boost::thread*>::iterator thread_it = thread_list.begin();
-         thread_it != thread_list.end();
-         ++thread_it) {
-      (*thread_it)->join();
-      delete (*thread_it);
+    vector<string> categories;
+    for (TrainingExampleMap::const_iterator it = file_to_example.begin();
+         it != file_to_example.end(); ++it) {
+      categories.push_back(it->second.second);
     }
-    float best_c = KeyWithMaxValue(result_map);
-    LOG(INFO) << "Selected c: " << best_c << ".";
-    selected_c = best_c;
+    selected_c = SearchForC(
+        boost::bind(ScoreEnsembleFold,
+                    boost::cref(categories),
+                    category_set.size(),
+                    &problem,
+                    _1, _2, _3, _4, _5),
+        categories, category_set);
   } else {
     selected_c = FLAGS_c;
   }
 
-  if (!FLAGS_cross_validation_checkpoint_file.empty()) {
-    FILE* f = fopen(FLAGS_cross_validation_checkpoint_file.c_str(), "w");
-  }
+  WriteCrossValidationCheckpoint(selected_c);
 
   svm_parameter param;
   param.svm_type = C_SVC;
@@ -568,6 +904,23 @@ int main(int argc, char* argv[]) {
   param.probability = 0;
   param.eps = 0.001;
 
+  // For linear models, the unrolled training vectors are needed to
+  // fold each model's support vectors into a weight vector.
+  const bool export_linear_model =
+      svm_kernel == LINEAR_KERNEL && FLAGS_export_linear_model;
+  vector<SparseVectorFloat> unrolled_examples;
+  LinearModel linear_model;
+  if (export_linear_model) {
+    int dimensions = 0;
+    for (TrainingExampleMap::const_iterator it = file_to_example.begin();
+         it != file_to_example.end(); ++it) {
+      unrolled_examples.push_back(SparseVectorFloat());
+      sjm::spatial_pyramid::UnrollHistograms(
+          it->second.first, &unrolled_examples.back(), &dimensions);
+    }
+    linear_model.set_dimensions(dimensions);
+  }
+
   for (set<string>::const_iterator category = category_set.begin();
        category != category_set.end(); ++category) {
       int i = 0;
@@ -592,10 +945,36 @@ int main(int argc, char* argv[]) {
                    full_output_path.string().c_str(),
                    model)) << "Error saving " << full_output_path;
       LOG(INFO) << "[" << *category << "] Saved model.";
+      if (FLAGS_binary_models) {
+        PrecomputedModel compact_model;
+        sjm::spatial_pyramid::CompactPrecomputedModel(*category, *model,
+                                                      &compact_model);
+        sjm::spatial_pyramid::WritePrecomputedModelOrDie(
+            (output_directory / (*category + ".svmb")).string(),
+            compact_model);
+      }
+      if (export_linear_model) {
+        sjm::spatial_pyramid::LinearCategoryModel* category_model =
+            linear_model.add_category_model();
+        category_model->set_category(*category);
+        sjm::spatial_pyramid::FoldPrecomputedLinearModel(
+            *model, unrolled_examples, linear_model.dimensions(),
+            category_model);
+      }
       svm_free_model_content(model);
       svm_free_and_destroy_model(&model);
   }
 
+  if (export_linear_model) {
+    boost::filesystem::path full_output_path =
+        boost::filesystem::path(FLAGS_output_directory) / "linear_model.pb";
+    string serialized_model;
+    linear_model.SerializeToString(&serialized_model);
+    sjm::util::WriteStringToFileOrDie(full_output_path.string(),
+                                      serialized_model);
+    LOG(INFO) << "Saved linear model to " << full_output_path << ".";
+  }
+
   delete[] param.weight;
   delete[] param.weight_label;
   delete[] problem.y;
@@ -25,20 +25,27 @@
 // This command line tool uses learned SVM models to classify a set of
 // test files.
 
+#include <algorithm>
 #include <map>
 #include <set>
 #include <string>
 #include <vector>
 
+#include "boost/bind.hpp"
 #include "boost/foreach.hpp"
 #include "boost/thread.hpp"
 
 #include "gflags/gflags.h"
 #include "glog/logging.h"
 
+#include "spatial_pyramid/feature_map.h"
+#include "spatial_pyramid/gram_cache.h"
+#include "spatial_pyramid/linear_model.h"
+#include "spatial_pyramid/precomputed_model.h"
 #include "spatial_pyramid/spatial_pyramid.pb.h"
 #include "spatial_pyramid/spatial_pyramid_kernel.h"
 #include "spatial_pyramid/svm/svm.h"
+#include "util/thread_pool.h"
 #include "util/util.h"
 
 DEFINE_string(
@@ -47,8 +54,10 @@ DEFINE_string(
     "Each line is '<train_file>:<ground_truth_category>'.");
 DEFINE_string(
     model_list, "",
-    "A list of libsvm model files - one for each category. Each line is "
-    "'<model_file>:<category>'.");
+    "A list of model files - one for each category. Each line is "
+    "'<model_file>:<category>'. The files can be libsvm text models or "
+    "the binary .svmb models written by trainer_cli and "
+    "convert_model_cli, which load much faster.");
 DEFINE_string(
     testing_list, "",
     "A list of pyramid files to classify using the models from model_list. "
@@ -62,112 +71,298 @@ DEFINE_int32(
 DEFINE_string(
     kernel, "intersection",
     "The svm type. Options are \"intersection\" or \"linear\".");
+DEFINE_string(
+    linear_model, "",
+    "A linear_model.pb file written by trainer_cli --kernel=linear or "
+    "--solver=dcd. If given, each test pyramid is mapped with the "
+    "model's feature map and scored with one dot product per category, "
+    "and --training_list, --model_list, and --kernel are ignored.");
+DEFINE_string(
+    gram_cache, "",
+    "If set, the kernel values between the test and training pyramids "
+    "are read from and saved to this gram cache file, which is usually "
+    "the file that trainer_cli used with --gram_cache. The test "
+    "pyramids aren't added to it, so only those that are already in "
+    "it (e.g. because trainer_cli was run on them) use it.");
+
+DEFINE_bool(
+    batch, false,
+    "If true, the kernel SVMs classify all the test pyramids together: "
+    "the test x training kernel values are computed in blocks of "
+    "--batch_size test pyramids on a fixed pool of --thread_limit "
+    "threads. --gram_cache isn't used in this mode.");
+DEFINE_int32(
+    batch_size, 1024,
+    "The number of test pyramids whose kernel values are held in memory "
+    "at once with --batch.");
+
 using std::map;
 using std::pair;
 using std::set;
 using std::string;
 using std::vector;
+using sjm::spatial_pyramid::GramCache;
+using sjm::spatial_pyramid::LinearModel;
+using sjm::spatial_pyramid::PrecomputedModel;
 using sjm::spatial_pyramid::SpatialPyramid;
 using sjm::spatial_pyramid::SparseVectorFloat;
+using sjm::spatial_pyramid::SvmKernel;
+using sjm::spatial_pyramid::INTERSECTION_KERNEL;
+using sjm::spatial_pyramid::LINEAR_KERNEL;
 
-typedef map<string, SpatialPyramid> PyramidMap;
-typedef map<string, svm_model*> SvmMap;
+// Training pyramids keyed by their index in the training list sorted
+// by line, which is the index libsvm's support vectors refer to. Only
+// the support vectors are loaded.
+typedef map<int, SpatialPyramid> PyramidMap;
+typedef map<string, PrecomputedModel> ModelMap;
 typedef map<string, pair<int, int> > ResultsMap;
 
-enum SvmKernel {
-  LINEAR_KERNEL,
-  INTERSECTION_KERNEL
+// The items of the training pyramids in a gram cache.
+struct CacheItems {
+  GramCache* gram_cache;
+  // In PyramidMap order.
+  vector<int> training_items;
 };
 
+// Counts the prediction in the per-category (total, correct) results.
+void TallyResult(const string& test_filename,
+                 const string& true_category,
+                 const string& predicted_category,
+                 ResultsMap* results_map) {
+  if (results_map->find(true_category) != results_map->end()) {
+    // We've already got some results for this category.
+    int total = (*results_map)[true_category].first;
+    int correct = (*results_map)[true_category].second;
+    int new_total = total + 1;
+    int new_correct = correct;
+    if (predicted_category == true_category) {
+      new_correct += 1;
+    }
+    (*results_map)[true_category] = std::make_pair(new_total, new_correct);
+  } else {
+    if (predicted_category == true_category) {
+      (*results_map)[true_category] = std::make_pair(1, 1);
+    } else {
+      (*results_map)[true_category] = std::make_pair(1, 0);
+    }
+  }
+
+  LOG(INFO) << "File: " << test_filename <<
+      ", Prediction: " << predicted_category;
+}
+
+void RecordResult(const string& test_filename,
+                  const string& true_category,
+                  const string& predicted_category,
+                  ResultsMap& results_map,
+                  boost::mutex& results_mutex) {
+  boost::mutex::scoped_lock l(results_mutex);
+  TallyResult(test_filename, true_category, predicted_category, &results_map);
+}
+
+// Classifies the test file using a model that was folded into
+// explicit weight vectors. This is a single sparse-dense product per
+// category, independent of the number of training examples.
+void ClassifyLinear(const string test_filename,
+                    const string true_category,
+                    const LinearModel& linear_model,
+                    ResultsMap& results_map,
+                    boost::mutex& results_mutex) {
+  SpatialPyramid testing_pyramid;
+  string pyramid_data;
+  sjm::util::ReadFileToStringOrDie(test_filename, &pyramid_data);
+  testing_pyramid.ParseFromString(pyramid_data);
+  SparseVectorFloat mapped;
+  sjm::spatial_pyramid::MapFeatures(linear_model.feature_map(),
+                                    testing_pyramid, &mapped);
+  string max_category =
+      sjm::spatial_pyramid::PredictCategory(linear_model, mapped);
+  RecordResult(test_filename, true_category, max_category,
+               results_map, results_mutex);
+}
+
+// Classifies the test file with the kernel SVMs. If cache_items is
+// not NULL, the kernel values are looked up in its gram cache (and
+// saved to it if they weren't cached).
 void Classify(const string test_filename,
               const string true_category,
               const PyramidMap& example_map,
-              const SvmMap& svm_map,
+              const ModelMap& model_map,
               const SvmKernel svm_kernel,
+              const CacheItems* cache_items,
               ResultsMap& results_map,
               boost::mutex& results_mutex) {
-  svm_node* kernel_vector = new svm_node[example_map.size() + 2];
-  int* label_vector = new int[2];
-  double decision_value = 0;
-
   SpatialPyramid testing_pyramid;
   string pyramid_data;
   sjm::util::ReadFileToStringOrDie(test_filename, &pyramid_data);
   testing_pyramid.ParseFromString(pyramid_data);
-  // Form the kernel vector for this example. The first index is zero
-  // and the value doesn't matter. This is the libsvm library
-  // convention for test vectors.
-  kernel_vector[0].index = 0;
-  kernel_vector[0].value = 0;
-  int i = 1;
+  // The kernel values are indexed by training index. Only the entries
+  // of support vectors are read by the models, so the others are left
+  // at zero.
+  const int num_entries = example_map.empty() ?
+      0 : example_map.rbegin()->first + 1;
+  vector<float> kernel_values(num_entries, 0);
+  // Test pyramids that aren't in the gram cache don't use it.
+  GramCache* gram_cache = NULL;
+  int test_item = -1;
+  if (cache_items != NULL) {
+    test_item = cache_items->gram_cache->FindItem(
+        sjm::util::Fnv1aHash(pyramid_data));
+    if (test_item >= 0) {
+      gram_cache = cache_items->gram_cache;
+    }
+  }
+  int item = 0;
   for (PyramidMap::const_iterator it = example_map.begin();
-       it != example_map.end(); ++it) {
-    kernel_vector[i].index = i;
-    if (svm_kernel == INTERSECTION_KERNEL) {
-      kernel_vector[i].value =
-          sjm::spatial_pyramid::SpmKernel(testing_pyramid, it->second,
-                                          testing_pyramid.level_size());
-    } else if (svm_kernel == LINEAR_KERNEL) {
-      kernel_vector[i].value =
-          sjm::spatial_pyramid::LinearKernel(testing_pyramid, it->second);
+       it != example_map.end(); ++it, ++item) {
+    float value = 0;
+    if (gram_cache == NULL ||
+        !gram_cache->Get(test_item, cache_items->training_items[item],
+                         &value)) {
+      value = sjm::spatial_pyramid::EvaluateKernel(svm_kernel,
+                                                   testing_pyramid,
+                                                   it->second);
+      if (gram_cache != NULL) {
+        gram_cache->Set(test_item, cache_items->training_items[item], value);
+      }
     }
-    ++i;
+    kernel_values[it->first] = value;
   }
-  kernel_vector[example_map.size() + 1].index = -1;
-  kernel_vector[example_map.size() + 1].value = 0;
 
-  // Now, get the decision values for the +1 class in each of the
-  // models and find the category scored most strongly.
+  // Now, get the scores for each of the models and find the category
+  // scored most strongly.
   string max_category = "";
   double max_score = -10000;
-  for (SvmMap::const_iterator it = svm_map.begin();
-       it != svm_map.end(); ++it) {
-    const string category = it->first;
-    const svm_model* model = it->second;
-    // The meaning of decision_value depends on what label is in
-    // position [0] of the labels structure.
-    svm_get_labels(model, label_vector);
-    svm_predict_values(model, kernel_vector, &decision_value);
-    double category_score;
-    if (label_vector[0] == 1) {
-      // If the first label was +1, then the decision value is the
-      // confidence for +1 class.
-      category_score = decision_value;
-    } else {
-      // If the first label was not +1 (ie. it was -1), then the
-      // decision value is the confidence for the -1 class.
-      category_score = -decision_value;
-    }
+  for (ModelMap::const_iterator it = model_map.begin();
+       it != model_map.end(); ++it) {
+    const double category_score = sjm::spatial_pyramid::PrecomputedScore(
+        it->second, kernel_values.empty() ? NULL : &kernel_values[0]);
     if (category_score > max_score) {
       max_score = category_score;
-      max_category = category;
+      max_category = it->first;
     }
   }
 
-  boost::mutex::scoped_lock l(results_mutex);
-  if (results_map.find(true_category) != results_map.end()) {
-    // We've already got some results for this category.
-    int total = results_map[true_category].first;
-    int correct = results_map[true_category].second;
-    int new_total = total + 1;
-    int new_correct = correct;
-    if (max_category == true_category) {
-      new_correct += 1;
+  RecordResult(test_filename, true_category, max_category,
+               results_map, results_mutex);
+}
+
+void LoadPyramid(const string& filename, SpatialPyramid* pyramid) {
+  string pyramid_data;
+  sjm::util::ReadFileToStringOrDie(filename, &pyramid_data);
+  pyramid->ParseFromString(pyramid_data);
+}
+
+// Finds the top scoring model for each of the rows [first_row,
+// end_row) of the kernel block, and stores the category at
+// predictions[prediction_offset + row].
+void PredictBlockRows(const vector<PrecomputedModel>& models,
+                      const vector<float>& block,
+                      const size_t num_columns,
+                      const size_t first_row,
+                      const size_t end_row,
+                      const size_t prediction_offset,
+                      vector<string>* predictions) {
+  for (size_t row = first_row; row < end_row; ++row) {
+    const float* kernel_values = &block[row * num_columns];
+    string max_category = "";
+    double max_score = -10000;
+    for (size_t m = 0; m < models.size(); ++m) {
+      const double category_score =
+          sjm::spatial_pyramid::PrecomputedScore(models[m], kernel_values);
+      if (category_score > max_score) {
+        max_score = category_score;
+        max_category = models[m].category;
+      }
     }
-    results_map[true_category] = std::make_pair(new_total, new_correct);
-  } else {
-    if (max_category == true_category) {
-      results_map[true_category] = std::make_pair(1, 1);
-    } else {
-      results_map[true_category] = std::make_pair(1, 0);
+    (*predictions)[prediction_offset + row] = max_category;
+  }
+}
+
+// Classifies all the test files with the kernel SVMs. Unlike Classify,
+// the test pyramids are loaded once, the test x training kernel
+// values are computed a block at a time, and the work is done on a
+// fixed pool of threads. Each task writes its predictions to its own
+// slots, and they are tallied at the end.
+void ClassifyBatch(const vector<string>& testing_list,
+                   const PyramidMap& example_map,
+                   const ModelMap& model_map,
+                   const SvmKernel svm_kernel,
+                   ResultsMap* results_map) {
+  sjm::util::ThreadPool pool(FLAGS_thread_limit);
+  vector<string> test_filenames;
+  vector<string> true_categories;
+  BOOST_FOREACH(string t, testing_list) {
+    if (!t.empty()) {
+      vector<string> testing_parts;
+      boost::split(testing_parts, t, boost::is_any_of(":"));
+      test_filenames.push_back(testing_parts[0]);
+      true_categories.push_back(testing_parts[1]);
     }
   }
+  LOG(INFO) << "Loading " << test_filenames.size() << " test pyramids.";
+  vector<SpatialPyramid> test_pyramids(test_filenames.size());
+  sjm::util::TaskGroup loads;
+  for (size_t i = 0; i < test_filenames.size(); ++i) {
+    pool.Schedule(boost::bind(LoadPyramid, boost::cref(test_filenames[i]),
+                              &test_pyramids[i]),
+                  &loads);
+  }
+  loads.Wait();
 
-  LOG(INFO) << "File: " << test_filename <<
-      ", Prediction: " << max_category;
+  // The kernel block only has columns for the support vectors, so the
+  // models' training indices are remapped to column indices.
+  vector<const SpatialPyramid*> training_pyramids;
+  map<int, int> training_index_to_column;
+  for (PyramidMap::const_iterator it = example_map.begin();
+       it != example_map.end(); ++it) {
+    training_index_to_column[it->first] = training_pyramids.size();
+    training_pyramids.push_back(&it->second);
+  }
+  vector<PrecomputedModel> models;
+  int m = 0;
+  for (ModelMap::const_iterator it = model_map.begin(); it != model_map.end();
+       ++it) {
+    models.push_back(it->second);
+    for (size_t i = 0; i < models[m].support_vectors.size(); ++i) {
+      map<int, int>::const_iterator column =
+          training_index_to_column.find(models[m].support_vectors[i]);
+      CHECK(column != training_index_to_column.end()) <<
+          "The model for " << it->first << " doesn't match the training list.";
+      models[m].support_vectors[i] = column->second;
+    }
+    ++m;
+  }
+
+  const size_t kRowsPerTask = 16;
+  const size_t num_columns = training_pyramids.size();
+  vector<string> predictions(test_filenames.size());
+  vector<float> block;
+  for (size_t start = 0; start < test_pyramids.size();
+       start += FLAGS_batch_size) {
+    const size_t end =
+        std::min(test_pyramids.size(), start + FLAGS_batch_size);
+    LOG(INFO) << "Classifying test pyramids " << start << " to " << end << ".";
+    vector<const SpatialPyramid*> rows;
+    for (size_t i = start; i < end; ++i) {
+      rows.push_back(&test_pyramids[i]);
+    }
+    sjm::spatial_pyramid::ComputeKernelBlock(svm_kernel, rows,
+                                             training_pyramids, &pool, &block);
+    sjm::util::TaskGroup predictions_done;
+    for (size_t row = 0; row < rows.size(); row += kRowsPerTask) {
+      pool.Schedule(boost::bind(
+          PredictBlockRows, boost::cref(models), boost::cref(block),
+          num_columns, row, std::min(rows.size(), row + kRowsPerTask), start,
+          &predictions), &predictions_done);
+    }
+    predictions_done.Wait();
+  }
 
-  delete[] label_vector;
-  delete[] kernel_vector;
+  for (size_t i = 0; i < test_filenames.size(); ++i) {
+    TallyResult(test_filenames[i], true_categories[i], predictions[i],
+                results_map);
+  }
 }
 
 int main(int argc, char* argv[]) {
@@ -189,84 +384,151 @@ int main(int argc, char* argv[]) {
   }
 
   // Load all the list data.
-  string pyramid_list_data;
-  sjm::util::ReadFileToStringOrDie(FLAGS_training_list, &pyramid_list_data);
-  string model_list_data;
-  sjm::util::ReadFileToStringOrDie(FLAGS_model_list, &model_list_data);
   string testing_list_data;
   sjm::util::ReadFileToStringOrDie(FLAGS_testing_list, &testing_list_data);
-  vector<string> pyramid_list;
-  boost::split(pyramid_list, pyramid_list_data, boost::is_any_of("\n"));
-  vector<string> model_list;
-  boost::split(model_list, model_list_data, boost::is_any_of("\n"));
   vector<string> testing_list;
   boost::split(testing_list, testing_list_data, boost::is_any_of("\n"));
 
-  // Load the training data into a map sorted by filename.
   PyramidMap file_to_training_data;
-  BOOST_FOREACH(string t, pyramid_list) {
-    if (!t.empty()) {
-      vector<string> training_parts;
-      boost::split(training_parts, t, boost::is_any_of(":"));
-      string training_pyramid_name = training_parts[0];
-      SpatialPyramid pyramid;
-      string pyramid_data;
-      sjm::util::ReadFileToStringOrDie(training_pyramid_name, &pyramid_data);
-      pyramid.ParseFromString(pyramid_data);
-      file_to_training_data[t] = pyramid;
+  map<int, uint64_t> index_to_hash;
+  ModelMap category_to_model;
+  LinearModel linear_model;
+  if (!FLAGS_linear_model.empty()) {
+    // The folded linear model replaces both the training pyramids and
+    // the per-category libsvm models.
+    string linear_model_data;
+    sjm::util::ReadFileToStringOrDie(FLAGS_linear_model, &linear_model_data);
+    CHECK(linear_model.ParseFromString(linear_model_data)) <<
+        "Error parsing " << FLAGS_linear_model;
+    LOG(INFO) << "Loaded linear model with " <<
+        linear_model.category_model_size() << " categories.";
+  } else {
+    string pyramid_list_data;
+    sjm::util::ReadFileToStringOrDie(FLAGS_training_list, &pyramid_list_data);
+    string model_list_data;
+    sjm::util::ReadFileToStringOrDie(FLAGS_model_list, &model_list_data);
+    vector<string> pyramid_list;
+    boost::split(pyramid_list, pyramid_list_data, boost::is_any_of("\n"));
+    vector<string> model_list;
+    boost::split(model_list, model_list_data, boost::is_any_of("\n"));
+
+    // Load all the models and put in map, keyed by category name. The
+    // models are loaded first so that only the training pyramids that
+    // are support vectors of some model need to be loaded.
+    set<int> support_vectors;
+    BOOST_FOREACH(string t, model_list) {
+      if (!t.empty()) {
+        vector<string> model_parts;
+        boost::split(model_parts, t, boost::is_any_of(":"));
+        const string model_file = sjm::util::expand_user(model_parts[0]);
+        PrecomputedModel* model = &category_to_model[model_parts[1]];
+        if (sjm::spatial_pyramid::IsBinaryPrecomputedModel(model_file)) {
+          sjm::spatial_pyramid::ReadPrecomputedModelOrDie(model_file, model);
+          model->category = model_parts[1];
+        } else {
+          svm_model* libsvm_model = svm_load_model(model_file.c_str());
+          CHECK(libsvm_model != NULL) << "Error loading " << model_file;
+          sjm::spatial_pyramid::CompactPrecomputedModel(
+              model_parts[1], *libsvm_model, model);
+          svm_free_and_destroy_model(&libsvm_model);
+        }
+        support_vectors.insert(model->support_vectors.begin(),
+                               model->support_vectors.end());
+      }
+    }
+
+    // The support vectors refer to the training examples by their
+    // position in the training list sorted by line.
+    set<string> sorted_pyramid_list;
+    BOOST_FOREACH(string t, pyramid_list) {
+      if (!t.empty()) {
+        sorted_pyramid_list.insert(t);
+      }
     }
+    int index = 0;
+    BOOST_FOREACH(string t, sorted_pyramid_list) {
+      if (support_vectors.count(index) > 0) {
+        vector<string> training_parts;
+        boost::split(training_parts, t, boost::is_any_of(":"));
+        string training_pyramid_name = training_parts[0];
+        SpatialPyramid pyramid;
+        string pyramid_data;
+        sjm::util::ReadFileToStringOrDie(training_pyramid_name, &pyramid_data);
+        pyramid.ParseFromString(pyramid_data);
+        file_to_training_data[index] = pyramid;
+        index_to_hash[index] = sjm::util::Fnv1aHash(pyramid_data);
+      }
+      ++index;
+    }
+    CHECK(support_vectors.empty() ||
+          *support_vectors.rbegin() < static_cast<int>(
+              sorted_pyramid_list.size())) <<
+        "The models don't match the training list.";
+    LOG(INFO) << "Loaded " << file_to_training_data.size() << " of " <<
+        sorted_pyramid_list.size() << " training pyramids as support vectors.";
   }
 
-  // Load all the models and put in map, keyed by category name.
-  SvmMap category_to_svm_model;
-  BOOST_FOREACH(string t, model_list) {
-    if (!t.empty()) {
-      vector<string> model_parts;
-      boost::split(model_parts, t, boost::is_any_of(":"));
-      svm_model* model =
-          svm_load_model(sjm::util::expand_user(model_parts[0]).c_str());
-      category_to_svm_model[model_parts[1]] = model;
+  // The training pyramids are added to the gram cache up front, since
+  // adding items can't be done concurrently with lookups.
+  GramCache gram_cache;
+  CacheItems cache_items;
+  cache_items.gram_cache = &gram_cache;
+  // Batch mode only applies to the kernel SVMs.
+  const bool batch = FLAGS_batch && FLAGS_linear_model.empty();
+  if (!FLAGS_gram_cache.empty() && FLAGS_linear_model.empty() && !batch) {
+    gram_cache.OpenOrDie(FLAGS_gram_cache, svm_kernel);
+    vector<uint64_t> hashes;
+    for (PyramidMap::const_iterator it = file_to_training_data.begin();
+         it != file_to_training_data.end(); ++it) {
+      hashes.push_back(index_to_hash[it->first]);
     }
+    gram_cache.FindOrAddItems(hashes, &cache_items.training_items);
   }
 
   ResultsMap results_map;
   boost::mutex results_mutex;
-  vector<boost::thread*> threads_list;
-  // Classify each of the test images and compare against the ground truth.
-  BOOST_FOREACH(string t, testing_list) {
-    if (!t.empty()) {
-      vector<string> testing_parts;
-      boost::split(testing_parts, t, boost::is_any_of(":"));
-      string test_filename = testing_parts[0];
-      string true_category = testing_parts[1];
-      while (threads_list.size() >= FLAGS_thread_limit) {
-        for (vector<boost::thread*>::iterator thread_it = threads_list.begin();
-             thread_it != threads_list.end();
-             ++thread_it) {
-          if ((*thread_it)->timed_join(boost::posix_time::milliseconds(25))) {
-            delete (*thread_it);
-            threads_list.erase(thread_it);
-            break;
-          }
+  if (batch) {
+    ClassifyBatch(testing_list, file_to_training_data, category_to_model,
+                  svm_kernel, &results_map);
+  } else {
+    vector<boost::thread*> threads_list;
+    // Classify each of the test images and compare against the ground truth.
+    BOOST_FOREACH(string t, testing_list) {
+      if (!t.empty()) {
+        vector<string> testing_parts;
+        boost::split(testing_parts, t, boost::is_any_of(":"));
+        string test_filename = testing_parts[0];
+        string true_category = testing_parts[1];
+        sjm::util::PollForAvailablePoolSpace(FLAGS_thread_limit, 25,
+                                             &threads_list);
+        // TODO(sanchom): Change results_map to a pointer instead of a
+        // reference.  Same with results_mutex.
+        boost::thread* classify_thread = NULL;
+        if (!FLAGS_linear_model.empty()) {
+          classify_thread =
+              new boost::thread(ClassifyLinear, test_filename, true_category,
+                                boost::ref(linear_model),
+                                boost::ref(results_map),
+                                boost::ref(results_mutex));
+        } else {
+          classify_thread =
+              new boost::thread(Classify, test_filename, true_category,
+                                boost::ref(file_to_training_data),
+                                boost::ref(category_to_model),
+                                svm_kernel,
+                                FLAGS_gram_cache.empty() ? NULL : &cache_items,
+                                boost::ref(results_map),
+                                boost::ref(results_mutex));
         }
+        threads_list.push_back(classify_thread);
       }
-      // TODO(sanchom): Change results_map to a pointer instead of a
-      // reference.  Same with results_mutex.
-      boost::thread* classify_thread =
-          new boost::thread(Classify, test_filename, true_category,
-                            boost::ref(file_to_training_data),
-                            boost::ref(category_to_svm_model),
-                            svm_kernel,
-                            boost::ref(results_map),
-                            boost::ref(results_mutex));
-      threads_list.push_back(classify_thread);
     }
-  }
-  // Join with any remaining threads.
-  for (vector<boost::thread*>::iterator thread_it = threads_list.begin();
-       thread_it != threads_list.end(); ++thread_it) {
-    (*thread_it)->join();
-    delete (*thread_it);
+    // Join with any remaining threads.
+    for (vector<boost::thread*>::iterator thread_it = threads_list.begin();
+         thread_it != threads_list.end(); ++thread_it) {
+      (*thread_it)->join();
+      delete (*thread_it);
+    }
   }
 
   float average_accuracy = 0;
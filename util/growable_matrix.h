@@ -0,0 +1,150 @@
+// Copyright (c) 2011-2012, Sancho McCann
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+
+// - Redistributions of source code must retain the above copyright
+//   notice, this list of conditions and the following disclaimer.
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// A row-major matrix that grows one block of rows at a time without
+// ever moving its data. The address space for the largest size is
+// reserved up front (with no access, so it uses no memory), and is
+// made writable a chunk at a time as rows are added. Growing never
+// copies, so the peak memory is the final data size, and pointers to
+// the rows (e.g. a flann::Matrix over data()) stay valid. Only
+// reserving more rows than the first reservation moves them.
+
+#ifndef UTIL_GROWABLE_MATRIX_H_
+#define UTIL_GROWABLE_MATRIX_H_
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+
+#include "glog/logging.h"
+
+namespace sjm {
+namespace util {
+
+template <typename T>
+class GrowableMatrix {
+ public:
+  GrowableMatrix()
+      : data_(NULL), cols_(0), rows_(0), max_rows_(0), reserved_bytes_(0),
+        committed_bytes_(0) {}
+  ~GrowableMatrix() {
+    if (data_ != NULL) {
+      PCHECK(munmap(data_, reserved_bytes_) == 0);
+    }
+  }
+  // The number of rows to reserve when there's no better estimate. It
+  // only costs address space.
+  static const size_t kDefaultMaxRows = static_cast<size_t>(1) << 28;
+
+  // Reserves the address space for up to max_rows rows of cols
+  // elements. This must be called before adding rows. Calling it
+  // again with more rows moves the rows into a new reservation, which
+  // invalidates any pointers to them.
+  void Reserve(const size_t cols, const size_t max_rows) {
+    CHECK_GT(cols, 0);
+    if (data_ != NULL) {
+      CHECK_EQ(cols_, cols) << "The matrix was reserved with " << cols_ <<
+          " columns.";
+      if (max_rows <= max_rows_) {
+        return;
+      }
+    }
+    const size_t reserved_bytes = RoundUpToPage(max_rows * cols * sizeof(T));
+    void* reserved = mmap(NULL, reserved_bytes, PROT_NONE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    PCHECK(reserved != MAP_FAILED) << "Error reserving " <<
+        reserved_bytes << " bytes.";
+    if (data_ != NULL) {
+      if (committed_bytes_ > 0) {
+        PCHECK(mprotect(reserved, committed_bytes_,
+                        PROT_READ | PROT_WRITE) == 0) <<
+            "Error committing " << committed_bytes_ << " bytes.";
+        memcpy(reserved, data_, rows_ * cols_ * sizeof(T));
+      }
+      PCHECK(munmap(data_, reserved_bytes_) == 0);
+    }
+    data_ = static_cast<T*>(reserved);
+    cols_ = cols;
+    max_rows_ = max_rows;
+    reserved_bytes_ = reserved_bytes;
+  }
+  // Adds num_rows rows to the end, and returns the first of them. The
+  // new rows are zeroed.
+  T* AddRows(const size_t num_rows) {
+    CHECK(data_ != NULL) << "Reserve() must be called before AddRows().";
+    CHECK_LE(rows_ + num_rows, max_rows_) <<
+        "The matrix is full. Reserve more rows.";
+    const size_t needed_bytes = (rows_ + num_rows) * cols_ * sizeof(T);
+    if (needed_bytes > committed_bytes_) {
+      // Commit at least double the current size, so that the number
+      // of mprotect calls is logarithmic in the final size.
+      const size_t kMinimumCommit = 1 << 20;
+      const size_t new_committed_bytes = std::min(
+          reserved_bytes_,
+          RoundUpToPage(std::max(needed_bytes,
+                                 std::max(2 * committed_bytes_,
+                                          kMinimumCommit))));
+      PCHECK(mprotect(data_, new_committed_bytes,
+                      PROT_READ | PROT_WRITE) == 0) <<
+          "Error committing " << new_committed_bytes << " bytes.";
+      committed_bytes_ = new_committed_bytes;
+    }
+    T* first_row = (*this)[rows_];
+    rows_ += num_rows;
+    return first_row;
+  }
+  T* operator[](const size_t row) const {
+    return data_ + row * cols_;
+  }
+  T* data() const { return data_; }
+  size_t rows() const { return rows_; }
+  size_t cols() const { return cols_; }
+  size_t max_rows() const { return max_rows_; }
+
+ private:
+  static size_t RoundUpToPage(const size_t bytes) {
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+    return (bytes + page_size - 1) / page_size * page_size;
+  }
+
+  T* data_;
+  size_t cols_;
+  size_t rows_;
+  size_t max_rows_;
+  size_t reserved_bytes_;
+  size_t committed_bytes_;
+
+  // Not copyable.
+  GrowableMatrix(const GrowableMatrix&);
+  void operator=(const GrowableMatrix&);
+};
+
+template <typename T>
+const size_t GrowableMatrix<T>::kDefaultMaxRows;
+}}  // End namespaces sjm, util
+
+#endif  // UTIL_GROWABLE_MATRIX_H_
@@ -0,0 +1,165 @@
+// Copyright (c) 2011-2012, Sancho McCann
+
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+
+// - Redistributions of source code must retain the above copyright
+//   notice, this list of conditions and the following disclaimer.
+// - Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// A fixed-size pool of worker threads. Unlike starting one
+// boost::thread per unit of work (see PollForAvailablePoolSpace), the
+// threads are started once and pull tasks from a shared queue, so
+// small tasks don't pay for thread creation and polling. Each caller
+// waits for its own tasks through a TaskGroup, so several callers can
+// share a pool without waiting for each other's tasks.
+
+#ifndef UTIL_THREAD_POOL_H_
+#define UTIL_THREAD_POOL_H_
+
+#include <deque>
+#include <vector>
+
+#include "boost/bind.hpp"
+#include "boost/function.hpp"
+#include "boost/thread.hpp"
+
+#include "glog/logging.h"
+
+namespace sjm {
+namespace util {
+
+// Counts the unfinished tasks that were scheduled with it.
+class TaskGroup {
+ public:
+  TaskGroup() : num_unfinished_(0) {}
+  // Blocks until all the tasks scheduled with this group have
+  // finished.
+  void Wait() {
+    boost::mutex::scoped_lock l(mutex_);
+    while (num_unfinished_ > 0) {
+      all_finished_.wait(l);
+    }
+  }
+ private:
+  friend class ThreadPool;
+
+  void Add() {
+    boost::mutex::scoped_lock l(mutex_);
+    ++num_unfinished_;
+  }
+  void Finish() {
+    boost::mutex::scoped_lock l(mutex_);
+    if (--num_unfinished_ == 0) {
+      all_finished_.notify_all();
+    }
+  }
+
+  boost::mutex mutex_;
+  boost::condition_variable all_finished_;
+  int num_unfinished_;
+
+  TaskGroup(const TaskGroup&);
+  void operator=(const TaskGroup&);
+};
+
+class ThreadPool {
+ public:
+  explicit ThreadPool(const int num_threads)
+      : num_unfinished_(0), stopping_(false) {
+    CHECK_GT(num_threads, 0);
+    for (int i = 0; i < num_threads; ++i) {
+      threads_.push_back(
+          new boost::thread(&ThreadPool::Work, this));
+    }
+  }
+  // Waits for all the scheduled tasks to finish.
+  ~ThreadPool() {
+    Wait();
+    {
+      boost::mutex::scoped_lock l(mutex_);
+      stopping_ = true;
+    }
+    task_available_.notify_all();
+    for (size_t i = 0; i < threads_.size(); ++i) {
+      threads_[i]->join();
+      delete threads_[i];
+    }
+  }
+  // Queues the task to be run by one of the threads. The group's
+  // Wait() returns once it has finished.
+  void Schedule(const boost::function<void ()>& task, TaskGroup* group) {
+    group->Add();
+    {
+      boost::mutex::scoped_lock l(mutex_);
+      tasks_.push_back(boost::bind(&ThreadPool::Run, task, group));
+      ++num_unfinished_;
+    }
+    task_available_.notify_one();
+  }
+  int size() const {
+    return threads_.size();
+  }
+ private:
+  static void Run(const boost::function<void ()>& task, TaskGroup* group) {
+    task();
+    group->Finish();
+  }
+
+  // Blocks until all the scheduled tasks have finished.
+  void Wait() {
+    boost::mutex::scoped_lock l(mutex_);
+    while (num_unfinished_ > 0) {
+      all_finished_.wait(l);
+    }
+  }
+
+  void Work() {
+    while (true) {
+      boost::function<void ()> task;
+      {
+        boost::mutex::scoped_lock l(mutex_);
+        while (tasks_.empty() && !stopping_) {
+          task_available_.wait(l);
+        }
+        if (tasks_.empty()) {
+          return;
+        }
+        task = tasks_.front();
+        tasks_.pop_front();
+      }
+      task();
+      boost::mutex::scoped_lock l(mutex_);
+      if (--num_unfinished_ == 0) {
+        all_finished_.notify_all();
+      }
+    }
+  }
+
+  boost::mutex mutex_;
+  boost::condition_variable task_available_;
+  boost::condition_variable all_finished_;
+  std::deque<boost::function<void ()> > tasks_;
+  // The number of tasks that are queued or running.
+  int num_unfinished_;
+  bool stopping_;
+  std::vector<boost::thread*> threads_;
+};
+}}  // End namespaces sjm, util
+
+#endif  // UTIL_THREAD_POOL_H_
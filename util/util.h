@@ -25,6 +25,8 @@
 #ifndef UTIL_UTIL_H_
 #define UTIL_UTIL_H_
 
+#include <stdint.h>
+
 #include <cstdlib>
 #include <set>
 #include <string>
@@ -108,6 +110,26 @@ void AppendStringToFileOrDie(const std::string& filename,
   CHECK_EQ(0, fclose(f));
 }
 
+// The FNV-1a hash of no bytes.
+const uint64_t kFnv1aOffsetBasis = 14695981039346656037ULL;
+
+// Returns the 64-bit FNV-1a hash of the bytes, continuing from seed,
+// the hash of any preceding bytes. This is for identifying content,
+// e.g. in caches, and is not cryptographic.
+inline uint64_t Fnv1aHash(const void* data, const size_t size,
+                          uint64_t seed = kFnv1aOffsetBasis) {
+  const unsigned char* bytes = static_cast<const unsigned char*>(data);
+  for (size_t i = 0; i < size; ++i) {
+    seed ^= bytes[i];
+    seed *= 1099511628211ULL;
+  }
+  return seed;
+}
+
+inline uint64_t Fnv1aHash(const std::string& data) {
+  return Fnv1aHash(data.data(), data.size());
+}
+
 template<typename T>
 inline bool HasKey(const T& keyed_collection, const typename T::key_type& key) {
   return keyed_collection.find(key) != keyed_collection.end();
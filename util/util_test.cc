@@ -26,11 +26,15 @@
 
 // File under test.
 #include "util/util.h"
+#include "util/growable_matrix.h"
+#include "util/thread_pool.h"
 
 #include <map>
 #include <string>
 #include <vector>
 
+#include "boost/bind.hpp"
+#include "boost/thread.hpp"
 #include "gtest/gtest.h"
 
 using std::map;
@@ -53,6 +57,114 @@ TEST(UtilTest, HasKey) {
   ASSERT_FALSE(sjm::util::HasKey(test_map, "b"));
 }
 
+TEST(UtilTest, Fnv1aHash) {
+  // Published FNV-1a 64 test vectors.
+  ASSERT_EQ(0xcbf29ce484222325ULL, sjm::util::Fnv1aHash(""));
+  ASSERT_EQ(0xaf63dc4c8601ec8cULL, sjm::util::Fnv1aHash("a"));
+  ASSERT_EQ(0x85944171f73967e8ULL, sjm::util::Fnv1aHash("foobar"));
+  // Hashing in pieces gives the hash of the whole.
+  ASSERT_EQ(sjm::util::Fnv1aHash("foobar"),
+            sjm::util::Fnv1aHash("bar", 3, sjm::util::Fnv1aHash("foo")));
+}
+
+TEST(GrowableMatrixTest, RowsDontMoveAsTheMatrixGrows) {
+  sjm::util::GrowableMatrix<float> matrix;
+  matrix.Reserve(130, 1 << 20);
+  float* first_row = matrix.AddRows(1);
+  first_row[129] = 7;
+  // Grow well past the first committed chunk.
+  for (int i = 0; i < 100; ++i) {
+    float* rows = matrix.AddRows(100);
+    rows[0] = i;
+    ASSERT_EQ(0, rows[1]);
+  }
+  ASSERT_EQ(10001, matrix.rows());
+  ASSERT_EQ(130, matrix.cols());
+  ASSERT_EQ(first_row, matrix[0]);
+  ASSERT_EQ(first_row, matrix.data());
+  ASSERT_EQ(7, matrix[0][129]);
+  ASSERT_EQ(99, matrix[1 + 99 * 100][0]);
+}
+
+TEST(GrowableMatrixTest, ReservingMoreRowsKeepsTheirData) {
+  sjm::util::GrowableMatrix<float> matrix;
+  matrix.Reserve(130, 100);
+  for (int i = 0; i < 100; ++i) {
+    matrix.AddRows(1)[0] = i;
+  }
+  // Reserving fewer rows does nothing.
+  matrix.Reserve(130, 10);
+  ASSERT_EQ(100, matrix.max_rows());
+  matrix.Reserve(130, 1 << 20);
+  ASSERT_EQ(1 << 20, matrix.max_rows());
+  ASSERT_EQ(100, matrix.rows());
+  for (int i = 0; i < 100; ++i) {
+    ASSERT_EQ(i, matrix[i][0]);
+  }
+  float* rows = matrix.AddRows(10000);
+  ASSERT_EQ(0, rows[0]);
+  ASSERT_EQ(10100, matrix.rows());
+}
+
+void AddToSlot(const int slot, vector<int>* slots) {
+  (*slots)[slot] += slot;
+}
+
+TEST(ThreadPoolTest, RunsAllTasksBeforeWaitReturns) {
+  sjm::util::ThreadPool pool(3);
+  ASSERT_EQ(3, pool.size());
+  vector<int> slots(100, 0);
+  for (int round = 0; round < 2; ++round) {
+    sjm::util::TaskGroup group;
+    for (int i = 0; i < 100; ++i) {
+      pool.Schedule(boost::bind(AddToSlot, i, &slots), &group);
+    }
+    group.Wait();
+  }
+  for (int i = 0; i < 100; ++i) {
+    ASSERT_EQ(2 * i, slots[i]);
+  }
+}
+
+// Blocks until the gate is opened.
+struct Gate {
+  Gate() : open(false) {}
+  void Pass() {
+    boost::mutex::scoped_lock l(mutex);
+    while (!open) {
+      opened.wait(l);
+    }
+  }
+  void Open() {
+    boost::mutex::scoped_lock l(mutex);
+    open = true;
+    opened.notify_all();
+  }
+  boost::mutex mutex;
+  boost::condition_variable opened;
+  bool open;
+};
+
+TEST(ThreadPoolTest, WaitsOnlyForItsGroupsTasks) {
+  sjm::util::ThreadPool pool(2);
+  Gate gate;
+  sjm::util::TaskGroup blocked;
+  pool.Schedule(boost::bind(&Gate::Pass, &gate), &blocked);
+  // The other group's tasks finish, and its Wait() returns, while the
+  // first group's task is still running.
+  vector<int> slots(10, 0);
+  sjm::util::TaskGroup group;
+  for (int i = 0; i < 10; ++i) {
+    pool.Schedule(boost::bind(AddToSlot, i, &slots), &group);
+  }
+  group.Wait();
+  for (int i = 0; i < 10; ++i) {
+    ASSERT_EQ(i, slots[i]);
+  }
+  gate.Open();
+  blocked.Wait();
+}
+
 int main(int argc, char **argv) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();